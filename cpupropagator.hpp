@@ -21,8 +21,12 @@ along with CUDAProb3++.  If not, see <http://www.gnu.org/licenses/>.
 #include "constants.hpp"
 #include "propagator.hpp"
 #include "physics.hpp"
+#include "physics_simd.hpp"
+#include "threadpool.hpp"
 
-#include <omp.h>
+#include <algorithm>
+#include <array>
+#include <memory>
 #include <vector>
 
 
@@ -30,6 +34,10 @@ namespace cudaprob3{
 
     /// \class CpuPropagator
     /// \brief Multi-threaded CPU neutrino propagation. Derived from Propagator
+    /// \details The grid calculations are split into tasks of a hypothesis, a cosine and a range of energies, whose size is balanced by the
+    /// number of crossed layers, and run by a TaskScheduler. By default, each propagator owns a work-stealing ThreadPool.
+    /// An application can pass its own scheduler instead, which may be shared by several propagators. Event and gradient calculations
+    /// run on the same scheduler, in tasks of a range of events and of a hypothesis and a cosine, respectively
     /// @param FLOAT_T The floating point type to use for calculations, i.e float, double
     template<class FLOAT_T>
     class CpuPropagator : public Propagator<FLOAT_T>{
@@ -38,12 +46,23 @@ namespace cudaprob3{
         ///
         /// @param n_cosines Number cosine bins
         /// @param n_energies Number of energy bins
-        /// @param threads Number of threads
-        CpuPropagator(int n_cosines, int n_energies, int threads) : Propagator<FLOAT_T>(n_cosines, n_energies){
+        /// @param threads Number of threads of the internal ThreadPool
+        CpuPropagator(int n_cosines, int n_energies, int threads)
+            : CpuPropagator(n_cosines, n_energies, std::make_shared<ThreadPool>(threads)){
 
-            resultList.resize(std::uint64_t(n_cosines) * std::uint64_t(n_energies) * std::uint64_t(9));
+            internalScheduler = true;
+        }
+
+        /// \brief Constructor
+        ///
+        /// @param n_cosines Number cosine bins
+        /// @param n_energies Number of energy bins
+        /// @param scheduler Scheduler which runs the calculations, see setScheduler
+        CpuPropagator(int n_cosines, int n_energies, std::shared_ptr<TaskScheduler> scheduler) : Propagator<FLOAT_T>(n_cosines, n_energies){
 
-            omp_set_num_threads(threads);
+            setScheduler(std::move(scheduler));
+
+            resizeResults(this->getResultsPerHypothesis());
         }
 
         /// \brief Copy constructor
@@ -63,7 +82,22 @@ namespace cudaprob3{
         CpuPropagator& operator=(const CpuPropagator& other){
             Propagator<FLOAT_T>::operator=(other);
 
+            // a copy can be used concurrently with the original, thus it gets its own internal pool. A scheduler of the application is shared
+            if(other.internalScheduler){
+                if(!internalScheduler || scheduler->getThreadCount() != other.scheduler->getThreadCount())
+                    scheduler = std::make_shared<ThreadPool>(other.scheduler->getThreadCount());
+            }else{
+                scheduler = other.scheduler;
+            }
+            internalScheduler = other.internalScheduler;
+
             resultList = other.resultList;
+            placedResults = false;
+            parameterList = other.parameterList;
+            matterSolutionBlockList = other.matterSolutionBlockList;
+            gradientParameterList = other.gradientParameterList;
+            gradientSolutionList = other.gradientSolutionList;
+            batchSize = other.batchSize;
 
             return *this;
         }
@@ -73,38 +107,435 @@ namespace cudaprob3{
         CpuPropagator& operator=(CpuPropagator&& other){
             Propagator<FLOAT_T>::operator=(std::move(other));
 
+            scheduler = std::move(other.scheduler);
+            internalScheduler = other.internalScheduler;
+
             resultList = std::move(other.resultList);
+            placedResults = other.placedResults;
+            parameterList = std::move(other.parameterList);
+            matterSolutionBlockList = std::move(other.matterSolutionBlockList);
+            gradientParameterList = std::move(other.gradientParameterList);
+            gradientSolutionList = std::move(other.gradientSolutionList);
+            batchSize = other.batchSize;
 
             return *this;
         }
 
     public:
 
+        /// \brief Set the scheduler which runs the grid calculations
+        /// \details The scheduler is used by the calculations of this propagator only while they run. It may be shared with other propagators
+        /// and with the application. The result buffers are placed on the NUMA nodes of the threads of the scheduler when they are allocated
+        /// @param scheduler_ The scheduler
+        void setScheduler(std::shared_ptr<TaskScheduler> scheduler_){
+            if(!scheduler_)
+                throw std::runtime_error("CpuPropagator::setScheduler. scheduler must not be empty");
+
+            scheduler = std::move(scheduler_);
+            internalScheduler = false;
+        }
+
+        /// \brief Get the scheduler which runs the grid calculations
+        std::shared_ptr<TaskScheduler> getScheduler() const{
+            return scheduler;
+        }
+
         void calculateProbabilities(NeutrinoType type) override{
-            if(!this->isInit)
-                throw std::runtime_error("CpuPropagator::calculateProbabilities. Object has been moved from.");
-            if(!this->isSetProductionHeight)
-                throw std::runtime_error("CpuPropagator::calculateProbabilities. production height was not set");
+            // nothing changed since the last calculation
+            if(this->isCachedCalculation(type, 1)){
+                this->instrumentation.recordSkippedCalculation();
+                return;
+            }
+
+            if(this->loadCachedResults(type, 1))
+                return;
+
+            setParameterSet();
+            calculate(type, 1);
+            this->setCachedCalculation(type, 1);
+            this->storeCachedResults();
+        }
+
+        void calculateProbabilitiesBatch(NeutrinoType type, const std::vector<OscParams<FLOAT_T>>& batch) override{
+            if(this->isCachedBatchCalculation(type, 1, batch)){
+                this->instrumentation.recordSkippedCalculation();
+                return;
+            }
 
-            // set neutrino parameters for core physics functions
-            physics::setMixMatrix_host(this->Mix_U.data());
-            physics::setMassDifferences_host(this->dm.data());
+            setBatchParameterSets(batch);
+            calculate(type, 1);
+            this->setCachedBatchCalculation(type, 1, batch);
+        }
+
+        void calculateProbabilitiesBothTypes() override{
+            if(this->isCachedCalculation(Neutrino, 2)){
+                this->instrumentation.recordSkippedCalculation();
+                return;
+            }
 
-            physics::calculate(type, this->cosineList.data(), this->cosineList.size(),
-                this->energyList.data(), this->energyList.size(), this->radii.data(), this->rhos.data(), this->maxlayers.data(), this->ProductionHeightinCentimeter, resultList.data());
+            if(this->loadCachedResults(Neutrino, 2))
+                return;
+
+            setParameterSet();
+            calculate(Neutrino, 2);
+            this->setCachedCalculation(Neutrino, 2);
+            this->storeCachedResults();
+        }
+
+        void calculateProbabilitiesBatchBothTypes(const std::vector<OscParams<FLOAT_T>>& batch) override{
+            if(this->isCachedBatchCalculation(Neutrino, 2, batch)){
+                this->instrumentation.recordSkippedCalculation();
+                return;
+            }
+
+            setBatchParameterSets(batch);
+            calculate(Neutrino, 2);
+            this->setCachedBatchCalculation(Neutrino, 2, batch);
         }
 
         FLOAT_T getProbability(int index_cosine, int index_energy, ProbType t) override{
+            if(this->hasLoadedTable())
+                return this->getLoadedProbability(index_cosine, index_energy, t, this->n_calculatedTypes == 2 ? Neutrino : this->calculatedType);
+            if(index_cosine >= this->n_cosines || index_energy >= this->n_energies)
+                throw std::runtime_error("CpuPropagator::getProbability. Invalid indices");
+            if(!this->isRequestedChannel(t))
+                throw std::runtime_error("CpuPropagator::getProbability. ProbType was not requested");
+
+            return resultList[this->getResultIndex(0, index_cosine, index_energy, t)];
+        }
+
+        FLOAT_T getProbability(int index_cosine, int index_energy, ProbType t, NeutrinoType type) override{
+            if(this->hasLoadedTable())
+                return this->getLoadedProbability(index_cosine, index_energy, t, type);
             if(index_cosine >= this->n_cosines || index_energy >= this->n_energies)
                 throw std::runtime_error("CpuPropagator::getProbability. Invalid indices");
+            if(!this->isRequestedChannel(t))
+                throw std::runtime_error("CpuPropagator::getProbability. ProbType was not requested");
+            if(this->getTypeIndex(type) < 0)
+                throw std::runtime_error("CpuPropagator::getProbability. NeutrinoType was not calculated");
+
+            return resultList[getTypeOffset(type) + this->getResultIndex(0, index_cosine, index_energy, t)];
+        }
+
+        FLOAT_T getBatchProbability(int index_batch, int index_cosine, int index_energy, ProbType t) override{
+            if(index_batch >= batchSize || index_cosine >= this->n_cosines || index_energy >= this->n_energies)
+                throw std::runtime_error("CpuPropagator::getBatchProbability. Invalid indices");
+            if(!this->isRequestedChannel(t))
+                throw std::runtime_error("CpuPropagator::getBatchProbability. ProbType was not requested");
+
+            return resultList[this->getResultIndex(index_batch, index_cosine, index_energy, t)];
+        }
+
+        FLOAT_T getBatchProbability(int index_batch, int index_cosine, int index_energy, ProbType t, NeutrinoType type) override{
+            if(index_batch >= batchSize || index_cosine >= this->n_cosines || index_energy >= this->n_energies)
+                throw std::runtime_error("CpuPropagator::getBatchProbability. Invalid indices");
+            if(!this->isRequestedChannel(t))
+                throw std::runtime_error("CpuPropagator::getBatchProbability. ProbType was not requested");
+            if(this->getTypeIndex(type) < 0)
+                throw std::runtime_error("CpuPropagator::getBatchProbability. NeutrinoType was not calculated");
+
+            return resultList[getTypeOffset(type) + this->getResultIndex(index_batch, index_cosine, index_energy, t)];
+        }
+
+        /// \brief get view of probability t of each cell, without copying
+        /// \details The view is invalidated by the next calculation. With SoA layout, the view is contiguous
+        /// @param t Specify which probability P(i->j)
+        /// @param index_batch Hypothesis index in batch (zero based)
+        ProbabilityView<FLOAT_T> getProbabilityView(ProbType t, int index_batch = 0) const{
+            return getProbabilityView(t, this->n_calculatedTypes == 2 ? Neutrino : this->calculatedType, index_batch);
+        }
+
+        /// \brief get view of probability t of each cell for the given neutrino type, without copying
+        /// \details The view is invalidated by the next calculation. With SoA layout, the view is contiguous.
+        /// After load or a hit of the result cache, the view points into the loaded table
+        /// @param t Specify which probability P(i->j)
+        /// @param type Neutrino or Antineutrino
+        /// @param index_batch Hypothesis index in batch (zero based)
+        ProbabilityView<FLOAT_T> getProbabilityView(ProbType t, NeutrinoType type, int index_batch = 0) const{
+            if(index_batch >= batchSize)
+                throw std::runtime_error("CpuPropagator::getProbabilityView. Invalid batch index");
+            if(!this->isRequestedChannel(t))
+                throw std::runtime_error("CpuPropagator::getProbabilityView. ProbType was not requested");
+            if(this->getTypeIndex(type) < 0)
+                throw std::runtime_error("CpuPropagator::getProbabilityView. NeutrinoType was not calculated");
+
+            if(this->hasLoadedTable()){
+                if(index_batch != 0)
+                    throw std::runtime_error("CpuPropagator::getProbabilityView. Invalid batch index");
+                return this->getLoadedProbabilityView(t, type);
+            }
+
+            ProbabilityView<FLOAT_T> view;
+            view.data = resultList.data() + getTypeOffset(type) + this->getResultIndex(index_batch, 0, 0, t);
+            view.stride = this->getResultCellStride();
+            view.n_cosines = this->n_cosines;
+            view.n_energies = this->n_energies;
+
+            return view;
+        }
+
+        /// \brief get view of all probabilities of the last calculation, without copying
+        /// \details The view is invalidated by the next calculation. After load or a hit of the result cache, the view points into
+        /// the loaded table, whose layout is SoA
+        ResultSpan<FLOAT_T> getResultSpan() const{
+            if(this->hasLoadedTable())
+                return this->getLoadedResultSpan();
+
+            ResultSpan<FLOAT_T> span;
+            span.data = resultList.data();
+            span.size = std::uint64_t(this->n_calculatedTypes) * std::uint64_t(batchSize) * this->getResultsPerHypothesis();
+            span.cellStride = this->getResultCellStride();
+            span.channelStride = this->getResultChannelStride();
+            span.batchStride = this->getResultsPerHypothesis();
+            span.typeStride = std::uint64_t(batchSize) * this->getResultsPerHypothesis();
+            span.n_types = this->n_calculatedTypes;
+            span.layout = this->resultLayout;
+
+            return span;
+        }
+
+    protected:
+        void calculateEvents(NeutrinoType type, int n_types, std::uint64_t n_events, const FLOAT_T* cosines, const FLOAT_T* energies,
+                                const FLOAT_T* productionHeights, FLOAT_T* result) override{
+            if(!this->isInit)
+                throw std::runtime_error("CpuPropagator::calculateEventProbabilities. Object has been moved from.");
+
+            // the results of the last grid calculation stay valid, so parameterList is not used
+            physics::ParameterSet<FLOAT_T> parameters;
+            {
+                ScopedPhase phase(this->instrumentation, Phase::Setup);
+                physics::setParameterSet(parameters, this->Mix_U.data(), this->dm.data());
+            }
+
+            physics::EventContext<FLOAT_T> context;
+            this->setEventContext(context, n_types);
+            context.cosines = cosines;
+            context.energies = energies;
+            context.productionHeights = productionHeights;
+            context.n_events = n_events;
+            context.radii = this->densityModel->getRadii().data();
+            context.coslimit = this->densityModel->getCoslimit().data();
+            context.densityIndices = this->densityModel->getDensityIndices().data();
+            context.densities = this->densityModel->getDensities().data();
+            context.parameters = &parameters;
+
+            ScopedPhase phase(this->instrumentation, Phase::Kernel);
+
+            // events of all types are split into tasks of eventsPerTask events. Each event computes its own matter solutions
+            constexpr std::uint64_t eventsPerTask = 64;
+            const std::uint64_t n_tasks = std::uint64_t(n_types) * n_events;
 
-            std::uint64_t index = std::uint64_t(index_cosine) * std::uint64_t(this->n_energies) * std::uint64_t(9)
-                    + std::uint64_t(index_energy) * std::uint64_t(9);
-            return resultList[index + int(t)];
+            scheduler->parallelFor(SDIV(n_tasks, eventsPerTask), [&](std::int64_t index_task, int){
+                const std::uint64_t first = std::uint64_t(index_task) * eventsPerTask;
+                const std::uint64_t last = std::min(first + eventsPerTask, n_tasks);
+
+                for(std::uint64_t index = first; index < last; index++)
+                    physics::calculateEvent(type, context, index, result);
+            });
+
+            this->instrumentation.recordCalculation(std::uint64_t(n_types) * n_events);
+        }
+
+        // the dual number arithmetic is not vectorized, so the scalar physics functions are used
+        void calculateGradients(NeutrinoType type, int n_types) override{
+            if(this->isCachedCalculation(type, n_types, this->GradientCalculation)){
+                this->instrumentation.recordSkippedCalculation();
+                return;
+            }
+
+            {
+                ScopedPhase phase(this->instrumentation, Phase::Setup);
+                gradientParameterList.resize(1);
+                this->setGradientParameterSet(gradientParameterList[0]);
+            }
+
+            ScopedPhase phase(this->instrumentation, Phase::Kernel);
+
+            const std::uint64_t resultsPerHypothesis = this->getResultsPerHypothesis();
+
+            // the probabilities are followed by their derivatives
+            batchSize = physics::ResultBlocks<physics::Gradient<FLOAT_T>>::value;
+
+            resizeResults(std::uint64_t(n_types) * std::uint64_t(batchSize) * resultsPerHypothesis);
+            gradientSolutionList.resize(std::uint64_t(n_types) * std::uint64_t(this->n_energies) * this->getGridDensities().size());
+
+            physics::OscillationContext<FLOAT_T> context = getContext();
+            context.n_parameters = 1;
+            context.n_types = n_types;
+            context.resultTypeStride = std::uint64_t(batchSize) * resultsPerHypothesis;
+
+            // the matter solutions are split into tasks of all densities of a type and energy, see physics::calculateMatterSolutions
+            const int n_densities = context.n_densities;
+
+            scheduler->parallelFor(std::int64_t(n_types) * this->n_energies, [&](std::int64_t index_task, int){
+                for(int index_density = 0; index_density < n_densities; index_density++)
+                    physics::calculateMatterSolution(type, context, std::uint64_t(index_task) * n_densities + index_density, context.gradientSolutions);
+            });
+
+            // the paths are split into tasks of a hypothesis and a cosine. With pathOrder, paths with many layers are started first
+            const int n_cosines = this->n_cosines;
+            const int n_hypotheses = n_types * context.n_parameters * context.n_densityVariants;
+
+            scheduler->parallelFor(std::int64_t(n_hypotheses) * n_cosines, [&](std::int64_t index_task, int){
+                physics::calculatePath(context, context.gradientSolutions, resultList.data(), int(index_task / n_cosines), int(index_task % n_cosines));
+            });
+
+            this->calculatedType = type;
+            this->n_calculatedTypes = n_types;
+            this->n_calculatedVariants = 1;
+            this->setCachedCalculation(type, n_types, this->GradientCalculation);
+
+            this->instrumentation.recordCalculation(std::uint64_t(n_types) * std::uint64_t(this->n_cosines) * std::uint64_t(this->n_energies));
         }
 
     private:
-        std::vector<FLOAT_T> resultList;
+        // set neutrino parameters for core physics functions from the mixing matrix and the mass differences
+        void setParameterSet(){
+            if(!this->isInit)
+                throw std::runtime_error("CpuPropagator::calculateProbabilities. Object has been moved from.");
+            if(!this->isSetProductionHeight)
+                throw std::runtime_error("CpuPropagator::calculateProbabilities. production height was not set");
+
+            ScopedPhase phase(this->instrumentation, Phase::Setup);
+
+            // the parameter set of the last calculation is still valid if neither the mixing matrix nor the mass differences changed.
+            // Results of a loaded table were not calculated with a parameter set
+            const bool parametersChanged = this->cachedCalculation != this->GridCalculation
+                                            || this->hasLoadedTable()
+                                            || (this->changedInputs & (this->MixingInput | this->MassInput)) != 0;
+
+            if(parametersChanged){
+                parameterList.resize(1);
+                physics::setParameterSet(parameterList[0], this->Mix_U.data(), this->dm.data());
+            }
+        }
+
+        // set neutrino parameters of each hypothesis of the batch
+        void setBatchParameterSets(const std::vector<OscParams<FLOAT_T>>& batch){
+            if(!this->isInit)
+                throw std::runtime_error("CpuPropagator::calculateProbabilitiesBatch. Object has been moved from.");
+            if(!this->isSetProductionHeight)
+                throw std::runtime_error("CpuPropagator::calculateProbabilitiesBatch. production height was not set");
+            if(batch.size() == 0)
+                throw std::runtime_error("CpuPropagator::calculateProbabilitiesBatch. batch must not be empty");
+
+            ScopedPhase phase(this->instrumentation, Phase::Setup);
+
+            parameterList.resize(batch.size());
+
+            for(size_t i = 0; i < batch.size(); i++){
+                std::array<math::ComplexNumber<FLOAT_T>, 9> U;
+                std::array<FLOAT_T, 9> DM;
+
+                this->computeMNSMatrix(batch[i].theta12, batch[i].theta13, batch[i].theta23, batch[i].dCP, U.data());
+                this->computeMassDifferences(batch[i].dm12sq, batch[i].dm23sq, DM.data());
+
+                physics::setParameterSet(parameterList[i], U.data(), DM.data());
+            }
+        }
+
+        // offset of the results of type in resultList
+        std::uint64_t getTypeOffset(NeutrinoType type) const{
+            return std::uint64_t(this->getTypeIndex(type)) * std::uint64_t(batchSize) * this->getResultsPerHypothesis();
+        }
+
+        // calculate the results of all hypotheses in parameterList for n_types neutrino types. Large batches are processed in chunks
+        // to limit the memory of the precomputed matter solutions
+        void calculate(NeutrinoType type, int n_types){
+            ScopedPhase phase(this->instrumentation, Phase::Kernel);
+
+            physics::OscillationContext<FLOAT_T> context = getContext();
+
+            const int n_parameters = parameterList.size();
+            const int n_variants = this->getDensityVariantCount();
+            const int n_densities = this->getGridDensities().size();
+            const int n_blocks = physics::getEnergyBlockCount<FLOAT_T>(this->n_energies);
+            const int chunkSize = physics::getMatterSolutionChunkSize<FLOAT_T>(n_blocks * physics::SimdWidth<FLOAT_T>::value, n_densities, n_parameters, n_types);
+            const std::uint64_t resultsPerHypothesis = this->getResultsPerHypothesis();
+
+            // each parameter set is calculated for each density variant
+            batchSize = n_parameters * n_variants;
+
+            resizeResults(std::uint64_t(n_types) * std::uint64_t(batchSize) * resultsPerHypothesis);
+
+            matterSolutionBlockList.resize(std::uint64_t(n_types) * std::uint64_t(chunkSize) * std::uint64_t(n_blocks) * std::uint64_t(n_densities));
+            context.n_types = n_types;
+            context.resultTypeStride = std::uint64_t(batchSize) * resultsPerHypothesis;
+
+            for(int first = 0; first < n_parameters; first += chunkSize){
+                context.parameterList = parameterList.data() + first;
+                context.n_parameters = std::min(chunkSize, n_parameters - first);
+
+                physics::calculateVectorized(type, context, matterSolutionBlockList.data(),
+                                                resultList.data() + std::uint64_t(first) * std::uint64_t(n_variants) * resultsPerHypothesis,
+                                                *scheduler, !placedResults);
+            }
+
+            placedResults = true;
+
+            this->calculatedType = type;
+            this->n_calculatedTypes = n_types;
+            this->n_calculatedVariants = n_variants;
+
+            this->instrumentation.recordCalculation(std::uint64_t(n_types) * std::uint64_t(batchSize) * std::uint64_t(this->n_cosines) * std::uint64_t(this->n_energies));
+        }
+
+        // resize the results to n elements. A larger buffer is allocated without writing its pages, see DefaultInitAllocator,
+        // such that the next grid calculation places them on the NUMA nodes of the threads which calculate them
+        void resizeResults(std::uint64_t n){
+            if(n > resultList.capacity()){
+                ResultVector().swap(resultList);
+                placedResults = false;
+            }
+
+            resultList.resize(n);
+        }
+
+        // collect the input of the core physics functions. The context only refers to data owned by this propagator
+        physics::OscillationContext<FLOAT_T> getContext(){
+            physics::OscillationContext<FLOAT_T> context;
+
+            context.cosinelist = this->cosineList.data();
+            context.n_cosines = this->cosineList.size();
+            context.energylist = this->energyList.data();
+            context.n_energies = this->energyList.size();
+            context.densities = this->getGridDensities().data();
+            context.n_densities = this->getGridDensities().size();
+            context.maxlayers = this->maxlayers.data();
+            context.pathOrder = this->pathOrder.data();
+            context.layerDistances = this->layerDistances.data();
+            context.layerDensityIndices = this->layerDensityIndices.data();
+            context.layerStride = this->layerStride;
+            context.n_densityVariants = this->getDensityVariantCount();
+            context.layerVariantStride = std::uint64_t(this->n_cosines) * std::uint64_t(this->layerStride);
+            context.heightDistances = this->heightDistances.data();
+            context.heightWeights = this->productionHeightWeights.data();
+            context.n_heightSamples = this->n_heightSamples;
+            context.parameterList = parameterList.data();
+            context.n_parameters = parameterList.size();
+            context.n_types = 1;
+            context.matterSolutions = nullptr; // the vectorized calculation uses matterSolutionBlockList
+            context.gradientParameterList = gradientParameterList.data();
+            context.gradientSolutions = gradientSolutionList.data();
+            context.resultTypeStride = 0;
+            this->setContextChannels(context);
+
+            return context;
+        }
+
+        using ResultVector = std::vector<FLOAT_T, DefaultInitAllocator<FLOAT_T>>;
+
+        std::shared_ptr<TaskScheduler> scheduler;
+        bool internalScheduler = false; // scheduler is a ThreadPool of this propagator
+
+        ResultVector resultList;
+        bool placedResults = false; // the pages of resultList were first written by a grid calculation
+        std::vector<physics::ParameterSet<FLOAT_T>> parameterList;
+        std::vector<physics::MatterSolutionBlock<FLOAT_T>> matterSolutionBlockList;
+        std::vector<physics::ParameterSet<physics::Gradient<FLOAT_T>>> gradientParameterList; // parameter set with derivatives of calculateGradients
+        std::vector<physics::MatterSolution<physics::Gradient<FLOAT_T>>> gradientSolutionList;
+
+        int batchSize = 1; // number of hypotheses of last calculation, i.e. parameter sets times density variants
     };
 
 
@@ -23,12 +23,20 @@ along with CUDAProb3++.  If not, see <http://www.gnu.org/licenses/>.
 #include <cuda.h>
 #include <cuda_runtime.h>
 
+#include <cstdint>
+#include <iostream>
+#include <map>
 #include <memory>
+#include <mutex>
 
 
+class CudaMemoryPool;
+
 struct CudaDeleter
 {
 	int deviceId;
+	std::shared_ptr<CudaMemoryPool> pool; // if set, the memory is returned to the pool instead of being freed
+	std::uint64_t bytes = 0; // size of the block of the pool
 
 	CudaDeleter(){}
 
@@ -42,33 +50,31 @@ struct CudaDeleter
 
 	CudaDeleter(int id):deviceId(id){}
 
+	CudaDeleter(int id, std::shared_ptr<CudaMemoryPool> pool_, std::uint64_t bytes_):deviceId(id), pool(std::move(pool_)), bytes(bytes_){}
+
 	CudaDeleter& operator=(const CudaDeleter& other){
 		deviceId = other.deviceId;
+		pool = other.pool;
+		bytes = other.bytes;
 		return *this;
 	}
 
 	CudaDeleter& operator=(const CudaDeleter&& other){
 		deviceId = other.deviceId;
+		pool = other.pool;
+		bytes = other.bytes;
 		return *this;
 	}
 
-	void operator()(void *p){
-		cudaSetDevice(deviceId); CUERR;
-		cudaFree(p);// CUERR;
-
-        cudaError_t err;
-        if ((err = cudaGetLastError()) != cudaSuccess) {
-            std::cout << "CUDA error: " << cudaGetErrorString(err) << " : "
-                      << __FILE__ << ", line " << __LINE__ << std::endl;
-        }
-	}
+	void operator()(void *p);
 };
 
 struct PinnedCudaDeleter
 {
-	void operator()(void *p){
-		cudaFreeHost(p); CUERR;
-	}
+	std::shared_ptr<CudaMemoryPool> pool; // if set, the memory is returned to the pool instead of being freed
+	std::uint64_t bytes = 0;
+
+	void operator()(void *p);
 };
 
 
@@ -89,6 +95,185 @@ using shared_pinned_ptr = std::shared_ptr<T>;
 
 
 
+/// \class CudaMemoryPool
+/// \brief Caching allocator for device memory and pinned host memory
+/// \details Memory of a pointer which was created by the pool is returned to the pool when the pointer is destroyed and is handed out
+/// again by later allocations, instead of being freed. Buffers which are replaced repeatedly, e.g. when a propagator is resized, thus do not
+/// call cudaMalloc, cudaMallocHost and cudaFree each time. A cached block is reused for requests of at least half of its size.
+/// The pool does not track streams, i.e. memory must not be used by pending work when its pointer is destroyed.
+/// Cached memory is freed by release and by the destructor. The pool is thread-safe and may be shared by several propagators and GPUs
+class CudaMemoryPool{
+public:
+	CudaMemoryPool(){}
+
+	CudaMemoryPool(const CudaMemoryPool& other) = delete;
+	CudaMemoryPool& operator=(const CudaMemoryPool& other) = delete;
+
+	~CudaMemoryPool(){
+		release();
+	}
+
+	// allocate at least bytes of device memory on GPU deviceId. bytes is set to the size of the returned block
+	void* allocateDevice(int deviceId, std::uint64_t& bytes){
+		if(bytes == 0)
+			return nullptr;
+
+		bytes = getBlockSize(bytes);
+
+		std::lock_guard<std::mutex> lock(mutex);
+
+		void* mem = takeCachedBlock(deviceBlocks[deviceId], bytes);
+		if(mem != nullptr)
+			return mem;
+
+		cudaSetDevice(deviceId); CUERR;
+
+		if(cudaMalloc(&mem, bytes) == cudaErrorMemoryAllocation){
+			// the cached blocks of the GPU may be too small for the current requests. free them and try again
+			cudaGetLastError();
+			freeBlocks(deviceId, deviceBlocks[deviceId]);
+
+			cudaSetDevice(deviceId); CUERR;
+			cudaMalloc(&mem, bytes);
+		}
+		CUERR;
+
+		return mem;
+	}
+
+	// allocate at least bytes of pinned host memory. bytes is set to the size of the returned block
+	void* allocatePinned(std::uint64_t& bytes){
+		if(bytes == 0)
+			return nullptr;
+
+		bytes = getBlockSize(bytes);
+
+		std::lock_guard<std::mutex> lock(mutex);
+
+		void* mem = takeCachedBlock(pinnedBlocks, bytes);
+		if(mem != nullptr)
+			return mem;
+
+		if(cudaMallocHost(&mem, bytes) == cudaErrorMemoryAllocation){
+			cudaGetLastError();
+			freeBlocks(-1, pinnedBlocks);
+			cudaMallocHost(&mem, bytes);
+		}
+		CUERR;
+
+		return mem;
+	}
+
+	// return a block of allocateDevice to the pool
+	void deallocateDevice(int deviceId, void* p, std::uint64_t bytes){
+		if(p == nullptr)
+			return;
+
+		std::lock_guard<std::mutex> lock(mutex);
+
+		deviceBlocks[deviceId].emplace(bytes, p);
+		cachedBytes += bytes;
+	}
+
+	// return a block of allocatePinned to the pool
+	void deallocatePinned(void* p, std::uint64_t bytes){
+		if(p == nullptr)
+			return;
+
+		std::lock_guard<std::mutex> lock(mutex);
+
+		pinnedBlocks.emplace(bytes, p);
+		cachedBytes += bytes;
+	}
+
+	/// \brief Free all cached memory. Memory which is still used by pointers is returned to the pool when they are destroyed
+	void release(){
+		std::lock_guard<std::mutex> lock(mutex);
+
+		for(auto& blocks : deviceBlocks)
+			freeBlocks(blocks.first, blocks.second);
+		freeBlocks(-1, pinnedBlocks);
+	}
+
+	/// \brief get the number of bytes of device and pinned memory which are cached for reuse
+	std::uint64_t getCachedBytes() const{
+		std::lock_guard<std::mutex> lock(mutex);
+
+		return cachedBytes;
+	}
+
+private:
+	using BlockMap = std::multimap<std::uint64_t, void*>; // cached blocks by size
+
+	// blocks are rounded up, such that slightly different requests share blocks
+	static std::uint64_t getBlockSize(std::uint64_t bytes){
+		const std::uint64_t granularity = bytes < (std::uint64_t(1) << 20) ? 512 : (std::uint64_t(1) << 20);
+		return (bytes + granularity - 1) / granularity * granularity;
+	}
+
+	// remove the smallest cached block which can hold bytes and is at most twice as large, or return nullptr
+	void* takeCachedBlock(BlockMap& blocks, std::uint64_t& bytes){
+		auto it = blocks.lower_bound(bytes);
+		if(it == blocks.end() || it->first > 2 * bytes)
+			return nullptr;
+
+		void* mem = it->second;
+		bytes = it->first;
+		cachedBytes -= bytes;
+		blocks.erase(it);
+
+		return mem;
+	}
+
+	// free the blocks of GPU deviceId, or pinned blocks if deviceId < 0
+	void freeBlocks(int deviceId, BlockMap& blocks){
+		if(deviceId >= 0 && !blocks.empty())
+			cudaSetDevice(deviceId);
+
+		for(const auto& block : blocks){
+			if(deviceId >= 0)
+				cudaFree(block.second);
+			else
+				cudaFreeHost(block.second);
+			cachedBytes -= block.first;
+		}
+		blocks.clear();
+	}
+
+	std::map<int, BlockMap> deviceBlocks;
+	BlockMap pinnedBlocks;
+	std::uint64_t cachedBytes = 0;
+	mutable std::mutex mutex;
+};
+
+inline void CudaDeleter::operator()(void *p){
+	if(pool){
+		pool->deallocateDevice(deviceId, p, bytes);
+		return;
+	}
+
+	cudaSetDevice(deviceId); CUERR;
+	cudaFree(p);// CUERR;
+
+	cudaError_t err;
+	if ((err = cudaGetLastError()) != cudaSuccess) {
+		std::cout << "CUDA error: " << cudaGetErrorString(err) << " : "
+				  << __FILE__ << ", line " << __LINE__ << std::endl;
+	}
+}
+
+inline void PinnedCudaDeleter::operator()(void *p){
+	if(pool){
+		pool->deallocatePinned(p, bytes);
+		return;
+	}
+
+	cudaFreeHost(p); CUERR;
+}
+
+
+
+
 template <class T>
 unique_dev_ptr<T> make_unique_dev(int deviceId, std::uint64_t elements){
 	cudaSetDevice(deviceId); CUERR;
@@ -131,6 +316,42 @@ shared_pinned_ptr<T> make_shared_pinned(std::uint64_t elements){
 
 
 
+// allocate from pool. If pool is empty, the memory is allocated directly
+template <class T>
+unique_dev_ptr<T> make_unique_dev(const std::shared_ptr<CudaMemoryPool>& pool, int deviceId, std::uint64_t elements){
+	if(!pool)
+		return make_unique_dev<T>(deviceId, elements);
+
+	std::uint64_t bytes = sizeof(T) * elements;
+	T* mem = static_cast<T*>(pool->allocateDevice(deviceId, bytes));
+
+	return unique_dev_ptr<T>(mem, CudaDeleter{deviceId, pool, bytes});
+}
+
+template <class T>
+shared_dev_ptr<T> make_shared_dev(const std::shared_ptr<CudaMemoryPool>& pool, int deviceId, std::uint64_t elements){
+	if(!pool)
+		return make_shared_dev<T>(deviceId, elements);
+
+	std::uint64_t bytes = sizeof(T) * elements;
+	T* mem = static_cast<T*>(pool->allocateDevice(deviceId, bytes));
+
+	return shared_dev_ptr<T>(mem, CudaDeleter{deviceId, pool, bytes});
+}
+
+template <class T>
+unique_pinned_ptr<T> make_unique_pinned(const std::shared_ptr<CudaMemoryPool>& pool, std::uint64_t elements){
+	if(!pool)
+		return make_unique_pinned<T>(elements);
+
+	std::uint64_t bytes = sizeof(T) * elements;
+	T* mem = static_cast<T*>(pool->allocatePinned(bytes));
+
+	return unique_pinned_ptr<T>(mem, PinnedCudaDeleter{pool, bytes});
+}
+
+
+
 // wrap existing device pointer into unique pointer
 template <class T>
 unique_dev_ptr<T> make_unique_dev(int deviceId, T* ptr){
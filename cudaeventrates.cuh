@@ -0,0 +1,336 @@
+/*
+This file is part of CUDAProb3++.
+
+CUDAProb3++ is free software: you can redistribute it and/or modify
+it under the terms of the GNU Lesser General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+CUDAProb3++ is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public License
+along with CUDAProb3++.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef CUDAPROB3_CUDAEVENTRATES_CUH
+#define CUDAPROB3_CUDAEVENTRATES_CUH
+
+#include "cudapropagator.cuh"
+#include "eventrates.hpp"
+
+#include "cuda_unique.cuh"
+#include "hpc_helpers.cuh"
+
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <cstring>
+#include <initializer_list>
+#include <stdexcept>
+#include <vector>
+
+/*
+ * Reduction of the probabilities of a CudaPropagatorSingle to expected event counts on the GPU, see eventrates.hpp.
+ *
+ * The probabilities are read from the device results of the propagator, so only the counts of the reconstructed bins are
+ * transferred to the host. Each reconstructed bin of a hypothesis is reduced by one warp: the lanes sum strided elements of
+ * the row of the bin, and the partial sums are combined with warp shuffles. The summation order does not depend on the
+ * timing, so the counts are reproducible.
+ */
+
+namespace cudaprob3{
+
+namespace eventrates{
+
+    constexpr int reduceWarpSize = 32;
+    constexpr int reduceBlockSize = 256;
+
+    // results of the hypotheses of a propagator
+    template<class FLOAT_T>
+    struct ReductionSource{
+        const FLOAT_T* results; // results of the first hypothesis
+        std::uint64_t batchStride;
+        std::uint64_t cellStride;
+        ChannelOffsets offsets;
+    };
+
+    // counts[index_batch * n_bins + bin] = expected events of bin for hypothesis index_batch.
+    // All lanes of a warp process the same bin and hypothesis, so the shuffles are executed by the full warp
+    template<class FLOAT_T>
+    __global__
+    void reduceEventRatesKernel(ReductionSource<FLOAT_T> source, const FLOAT_T* const flux, std::uint64_t n_cells,
+                                const int* const rowBegin, const RowElement<FLOAT_T>* const rows, int n_bins, int n_batch,
+                                FLOAT_T* const counts){
+
+        const int lane = threadIdx.x % reduceWarpSize;
+        const int warpsPerBlock = blockDim.x / reduceWarpSize;
+
+        for(int index_batch = blockIdx.y; index_batch < n_batch; index_batch += gridDim.y){
+            const FLOAT_T* const results = source.results + std::uint64_t(index_batch) * source.batchStride;
+
+            for(int bin = blockIdx.x * warpsPerBlock + threadIdx.x / reduceWarpSize; bin < n_bins; bin += gridDim.x * warpsPerBlock){
+                FLOAT_T sum = FLOAT_T(0);
+
+                for(int k = rowBegin[bin] + lane; k < rowBegin[bin + 1]; k += reduceWarpSize)
+                    sum += getElementRate(rows[k], results, source.cellStride, flux, n_cells, source.offsets);
+
+                for(int delta = reduceWarpSize / 2; delta > 0; delta /= 2)
+                    sum += __shfl_down_sync(0xFFFFFFFF, sum, delta);
+
+                if(lane == 0)
+                    counts[std::uint64_t(index_batch) * n_bins + bin] = sum;
+            }
+        }
+    }
+
+} // namespace eventrates
+
+    /// \class CudaEventRateReducer
+    /// \brief Reduces the probabilities of a CudaPropagatorSingle on its GPU to expected event counts per reconstructed bin
+    /// \details The flux and the response are uploaded once and stay on the GPU. reduceAsync reads the device results of the last
+    /// calculation, ordered after the calculation in the stream of the propagator, and copies only the counts to pinned host memory.
+    /// The propagator must belong to the same GPU in subsequent reductions
+    /// @param FLOAT_T The floating point type to use for calculations, i.e float, double
+    template<class FLOAT_T>
+    class CudaEventRateReducer{
+    public:
+        /// \brief Constructor
+        /// @param deviceId_ GPU of the propagators whose results are reduced
+        /// @param flux_ Flux of the grid
+        /// @param response_ Response of the grid
+        CudaEventRateReducer(int deviceId_, const FluxTable<FLOAT_T>& flux_, const ResponseMatrix<FLOAT_T>& response_)
+            : deviceId(deviceId_), flux(flux_){
+
+            cudaSetDevice(deviceId); CUERR;
+            cudaEventCreateWithFlags(&readyEvent, cudaEventDisableTiming); CUERR;
+            cudaEventCreateWithFlags(&uploadEvent, cudaEventDisableTiming); CUERR;
+            cudaStreamCreateWithFlags(&uploadStream, cudaStreamNonBlocking); CUERR;
+
+            setFlux(flux_);
+            setResponse(response_);
+        }
+
+        CudaEventRateReducer(const CudaEventRateReducer&) = delete;
+        CudaEventRateReducer& operator=(const CudaEventRateReducer&) = delete;
+
+        ~CudaEventRateReducer(){
+            cudaSetDevice(deviceId);
+            cudaEventSynchronize(readyEvent);
+            cudaEventSynchronize(uploadEvent);
+            cudaEventDestroy(readyEvent);
+            cudaEventDestroy(uploadEvent);
+            cudaStreamDestroy(uploadStream);
+        }
+
+        /// \brief Replace the flux. Waits until the last reduction is completed. The upload is asynchronous and ordered before the next reduction
+        void setFlux(const FluxTable<FLOAT_T>& flux_){
+            cudaSetDevice(deviceId); CUERR;
+            cudaEventSynchronize(readyEvent); CUERR;
+            // the device arrays and the staging buffer may still be written by the previous upload
+            cudaEventSynchronize(uploadEvent); CUERR;
+
+            flux = flux_;
+
+            const std::uint64_t n_values = flux.getValues().size();
+            if(n_values > fluxCapacity){
+                d_flux = make_unique_dev<FLOAT_T>(deviceId, n_values); CUERR;
+                fluxCapacity = n_values;
+            }
+
+            enqueueUploads({{d_flux.get(), flux.getValues().data(), sizeof(FLOAT_T) * n_values}});
+        }
+
+        /// \brief Replace the response. Waits until the last reduction is completed. The upload is asynchronous and ordered before the next reduction
+        void setResponse(const ResponseMatrix<FLOAT_T>& response){
+            cudaSetDevice(deviceId); CUERR;
+            cudaEventSynchronize(readyEvent); CUERR;
+            // the device arrays and the staging buffer may still be written by the previous upload
+            cudaEventSynchronize(uploadEvent); CUERR;
+
+            n_recoBins = response.getRecoBinCount();
+            n_cosines = response.getCosineCount();
+            n_energies = response.getEnergyCount();
+
+            std::vector<int> rowBegin;
+            std::vector<eventrates::RowElement<FLOAT_T>> rows;
+            eventrates::makeRows(response, rowBegin, rows, usedChannels);
+
+            if(rowBegin.size() > rowBeginCapacity){
+                d_rowBegin = make_unique_dev<int>(deviceId, rowBegin.size()); CUERR;
+                rowBeginCapacity = rowBegin.size();
+            }
+            if(rows.size() > rowCapacity){
+                d_rows = make_unique_dev<eventrates::RowElement<FLOAT_T>>(deviceId, rows.size()); CUERR;
+                rowCapacity = rows.size();
+            }
+
+            // a response without elements has only empty rows, which is an upload of 0 bytes
+            enqueueUploads({{d_rowBegin.get(), rowBegin.data(), sizeof(int) * rowBegin.size()},
+                            {d_rows.get(), rows.data(), sizeof(eventrates::RowElement<FLOAT_T>) * rows.size()}});
+        }
+
+        /// \brief Enqueue the reduction of n_batch hypotheses of the last calculation of propagator, starting at firstBatch
+        /// \details The counts of the previous reduction are invalidated. Use waitForCompletion or getCounts to access the counts
+        /// @param propagator Propagator with a calculation on the device
+        /// @param firstBatch First hypothesis of a batch calculation, or 0 for a grid calculation
+        /// @param n_batch Number of hypotheses
+        void reduceAsync(CudaPropagatorSingle<FLOAT_T>& propagator, int firstBatch = 0, int n_batch = 1){
+            if(propagator.getDeviceId() != deviceId)
+                throw std::runtime_error("CudaEventRateReducer::reduce. The propagator belongs to another GPU");
+            if(propagator.hasLoadedTable())
+                throw std::runtime_error("CudaEventRateReducer::reduce. The results of a loaded table are not on the device");
+
+            const ResultSpan<FLOAT_T> span = propagator.getDeviceResultSpan();
+            if(firstBatch < 0 || n_batch < 1 || std::uint64_t(firstBatch + n_batch) * span.batchStride > span.typeStride)
+                throw std::runtime_error("CudaEventRateReducer::reduce. Invalid batch range");
+
+            eventrates::checkInputs(propagator, flux, n_cosines, n_energies, usedChannels);
+
+            cudaSetDevice(deviceId); CUERR;
+            cudaEventSynchronize(readyEvent); CUERR; // the pinned counts may still be in use by the previous transfer
+
+            // offset of each needed probability relative to the results of a hypothesis
+            eventrates::ReductionSource<FLOAT_T> source;
+            source.results = span.data + std::uint64_t(firstBatch) * span.batchStride;
+            source.batchStride = span.batchStride;
+            source.cellStride = span.cellStride;
+
+            for(int channel = 0; channel < 6; channel++){
+                const NeutrinoType type = NeutrinoType(channel / 3);
+                const std::uint64_t typeOffset = span.n_types == 2 ? std::uint64_t(type) * span.typeStride : 0;
+
+                for(int i = 0; i < 3; i++){
+                    const ProbType t = ProbType(i * 3 + channel % 3);
+                    std::int64_t offset = -1;
+
+                    if(usedChannels[channel] && flux.hasFlux(type, Flavour(i))){
+                        int slot = 0;
+                        for(int s = 0; s < t; s++)
+                            slot += propagator.isRequestedChannel(ProbType(s)) ? 1 : 0;
+
+                        offset = std::int64_t(typeOffset + std::uint64_t(slot) * span.channelStride);
+                    }
+
+                    source.offsets.offset[channel * 3 + i] = offset;
+                }
+            }
+
+            const std::uint64_t n_counts = std::uint64_t(n_batch) * n_recoBins;
+            if(n_counts > countCapacity){
+                d_counts = make_unique_dev<FLOAT_T>(deviceId, n_counts); CUERR;
+                counts = make_unique_pinned<FLOAT_T>(n_counts);
+                countCapacity = n_counts;
+            }
+            n_countedBatches = n_batch;
+
+            const cudaStream_t stream = propagator.getStream();
+
+            // the flux and the response may still be uploaded
+            cudaStreamWaitEvent(stream, uploadEvent, 0); CUERR;
+
+            const int warpsPerBlock = eventrates::reduceBlockSize / eventrates::reduceWarpSize;
+            const dim3 grid(unsigned(std::min(SDIV(n_recoBins, warpsPerBlock), 65535)), unsigned(std::min(n_batch, 65535)), 1);
+
+            eventrates::reduceEventRatesKernel<<<grid, eventrates::reduceBlockSize, 0, stream>>>(source, d_flux.get(), flux.getCellCount(),
+                                                                    d_rowBegin.get(), d_rows.get(), n_recoBins, n_batch, d_counts.get()); CUERR;
+
+            cudaMemcpyAsync(counts.get(), d_counts.get(), sizeof(FLOAT_T) * n_counts, D2H, stream); CUERR;
+            cudaEventRecord(readyEvent, stream); CUERR;
+        }
+
+        /// \brief Reduce n_batch hypotheses of the last calculation of propagator and wait for the counts
+        /// @return Expected events of each reconstructed bin of each hypothesis, [hypothesis][bin]
+        std::vector<FLOAT_T> reduce(CudaPropagatorSingle<FLOAT_T>& propagator, int firstBatch = 0, int n_batch = 1){
+            reduceAsync(propagator, firstBatch, n_batch);
+            const FLOAT_T* const result = getCounts();
+
+            return std::vector<FLOAT_T>(result, result + std::uint64_t(n_batch) * n_recoBins);
+        }
+
+        /// \brief Wait until the last reduction is completed
+        void waitForCompletion() const{
+            cudaSetDevice(deviceId); CUERR;
+            cudaEventSynchronize(readyEvent); CUERR;
+        }
+
+        /// \brief Counts of the last reduction in pinned host memory, [hypothesis][bin]. Waits until the reduction is completed
+        const FLOAT_T* getCounts() const{
+            if(n_countedBatches == 0)
+                throw std::runtime_error("CudaEventRateReducer::getCounts. No reduction was enqueued");
+
+            waitForCompletion();
+            return counts.get();
+        }
+
+        /// \brief Counts of the last reduction in device memory, [hypothesis][bin], e.g. for a likelihood on the GPU
+        /// \details The counts are ready after the last reduction in the stream of the propagator
+        const FLOAT_T* getDeviceCounts() const{
+            return d_counts.get();
+        }
+
+        int getRecoBinCount() const{ return n_recoBins; }
+
+    private:
+        // transfer of bytes from host memory at src to device memory at dst
+        struct Upload{
+            void* dst;
+            const void* src;
+            std::uint64_t bytes;
+        };
+
+        // copy the host arrays to the pinned staging buffer and enqueue their transfers in the upload stream. The host arrays can be
+        // released afterwards. Reductions wait for uploadEvent. The previous upload must be completed
+        void enqueueUploads(std::initializer_list<Upload> uploads){
+            std::uint64_t totalBytes = 0;
+            for(const auto& upload : uploads)
+                totalBytes += upload.bytes;
+
+            if(totalBytes > stagingCapacity){
+                staging = make_unique_pinned<unsigned char>(totalBytes);
+                stagingCapacity = totalBytes;
+            }
+
+            std::uint64_t offset = 0;
+            for(const auto& upload : uploads){
+                if(upload.bytes == 0)
+                    continue;
+
+                std::memcpy(staging.get() + offset, upload.src, upload.bytes);
+                cudaMemcpyAsync(upload.dst, staging.get() + offset, upload.bytes, H2D, uploadStream); CUERR;
+                offset += upload.bytes;
+            }
+
+            cudaEventRecord(uploadEvent, uploadStream); CUERR;
+        }
+
+        int deviceId = 0;
+        cudaEvent_t readyEvent = nullptr; // recorded after the transfer of the counts of the last reduction
+        cudaEvent_t uploadEvent = nullptr; // recorded after the upload of the flux or the response
+        cudaStream_t uploadStream = nullptr; // non-blocking stream of the uploads
+
+        FluxTable<FLOAT_T> flux;
+        std::array<bool, 6> usedChannels;
+        int n_recoBins = 0;
+        int n_cosines = 0;
+        int n_energies = 0;
+        int n_countedBatches = 0;
+
+        unique_dev_ptr<FLOAT_T> d_flux; // [type][flavour][cosine][energy]
+        unique_dev_ptr<int> d_rowBegin;
+        unique_dev_ptr<eventrates::RowElement<FLOAT_T>> d_rows;
+        unique_dev_ptr<FLOAT_T> d_counts;
+        unique_pinned_ptr<FLOAT_T> counts;
+        unique_pinned_ptr<unsigned char> staging; // pinned copy of the uploaded host arrays
+        std::uint64_t stagingCapacity = 0;
+        std::uint64_t fluxCapacity = 0;
+        std::size_t rowBeginCapacity = 0;
+        std::size_t rowCapacity = 0;
+        std::uint64_t countCapacity = 0;
+    };
+
+} // namespace cudaprob3
+
+#endif
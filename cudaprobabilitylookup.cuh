@@ -0,0 +1,405 @@
+/*
+This file is part of CUDAProb3++.
+
+CUDAProb3++ is free software: you can redistribute it and/or modify
+it under the terms of the GNU Lesser General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+CUDAProb3++ is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public License
+along with CUDAProb3++.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef CUDAPROB3_CUDAPROBABILITYLOOKUP_CUH
+#define CUDAPROB3_CUDAPROBABILITYLOOKUP_CUH
+
+#include "cudapropagator.cuh"
+#include "probabilitylookup.hpp"
+
+#include "cuda_unique.cuh"
+#include "hpc_helpers.cuh"
+
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
+#include <vector>
+
+/*
+ * Interpolation of the probabilities of a CudaPropagatorSingle on the GPU, see probabilitylookup.hpp.
+ *
+ * The probabilities are copied from the device results of the propagator into a layered CUDA array, one layer per calculated
+ * neutrino type and requested ProbType, without a transfer to the host. Each event is interpolated by one thread, which
+ * reads the nodes through a texture object. The texture uses point sampling, the interpolation weights are computed in FLOAT_T.
+ * Double precision values are stored as int2.
+ */
+
+namespace cudaprob3{
+
+namespace lookup{
+
+    // texel type of the lookup array
+    template<class FLOAT_T>
+    struct Texel;
+
+    template<>
+    struct Texel<float>{
+        using type = float;
+
+        __device__
+        static float load(cudaTextureObject_t texture, int index_cosine, int index_energy, int layer){
+            return tex2DLayered<float>(texture, index_energy + 0.5f, index_cosine + 0.5f, layer);
+        }
+
+        __device__
+        static void store(cudaSurfaceObject_t surface, float value, int index_cosine, int index_energy, int layer){
+            surf2DLayeredwrite(value, surface, index_energy * int(sizeof(float)), index_cosine, layer);
+        }
+    };
+
+    template<>
+    struct Texel<double>{
+        using type = int2;
+
+        __device__
+        static double load(cudaTextureObject_t texture, int index_cosine, int index_energy, int layer){
+            const int2 value = tex2DLayered<int2>(texture, index_energy + 0.5f, index_cosine + 0.5f, layer);
+            return __hiloint2double(value.y, value.x);
+        }
+
+        __device__
+        static void store(cudaSurfaceObject_t surface, double value, int index_cosine, int index_energy, int layer){
+            surf2DLayeredwrite(make_int2(__double2loint(value), __double2hiint(value)), surface,
+                                index_energy * int(sizeof(int2)), index_cosine, layer);
+        }
+    };
+
+    template<class FLOAT_T>
+    struct TextureFetch{
+        cudaTextureObject_t texture;
+        int layer;
+
+        __device__
+        FLOAT_T operator()(int index_cosine, int index_energy) const{
+            return Texel<FLOAT_T>::load(texture, index_cosine, index_energy, layer);
+        }
+    };
+
+    // position of a lookup layer in the results of a propagator
+    struct LayerSource{
+        std::uint64_t offset; // offset of the first cell
+        int layer;
+    };
+
+    // copy the results of each layer into the lookup array
+    template<class FLOAT_T>
+    __global__
+    void fillLookupLayersKernel(cudaSurfaceObject_t surface, const FLOAT_T* const results, const LayerSource* const sources, int n_layers,
+                                int n_cosines, int n_energies, std::uint64_t cellStride){
+
+        const std::uint64_t n_cells = std::uint64_t(n_cosines) * n_energies;
+
+        for(std::uint64_t index = std::uint64_t(blockIdx.x) * blockDim.x + threadIdx.x; index < n_cells * n_layers;
+                index += std::uint64_t(blockDim.x) * gridDim.x){
+
+            const int k = int(index / n_cells);
+            const std::uint64_t cell = index % n_cells;
+            const int index_cosine = int(cell / n_energies);
+            const int index_energy = int(cell % n_energies);
+
+            Texel<FLOAT_T>::store(surface, results[sources[k].offset + cell * cellStride], index_cosine, index_energy, sources[k].layer);
+        }
+    }
+
+    template<class FLOAT_T>
+    __global__
+    void evaluateLookupKernel(TextureFetch<FLOAT_T> fetch, LookupAxis<FLOAT_T> cosineAxis, LookupAxis<FLOAT_T> energyAxis,
+                                Interpolation interpolation, std::uint64_t n_events,
+                                const FLOAT_T* const cosines, const FLOAT_T* const energies, FLOAT_T* const result){
+
+        for(std::uint64_t index = std::uint64_t(blockIdx.x) * blockDim.x + threadIdx.x; index < n_events;
+                index += std::uint64_t(blockDim.x) * gridDim.x){
+
+            FLOAT_T tc;
+            FLOAT_T te;
+            const int index_cosine = locate(cosineAxis, cosines[index], tc);
+            const int index_energy = locate(energyAxis, FLOAT_T(log(energies[index])), te);
+
+            if(interpolation == Interpolation::Bilinear)
+                result[index] = interpolateBilinear(fetch, index_cosine, tc, index_energy, te);
+            else
+                result[index] = interpolateBicubic(fetch, cosineAxis, index_cosine, tc, energyAxis, index_energy, te);
+        }
+    }
+
+} // namespace lookup
+
+    /// \class CudaProbabilityLookup
+    /// \brief Interpolates the probabilities of a CudaPropagatorSingle on its GPU
+    /// \details update copies the device results of the last calculation into a texture, ordered after the calculation in the stream
+    /// of the propagator. The propagator can be used for other calculations afterwards. Call update after a new calculation to
+    /// refresh the lookup. The cosine list and the energy list must be strictly increasing
+    /// @param FLOAT_T The floating point type to use for calculations, i.e float, double
+    template<class FLOAT_T>
+    class CudaProbabilityLookup{
+    public:
+        /// \brief Constructor
+        /// @param propagator Propagator with a calculation on the device
+        /// @param index_batch Hypothesis of a batch calculation, or 0 for a grid calculation
+        explicit CudaProbabilityLookup(CudaPropagatorSingle<FLOAT_T>& propagator, int index_batch = 0){
+            update(propagator, index_batch);
+        }
+
+        CudaProbabilityLookup(const CudaProbabilityLookup&) = delete;
+        CudaProbabilityLookup& operator=(const CudaProbabilityLookup&) = delete;
+
+        ~CudaProbabilityLookup(){
+            releaseArray();
+            if(readyEvent != nullptr){
+                cudaSetDevice(deviceId);
+                cudaEventDestroy(readyEvent);
+            }
+        }
+
+        /// \brief Copy the probabilities of the last calculation of propagator into the lookup, without waiting for the copy
+        /// \details The propagator must belong to the same GPU in subsequent updates. The grid may differ from the previous one
+        /// @param propagator Propagator with a calculation on the device
+        /// @param index_batch Hypothesis of a batch calculation, or 0 for a grid calculation
+        void update(CudaPropagatorSingle<FLOAT_T>& propagator, int index_batch = 0){
+            if(propagator.hasLoadedTable())
+                throw std::runtime_error("CudaProbabilityLookup::update. The results of a loaded table are not on the device");
+
+            const ResultSpan<FLOAT_T> span = propagator.getDeviceResultSpan();
+            if(index_batch < 0 || std::uint64_t(index_batch + 1) * span.batchStride > span.typeStride)
+                throw std::runtime_error("CudaProbabilityLookup::update. Invalid batch index");
+
+            if(readyEvent == nullptr){
+                deviceId = propagator.getDeviceId();
+                cudaSetDevice(deviceId); CUERR;
+                cudaEventCreateWithFlags(&readyEvent, cudaEventDisableTiming); CUERR;
+            }else if(deviceId != propagator.getDeviceId()){
+                throw std::runtime_error("CudaProbabilityLookup::update. The propagator belongs to another GPU");
+            }
+
+            cudaSetDevice(deviceId); CUERR;
+            defaultStream = propagator.getStream();
+
+            const int n_cosines_old = n_cosines;
+            const int n_energies_old = n_energies;
+            const int n_layers_old = n_layers;
+
+            lookup::getLookupNodes(propagator, cosineNodes, energyNodes);
+            n_cosines = cosineNodes.size();
+            n_energies = energyNodes.size();
+
+            // buckets and nodes of both axes in one table each: cosines first
+            std::vector<int> buckets = lookup::makeBuckets(cosineNodes);
+            const std::vector<int> energyBuckets = lookup::makeBuckets(energyNodes);
+            buckets.insert(buckets.end(), energyBuckets.begin(), energyBuckets.end());
+            std::vector<FLOAT_T> nodes = cosineNodes;
+            nodes.insert(nodes.end(), energyNodes.begin(), energyNodes.end());
+
+            // one layer per calculated type and requested ProbType
+            std::vector<lookup::LayerSource> sources;
+            n_layers = 0;
+            for(int index_type = 0; index_type < 2; index_type++){
+                for(int t = 0; t < 9; t++){
+                    const NeutrinoType type = NeutrinoType(index_type);
+                    if(!propagator.isCalculatedType(type) || !propagator.isRequestedChannel(ProbType(t))){
+                        layers[index_type * 9 + t] = -1;
+                        continue;
+                    }
+
+                    int slot = 0;
+                    for(int s = 0; s < t; s++)
+                        slot += propagator.isRequestedChannel(ProbType(s)) ? 1 : 0;
+
+                    const int typeIndex = span.n_types == 2 ? index_type : 0;
+
+                    lookup::LayerSource source;
+                    source.offset = std::uint64_t(typeIndex) * span.typeStride + std::uint64_t(index_batch) * span.batchStride
+                                    + std::uint64_t(slot) * span.channelStride;
+                    source.layer = n_layers;
+                    sources.push_back(source);
+
+                    layers[index_type * 9 + t] = n_layers++;
+                }
+            }
+
+            if(n_nodes_capacity < nodes.size()){
+                d_nodes = make_unique_dev<FLOAT_T>(deviceId, nodes.size()); CUERR;
+                d_buckets = make_unique_dev<int>(deviceId, buckets.size()); CUERR;
+                n_nodes_capacity = nodes.size();
+            }
+            if(n_sources_capacity < sources.size()){
+                d_sources = make_unique_dev<lookup::LayerSource>(deviceId, sources.size()); CUERR;
+                n_sources_capacity = sources.size();
+            }
+
+            // the host tables are members, so they outlive the asynchronous transfers
+            hostNodes = std::move(nodes);
+            hostBuckets = std::move(buckets);
+            hostSources = std::move(sources);
+            cudaMemcpyAsync(d_nodes.get(), hostNodes.data(), sizeof(FLOAT_T) * hostNodes.size(), H2D, defaultStream); CUERR;
+            cudaMemcpyAsync(d_buckets.get(), hostBuckets.data(), sizeof(int) * hostBuckets.size(), H2D, defaultStream); CUERR;
+            cudaMemcpyAsync(d_sources.get(), hostSources.data(), sizeof(lookup::LayerSource) * hostSources.size(), H2D, defaultStream); CUERR;
+
+            if(array == nullptr || n_cosines != n_cosines_old || n_energies != n_energies_old || n_layers != n_layers_old){
+                cudaStreamSynchronize(defaultStream); CUERR;
+                releaseArray();
+                createArray();
+            }
+
+            const std::uint64_t n_values = std::uint64_t(n_cosines) * n_energies * n_layers;
+            const unsigned blocks = unsigned(std::min(SDIV(n_values, std::uint64_t(256)), std::uint64_t(65535)));
+
+            lookup::fillLookupLayersKernel<<<blocks, 256, 0, defaultStream>>>(surface, span.data, d_sources.get(), n_layers,
+                                                                                n_cosines, n_energies, span.cellStride); CUERR;
+
+            cudaEventRecord(readyEvent, defaultStream); CUERR;
+        }
+
+        /// \brief Check if the lookup contains the probability t of type
+        bool contains(ProbType t, NeutrinoType type) const{
+            return layers[int(type) * 9 + int(t)] >= 0;
+        }
+
+        /// \brief Enqueue the interpolation of the probability t of type for a list of events in device memory
+        /// @param t ProbType
+        /// @param type Neutrino or Antineutrino
+        /// @param n_events Number of events
+        /// @param d_cosines Cosine of each event
+        /// @param d_energies Energy (GeV) of each event
+        /// @param d_result Output with space for n_events probabilities
+        /// @param interpolation Bilinear or Bicubic
+        /// @param stream Stream to use. nullptr selects the stream of the propagator
+        void evaluateAsync(ProbType t, NeutrinoType type, std::uint64_t n_events, const FLOAT_T* d_cosines, const FLOAT_T* d_energies,
+                            FLOAT_T* d_result, Interpolation interpolation = Interpolation::Bilinear, cudaStream_t stream = nullptr) const{
+
+            const int layer = layers[int(type) * 9 + int(t)];
+            if(layer < 0)
+                throw std::runtime_error("CudaProbabilityLookup::evaluate. ProbType or NeutrinoType was not calculated");
+            if(n_events == 0)
+                return;
+
+            cudaSetDevice(deviceId); CUERR;
+            if(stream == nullptr)
+                stream = defaultStream;
+
+            // the events must not be interpolated before the last update completes
+            cudaStreamWaitEvent(stream, readyEvent, 0); CUERR;
+
+            const lookup::LookupAxis<FLOAT_T> cosineAxis = lookup::makeAxis(d_nodes.get(), d_buckets.get(), n_cosines,
+                                                                            cosineNodes.front(), cosineNodes.back());
+            const lookup::LookupAxis<FLOAT_T> energyAxis = lookup::makeAxis(d_nodes.get() + n_cosines, d_buckets.get() + 4 * n_cosines,
+                                                                            n_energies, energyNodes.front(), energyNodes.back());
+            const lookup::TextureFetch<FLOAT_T> fetch{texture, layer};
+
+            const unsigned blocks = unsigned(std::min(SDIV(n_events, std::uint64_t(256)), std::uint64_t(65535)));
+
+            lookup::evaluateLookupKernel<<<blocks, 256, 0, stream>>>(fetch, cosineAxis, energyAxis, interpolation, n_events,
+                                                                        d_cosines, d_energies, d_result); CUERR;
+        }
+
+        /// \brief Interpolate the probability t of type for a list of events in host memory and wait for the results
+        /// \details The events are copied to the GPU and the results back. Keep the events on the GPU and use evaluateAsync to avoid the transfers
+        void evaluate(ProbType t, NeutrinoType type, std::uint64_t n_events, const FLOAT_T* cosines, const FLOAT_T* energies,
+                        FLOAT_T* result, Interpolation interpolation = Interpolation::Bilinear){
+            if(n_events == 0)
+                return;
+
+            cudaSetDevice(deviceId); CUERR;
+
+            if(n_events > eventCapacity){
+                d_events = make_unique_dev<FLOAT_T>(deviceId, 3 * n_events); CUERR;
+                eventCapacity = n_events;
+            }
+
+            FLOAT_T* const d_cosines = d_events.get();
+            FLOAT_T* const d_energies = d_events.get() + eventCapacity;
+            FLOAT_T* const d_result = d_events.get() + 2 * eventCapacity;
+
+            cudaMemcpyAsync(d_cosines, cosines, sizeof(FLOAT_T) * n_events, H2D, defaultStream); CUERR;
+            cudaMemcpyAsync(d_energies, energies, sizeof(FLOAT_T) * n_events, H2D, defaultStream); CUERR;
+            evaluateAsync(t, type, n_events, d_cosines, d_energies, d_result, interpolation, defaultStream);
+            cudaMemcpyAsync(result, d_result, sizeof(FLOAT_T) * n_events, D2H, defaultStream); CUERR;
+            cudaStreamSynchronize(defaultStream); CUERR;
+        }
+
+        int getCosineCount() const{ return n_cosines; }
+        int getEnergyCount() const{ return n_energies; }
+
+    private:
+        void createArray(){
+            const cudaChannelFormatDesc channelDesc = cudaCreateChannelDesc<typename lookup::Texel<FLOAT_T>::type>();
+            cudaMalloc3DArray(&array, &channelDesc, make_cudaExtent(n_energies, n_cosines, n_layers),
+                                cudaArrayLayered | cudaArraySurfaceLoadStore); CUERR;
+
+            cudaResourceDesc resourceDesc;
+            std::memset(&resourceDesc, 0, sizeof(resourceDesc));
+            resourceDesc.resType = cudaResourceTypeArray;
+            resourceDesc.res.array.array = array;
+
+            cudaTextureDesc textureDesc;
+            std::memset(&textureDesc, 0, sizeof(textureDesc));
+            textureDesc.addressMode[0] = cudaAddressModeClamp;
+            textureDesc.addressMode[1] = cudaAddressModeClamp;
+            textureDesc.filterMode = cudaFilterModePoint;
+            textureDesc.readMode = cudaReadModeElementType;
+            textureDesc.normalizedCoords = 0;
+
+            cudaCreateTextureObject(&texture, &resourceDesc, &textureDesc, nullptr); CUERR;
+            cudaCreateSurfaceObject(&surface, &resourceDesc); CUERR;
+        }
+
+        void releaseArray(){
+            if(array == nullptr)
+                return;
+
+            cudaSetDevice(deviceId);
+            cudaDestroyTextureObject(texture);
+            cudaDestroySurfaceObject(surface);
+            cudaFreeArray(array);
+
+            array = nullptr;
+            texture = 0;
+            surface = 0;
+        }
+
+        int deviceId = 0;
+        cudaStream_t defaultStream = nullptr; // stream of the propagator of the last update
+        cudaEvent_t readyEvent = nullptr; // recorded after the last update
+
+        cudaArray_t array = nullptr; // [layer][cosine][energy]
+        cudaTextureObject_t texture = 0;
+        cudaSurfaceObject_t surface = 0;
+
+        std::vector<FLOAT_T> cosineNodes;
+        std::vector<FLOAT_T> energyNodes; // log(energy)
+        std::vector<FLOAT_T> hostNodes;
+        std::vector<int> hostBuckets;
+        std::vector<lookup::LayerSource> hostSources;
+        unique_dev_ptr<FLOAT_T> d_nodes; // cosine nodes followed by the energy nodes
+        unique_dev_ptr<int> d_buckets; // cosine buckets followed by the energy buckets
+        unique_dev_ptr<lookup::LayerSource> d_sources;
+        std::size_t n_nodes_capacity = 0;
+        std::size_t n_sources_capacity = 0;
+
+        unique_dev_ptr<FLOAT_T> d_events; // cosines, energies and results of evaluate
+        std::uint64_t eventCapacity = 0;
+
+        std::array<int, 18> layers; // for each type and ProbType, the layer in array, or -1
+        int n_layers = 0;
+        int n_cosines = 0;
+        int n_energies = 0;
+    };
+
+} // namespace cudaprob3
+
+#endif
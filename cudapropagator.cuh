@@ -26,13 +26,54 @@ along with CUDAProb3++.  If not, see <http://www.gnu.org/licenses/>.
 #include "cuda_unique.cuh"
 
 #include <algorithm>
+#include <array>
+#include <chrono>
+#include <functional>
+#include <limits>
+#include <map>
+#include <mutex>
+#include <numeric>
 #include <stdexcept>
 #include <string>
+#include <tuple>
+#include <type_traits>
 #include <vector>
 
 
 namespace cudaprob3{
 
+    // block sizes of the path kernels which were selected by CudaPropagatorSingle::autotuneBlockSize. They are shared by all propagators
+    // of the process and are looked up by the compute capability of the GPU, the precision, and the number of radii of the density model
+    class PathsBlockSizeRegistry{
+    public:
+        // get the selected block size, or 0 if there is none
+        static int get(int architecture, int floatBytes, bool mixedPrecision, int n_radii){
+            std::lock_guard<std::mutex> lock(getMutex());
+
+            const auto it = getBlockSizes().find(Key(architecture, floatBytes, mixedPrecision, n_radii));
+            return it == getBlockSizes().end() ? 0 : it->second;
+        }
+
+        static void set(int architecture, int floatBytes, bool mixedPrecision, int n_radii, int blockSize){
+            std::lock_guard<std::mutex> lock(getMutex());
+
+            getBlockSizes()[Key(architecture, floatBytes, mixedPrecision, n_radii)] = blockSize;
+        }
+
+    private:
+        using Key = std::tuple<int, int, bool, int>;
+
+        static std::map<Key, int>& getBlockSizes(){
+            static std::map<Key, int> blockSizes;
+            return blockSizes;
+        }
+
+        static std::mutex& getMutex(){
+            static std::mutex mutex;
+            return mutex;
+        }
+    };
+
     /// \class CudaPropagatorSingle
     /// \brief Single-GPU neutrino propagation. Derived from Propagator
     /// @param FLOAT_T The floating point type to use for calculations, i.e float, double
@@ -47,7 +88,9 @@ namespace cudaprob3{
         /// @param id device id of the GPU to use
         /// @param n_cosines_ Number cosine bins
         /// @param n_energies_ Number of energy bins
-        CudaPropagatorSingle(int id, int n_cosines_, int n_energies_) : Propagator<FLOAT_T>(n_cosines_, n_energies_), deviceId(id){
+        /// @param pool Memory pool of the device and pinned buffers, which may be shared with other propagators. If empty, the propagator creates its own pool
+        CudaPropagatorSingle(int id, int n_cosines_, int n_energies_, std::shared_ptr<CudaMemoryPool> pool = nullptr)
+                : Propagator<FLOAT_T>(n_cosines_, n_energies_), memoryPool(pool ? std::move(pool) : std::make_shared<CudaMemoryPool>()), deviceId(id){
 
             int nDevices;
 
@@ -67,16 +110,22 @@ namespace cudaprob3{
             cudaSetDevice(id); CUERR;
             cudaFree(0);
 
-            cudaStreamCreate(&stream); CUERR;
+            int major = 0;
+            int minor = 0;
+            cudaDeviceGetAttribute(&major, cudaDevAttrComputeCapabilityMajor, id); CUERR;
+            cudaDeviceGetAttribute(&minor, cudaDevAttrComputeCapabilityMinor, id); CUERR;
+            architecture = 10 * major + minor;
 
-            //allocate host arrays which are not already allocated by Propagator base class
-            resultList = make_unique_pinned<FLOAT_T>(std::uint64_t(n_cosines_) * std::uint64_t(n_energies_) * std::uint64_t(9));
+            createStreamsAndEvents();
 
-            //allocate GPU arrays
-            d_energy_list = make_unique_dev<FLOAT_T>(deviceId, n_energies_); CUERR;
-            d_cosine_list = make_unique_dev<FLOAT_T>(deviceId, n_cosines_); CUERR;
-            d_result_list = make_shared_dev<FLOAT_T>(deviceId, std::uint64_t(n_cosines_) * std::uint64_t(n_energies_) * std::uint64_t(9)); CUERR;
-            d_maxlayers = make_unique_dev<int>(deviceId, this->n_cosines);
+            this->instrumentation.setDeviceId(id);
+
+            //allocate GPU arrays. The result arrays are allocated by the first calculation, such that tiled calculations
+            //do not need memory for the whole grid
+            reserveGrid(n_cosines_, n_energies_);
+
+            // coalesced writes of the kernel
+            this->resultLayout = SoA;
         }
 
         /// \brief Constructor which uses device id 0
@@ -90,7 +139,17 @@ namespace cudaprob3{
         /// \brief Destructor
         ~CudaPropagatorSingle(){
             cudaSetDevice(deviceId);
-            cudaStreamDestroy(stream);
+            // the buffers are returned to the memory pool, which does not wait for pending work
+            cudaStreamSynchronize(stream);
+            cudaStreamSynchronize(tileStream);
+            if(graphExec != nullptr)
+                cudaGraphExecDestroy(graphExec);
+            cudaEventDestroy(tileEvents[1]);
+            cudaEventDestroy(tileEvents[0]);
+            cudaEventDestroy(parameterEvent);
+            cudaEventDestroy(completionEvent);
+            cudaStreamDestroy(tileStream);
+            cudaStreamDestroy(ownStream);
         }
 
         CudaPropagatorSingle(const CudaPropagatorSingle& other) = delete;
@@ -101,7 +160,7 @@ namespace cudaprob3{
             *this = std::move(other);
 
             cudaSetDevice(deviceId);
-            cudaStreamCreate(&stream); CUERR;
+            createStreamsAndEvents();
         }
 
         CudaPropagatorSingle& operator=(const CudaPropagatorSingle& other) = delete;
@@ -111,143 +170,1502 @@ namespace cudaprob3{
         CudaPropagatorSingle& operator=(CudaPropagatorSingle&& other){
             Propagator<FLOAT_T>::operator=(std::move(other));
 
+            memoryPool = other.memoryPool;
             resultList = std::move(other.resultList);
-            d_rhos = std::move(other.d_rhos);
-            d_radii = std::move(other.d_radii);
+            d_densities = std::move(other.d_densities);
+            d_layer_distances = std::move(other.d_layer_distances);
+            d_layer_density_indices = std::move(other.d_layer_density_indices);
+            d_height_distances = std::move(other.d_height_distances);
+            d_height_weights = std::move(other.d_height_weights);
+            d_matter_solution_list = std::move(other.d_matter_solution_list);
             d_maxlayers = std::move(other.d_maxlayers);
+            d_path_order = std::move(other.d_path_order);
             d_energy_list = std::move(other.d_energy_list);
             d_cosine_list = std::move(other.d_cosine_list);
             d_result_list = std::move(other.d_result_list);
+            parameterList = std::move(other.parameterList);
+            d_parameter_list = std::move(other.d_parameter_list);
+            gradientParameterList = std::move(other.gradientParameterList);
+            d_gradient_parameter_list = std::move(other.d_gradient_parameter_list);
+            d_gradient_solution_list = std::move(other.d_gradient_solution_list);
+            d_radii = std::move(other.d_radii);
+            d_coslimit = std::move(other.d_coslimit);
+            d_density_indices = std::move(other.d_density_indices);
+            for(int j = 0; j < 2; j++){
+                eventInputList[j] = std::move(other.eventInputList[j]);
+                eventResultList[j] = std::move(other.eventResultList[j]);
+                d_event_input_list[j] = std::move(other.d_event_input_list[j]);
+                d_event_result_list[j] = std::move(other.d_event_result_list[j]);
+            }
+            tileList[0] = std::move(other.tileList[0]);
+            tileList[1] = std::move(other.tileList[1]);
+            d_tile_list[0] = std::move(other.d_tile_list[0]);
+            d_tile_list[1] = std::move(other.d_tile_list[1]);
 
             deviceId = other.deviceId;
             resultsResideOnHost = other.resultsResideOnHost;
-
-            //the stream is not moved
+            resultsDownloadPending = other.resultsDownloadPending;
+            batchSize = other.batchSize;
+            parameterCount = other.parameterCount;
+            cosineCapacity = other.cosineCapacity;
+            energyCapacity = other.energyCapacity;
+            resultCapacity = other.resultCapacity;
+            matterSolutionCapacity = other.matterSolutionCapacity;
+            gradientSolutionCapacity = other.gradientSolutionCapacity;
+            densityCapacity = other.densityCapacity;
+            layerCapacity = other.layerCapacity;
+            parameterCapacity = other.parameterCapacity;
+            layerTableSize = other.layerTableSize;
+            layerIndexTableSize = other.layerIndexTableSize;
+            heightTableSize = other.heightTableSize;
+            eventChunkSize = other.eventChunkSize;
+            eventCapacity = other.eventCapacity;
+            eventResultCapacity = other.eventResultCapacity;
+            tileCapacity = other.tileCapacity;
+            graphMode = other.graphMode;
+            mixedPrecision = other.mixedPrecision;
+            blockSize = other.blockSize;
+            architecture = other.architecture;
+
+            //the streams, events, and the graph are not moved. The graph refers to the arrays of the previous owner
+            graphIsValid = false;
 
             return *this;
         }
 
     public:
 
-        void setDensity(const std::vector<FLOAT_T>& radii_, const std::vector<FLOAT_T>& rhos_) override{
+        void setDensityModel(std::shared_ptr<const DensityModel<FLOAT_T>> model) override{
+            const bool sameModel = model == this->densityModel;
+
             // call parent function to set up host density data
-            Propagator<FLOAT_T>::setDensity(radii_, rhos_);
+            Propagator<FLOAT_T>::setDensityModel(std::move(model));
+
+            if(sameModel)
+                return;
 
-            // allocate GPU arrays for density information and copy host density data to device density data
+            // copy host density data to device density data. The arrays are only reallocated if they are too small,
+            // so switching between prepared models costs one asynchronous upload. The densities are uploaded by setGridDensities
             cudaSetDevice(deviceId); CUERR;
 
-            int nDensityLayers = this->radii.size();
+            const DensityModel<FLOAT_T>& densityModel = *this->densityModel;
+
+            // the density model is also used to compute the path geometry of events on the device
+            const int nLayers = densityModel.getLayerCount();
 
-            d_rhos = make_unique_dev<FLOAT_T>(deviceId, 2 * nDensityLayers + 1);
-            d_radii = make_unique_dev<FLOAT_T>(deviceId, 2 * nDensityLayers + 1);
+            if(nLayers > layerCapacity){
+                cudaStreamSynchronize(stream); CUERR;
 
-            cudaMemcpy(d_rhos.get(), this->rhos.data(), sizeof(FLOAT_T) * nDensityLayers, H2D); CUERR;
-            cudaMemcpy(d_radii.get(), this->radii.data(), sizeof(FLOAT_T) * nDensityLayers, H2D); CUERR;
+                d_radii = make_unique_dev<FLOAT_T>(memoryPool, deviceId, nLayers);
+                d_coslimit = make_unique_dev<FLOAT_T>(memoryPool, deviceId, nLayers);
+                d_density_indices = make_unique_dev<int>(memoryPool, deviceId, nLayers);
+                layerCapacity = nLayers;
+            }
+
+            copyAsync(d_radii.get(), densityModel.getRadii().data(), sizeof(FLOAT_T) * nLayers, H2D, stream);
+            copyAsync(d_coslimit.get(), densityModel.getCoslimit().data(), sizeof(FLOAT_T) * nLayers, H2D, stream);
+            copyAsync(d_density_indices.get(), densityModel.getDensityIndices().data(), sizeof(int) * nLayers, H2D, stream);
+        }
+
+        void setGridDensities() override{
+            Propagator<FLOAT_T>::setGridDensities();
+
+            // upload the unique densities of the model and the density variants. The array is only reallocated if it is too small
+            cudaSetDevice(deviceId); CUERR;
+
+            const std::vector<FLOAT_T>& densities = this->getGridDensities();
+            const int nDensities = densities.size();
+
+            if(nDensities > densityCapacity){
+                cudaStreamSynchronize(stream); CUERR;
+
+                d_densities = make_unique_dev<FLOAT_T>(memoryPool, deviceId, nDensities);
+                densityCapacity = nDensities;
+            }
+
+            copyAsync(d_densities.get(), densities.data(), sizeof(FLOAT_T) * nDensities, H2D, stream);
+
+            // the number of matter solutions per hypothesis may have changed
+            graphIsValid = false;
         }
 
         void setEnergyList(const std::vector<FLOAT_T>& list) override{
             Propagator<FLOAT_T>::setEnergyList(list); // set host energy list
 
             //copy host energy list to gpu memory
-            cudaMemcpy(d_energy_list.get(), this->energyList.data(), sizeof(FLOAT_T) * this->n_energies, H2D); CUERR;
+            cudaSetDevice(deviceId); CUERR;
+            copyAsync(d_energy_list.get(), this->energyList.data(), sizeof(FLOAT_T) * this->n_energies, H2D, stream);
         }
 
         void setCosineList(const std::vector<FLOAT_T>& list) override{
             Propagator<FLOAT_T>::setCosineList(list); // set host cosine list
             //copy host cosine list to gpu memory
-            cudaMemcpy(d_cosine_list.get(), this->cosineList.data(), sizeof(FLOAT_T) * this->n_cosines, H2D); CUERR;
+            cudaSetDevice(deviceId); CUERR;
+            copyAsync(d_cosine_list.get(), this->cosineList.data(), sizeof(FLOAT_T) * this->n_cosines, H2D, stream);
+        }
+
+        /// \brief Change the number of cosine bins and energy bins, see Propagator::resize
+        /// \details The streams, events and settings of the propagator are kept. Device and pinned buffers only grow, and replaced buffers
+        /// are returned to the memory pool, so resizing does not allocate memory once the propagator was used with the largest binning
+        void resize(int n_cosines_, int n_energies_) override{
+            if(n_cosines_ == this->n_cosines && n_energies_ == this->n_energies)
+                return;
+            if(n_cosines_ < 1 || n_energies_ < 1)
+                throw std::runtime_error("CudaPropagatorSingle::resize. Number of cosine bins and energy bins must be positive");
+
+            cudaSetDevice(deviceId); CUERR;
+
+            // the grid arrays must be large enough before the parent function uploads the new path geometry
+            reserveGrid(n_cosines_, n_energies_);
+
+            const bool energiesChanged = n_energies_ != this->n_energies;
+
+            Propagator<FLOAT_T>::resize(n_cosines_, n_energies_);
+
+            if(energiesChanged)
+                copyAsync(d_energy_list.get(), this->energyList.data(), sizeof(FLOAT_T) * this->n_energies, H2D, stream);
+
+            // the previous results do not match the new grid. The graph refers to the old grid size
+            resultsResideOnHost = false;
+            resultsDownloadPending = false;
+            graphIsValid = false;
+        }
+
+        /// \brief get the memory pool of the device and pinned buffers of this propagator
+        std::shared_ptr<CudaMemoryPool> getMemoryPool() const{
+            return memoryPool;
         }
 
         // calculate the probability of each cell
         void calculateProbabilities(NeutrinoType type) override{
-            calculateProbabilitiesAsync(type);
+            if(this->loadCachedResults(type, 1))
+                return;
+
+            launchCalculationAsync(type, 1);
             waitForCompletion();
+            this->storeCachedResults();
+        }
+
+        // calculate the probability of each cell for each hypothesis of the batch
+        void calculateProbabilitiesBatch(NeutrinoType type, const std::vector<OscParams<FLOAT_T>>& batch) override{
+            launchBatchCalculationAsync(type, batch, 1);
+            waitForCompletion();
+        }
+
+        // calculate the probability of each cell for Neutrino and Antineutrino
+        void calculateProbabilitiesBothTypes() override{
+            if(this->loadCachedResults(Neutrino, 2))
+                return;
+
+            launchCalculationAsync(Neutrino, 2);
+            waitForCompletion();
+            this->storeCachedResults();
+        }
+
+        // calculate the probability of each cell for Neutrino and Antineutrino for each hypothesis of the batch
+        void calculateProbabilitiesBatchBothTypes(const std::vector<OscParams<FLOAT_T>>& batch) override{
+            launchBatchCalculationAsync(Neutrino, batch, 2);
+            waitForCompletion();
+        }
+
+        /// \brief Enqueue the calculation of the probability of each cell and return without waiting for its completion
+        /// \details The results can be accessed as usual afterwards. Accessing them waits for the completion of the calculation
+        /// @param type Neutrino or Antineutrino
+        void calculateProbabilitiesAsync(NeutrinoType type){
+            launchCalculationAsync(type, 1);
+        }
+
+        /// \brief Enqueue the calculation of each hypothesis of the batch and return without waiting for its completion
+        /// @param type Neutrino or Antineutrino
+        /// @param batch Oscillation parameters of each hypothesis
+        void calculateProbabilitiesBatchAsync(NeutrinoType type, const std::vector<OscParams<FLOAT_T>>& batch){
+            launchBatchCalculationAsync(type, batch, 1);
+        }
+
+        /// \brief Enqueue the calculation of Neutrino and Antineutrino and return without waiting for its completion
+        void calculateProbabilitiesBothTypesAsync(){
+            launchCalculationAsync(Neutrino, 2);
+        }
+
+        /// \brief Enqueue the calculation of Neutrino and Antineutrino for each hypothesis of the batch and return without waiting for its completion
+        /// @param batch Oscillation parameters of each hypothesis
+        void calculateProbabilitiesBatchBothTypesAsync(const std::vector<OscParams<FLOAT_T>>& batch){
+            launchBatchCalculationAsync(Neutrino, batch, 2);
+        }
+
+        /// \brief Enqueue the transfer of the results of the last calculation to the internal pinned host buffer
+        /// \details Subsequent accesses to the results only wait for the transfer instead of starting it
+        void fetchResultsAsync(){
+            if(resultsResideOnHost || resultsDownloadPending)
+                return;
+            if(getResultCount() > resultCapacity)
+                throw std::runtime_error("CudaPropagatorSingle::fetchResultsAsync. No results were calculated");
+
+            cudaSetDevice(deviceId); CUERR;
+            copyAsync(resultList.get(), d_result_list.get(), sizeof(FLOAT_T) * getResultCount(), D2H, stream);
+            cudaEventRecord(completionEvent, stream); CUERR;
+
+            resultsDownloadPending = true;
+        }
+
+        /// \brief Enqueue the transfer of the results of the last calculation to a user buffer
+        /// \details The buffer must not be accessed before the transfer is completed, see isCompleted and waitForCompletion.
+        /// The buffer should be pinned host memory. Otherwise, the transfer is not asynchronous
+        /// @param buffer Host buffer with space for getResultCount() probabilities
+        /// @return Layout of the results in buffer
+        ResultSpan<FLOAT_T> copyResultsAsync(FLOAT_T* buffer){
+            if(buffer == nullptr)
+                throw std::runtime_error("CudaPropagatorSingle::copyResultsAsync. buffer is nullptr");
+            if(getResultCount() > resultCapacity)
+                throw std::runtime_error("CudaPropagatorSingle::copyResultsAsync. No results were calculated");
+
+            cudaSetDevice(deviceId); CUERR;
+            copyAsync(buffer, d_result_list.get(), sizeof(FLOAT_T) * getResultCount(), D2H, stream);
+            cudaEventRecord(completionEvent, stream); CUERR;
+
+            return makeResultSpan(buffer);
+        }
+
+        /// \brief get the number of probabilities of the last calculation
+        std::uint64_t getResultCount() const{
+            return std::uint64_t(this->n_calculatedTypes) * std::uint64_t(batchSize) * this->getResultsPerHypothesis();
+        }
+
+        /// \brief Check without blocking whether the last enqueued calculation or transfer is completed
+        bool isCompleted(){
+            cudaSetDevice(deviceId); CUERR;
+
+            const cudaError_t status = cudaEventQuery(completionEvent);
+            if(status == cudaErrorNotReady){
+                return false;
+            }
+            if(status != cudaSuccess){
+                CUERR;
+            }
+            return true;
+        }
+
+        /// \brief Wait until the last enqueued calculation or transfer is completed
+        void waitForCompletion(){
+            cudaSetDevice(deviceId); CUERR;
+            cudaEventSynchronize(completionEvent); CUERR;
+
+            phaseTimer.collect(this->instrumentation, false);
+        }
+
+        /// \brief get the CUDA event which is recorded after the last enqueued calculation or transfer
+        /// \details Other streams can wait for the results with cudaStreamWaitEvent. The event is re-recorded by the next calculation or transfer
+        cudaEvent_t getCompletionEvent() const{
+            return completionEvent;
+        }
+
+        /// \brief Enqueue the work of this propagator in a user stream
+        /// \details The stream must belong to the GPU of this propagator. Work which was already enqueued in the previous stream is completed first
+        /// @param userStream Stream to use. nullptr selects the internal non-blocking stream
+        void setStream(cudaStream_t userStream){
+            cudaSetDevice(deviceId); CUERR;
+            cudaStreamSynchronize(stream); CUERR;
+
+            stream = userStream == nullptr ? ownStream : userStream;
+        }
+
+        /// \brief get the stream in which the work of this propagator is enqueued
+        cudaStream_t getStream() const{
+            return stream;
+        }
+
+        /// \brief Set the number of events which are transferred and calculated at once by calculateEventProbabilities
+        /// \details Limits the device memory used for events
+        /// @param chunkSize Number of events per chunk
+        void setEventChunkSize(std::uint64_t chunkSize){
+            if(chunkSize == 0)
+                throw std::runtime_error("CudaPropagatorSingle::setEventChunkSize. chunkSize must be positive");
+
+            eventChunkSize = chunkSize;
+        }
+
+        /// \brief get the number of events which are transferred and calculated at once by calculateEventProbabilities
+        std::uint64_t getEventChunkSize() const{
+            return eventChunkSize;
+        }
+
+        /// \brief Replay the launch sequence of the calculation from a CUDA graph
+        /// \details The transfer of the parameters and the kernels are captured into a graph by the first calculation and replayed by
+        /// subsequent calculations with the same number of hypotheses and neutrino types, which reduces the launch overhead on the host.
+        /// The graph is captured again if the device arrays are reallocated or the result layout changes.
+        /// The stream of the propagator must not be the legacy default stream
+        /// @param enable Use graphs for subsequent calculations
+        void setGraphMode(bool enable){
+            graphMode = enable;
+
+            if(!enable){
+                cudaSetDevice(deviceId); CUERR;
+                destroyGraph();
+            }
+        }
+
+        /// \brief Check whether calculations are replayed from a CUDA graph
+        bool isGraphMode() const{
+            return graphMode;
+        }
+
+        /// \brief Calculate the probabilities of the grid in mixed precision
+        /// \details The matter eigen-solutions and the phase of each layer are computed in double precision, while the products
+        /// of the layer matrices and the probabilities are computed in single precision, which is much faster on GPUs with few
+        /// double precision units. The results are still returned as double. Requires FLOAT_T = double.
+        /// Event and tiled calculations always use full double precision.
+        /// See example/validate_precision.cpp for the resulting error
+        /// @param enable Use mixed precision for subsequent calculations
+        void setMixedPrecision(bool enable){
+            if(enable && !std::is_same<FLOAT_T, double>::value)
+                throw std::runtime_error("CudaPropagatorSingle::setMixedPrecision. mixed precision requires FLOAT_T = double");
+
+            if(enable != mixedPrecision){
+                mixedPrecision = enable;
+                graphIsValid = false;
+                this->invalidateCachedCalculation();
+            }
+        }
+
+        /// \brief Check whether calculations of the grid use mixed precision
+        bool isMixedPrecision() const{
+            return mixedPrecision;
+        }
+
+        /// \brief Set the number of threads per block of the kernel which calculates the paths
+        /// \details Each block calculates blockSize energies of the same path. By default (blockSize = 0), the block size which was
+        /// selected by autotuneBlockSize for the architecture of the GPU, the precision, and the number of layers is used, or 64
+        /// if there is none
+        /// @param blockSize_ One of 64, 128, 256, or 0
+        void setBlockSize(int blockSize_){
+            if(blockSize_ != 0 && std::find(std::begin(physics::pathsKernelBlockSizes), std::end(physics::pathsKernelBlockSizes), blockSize_)
+                                    == std::end(physics::pathsKernelBlockSizes))
+                throw std::runtime_error("CudaPropagatorSingle::setBlockSize. unsupported block size " + std::to_string(blockSize_));
+
+            blockSize = blockSize_;
+        }
+
+        /// \brief get the number of threads per block of the kernel which calculates the paths
+        int getBlockSize() const{
+            if(blockSize > 0)
+                return blockSize;
+
+            const int tuned = PathsBlockSizeRegistry::get(architecture, sizeof(FLOAT_T), mixedPrecision, this->layerStride - 1);
+
+            return tuned > 0 ? tuned : physics::defaultPathsKernelBlockSize;
+        }
+
+        /// \brief Time the calculation of the current grid with each supported block size and select the fastest
+        /// \details The selected block size is used by all propagators of the process on GPUs of the same architecture
+        /// with the same precision and number of layers, unless they call setBlockSize.
+        /// Each timed launch calculates the neutrino probabilities of the current inputs on the device, without the result cache and without
+        /// reusing previous results, so all inputs must be set
+        /// @param repetitions Number of timed calculations per block size
+        /// @return The fastest block size
+        int autotuneBlockSize(int repetitions = 3){
+            if(!this->isInit)
+                throw std::runtime_error("CudaPropagatorSingle::autotuneBlockSize. Object has been moved from.");
+            if(repetitions < 1)
+                throw std::runtime_error("CudaPropagatorSingle::autotuneBlockSize. repetitions must be positive");
+
+            // time the device calculation of the current inputs. Each launch is forced, so neither the result cache
+            // nor the results of the previous calculation are reused
+            const NeutrinoType type = Neutrino;
+            const int n_types = 1;
+
+            auto launch = [&](){
+                this->invalidateCachedCalculation();
+                launchCalculationAsync(type, n_types);
+            };
+
+            cudaSetDevice(deviceId); CUERR;
+
+            cudaEvent_t start;
+            cudaEvent_t stop;
+            cudaEventCreate(&start); CUERR;
+            cudaEventCreate(&stop); CUERR;
+
+            int bestBlockSize = physics::defaultPathsKernelBlockSize;
+            float bestMilliseconds = std::numeric_limits<float>::max();
+
+            for(int candidate : physics::pathsKernelBlockSizes){
+                blockSize = candidate;
+
+                // the first launch is not timed
+                launch();
+
+                cudaEventRecord(start, stream); CUERR;
+                for(int r = 0; r < repetitions; r++)
+                    launch();
+                cudaEventRecord(stop, stream); CUERR;
+                cudaEventSynchronize(stop); CUERR;
+
+                float milliseconds = 0.0f;
+                cudaEventElapsedTime(&milliseconds, start, stop); CUERR;
+
+                if(milliseconds < bestMilliseconds){
+                    bestMilliseconds = milliseconds;
+                    bestBlockSize = candidate;
+                }
+            }
+
+            cudaEventDestroy(start);
+            cudaEventDestroy(stop);
+
+            blockSize = 0;
+            PathsBlockSizeRegistry::set(architecture, sizeof(FLOAT_T), mixedPrecision, this->layerStride - 1, bestBlockSize);
+
+            return bestBlockSize;
+        }
+
+        /// \brief Function which receives the results of one tile of a tiled calculation
+        /// \details The tile resides in pinned staging memory which is only valid during the call
+        using TileCallback = std::function<void(const ResultTile<FLOAT_T>&)>;
+
+        /// \brief Calculate the probability of each cell in tiles of consecutive cosine bins and pass each tile to callback
+        /// \details Only the memory of two tiles is used for results, so grids larger than the device memory can be calculated.
+        /// The calculation of a tile overlaps with the transfer and the callback of the previous tile. Tiles are passed in ascending order.
+        /// The results are not kept by the propagator, i.e. getProbability still refers to the last non-tiled calculation
+        /// @param type Neutrino or Antineutrino
+        /// @param tileCosines Number of cosine bins per tile
+        /// @param callback Function which is called for each tile
+        void calculateProbabilitiesTiled(NeutrinoType type, int tileCosines, const TileCallback& callback){
+            runTiledCalculation(type, 1, tileCosines, callback);
+        }
+
+        /// \brief Calculate the probability of each cell for Neutrino and Antineutrino in tiles of consecutive cosine bins and pass each tile to callback
+        /// @param tileCosines Number of cosine bins per tile
+        /// @param callback Function which is called for each tile
+        void calculateProbabilitiesBothTypesTiled(int tileCosines, const TileCallback& callback){
+            runTiledCalculation(Neutrino, 2, tileCosines, callback);
+        }
+
+        /// \brief Calculate the probability of each cell in tiles of consecutive cosine bins and store the tiles in a host buffer
+        /// \details The buffer holds n_cosines * n_energies * getNumberOfRequestedChannels() probabilities in the layout of getResultLayout(),
+        /// i.e. the same layout as getResultSpan() of a non-tiled calculation
+        /// @param type Neutrino or Antineutrino
+        /// @param tileCosines Number of cosine bins per tile
+        /// @param buffer Host buffer for the results
+        void calculateProbabilitiesTiled(NeutrinoType type, int tileCosines, FLOAT_T* buffer){
+            if(buffer == nullptr)
+                throw std::runtime_error("CudaPropagatorSingle::calculateProbabilitiesTiled. buffer is nullptr");
+
+            runTiledCalculation(type, 1, tileCosines, [&](const ResultTile<FLOAT_T>& tile){ storeTile(tile, buffer); });
+        }
+
+        /// \brief Calculate the probability of each cell for Neutrino and Antineutrino in tiles and store the tiles in a host buffer
+        /// \details The Antineutrino results follow the Neutrino results
+        /// @param tileCosines Number of cosine bins per tile
+        /// @param buffer Host buffer for 2 * n_cosines * n_energies * getNumberOfRequestedChannels() probabilities
+        void calculateProbabilitiesBothTypesTiled(int tileCosines, FLOAT_T* buffer){
+            if(buffer == nullptr)
+                throw std::runtime_error("CudaPropagatorSingle::calculateProbabilitiesTiled. buffer is nullptr");
+
+            runTiledCalculation(Neutrino, 2, tileCosines, [&](const ResultTile<FLOAT_T>& tile){ storeTile(tile, buffer); });
         }
 
         // get oscillation weight for specific cosine and energy
         FLOAT_T getProbability(int index_cosine, int index_energy, ProbType t) override{
+            if(this->hasLoadedTable())
+                return this->getLoadedProbability(index_cosine, index_energy, t, this->n_calculatedTypes == 2 ? Neutrino : this->calculatedType);
+            if(index_cosine >= this->n_cosines || index_energy >= this->n_energies)
+                throw std::runtime_error("CudaPropagatorSingle::getProbability. Invalid indices");
+            if(!this->isRequestedChannel(t))
+                throw std::runtime_error("CudaPropagatorSingle::getProbability. ProbType was not requested");
+
+            ensureResultsOnHost();
+
+            return resultList.get()[this->getResultIndex(0, index_cosine, index_energy, t)];
+        }
+
+        // get oscillation weight for specific cosine, energy and neutrino type
+        FLOAT_T getProbability(int index_cosine, int index_energy, ProbType t, NeutrinoType type) override{
+            if(this->hasLoadedTable())
+                return this->getLoadedProbability(index_cosine, index_energy, t, type);
             if(index_cosine >= this->n_cosines || index_energy >= this->n_energies)
                 throw std::runtime_error("CudaPropagatorSingle::getProbability. Invalid indices");
+            if(!this->isRequestedChannel(t))
+                throw std::runtime_error("CudaPropagatorSingle::getProbability. ProbType was not requested");
+            if(this->getTypeIndex(type) < 0)
+                throw std::runtime_error("CudaPropagatorSingle::getProbability. NeutrinoType was not calculated");
 
-            if(!resultsResideOnHost){
-                getResultFromDevice();
-                resultsResideOnHost = true;
+            ensureResultsOnHost();
+
+            return resultList.get()[getTypeOffset(type) + this->getResultIndex(0, index_cosine, index_energy, t)];
+        }
+
+        // get oscillation weight for specific hypothesis, cosine and energy
+        FLOAT_T getBatchProbability(int index_batch, int index_cosine, int index_energy, ProbType t) override{
+            if(index_batch >= batchSize || index_cosine >= this->n_cosines || index_energy >= this->n_energies)
+                throw std::runtime_error("CudaPropagatorSingle::getBatchProbability. Invalid indices");
+            if(!this->isRequestedChannel(t))
+                throw std::runtime_error("CudaPropagatorSingle::getBatchProbability. ProbType was not requested");
+
+            ensureResultsOnHost();
+
+            return resultList.get()[this->getResultIndex(index_batch, index_cosine, index_energy, t)];
+        }
+
+        // get oscillation weight for specific hypothesis, cosine, energy and neutrino type
+        FLOAT_T getBatchProbability(int index_batch, int index_cosine, int index_energy, ProbType t, NeutrinoType type) override{
+            if(index_batch >= batchSize || index_cosine >= this->n_cosines || index_energy >= this->n_energies)
+                throw std::runtime_error("CudaPropagatorSingle::getBatchProbability. Invalid indices");
+            if(!this->isRequestedChannel(t))
+                throw std::runtime_error("CudaPropagatorSingle::getBatchProbability. ProbType was not requested");
+            if(this->getTypeIndex(type) < 0)
+                throw std::runtime_error("CudaPropagatorSingle::getBatchProbability. NeutrinoType was not calculated");
+
+            ensureResultsOnHost();
+
+            return resultList.get()[getTypeOffset(type) + this->getResultIndex(index_batch, index_cosine, index_energy, t)];
+        }
+
+        /// \brief get view of probability t of each cell in pinned host memory, without further copying
+        /// \details The view is invalidated by the next calculation. With SoA layout, the view is contiguous
+        /// @param t Specify which probability P(i->j)
+        /// @param index_batch Hypothesis index in batch (zero based)
+        ProbabilityView<FLOAT_T> getProbabilityView(ProbType t, int index_batch = 0){
+            return getProbabilityView(t, this->n_calculatedTypes == 2 ? Neutrino : this->calculatedType, index_batch);
+        }
+
+        /// \brief get view of probability t of each cell for the given neutrino type in pinned host memory, without further copying
+        /// \details The view is invalidated by the next calculation. With SoA layout, the view is contiguous.
+        /// After load or a hit of the result cache, the view points into the loaded table
+        /// @param t Specify which probability P(i->j)
+        /// @param type Neutrino or Antineutrino
+        /// @param index_batch Hypothesis index in batch (zero based)
+        ProbabilityView<FLOAT_T> getProbabilityView(ProbType t, NeutrinoType type, int index_batch = 0){
+            if(index_batch >= batchSize)
+                throw std::runtime_error("CudaPropagatorSingle::getProbabilityView. Invalid batch index");
+            if(!this->isRequestedChannel(t))
+                throw std::runtime_error("CudaPropagatorSingle::getProbabilityView. ProbType was not requested");
+            if(this->getTypeIndex(type) < 0)
+                throw std::runtime_error("CudaPropagatorSingle::getProbabilityView. NeutrinoType was not calculated");
+
+            if(this->hasLoadedTable()){
+                if(index_batch != 0)
+                    throw std::runtime_error("CudaPropagatorSingle::getProbabilityView. Invalid batch index");
+                return this->getLoadedProbabilityView(t, type);
             }
 
-            const std::uint64_t index = std::uint64_t(index_cosine) * std::uint64_t(this->n_energies) + std::uint64_t(index_energy);
-            const std::uint64_t offset = std::uint64_t(t) * std::uint64_t(this->n_energies) * std::uint64_t(this->n_cosines);
+            ensureResultsOnHost();
+
+            ProbabilityView<FLOAT_T> view;
+            view.data = resultList.get() + getTypeOffset(type) + this->getResultIndex(index_batch, 0, 0, t);
+            view.stride = this->getResultCellStride();
+            view.n_cosines = this->n_cosines;
+            view.n_energies = this->n_energies;
+
+            return view;
+        }
+
+        /// \brief get view of all probabilities of the last calculation in pinned host memory, without further copying
+        /// \details The view is invalidated by the next calculation. After load or a hit of the result cache, the view points into
+        /// the loaded table, whose layout is SoA
+        ResultSpan<FLOAT_T> getResultSpan(){
+            if(this->hasLoadedTable())
+                return this->getLoadedResultSpan();
+
+            ensureResultsOnHost();
+
+            return makeResultSpan(resultList.get());
+        }
+
+        /// \brief get view of all probabilities of the last calculation in device memory, without copying
+        /// \details The view is invalidated by the next calculation. Work which reads it must be enqueued in getStream() or wait
+        /// for getCompletionEvent(). Throws after load or a hit of the result cache, since the loaded results are not on the device
+        ResultSpan<FLOAT_T> getDeviceResultSpan() const{
+            if(this->hasLoadedTable())
+                throw std::runtime_error("CudaPropagatorSingle::getDeviceResultSpan. The results of a loaded table are not on the device");
+
+            return makeResultSpan(d_result_list.get());
+        }
+
+        /// \brief get the GPU of this propagator
+        int getDeviceId() const{
+            return deviceId;
+        }
+
+        /// \brief get the timings and counters recorded since construction or the last call to resetStatistics
+        /// \details Waits until the timed work on the GPU is completed
+        Statistics getStatistics() override{
+            cudaSetDevice(deviceId); CUERR;
+            phaseTimer.collect(this->instrumentation, true);
 
-            return resultList.get()[index + offset];
+            return this->instrumentation.getStatistics();
+        }
+
+        void resetStatistics() override{
+            cudaSetDevice(deviceId); CUERR;
+            phaseTimer.collect(this->instrumentation, true);
+
+            this->instrumentation.reset();
         }
 
     protected:
+        bool usesMixedPrecision() const override{
+            return mixedPrecision;
+        }
+
+        void calculateGradients(NeutrinoType type, int n_types) override{
+            launchGradientCalculationAsync(type, n_types);
+            waitForCompletion();
+        }
+
+        void calculateEvents(NeutrinoType type, int n_types, std::uint64_t n_events, const FLOAT_T* cosines, const FLOAT_T* energies,
+                                const FLOAT_T* productionHeights, FLOAT_T* result) override{
+
+            const std::uint64_t resultTypeStride = n_events * std::uint64_t(this->n_channels);
+            const std::uint64_t n_chunks = SDIV(n_events, eventChunkSize);
+
+            beginEventCalculation(n_types, std::min(eventChunkSize, n_events));
+
+            auto launchChunk = [&](std::uint64_t k){
+                const std::uint64_t first = k * eventChunkSize;
+                const std::uint64_t n = std::min(eventChunkSize, n_events - first);
+
+                launchEventChunkAsync(int(k % 2), type, n_types, n, cosines + first, energies + first,
+                                        productionHeights == nullptr ? nullptr : productionHeights + first);
+            };
+
+            auto finishChunk = [&](std::uint64_t k){
+                const std::uint64_t first = k * eventChunkSize;
+                const std::uint64_t n = std::min(eventChunkSize, n_events - first);
+
+                finishEventChunk(int(k % 2), n_types, n, result + first * this->n_channels, resultTypeStride);
+            };
+
+            // the chunks alternate between both buffers and streams, such that the transfers of one chunk overlap with the kernel of the other one
+            for(std::uint64_t k = 0; k < n_chunks; k++){
+                // the buffers of chunk k were used by chunk k - 2
+                if(k >= 2)
+                    finishChunk(k - 2);
+                launchChunk(k);
+            }
+
+            for(std::uint64_t k = n_chunks >= 2 ? n_chunks - 2 : 0; k < n_chunks; k++)
+                finishChunk(k);
+
+            endEventCalculation();
+        }
+
+        // prepare the event calculation in chunks of at most maxChunk events. The parameters are copied to the device, and
+        // both buffers of launchEventChunkAsync are allocated
+        void beginEventCalculation(int n_types, std::uint64_t maxChunk){
+            if(!this->isInit)
+                throw std::runtime_error("CudaPropagatorSingle::calculateEventProbabilities. Object has been moved from.");
+
+            cudaSetDevice(deviceId); CUERR;
+
+            const std::uint64_t n_results = std::uint64_t(n_types) * maxChunk * std::uint64_t(this->n_channels);
+
+            if(maxChunk > eventCapacity || n_results > eventResultCapacity){
+                cudaStreamSynchronize(stream); CUERR;
+                cudaStreamSynchronize(tileStream); CUERR;
+            }
+
+            if(maxChunk > eventCapacity){
+                for(int j = 0; j < 2; j++){
+                    eventInputList[j] = make_unique_pinned<FLOAT_T>(memoryPool, 3 * maxChunk);
+                    d_event_input_list[j] = make_unique_dev<FLOAT_T>(memoryPool, deviceId, 3 * maxChunk); CUERR;
+                }
+                eventCapacity = maxChunk;
+            }
+
+            if(n_results > eventResultCapacity){
+                for(int j = 0; j < 2; j++){
+                    eventResultList[j] = make_unique_pinned<FLOAT_T>(memoryPool, n_results);
+                    d_event_result_list[j] = make_unique_dev<FLOAT_T>(memoryPool, deviceId, n_results); CUERR;
+                }
+                eventResultCapacity = n_results;
+            }
+
+            {
+                ScopedPhase phase(this->instrumentation, Phase::Setup);
+
+                reserveParameters(1);
+                physics::setParameterSet(parameterList.get()[0], this->Mix_U.data(), this->dm.data());
+            }
+
+            copyAsync(d_parameter_list.get(), parameterList.get(), sizeof(physics::ParameterSet<FLOAT_T>), H2D, stream);
+            cudaEventRecord(parameterEvent, stream); CUERR;
+
+            // the chunks on the second stream need the parameters and the previous work of the first stream
+            cudaStreamWaitEvent(tileStream, parameterEvent, 0); CUERR;
+        }
+
+        // copy n events to buffer j of the device, calculate them and enqueue the transfer of their results to pinned host memory.
+        // Buffer j must not be used by an unfinished chunk. The chunks of buffer 0 and 1 run in stream and tileStream, respectively
+        void launchEventChunkAsync(int j, NeutrinoType type, int n_types, std::uint64_t n, const FLOAT_T* cosines, const FLOAT_T* energies,
+                                    const FLOAT_T* productionHeights){
+            cudaSetDevice(deviceId); CUERR;
+
+            const cudaStream_t chunkStream = j == 0 ? stream : tileStream;
+            const std::uint64_t n_results = std::uint64_t(n_types) * n * std::uint64_t(this->n_channels);
+
+            // cosines, energies, and production heights of the chunk are transferred with a single copy
+            FLOAT_T* const input = eventInputList[j].get();
+            const int n_arrays = productionHeights == nullptr ? 2 : 3;
+
+            {
+                ScopedPhase phase(this->instrumentation, Phase::Setup);
+
+                std::copy(cosines, cosines + n, input);
+                std::copy(energies, energies + n, input + n);
+                if(productionHeights != nullptr)
+                    std::copy(productionHeights, productionHeights + n, input + 2 * n);
+            }
+
+            copyAsync(d_event_input_list[j].get(), input, sizeof(FLOAT_T) * n_arrays * n, H2D, chunkStream);
+
+            physics::EventContext<FLOAT_T> context;
+            this->setEventContext(context, n_types);
+            context.cosines = d_event_input_list[j].get();
+            context.energies = d_event_input_list[j].get() + n;
+            context.productionHeights = productionHeights == nullptr ? nullptr : d_event_input_list[j].get() + 2 * n;
+            context.n_events = n;
+            context.radii = d_radii.get();
+            context.coslimit = d_coslimit.get();
+            context.densityIndices = d_density_indices.get();
+            context.densities = d_densities.get();
+            context.parameters = d_parameter_list.get();
+
+            phaseTimer.begin(chunkStream, Phase::Kernel);
+            physics::callCalculateEventsKernelAsync(chunkStream, type, context, d_event_result_list[j].get());
+            phaseTimer.end(chunkStream);
+
+            this->instrumentation.recordCalculation(std::uint64_t(n_types) * n);
+
+            copyAsync(eventResultList[j].get(), d_event_result_list[j].get(), sizeof(FLOAT_T) * n_results, D2H, chunkStream);
+            cudaEventRecord(tileEvents[j], chunkStream); CUERR;
+        }
+
+        // wait for the chunk of buffer j and copy its results for each type to result + index_type * resultTypeStride
+        void finishEventChunk(int j, int n_types, std::uint64_t n, FLOAT_T* result, std::uint64_t resultTypeStride){
+            cudaSetDevice(deviceId); CUERR;
+            cudaEventSynchronize(tileEvents[j]); CUERR;
+
+            const std::uint64_t resultsPerType = n * std::uint64_t(this->n_channels);
+
+            for(int index_type = 0; index_type < n_types; index_type++){
+                const FLOAT_T* const chunkResult = eventResultList[j].get() + index_type * resultsPerType;
+                std::copy(chunkResult, chunkResult + resultsPerType, result + index_type * resultTypeStride);
+            }
+
+            phaseTimer.collect(this->instrumentation, false);
+        }
+
+        // mark the end of an event calculation whose chunks are finished. Later work in stream is ordered after the chunks of tileStream
+        void endEventCalculation(){
+            cudaSetDevice(deviceId); CUERR;
+            cudaEventRecord(tileEvents[1], tileStream); CUERR;
+            cudaStreamWaitEvent(stream, tileEvents[1], 0); CUERR;
+            cudaEventRecord(completionEvent, stream); CUERR;
+        }
+
+        // calculate the grid in tiles of tileCosines cosines. Both streams alternate between the tiles, such that the kernel of one tile
+        // overlaps with the transfer of the other one. The matter solutions are shared by all tiles and are computed once
+        void runTiledCalculation(NeutrinoType type, int n_types, int tileCosines, const TileCallback& callback){
+            if(!this->isInit)
+                throw std::runtime_error("CudaPropagatorSingle::calculateProbabilitiesTiled. Object has been moved from.");
+            if(!this->isSetProductionHeight)
+                throw std::runtime_error("CudaPropagatorSingle::calculateProbabilitiesTiled. production height was not set");
+            if(tileCosines < 1)
+                throw std::runtime_error("CudaPropagatorSingle::calculateProbabilitiesTiled. tileCosines must be positive");
+            if(this->getDensityVariantCount() > 1)
+                throw std::runtime_error("CudaPropagatorSingle::calculateProbabilitiesTiled. Density variants are not supported");
+
+            cudaSetDevice(deviceId); CUERR;
+
+            const int tileSize = std::min(tileCosines, this->n_cosines);
+            const int n_tiles = SDIV(this->n_cosines, tileSize);
+            const std::uint64_t resultsPerTile = std::uint64_t(n_types) * std::uint64_t(tileSize) * std::uint64_t(this->n_energies) * std::uint64_t(this->n_channels);
+
+            {
+                ScopedPhase phase(this->instrumentation, Phase::Setup);
+
+                reserveParameters(1);
+                physics::setParameterSet(parameterList.get()[0], this->Mix_U.data(), this->dm.data());
+            }
+
+            copyAsync(d_parameter_list.get(), parameterList.get(), sizeof(physics::ParameterSet<FLOAT_T>), H2D, stream);
+            cudaEventRecord(parameterEvent, stream); CUERR;
+
+            const std::uint64_t n_solutions = std::uint64_t(n_types) * std::uint64_t(this->n_energies) * std::uint64_t(this->getGridDensities().size());
+
+            if(n_solutions > matterSolutionCapacity){
+                cudaStreamSynchronize(stream); CUERR;
+
+                d_matter_solution_list = make_unique_dev<physics::MatterSolution<FLOAT_T>>(memoryPool, deviceId, n_solutions); CUERR;
+                matterSolutionCapacity = n_solutions;
+                graphIsValid = false;
+            }
+
+            if(resultsPerTile > tileCapacity){
+                cudaStreamSynchronize(stream); CUERR;
+                cudaStreamSynchronize(tileStream); CUERR;
+
+                for(int j = 0; j < 2; j++){
+                    tileList[j] = make_unique_pinned<FLOAT_T>(memoryPool, resultsPerTile);
+                    d_tile_list[j] = make_unique_dev<FLOAT_T>(memoryPool, deviceId, resultsPerTile); CUERR;
+                }
+                tileCapacity = resultsPerTile;
+            }
+
+            physics::OscillationContext<FLOAT_T> context = getContext();
+            context.n_parameters = 1;
+            context.n_types = n_types;
+
+            phaseTimer.begin(stream, Phase::Kernel);
+            physics::callCalculateMatterSolutionsKernelAsync(stream, type, context);
+            phaseTimer.end(stream);
+
+            // the tiles on the second stream need the matter solutions
+            cudaEventRecord(tileEvents[1], stream); CUERR;
+            cudaStreamWaitEvent(tileStream, tileEvents[1], 0); CUERR;
+
+            const cudaStream_t streams[2] = {stream, tileStream};
+
+            auto getTile = [&](int k){
+                ResultTile<FLOAT_T> tile;
+                tile.data = tileList[k % 2].get();
+                tile.firstCosine = k * tileSize;
+                tile.n_cosines = std::min(tileSize, this->n_cosines - tile.firstCosine);
+                tile.n_energies = this->n_energies;
+                tile.cellStride = this->resultLayout == AoS ? std::uint64_t(this->n_channels) : std::uint64_t(1);
+                tile.channelStride = this->resultLayout == AoS ? std::uint64_t(1) : std::uint64_t(tile.n_cosines) * std::uint64_t(this->n_energies);
+                tile.typeStride = std::uint64_t(tile.n_cosines) * std::uint64_t(this->n_energies) * std::uint64_t(this->n_channels);
+                tile.n_types = n_types;
+                tile.layout = this->resultLayout;
+                return tile;
+            };
+
+            auto launchTile = [&](int k){
+                const int j = k % 2;
+                const ResultTile<FLOAT_T> tile = getTile(k);
+
+                physics::OscillationContext<FLOAT_T> tileContext = context;
+                tileContext.cosinelist = context.cosinelist + tile.firstCosine;
+                tileContext.n_cosines = tile.n_cosines;
+                tileContext.maxlayers = context.maxlayers + tile.firstCosine;
+                tileContext.pathOrder = nullptr; // the order refers to all cosines
+                tileContext.layerDistances = context.layerDistances + std::uint64_t(tile.firstCosine) * std::uint64_t(context.layerStride);
+                tileContext.layerDensityIndices = context.layerDensityIndices + std::uint64_t(tile.firstCosine) * std::uint64_t(context.layerStride);
+                tileContext.heightDistances = context.heightDistances + std::uint64_t(tile.firstCosine) * std::uint64_t(context.n_heightSamples);
+                tileContext.heightWeights = context.heightWeights + std::uint64_t(tile.firstCosine) * std::uint64_t(context.n_heightSamples);
+                tileContext.resultCellStride = tile.cellStride;
+                tileContext.resultChannelStride = tile.channelStride;
+                tileContext.resultTypeStride = tile.typeStride;
+
+                dim3 block(getBlockSize(), 1, 1);
+                dim3 grid(SDIV(this->n_energies, block.x) * tile.n_cosines, 1, n_types);
+
+                phaseTimer.begin(streams[j], Phase::Kernel);
+                physics::callCalculatePathsKernelAsync(grid, block, streams[j], type, tileContext, d_tile_list[j].get());
+                phaseTimer.end(streams[j]);
+
+                copyAsync(tileList[j].get(), d_tile_list[j].get(), sizeof(FLOAT_T) * std::uint64_t(n_types) * tile.typeStride, D2H, streams[j]);
+                cudaEventRecord(tileEvents[j], streams[j]); CUERR;
+            };
+
+            auto finishTile = [&](int k){
+                cudaEventSynchronize(tileEvents[k % 2]); CUERR;
+                callback(getTile(k));
+            };
+
+            for(int k = 0; k < n_tiles; k++){
+                // the buffers of tile k were used by tile k - 2
+                if(k >= 2)
+                    finishTile(k - 2);
+                launchTile(k);
+            }
+
+            for(int k = std::max(0, n_tiles - 2); k < n_tiles; k++)
+                finishTile(k);
+
+            this->instrumentation.recordCalculation(std::uint64_t(n_types) * std::uint64_t(this->n_cosines) * std::uint64_t(this->n_energies));
+            phaseTimer.collect(this->instrumentation, false);
+        }
+
+        // copy a tile to its position in a buffer with the layout of the whole grid
+        void storeTile(const ResultTile<FLOAT_T>& tile, FLOAT_T* buffer) const{
+            const std::uint64_t cellsPerTile = std::uint64_t(tile.n_cosines) * std::uint64_t(tile.n_energies);
+            const std::uint64_t firstCell = std::uint64_t(tile.firstCosine) * std::uint64_t(tile.n_energies);
+
+            for(int index_type = 0; index_type < tile.n_types; index_type++){
+                const FLOAT_T* const src = tile.data + index_type * tile.typeStride;
+                FLOAT_T* const dst = buffer + index_type * this->getResultsPerHypothesis();
+
+                if(tile.layout == AoS){
+                    std::copy(src, src + cellsPerTile * this->n_channels, dst + firstCell * this->n_channels);
+                }else{
+                    for(int slot = 0; slot < this->n_channels; slot++){
+                        std::copy(src + slot * tile.channelStride,
+                                    src + slot * tile.channelStride + cellsPerTile,
+                                    dst + slot * this->getResultChannelStride() + firstCell);
+                    }
+                }
+            }
+        }
+
+        // create the streams and events of this propagator
+        void createStreamsAndEvents(){
+            // non-blocking stream, such that the work of this propagator does not synchronize with other propagators on the same GPU
+            cudaStreamCreateWithFlags(&ownStream, cudaStreamNonBlocking); CUERR;
+            cudaStreamCreateWithFlags(&tileStream, cudaStreamNonBlocking); CUERR;
+            stream = ownStream;
+
+            cudaEventCreateWithFlags(&completionEvent, cudaEventDisableTiming); CUERR;
+            cudaEventCreateWithFlags(&parameterEvent, cudaEventDisableTiming); CUERR;
+            cudaEventCreateWithFlags(&tileEvents[0], cudaEventDisableTiming); CUERR;
+            cudaEventCreateWithFlags(&tileEvents[1], cudaEventDisableTiming); CUERR;
+        }
+
+        // describe the layout of the results of the last calculation stored at data
+        ResultSpan<FLOAT_T> makeResultSpan(FLOAT_T* data) const{
+            ResultSpan<FLOAT_T> span;
+            span.data = data;
+            span.size = getResultCount();
+            span.cellStride = this->getResultCellStride();
+            span.channelStride = this->getResultChannelStride();
+            span.batchStride = this->getResultsPerHypothesis();
+            span.typeStride = std::uint64_t(batchSize) * this->getResultsPerHypothesis();
+            span.n_types = this->n_calculatedTypes;
+            span.layout = this->resultLayout;
+
+            return span;
+        }
+
         void setMaxlayers() override{
             Propagator<FLOAT_T>::setMaxlayers();
 
-            cudaMemcpy(d_maxlayers.get(), this->maxlayers.data(), sizeof(int) * this->n_cosines, H2D); CUERR;
+            cudaSetDevice(deviceId); CUERR;
+            copyAsync(d_maxlayers.get(), this->maxlayers.data(), sizeof(int) * this->n_cosines, H2D, stream);
+            copyAsync(d_path_order.get(), this->pathOrder.data(), sizeof(int) * this->n_cosines, H2D, stream);
+        }
+
+        void setPathGeometry() override{
+            Propagator<FLOAT_T>::setPathGeometry();
+
+            if(!this->isSetProductionHeight)
+                return;
+
+            // copy the geometry table to the GPU. it is reused by all calculations until the geometry changes
+            cudaSetDevice(deviceId); CUERR;
+
+            // the distances are shared by all density variants, the density indices are stored once per variant
+            const std::uint64_t entries = this->layerDistances.size();
+            const std::uint64_t indexEntries = this->layerDensityIndices.size();
+
+            if(entries != layerTableSize || indexEntries != layerIndexTableSize){
+                // make sure that no kernel reads the old table anymore
+                cudaStreamSynchronize(stream); CUERR;
+
+                d_layer_distances = make_unique_dev<FLOAT_T>(memoryPool, deviceId, entries); CUERR;
+                d_layer_density_indices = make_unique_dev<int>(memoryPool, deviceId, indexEntries); CUERR;
+                layerTableSize = entries;
+                layerIndexTableSize = indexEntries;
+                graphIsValid = false;
+            }
+
+            copyAsync(d_layer_distances.get(), this->layerDistances.data(), sizeof(FLOAT_T) * entries, H2D, stream);
+            copyAsync(d_layer_density_indices.get(), this->layerDensityIndices.data(), sizeof(int) * indexEntries, H2D, stream);
+
+            // atmospheric distances and weights of the production height distribution
+            const std::uint64_t heightEntries = this->heightDistances.size();
+
+            if(heightEntries != heightTableSize){
+                cudaStreamSynchronize(stream); CUERR;
+
+                d_height_distances = make_unique_dev<FLOAT_T>(memoryPool, deviceId, heightEntries); CUERR;
+                d_height_weights = make_unique_dev<FLOAT_T>(memoryPool, deviceId, heightEntries); CUERR;
+                heightTableSize = heightEntries;
+                graphIsValid = false; // the graph also refers to the number of samples
+            }
+
+            if(heightEntries > 0){
+                copyAsync(d_height_distances.get(), this->heightDistances.data(), sizeof(FLOAT_T) * heightEntries, H2D, stream);
+                copyAsync(d_height_weights.get(), this->productionHeightWeights.data(), sizeof(FLOAT_T) * heightEntries, H2D, stream);
+            }
+        }
+
+        // launch the calculation kernel without waiting for its completion. If n_types == 2, both Neutrino and Antineutrino are calculated
+        void launchCalculationAsync(NeutrinoType type, int n_types){
+            if(!this->isInit)
+                throw std::runtime_error("CudaPropagatorSingle::calculateProbabilities. Object has been moved from.");
+            if(!this->isSetProductionHeight)
+                throw std::runtime_error("CudaPropagatorSingle::calculateProbabilities. production height was not set");
+
+            // nothing changed since the last calculation. Its results are still available on the device
+            if(this->isCachedCalculation(type, n_types)){
+                this->instrumentation.recordSkippedCalculation();
+                return;
+            }
+
+            resultsResideOnHost = false;
+            resultsDownloadPending = false;
+            cudaSetDevice(deviceId); CUERR;
+
+            {
+                ScopedPhase phase(this->instrumentation, Phase::Setup);
+
+                // set neutrino parameters for core physics functions and copy them to the device
+                reserveParameters(1);
+                physics::setParameterSet(parameterList.get()[0], this->Mix_U.data(), this->dm.data());
+            }
+
+            parameterCount = 1;
+
+            launchCalculateKernelAsync(type, n_types);
+
+            this->setCachedCalculation(type, n_types);
+        }
+
+        // launch the calculation kernel for a batch of hypotheses without waiting for its completion.
+        // If n_types == 2, both Neutrino and Antineutrino are calculated
+        void launchBatchCalculationAsync(NeutrinoType type, const std::vector<OscParams<FLOAT_T>>& batch, int n_types){
+            if(!this->isInit)
+                throw std::runtime_error("CudaPropagatorSingle::calculateProbabilitiesBatch. Object has been moved from.");
+            if(!this->isSetProductionHeight)
+                throw std::runtime_error("CudaPropagatorSingle::calculateProbabilitiesBatch. production height was not set");
+            if(batch.size() == 0)
+                throw std::runtime_error("CudaPropagatorSingle::calculateProbabilitiesBatch. batch must not be empty");
+
+            if(this->isCachedBatchCalculation(type, n_types, batch)){
+                this->instrumentation.recordSkippedCalculation();
+                return;
+            }
+
+            resultsResideOnHost = false;
+            resultsDownloadPending = false;
+            cudaSetDevice(deviceId); CUERR;
+
+            const int n_parameters = batch.size();
+
+            {
+                ScopedPhase phase(this->instrumentation, Phase::Setup);
+
+                reserveParameters(n_parameters);
+
+                // set neutrino parameters of each hypothesis
+                for(int i = 0; i < n_parameters; i++){
+                    std::array<math::ComplexNumber<FLOAT_T>, 9> U;
+                    std::array<FLOAT_T, 9> DM;
+
+                    this->computeMNSMatrix(batch[i].theta12, batch[i].theta13, batch[i].theta23, batch[i].dCP, U.data());
+                    this->computeMassDifferences(batch[i].dm12sq, batch[i].dm23sq, DM.data());
+
+                    physics::setParameterSet(parameterList.get()[i], U.data(), DM.data());
+                }
+            }
+
+            parameterCount = n_parameters;
+
+            launchCalculateKernelAsync(type, n_types);
+
+            this->setCachedBatchCalculation(type, n_types, batch);
+        }
+
+        // launch the calculation of the probabilities of the current parameters and their derivatives without waiting for its completion.
+        // The derivatives are stored as hypotheses 1 to n_gradientParameters. Graph mode and mixed precision are not used
+        void launchGradientCalculationAsync(NeutrinoType type, int n_types){
+            if(!this->isInit)
+                throw std::runtime_error("CudaPropagatorSingle::calculateProbabilityGradients. Object has been moved from.");
+            if(!this->isSetProductionHeight)
+                throw std::runtime_error("CudaPropagatorSingle::calculateProbabilityGradients. production height was not set");
+            if(this->n_densityVariants > 0)
+                throw std::runtime_error("CudaPropagatorSingle::calculateProbabilityGradients. Density variants are not supported");
+
+            if(this->isCachedCalculation(type, n_types, this->GradientCalculation)){
+                this->instrumentation.recordSkippedCalculation();
+                return;
+            }
+
+            resultsResideOnHost = false;
+            resultsDownloadPending = false;
+            cudaSetDevice(deviceId); CUERR;
+
+            {
+                ScopedPhase phase(this->instrumentation, Phase::Setup);
+
+                // the transfer of the parameters of the previous calculation may still be pending
+                cudaEventSynchronize(parameterEvent); CUERR;
+
+                if(!gradientParameterList){
+                    gradientParameterList = make_unique_pinned<physics::ParameterSet<physics::Gradient<FLOAT_T>>>(memoryPool, 1);
+                    d_gradient_parameter_list = make_unique_dev<physics::ParameterSet<physics::Gradient<FLOAT_T>>>(memoryPool, deviceId, 1); CUERR;
+                }
+
+                this->setGradientParameterSet(gradientParameterList.get()[0]);
+            }
+
+            const std::uint64_t resultsPerHypothesis = this->getResultsPerHypothesis();
+
+            parameterCount = 1;
+            batchSize = physics::ResultBlocks<physics::Gradient<FLOAT_T>>::value;
+
+            phaseTimer.collect(this->instrumentation, false);
+
+            reserveResultCapacity(std::uint64_t(n_types) * std::uint64_t(batchSize) * resultsPerHypothesis);
+
+            const std::uint64_t n_solutions = std::uint64_t(n_types) * std::uint64_t(this->n_energies) * std::uint64_t(this->getGridDensities().size());
+            if(n_solutions > gradientSolutionCapacity){
+                cudaStreamSynchronize(stream); CUERR;
+
+                d_gradient_solution_list = make_unique_dev<physics::MatterSolution<physics::Gradient<FLOAT_T>>>(memoryPool, deviceId, n_solutions); CUERR;
+                gradientSolutionCapacity = n_solutions;
+            }
+
+            copyAsync(d_gradient_parameter_list.get(), gradientParameterList.get(), sizeof(physics::ParameterSet<physics::Gradient<FLOAT_T>>), H2D, stream);
+            cudaEventRecord(parameterEvent, stream); CUERR;
+
+            dim3 block(getBlockSize(), 1, 1);
+            const unsigned blocks = SDIV(this->energyList.size(), block.x) * this->cosineList.size();
+            dim3 grid(blocks, 1, n_types);
+
+            physics::OscillationContext<FLOAT_T> context = getContext();
+            context.n_parameters = 1;
+            context.n_types = n_types;
+            context.resultTypeStride = std::uint64_t(batchSize) * resultsPerHypothesis;
+
+            phaseTimer.begin(stream, Phase::Kernel);
+            physics::callCalculateGradientKernelAsync(grid, block, stream, type, context, d_result_list.get());
+            phaseTimer.end(stream);
+
+            this->instrumentation.recordCalculation(std::uint64_t(n_types) * std::uint64_t(this->n_cosines) * std::uint64_t(this->n_energies));
+
+            cudaEventRecord(completionEvent, stream); CUERR;
+
+            this->calculatedType = type;
+            this->n_calculatedTypes = n_types;
+            this->n_calculatedVariants = 1;
+            this->setCachedCalculation(type, n_types, this->GradientCalculation);
+        }
+
+        // make sure that the arrays of the cosine list, the energy list and the paths can hold n_cosines_ cosines and n_energies_ energies
+        void reserveGrid(int n_cosines_, int n_energies_){
+            if(n_cosines_ > cosineCapacity || n_energies_ > energyCapacity){
+                // make sure that no kernel reads the old arrays anymore
+                cudaStreamSynchronize(stream); CUERR;
+                cudaStreamSynchronize(tileStream); CUERR;
+            }
+
+            if(n_energies_ > energyCapacity){
+                d_energy_list = make_unique_dev<FLOAT_T>(memoryPool, deviceId, n_energies_); CUERR;
+                energyCapacity = n_energies_;
+                graphIsValid = false;
+            }
+
+            if(n_cosines_ > cosineCapacity){
+                d_cosine_list = make_unique_dev<FLOAT_T>(memoryPool, deviceId, n_cosines_); CUERR;
+                d_maxlayers = make_unique_dev<int>(memoryPool, deviceId, n_cosines_); CUERR;
+                d_path_order = make_unique_dev<int>(memoryPool, deviceId, n_cosines_); CUERR;
+                cosineCapacity = n_cosines_;
+                graphIsValid = false;
+            }
+        }
+
+        // make sure that the parameter arrays can hold n_parameters hypotheses and can be overwritten by the host
+        void reserveParameters(int n_parameters){
+            // the transfer of the parameters of the previous calculation may still be pending
+            cudaEventSynchronize(parameterEvent); CUERR;
+
+            if(n_parameters > parameterCapacity){
+                // make sure that the previous transfer from the old buffer is finished
+                cudaStreamSynchronize(stream); CUERR;
+
+                parameterList = make_unique_pinned<physics::ParameterSet<FLOAT_T>>(memoryPool, n_parameters);
+                d_parameter_list = make_unique_dev<physics::ParameterSet<FLOAT_T>>(memoryPool, deviceId, n_parameters); CUERR;
+                parameterCapacity = n_parameters;
+                graphIsValid = false;
+            }
+        }
+
+        // copy the first parameterCount parameter sets to the device and launch the calculation kernel for n_types neutrino types.
+        // Each parameter set is calculated for each density variant
+        void launchCalculateKernelAsync(NeutrinoType type, int n_types){
+            const int n_parameters = parameterCount;
+
+            batchSize = n_parameters * this->getDensityVariantCount();
+
+            // evaluate the timings of previous calculations which are completed by now
+            phaseTimer.collect(this->instrumentation, false);
+
+            reserveResults(n_types, n_parameters);
+
+            if(graphMode){
+                // the strides of the results are part of the captured kernel arguments
+                if((this->changedInputs & this->ResultFormatInput) != 0)
+                    graphIsValid = false;
+
+                if(!graphIsValid || graphType != type || graphTypes != n_types || graphParameters != n_parameters || graphBlockSize != getBlockSize())
+                    captureCalculationGraph(type, n_types);
+
+                phaseTimer.begin(stream, Phase::Kernel);
+                cudaGraphLaunch(graphExec, stream); CUERR;
+                phaseTimer.end(stream);
+
+                // the parameters are read by the graph
+                cudaEventRecord(parameterEvent, stream); CUERR;
+
+                this->instrumentation.recordTransfer(Phase::HostToDevice, sizeof(physics::ParameterSet<FLOAT_T>) * n_parameters);
+            }else{
+                copyAsync(d_parameter_list.get(), parameterList.get(), sizeof(physics::ParameterSet<FLOAT_T>) * n_parameters, H2D, stream);
+                cudaEventRecord(parameterEvent, stream); CUERR;
+
+                phaseTimer.begin(stream, Phase::Kernel);
+                enqueueCalculateKernels(type, n_types);
+                phaseTimer.end(stream);
+            }
+
+            this->instrumentation.recordCalculation(std::uint64_t(n_types) * std::uint64_t(batchSize) * std::uint64_t(this->n_cosines) * std::uint64_t(this->n_energies));
+
+            cudaEventRecord(completionEvent, stream); CUERR;
+
+            this->calculatedType = type;
+            this->n_calculatedTypes = n_types;
+            this->n_calculatedVariants = this->getDensityVariantCount();
+        }
+
+        // make sure that the result and matter solution arrays can hold the results of n_parameters parameter sets and each density variant
+        // for n_types neutrino types
+        void reserveResults(int n_types, int n_parameters){
+            const std::uint64_t resultsPerHypothesis = this->getResultsPerHypothesis();
+            const std::uint64_t n_hypotheses = std::uint64_t(n_parameters) * std::uint64_t(this->getDensityVariantCount());
+
+            reserveResultCapacity(std::uint64_t(n_types) * n_hypotheses * resultsPerHypothesis);
+
+            // large batches are processed in chunks to limit the memory of the precomputed matter solutions
+            const int n_densities = this->getGridDensities().size();
+            const int chunkSize = physics::getMatterSolutionChunkSize<FLOAT_T>(this->n_energies, n_densities, n_parameters, n_types);
+            const std::uint64_t n_solutions = std::uint64_t(n_types) * std::uint64_t(chunkSize) * std::uint64_t(this->n_energies) * std::uint64_t(n_densities);
+
+            if(n_solutions > matterSolutionCapacity){
+                cudaStreamSynchronize(stream); CUERR;
+
+                d_matter_solution_list = make_unique_dev<physics::MatterSolution<FLOAT_T>>(memoryPool, deviceId, n_solutions); CUERR;
+                matterSolutionCapacity = n_solutions;
+                graphIsValid = false;
+            }
+        }
+
+        // make sure that the result arrays can hold n_results probabilities
+        void reserveResultCapacity(std::uint64_t n_results){
+            if(n_results > resultCapacity){
+                // grow result arrays to hold the results of all hypotheses
+                cudaStreamSynchronize(stream); CUERR;
+
+                resultCapacity = n_results;
+                resultList = make_unique_pinned<FLOAT_T>(memoryPool, resultCapacity);
+                d_result_list = make_shared_dev<FLOAT_T>(memoryPool, deviceId, resultCapacity); CUERR;
+                graphIsValid = false;
+            }
+        }
+
+        // enqueue the kernels which calculate the first parameterCount parameter sets for each density variant on the device
+        void enqueueCalculateKernels(NeutrinoType type, int n_types){
+            const int n_parameters = parameterCount;
+            const int n_variants = this->getDensityVariantCount();
+            const std::uint64_t resultsPerHypothesis = this->getResultsPerHypothesis();
+            const int chunkSize = physics::getMatterSolutionChunkSize<FLOAT_T>(this->n_energies, this->getGridDensities().size(), n_parameters, n_types);
+
+            dim3 block(getBlockSize(), 1, 1);
+
+            //const unsigned blocks = SDIV(this->energyList.size() * this->cosineList.size(), block.x);
+            const unsigned blocks = SDIV(this->energyList.size(), block.x) * this->cosineList.size();
+
+            physics::OscillationContext<FLOAT_T> context = getContext();
+            context.n_types = n_types;
+            context.resultTypeStride = std::uint64_t(n_parameters) * std::uint64_t(n_variants) * resultsPerHypothesis;
+
+            for(int first = 0; first < n_parameters; first += chunkSize){
+                context.parameterList = d_parameter_list.get() + first;
+                context.n_parameters = std::min(chunkSize, n_parameters - first);
+
+                FLOAT_T* const chunkResults = d_result_list.get() + std::uint64_t(first) * std::uint64_t(n_variants) * resultsPerHypothesis;
+
+                // one (type, hypothesis, variant) per z-slice of the grid. larger batches are handled by a grid-stride loop in the kernel
+                dim3 grid(blocks, 1, std::min(n_types * context.n_parameters * n_variants, 65535));
+
+                if(mixedPrecision)
+                    physics::callCalculateMixedKernelAsync(grid, block, stream, type, context, chunkResults);
+                else
+                    physics::callCalculateKernelAsync(grid, block, stream, type, context, chunkResults);
+
+                CUERR;
+            }
         }
 
-        // launch the calculation kernel without waiting for its completion
-        void calculateProbabilitiesAsync(NeutrinoType type){
-            if(!this->isInit)
-                throw std::runtime_error("CudaPropagatorSingle::calculateProbabilities. Object has been moved from.");
-            if(!this->isSetProductionHeight)
-                throw std::runtime_error("CudaPropagatorSingle::calculateProbabilities. production height was not set");
+        // capture the transfer of the parameters and the kernels of a calculation into a CUDA graph. The graph refers to the current
+        // device arrays and reads the parameters from the pinned host buffer when it is launched, so it stays valid until an array is
+        // reallocated or the layout of the results changes
+        void captureCalculationGraph(NeutrinoType type, int n_types){
+            const int n_parameters = parameterCount;
 
-            resultsResideOnHost = false;
-            cudaSetDevice(deviceId); CUERR;
+            cudaStreamBeginCapture(stream, cudaStreamCaptureModeThreadLocal); CUERR;
 
-            // set neutrino parameters for core physics functions for both host and device
-            physics::setMixMatrix(this->Mix_U.data());
-            physics::setMassDifferences(this->dm.data());
+            cudaMemcpyAsync(d_parameter_list.get(), parameterList.get(), sizeof(physics::ParameterSet<FLOAT_T>) * n_parameters, H2D, stream); CUERR;
+            enqueueCalculateKernels(type, n_types);
 
-            dim3 block(64, 1, 1);
+            cudaGraph_t graph;
+            cudaStreamEndCapture(stream, &graph); CUERR;
 
-            //const unsigned blocks = SDIV(this->energyList.size() * this->cosineList.size(), block.x);
-            const unsigned blocks = SDIV(this->energyList.size(), block.x) * this->cosineList.size();
+            destroyGraph();
 
-            dim3 grid(blocks, 1, 1);
+            cudaGraphInstantiateWithFlags(&graphExec, graph, 0); CUERR;
+            cudaGraphDestroy(graph); CUERR;
 
-            physics::callCalculateKernelAsync(grid, block, stream,
-                            type,
-                            d_cosine_list.get(), this->n_cosines,
-                            d_energy_list.get(), this->n_energies,
-                            d_radii.get(), d_rhos.get(),
-                            d_maxlayers.get(),
-                            this->ProductionHeightinCentimeter, d_result_list.get());
+            graphIsValid = true;
+            graphType = type;
+            graphTypes = n_types;
+            graphParameters = n_parameters;
+            graphBlockSize = getBlockSize();
+        }
 
-            CUERR;
+        void destroyGraph(){
+            if(graphExec != nullptr){
+                cudaGraphExecDestroy(graphExec); CUERR;
+                graphExec = nullptr;
+            }
+            graphIsValid = false;
         }
 
-        // wait for calculateProbabilitiesAsync to finish
-        void waitForCompletion(){
-            cudaSetDevice(deviceId); CUERR;
-            cudaStreamSynchronize(stream); CUERR;
+        // offset of the results of type in resultList
+        std::uint64_t getTypeOffset(NeutrinoType type) const{
+            return std::uint64_t(this->getTypeIndex(type)) * std::uint64_t(batchSize) * this->getResultsPerHypothesis();
         }
 
-        // copy results from device to host
-        void getResultFromDevice(){
-            cudaSetDevice(deviceId); CUERR;
-            cudaMemcpyAsync(resultList.get(), d_result_list.get(),
-                            sizeof(FLOAT_T) * std::uint64_t(9) * std::uint64_t(this->n_energies) * std::uint64_t(this->n_cosines),
-                            D2H, stream);  CUERR;
-            cudaStreamSynchronize(stream);
+        // collect the input of the core physics functions. All pointers point to device memory owned by this propagator
+        physics::OscillationContext<FLOAT_T> getContext() const{
+            physics::OscillationContext<FLOAT_T> context;
+
+            context.cosinelist = d_cosine_list.get();
+            context.n_cosines = this->n_cosines;
+            context.energylist = d_energy_list.get();
+            context.n_energies = this->n_energies;
+            context.densities = d_densities.get();
+            context.n_densities = this->getGridDensities().size();
+            context.maxlayers = d_maxlayers.get();
+            context.pathOrder = d_path_order.get();
+            context.layerDistances = d_layer_distances.get();
+            context.layerDensityIndices = d_layer_density_indices.get();
+            context.layerStride = this->layerStride;
+            context.n_densityVariants = this->getDensityVariantCount();
+            context.layerVariantStride = std::uint64_t(this->n_cosines) * std::uint64_t(this->layerStride);
+            context.heightDistances = d_height_distances.get();
+            context.heightWeights = d_height_weights.get();
+            context.n_heightSamples = this->n_heightSamples;
+            context.parameterList = d_parameter_list.get();
+            context.n_parameters = parameterCount;
+            context.n_types = 1;
+            context.resultTypeStride = 0;
+            context.matterSolutions = d_matter_solution_list.get();
+            context.gradientParameterList = d_gradient_parameter_list.get();
+            context.gradientSolutions = d_gradient_solution_list.get();
+            this->setContextChannels(context);
+
+            return context;
+        }
+
+        // enqueue a transfer in s. The transfer is timed and counted by the instrumentation
+        void copyAsync(void* dst, const void* src, std::uint64_t bytes, cudaMemcpyKind kind, cudaStream_t s){
+            const Phase phase = kind == H2D ? Phase::HostToDevice : Phase::DeviceToHost;
+
+            phaseTimer.begin(s, phase);
+            cudaMemcpyAsync(dst, src, bytes, kind, s); CUERR;
+            phaseTimer.end(s);
+
+            this->instrumentation.recordTransfer(phase, bytes);
+        }
+
+        // copy results from device to host, unless this was already done
+        void ensureResultsOnHost(){
+            if(resultsResideOnHost)
+                return;
+
+            fetchResultsAsync();
+            waitForCompletion();
+
+            resultsDownloadPending = false;
+            resultsResideOnHost = true;
         }
 
     private:
+        std::shared_ptr<CudaMemoryPool> memoryPool; // never null. The buffers keep the pool alive until they are returned
+
         unique_pinned_ptr<FLOAT_T> resultList;
 
-        unique_dev_ptr<FLOAT_T> d_rhos;
-        unique_dev_ptr<FLOAT_T> d_radii;
+        unique_dev_ptr<FLOAT_T> d_densities;
+        unique_dev_ptr<FLOAT_T> d_layer_distances;
+        unique_dev_ptr<int> d_layer_density_indices;
+        unique_dev_ptr<FLOAT_T> d_height_distances;
+        unique_dev_ptr<FLOAT_T> d_height_weights;
         unique_dev_ptr<int> d_maxlayers;
+        unique_dev_ptr<int> d_path_order;
         unique_dev_ptr<FLOAT_T> d_energy_list;
         unique_dev_ptr<FLOAT_T> d_cosine_list;
         shared_dev_ptr<FLOAT_T> d_result_list;
 
-        cudaStream_t stream;
+        unique_pinned_ptr<physics::ParameterSet<FLOAT_T>> parameterList;
+        unique_dev_ptr<physics::ParameterSet<FLOAT_T>> d_parameter_list;
+        unique_dev_ptr<physics::MatterSolution<FLOAT_T>> d_matter_solution_list;
+        unique_pinned_ptr<physics::ParameterSet<physics::Gradient<FLOAT_T>>> gradientParameterList; // allocated by the first gradient calculation
+        unique_dev_ptr<physics::ParameterSet<physics::Gradient<FLOAT_T>>> d_gradient_parameter_list;
+        unique_dev_ptr<physics::MatterSolution<physics::Gradient<FLOAT_T>>> d_gradient_solution_list;
+
+        unique_dev_ptr<FLOAT_T> d_radii;
+        unique_dev_ptr<FLOAT_T> d_coslimit;
+        unique_dev_ptr<int> d_density_indices;
+
+        unique_pinned_ptr<FLOAT_T> tileList[2]; // pinned staging buffers of tiled calculations
+        unique_dev_ptr<FLOAT_T> d_tile_list[2];
+
+        unique_pinned_ptr<FLOAT_T> eventInputList[2]; // staging buffers for cosines, energies, and production heights of two event chunks
+        unique_pinned_ptr<FLOAT_T> eventResultList[2];
+        unique_dev_ptr<FLOAT_T> d_event_input_list[2];
+        unique_dev_ptr<FLOAT_T> d_event_result_list[2];
+
+        cudaStream_t ownStream;
+        cudaStream_t stream; // either ownStream or a user stream
+        cudaStream_t tileStream; // second stream of tiled calculations
+        cudaEvent_t tileEvents[2]; // recorded after the transfer of a tile or an event chunk in each stream of tiled and event calculations
+        cudaEvent_t completionEvent; // recorded after each calculation or transfer of results
+        cudaEvent_t parameterEvent; // recorded after the transfer of the parameters to the device
+        StreamPhaseTimer phaseTimer; // times transfers and kernels. Not moved, like the streams and events
+        cudaGraphExec_t graphExec = nullptr; // captured calculation of graph mode
         int deviceId;
 
         bool resultsResideOnHost = false;
+        bool resultsDownloadPending = false;
+
+        int batchSize = 1; // number of hypotheses of last calculation, i.e. parameter sets times density variants
+        int parameterCount = 1; // number of parameter sets of the last calculation
+        int cosineCapacity = 0; // number of cosines which fit into d_cosine_list, d_maxlayers, and d_path_order
+        int energyCapacity = 0; // number of energies which fit into d_energy_list
+        std::uint64_t resultCapacity = 0; // number of probabilities which fit into the result arrays
+        int parameterCapacity = 0; // number of hypotheses which fit into the parameter arrays
+        std::uint64_t matterSolutionCapacity = 0; // number of matter solutions which fit into the matter solution array
+        std::uint64_t gradientSolutionCapacity = 0; // number of matter solutions which fit into the gradient solution array
+        int densityCapacity = 0; // number of unique densities which fit into d_densities
+        int layerCapacity = 0; // number of layers which fit into d_radii, d_coslimit, and d_density_indices
+        std::uint64_t layerTableSize = 0; // number of entries of the geometry table on the GPU
+        std::uint64_t layerIndexTableSize = 0; // number of entries of the density index table on the GPU
+        std::uint64_t heightTableSize = 0; // number of entries of the production height tables on the GPU
+        std::uint64_t eventChunkSize = std::uint64_t(1) << 20; // number of events per chunk of calculateEventProbabilities
+        std::uint64_t eventCapacity = 0; // number of events which fit into the event input arrays
+        std::uint64_t eventResultCapacity = 0; // number of probabilities which fit into the event result arrays
+        std::uint64_t tileCapacity = 0; // number of probabilities which fit into each tile buffer
+
+        bool graphMode = false;
+        bool mixedPrecision = false;
+        bool graphIsValid = false; // graphExec can be replayed with the current device arrays
+        NeutrinoType graphType = Neutrino; // type, number of types, and number of hypotheses of the captured calculation
+        int graphTypes = 0;
+        int graphParameters = 0;
+        int graphBlockSize = 0;
+
+        int blockSize = 0; // threads per block of the path kernels, 0 selects getBlockSize automatically
+        int architecture = 0; // compute capability of the GPU, e.g. 70
     };
 
     /// \class CudaPropagator
@@ -298,23 +1716,25 @@ namespace cudaprob3{
             if(deviceIds.size() == 0){
                 throw std::runtime_error("No valid device id found.");
             }
-            cosineIndices.resize(deviceIds.size());
-            localCosineIndices.resize(this->n_cosines);
-
-            for(int icos = 0; icos < this->n_cosines; icos++){
 
-                int deviceIndex = getCosineDeviceIndex(icos);
+            // initial estimate of the throughput of each GPU. It can be refined by calibrateDeviceWeights
+            for(const auto& id : deviceIds){
+                int multiProcessors;
+                int clockRate;
+                cudaDeviceGetAttribute(&multiProcessors, cudaDevAttrMultiProcessorCount, id); CUERR;
+                cudaDeviceGetAttribute(&clockRate, cudaDevAttrClockRate, id); CUERR;
 
-                cosineIndices[deviceIndex].push_back(icos);
-                // the icos-th path is processed by GPU deviceIndex.
-                // In the subproblem processed by GPU deviceIndex, the icos-th path is the localCosineIndices[icos]-th path
-                localCosineIndices[icos] = cosineIndices[deviceIndex].size() - 1;
+                deviceWeights.push_back(double(multiProcessors) * double(clockRate));
             }
 
-            for(size_t i = 0; i < deviceIds.size() && i < size_t(this->n_cosines); i++){
+            this->resultLayout = SoA;
+
+            partitionCosines();
+
+            for(size_t i = 0; i < cosineIndices.size(); i++){
                 propagatorVector.push_back(
                     std::unique_ptr<CudaPropagatorSingle<FLOAT_T>>(
-                        new CudaPropagatorSingle<FLOAT_T>(deviceIds[i], cosineIndices[i].size(), this->n_energies)
+                        new CudaPropagatorSingle<FLOAT_T>(deviceIds[i], cosineIndices[i].size(), this->n_energies, memoryPool)
                     )
                 );
             }
@@ -335,9 +1755,12 @@ namespace cudaprob3{
         CudaPropagator& operator=(CudaPropagator&& other){
             Propagator<FLOAT_T>::operator=(std::move(other));
 
+            memoryPool = std::move(other.memoryPool);
             deviceIds = std::move(other.deviceIds);
+            deviceWeights = std::move(other.deviceWeights);
             cosineIndices = std::move(other.cosineIndices);
             localCosineIndices = std::move(other.localCosineIndices);
+            cosineDeviceIndices = std::move(other.cosineDeviceIndices);
             cosineBatches = std::move(other.cosineBatches);
             propagatorVector = std::move(other.propagatorVector);
 
@@ -346,18 +1769,26 @@ namespace cudaprob3{
 
     public:
 
-        void setDensityFromFile(const std::string& filename) override{
-            Propagator<FLOAT_T>::setDensityFromFile(filename);
+        // the model is parsed once and shared by the propagators of all devices
+        void setDensityModel(std::shared_ptr<const DensityModel<FLOAT_T>> model) override{
+            Propagator<FLOAT_T>::setDensityModel(model);
+
+            for(auto& propagator : propagatorVector)
+                propagator->setDensityModel(model);
+        }
+
+        void setDensityVariants(const std::vector<FLOAT_T>& rhos, int n_variants) override{
+            Propagator<FLOAT_T>::setDensityVariants(rhos, n_variants);
 
             for(auto& propagator : propagatorVector)
-                propagator->setDensityFromFile(filename);
+                propagator->setDensityVariants(rhos, n_variants);
         }
 
-        void setDensity(const std::vector<FLOAT_T>& radii, const std::vector<FLOAT_T>& rhos) override{
-            Propagator<FLOAT_T>::setDensity(radii, rhos);
+        void clearDensityVariants() override{
+            Propagator<FLOAT_T>::clearDensityVariants();
 
             for(auto& propagator : propagatorVector)
-                propagator->setDensity(radii, rhos);
+                propagator->clearDensityVariants();
         }
 
         void setNeutrinoMasses(FLOAT_T dm12sq, FLOAT_T dm23sq) override{
@@ -385,17 +1816,29 @@ namespace cudaprob3{
             Propagator<FLOAT_T>::setCosineList(list);
 
             for(size_t i = 0; i < propagatorVector.size(); i++){
-                // make list of cosines for GPU i and pass it to propagator i
-                std::vector<FLOAT_T> myCos(cosineIndices[i].size());
-                std::transform(cosineIndices[i].begin(),
-                                cosineIndices[i].end(),
-                                myCos.begin(),
-                                [&](int icos){ return this->cosineList[icos]; }
-                );
-                propagatorVector[i]->setCosineList(myCos);
+                propagatorVector[i]->setCosineList(getDeviceCosines(i));
             }
         }
 
+        // the propagators of the GPUs are resized instead of being replaced, so they keep their streams, buffers and settings
+        void resize(int n_cosines_, int n_energies_) override{
+            if(n_cosines_ == this->n_cosines && n_energies_ == this->n_energies)
+                return;
+            if(n_cosines_ < 1 || n_energies_ < 1)
+                throw std::runtime_error("CudaPropagator::resize. Number of cosine bins and energy bins must be positive");
+
+            // the paths are redistributed by the parent function if the number of cosine bins changes
+            for(size_t i = 0; i < propagatorVector.size(); i++)
+                propagatorVector[i]->resize(cosineIndices[i].size(), n_energies_);
+
+            Propagator<FLOAT_T>::resize(n_cosines_, n_energies_);
+        }
+
+        /// \brief get the memory pool which is shared by the propagators of all GPUs
+        std::shared_ptr<CudaMemoryPool> getMemoryPool() const{
+            return memoryPool;
+        }
+
         void setProductionHeight(FLOAT_T heightKM) override{
             Propagator<FLOAT_T>::setProductionHeight(heightKM);
 
@@ -403,53 +1846,571 @@ namespace cudaprob3{
                 propagator->setProductionHeight(heightKM);
         }
 
+        void setProductionHeightDistribution(const std::vector<FLOAT_T>& heightsKM, const std::vector<FLOAT_T>& weights, int n_samples) override{
+            Propagator<FLOAT_T>::setProductionHeightDistribution(heightsKM, weights, n_samples);
+
+            for(size_t i = 0; i < propagatorVector.size(); i++)
+                setDeviceProductionHeightDistribution(*propagatorVector[i], i);
+        }
+
+        void clearProductionHeightDistribution() override{
+            Propagator<FLOAT_T>::clearProductionHeightDistribution();
+
+            for(auto& propagator : propagatorVector)
+                propagator->clearProductionHeightDistribution();
+        }
+
+        void setResultLayout(ResultLayout layout) override{
+            Propagator<FLOAT_T>::setResultLayout(layout);
+
+            for(auto& propagator : propagatorVector)
+                propagator->setResultLayout(layout);
+        }
+
+        /// \brief Set the relative throughput of each GPU and redistribute the paths accordingly
+        /// \details The paths are distributed such that the number of crossed layers per GPU is proportional to its weight.
+        /// Results of previous calculations are invalidated if the distribution changes
+        /// @param weights One positive weight per GPU, in the order of the device ids passed to the constructor
+        void setDeviceWeights(const std::vector<double>& weights){
+            if(weights.size() != deviceIds.size())
+                throw std::runtime_error("CudaPropagator::setDeviceWeights. weights.size() != number of GPUs");
+            if(std::any_of(weights.begin(), weights.end(), [](double w){ return !(w > 0.0); }))
+                throw std::runtime_error("CudaPropagator::setDeviceWeights. weights must be positive");
+
+            deviceWeights = weights;
+
+            rebalanceCosines();
+        }
+
+        /// \brief get the relative throughput of each GPU which is used to distribute the paths
+        const std::vector<double>& getDeviceWeights() const{
+            return deviceWeights;
+        }
+
+        /// \brief Measure the throughput of each GPU with the current setup and redistribute the paths accordingly
+        /// \details Cosine list, density and production height must be set. Results of previous calculations are invalidated
+        /// @param repetitions Number of timed calculations per GPU
+        void calibrateDeviceWeights(int repetitions = 3){
+            if(!this->isSetProductionHeight)
+                throw std::runtime_error("CudaPropagator::calibrateDeviceWeights. production height was not set");
+            if(repetitions < 1)
+                throw std::runtime_error("CudaPropagator::calibrateDeviceWeights. repetitions must be positive");
+
+            std::vector<double> weights = deviceWeights;
+
+            for(size_t i = 0; i < propagatorVector.size(); i++){
+                // warm up
+                propagatorVector[i]->invalidateCachedCalculation();
+                propagatorVector[i]->calculateProbabilities(Neutrino);
+
+                auto begin = std::chrono::steady_clock::now();
+                for(int r = 0; r < repetitions; r++){
+                    // repeated calculations would be skipped otherwise
+                    propagatorVector[i]->invalidateCachedCalculation();
+                    propagatorVector[i]->calculateProbabilities(Neutrino);
+                }
+                auto end = std::chrono::steady_clock::now();
+
+                const double seconds = std::chrono::duration<double>(end - begin).count();
+
+                weights[i] = getPathCost(cosineIndices[i]) * repetitions / std::max(seconds, 1e-9);
+            }
+
+            setDeviceWeights(weights);
+        }
+
+        void setRequestedChannels(const std::vector<ProbType>& channels) override{
+            Propagator<FLOAT_T>::setRequestedChannels(channels);
+
+            for(auto& propagator : propagatorVector)
+                propagator->setRequestedChannels(channels);
+        }
+
+        /// \brief Set the number of events which are transferred and calculated at once per GPU by calculateEventProbabilities
+        /// @param chunkSize Number of events per chunk
+        void setEventChunkSize(std::uint64_t chunkSize){
+            for(auto& propagator : propagatorVector)
+                propagator->setEventChunkSize(chunkSize);
+        }
+
+        /// \brief Replay the launch sequence of the calculation from a CUDA graph on each GPU
+        /// @param enable Use graphs for subsequent calculations
+        void setGraphMode(bool enable){
+            for(auto& propagator : propagatorVector)
+                propagator->setGraphMode(enable);
+        }
+
+        /// \brief Calculate the probabilities of the grid in mixed precision on each GPU, see CudaPropagatorSingle::setMixedPrecision
+        /// @param enable Use mixed precision for subsequent calculations
+        void setMixedPrecision(bool enable){
+            for(auto& propagator : propagatorVector)
+                propagator->setMixedPrecision(enable);
+        }
+
+        /// \brief Set the number of threads per block of the path kernels on each GPU, see CudaPropagatorSingle::setBlockSize
+        /// @param blockSize One of 64, 128, 256, or 0
+        void setBlockSize(int blockSize){
+            for(auto& propagator : propagatorVector)
+                propagator->setBlockSize(blockSize);
+        }
+
+        /// \brief Select the fastest block size of the path kernels on each GPU, see CudaPropagatorSingle::autotuneBlockSize
+        /// \details Each GPU is tuned with its part of the grid
+        /// @param repetitions Number of timed calculations per block size
+        void autotuneBlockSize(int repetitions = 3){
+            for(auto& propagator : propagatorVector)
+                propagator->autotuneBlockSize(repetitions);
+        }
+
+        /// \brief get the timings and counters summed over all GPUs
+        /// \details lastSeconds of each phase is the maximum over the GPUs. Calculations are counted once per GPU,
+        /// calculations which used the result cache once
+        Statistics getStatistics() override{
+            Statistics statistics = Propagator<FLOAT_T>::getStatistics();
+            for(auto& propagator : propagatorVector)
+                statistics += propagator->getStatistics();
+
+            return statistics;
+        }
+
+        /// \brief get the timings and counters of each GPU, in the order of the device ids passed to the constructor
+        std::vector<Statistics> getDeviceStatistics(){
+            std::vector<Statistics> statistics;
+            for(auto& propagator : propagatorVector)
+                statistics.push_back(propagator->getStatistics());
+
+            return statistics;
+        }
+
+        void resetStatistics() override{
+            Propagator<FLOAT_T>::resetStatistics();
+
+            for(auto& propagator : propagatorVector)
+                propagator->resetStatistics();
+        }
+
+        /// \brief Set a function which is called with the duration of each timed phase on each GPU
+        void setInstrumentationHook(const InstrumentationHook& hook) override{
+            Propagator<FLOAT_T>::setInstrumentationHook(hook);
+
+            for(auto& propagator : propagatorVector)
+                propagator->setInstrumentationHook(hook);
+        }
+
     public:
         void calculateProbabilities(NeutrinoType type) override{
+            if(this->loadCachedResults(type, 1))
+                return;
+
+            calculateProbabilitiesAsync(type);
+            waitForCompletion();
+            this->storeCachedResults();
+        }
+
+        void calculateProbabilitiesBatch(NeutrinoType type, const std::vector<OscParams<FLOAT_T>>& batch) override{
+            calculateProbabilitiesBatchAsync(type, batch);
+            waitForCompletion();
+        }
 
+        void calculateProbabilitiesBothTypes() override{
+            if(this->loadCachedResults(Neutrino, 2))
+                return;
+
+            calculateProbabilitiesBothTypesAsync();
+            waitForCompletion();
+            this->storeCachedResults();
+        }
+
+        void calculateProbabilitiesBatchBothTypes(const std::vector<OscParams<FLOAT_T>>& batch) override{
+            calculateProbabilitiesBatchBothTypesAsync(batch);
+            waitForCompletion();
+        }
+
+        /// \brief Enqueue the calculation of the probability of each cell on each GPU and return without waiting for its completion
+        /// @param type Neutrino or Antineutrino
+        void calculateProbabilitiesAsync(NeutrinoType type){
             for(auto& propagator : propagatorVector)
                     propagator->calculateProbabilitiesAsync(type);
 
+            this->calculatedType = type;
+            this->n_calculatedTypes = 1;
+            this->n_calculatedVariants = this->getDensityVariantCount();
+            this->setCachedCalculation(type, 1);
+        }
+
+        /// \brief Enqueue the calculation of each hypothesis of the batch on each GPU and return without waiting for its completion
+        /// @param type Neutrino or Antineutrino
+        /// @param batch Oscillation parameters of each hypothesis
+        void calculateProbabilitiesBatchAsync(NeutrinoType type, const std::vector<OscParams<FLOAT_T>>& batch){
+            for(auto& propagator : propagatorVector)
+                    propagator->calculateProbabilitiesBatchAsync(type, batch);
+
+            this->calculatedType = type;
+            this->n_calculatedTypes = 1;
+            this->n_calculatedVariants = this->getDensityVariantCount();
+            this->setCachedBatchCalculation(type, 1, batch);
+        }
+
+        /// \brief Enqueue the calculation of Neutrino and Antineutrino on each GPU and return without waiting for its completion
+        void calculateProbabilitiesBothTypesAsync(){
+            for(auto& propagator : propagatorVector)
+                    propagator->calculateProbabilitiesBothTypesAsync();
+
+            this->calculatedType = Neutrino;
+            this->n_calculatedTypes = 2;
+            this->n_calculatedVariants = this->getDensityVariantCount();
+            this->setCachedCalculation(Neutrino, 2);
+        }
+
+        /// \brief Enqueue the calculation of Neutrino and Antineutrino for each hypothesis of the batch on each GPU and return without waiting for its completion
+        /// @param batch Oscillation parameters of each hypothesis
+        void calculateProbabilitiesBatchBothTypesAsync(const std::vector<OscParams<FLOAT_T>>& batch){
+            for(auto& propagator : propagatorVector)
+                    propagator->calculateProbabilitiesBatchBothTypesAsync(batch);
+
+            this->calculatedType = Neutrino;
+            this->n_calculatedTypes = 2;
+            this->n_calculatedVariants = this->getDensityVariantCount();
+            this->setCachedBatchCalculation(Neutrino, 2, batch);
+        }
+
+        /// \brief Enqueue the transfer of the results of the last calculation of each GPU to host memory
+        /// \details Subsequent accesses to the results only wait for the transfers instead of starting them
+        void fetchResultsAsync(){
+            for(auto& propagator : propagatorVector)
+                    propagator->fetchResultsAsync();
+        }
+
+        /// \brief Check without blocking whether the last enqueued calculation or transfer is completed on each GPU
+        bool isCompleted(){
+            return std::all_of(propagatorVector.begin(), propagatorVector.end(),
+                                [](const std::unique_ptr<CudaPropagatorSingle<FLOAT_T>>& propagator){ return propagator->isCompleted(); });
+        }
+
+        /// \brief Wait until the last enqueued calculation or transfer is completed on each GPU
+        void waitForCompletion(){
             for(auto& propagator : propagatorVector)
                     propagator->waitForCompletion();
         }
 
         FLOAT_T getProbability(int index_cosine, int index_energy, ProbType t) override{
+                if(this->hasLoadedTable())
+                    return this->getLoadedProbability(index_cosine, index_energy, t, this->n_calculatedTypes == 2 ? Neutrino : this->calculatedType);
+
                 const int deviceIndex = getCosineDeviceIndex(index_cosine);
                 const int localCosineIndex = localCosineIndices[index_cosine];
 
                 return propagatorVector[deviceIndex]->getProbability(localCosineIndex, index_energy, t);
         }
 
+        FLOAT_T getBatchProbability(int index_batch, int index_cosine, int index_energy, ProbType t) override{
+                const int deviceIndex = getCosineDeviceIndex(index_cosine);
+                const int localCosineIndex = localCosineIndices[index_cosine];
+
+                return propagatorVector[deviceIndex]->getBatchProbability(index_batch, localCosineIndex, index_energy, t);
+        }
+
+        FLOAT_T getProbability(int index_cosine, int index_energy, ProbType t, NeutrinoType type) override{
+                if(this->hasLoadedTable())
+                    return this->getLoadedProbability(index_cosine, index_energy, t, type);
+
+                const int deviceIndex = getCosineDeviceIndex(index_cosine);
+                const int localCosineIndex = localCosineIndices[index_cosine];
+
+                return propagatorVector[deviceIndex]->getProbability(localCosineIndex, index_energy, t, type);
+        }
+
+        FLOAT_T getBatchProbability(int index_batch, int index_cosine, int index_energy, ProbType t, NeutrinoType type) override{
+                const int deviceIndex = getCosineDeviceIndex(index_cosine);
+                const int localCosineIndex = localCosineIndices[index_cosine];
+
+                return propagatorVector[deviceIndex]->getBatchProbability(index_batch, localCosineIndex, index_energy, t, type);
+        }
+
+    protected:
+        bool usesMixedPrecision() const override{
+            return propagatorVector[0]->isMixedPrecision();
+        }
+
+        // each GPU calculates the gradients of its cosines
+        void calculateGradients(NeutrinoType type, int n_types) override{
+            for(auto& propagator : propagatorVector)
+                    propagator->launchGradientCalculationAsync(type, n_types);
+
+            waitForCompletion();
+
+            this->calculatedType = type;
+            this->n_calculatedTypes = n_types;
+            this->n_calculatedVariants = 1;
+            this->setCachedCalculation(type, n_types, this->GradientCalculation);
+        }
+
+        // the events are split into contiguous ranges according to the device weights. In each round, every GPU launches one chunk of its range
+        // and the chunks of the previous round are finished
+        void calculateEvents(NeutrinoType type, int n_types, std::uint64_t n_events, const FLOAT_T* cosines, const FLOAT_T* energies,
+                                const FLOAT_T* productionHeights, FLOAT_T* result) override{
+
+            const int n_used = propagatorVector.size();
+            const std::uint64_t resultTypeStride = n_events * std::uint64_t(this->n_channels);
+            const double totalWeight = std::accumulate(deviceWeights.begin(), deviceWeights.begin() + n_used, 0.0);
+
+            std::vector<std::uint64_t> begin(n_used + 1, 0);
+            double weight = 0.0;
+            for(int d = 0; d < n_used; d++){
+                weight += deviceWeights[d];
+                begin[d + 1] = d + 1 == n_used ? n_events : std::min(n_events, std::uint64_t(double(n_events) * weight / totalWeight));
+            }
+
+            for(int d = 0; d < n_used; d++)
+                propagatorVector[d]->beginEventCalculation(n_types, std::min(propagatorVector[d]->getEventChunkSize(), begin[d + 1] - begin[d]));
+
+            std::vector<std::uint64_t> next(begin.begin(), begin.end() - 1);
+
+            // first event and number of events of the unfinished chunk in each of the two buffers of each device
+            std::vector<std::uint64_t> chunkFirst(2 * n_used, 0);
+            std::vector<std::uint64_t> chunkSize(2 * n_used, 0);
+
+            auto finishChunk = [&](int d, int j){
+                const int c = 2 * d + j;
+                if(chunkSize[c] > 0){
+                    propagatorVector[d]->finishEventChunk(j, n_types, chunkSize[c], result + chunkFirst[c] * this->n_channels, resultTypeStride);
+                    chunkSize[c] = 0;
+                }
+            };
+
+            // in round k, each device calculates its next chunk in buffer k % 2 while the chunks of round k - 1 are finished
+            bool remaining = true;
+            for(int k = 0; remaining; k++){
+                const int j = k % 2;
+
+                remaining = false;
+                for(int d = 0; d < n_used; d++){
+                    const std::uint64_t n = std::min(propagatorVector[d]->getEventChunkSize(), begin[d + 1] - next[d]);
+                    if(n > 0){
+                        propagatorVector[d]->launchEventChunkAsync(j, type, n_types, n, cosines + next[d], energies + next[d],
+                                                                productionHeights == nullptr ? nullptr : productionHeights + next[d]);
+                        chunkFirst[2 * d + j] = next[d];
+                        chunkSize[2 * d + j] = n;
+                        next[d] += n;
+                    }
+                    remaining = remaining || next[d] < begin[d + 1];
+                }
+
+                for(int d = 0; d < n_used; d++)
+                    finishChunk(d, 1 - j);
+            }
+
+            for(int d = 0; d < n_used; d++){
+                finishChunk(d, 0);
+                finishChunk(d, 1);
+                propagatorVector[d]->endEventCalculation();
+            }
+        }
+
     private:
 
         void setMaxlayers() override{
             Propagator<FLOAT_T>::setMaxlayers();
 
+            // the cost of the paths may have changed
+            rebalanceCosines();
+
             for(auto& propagator : propagatorVector)
                 propagator->setMaxlayers();
         }
 
         // get index in device id for the GPU which processes the index_cosine-th path
         int getCosineDeviceIndex(int index_cosine){
-        #if 0
-                // block distribution
-                int id = 0;
-                for(int i = deviceIds.size(); i-- > 0;){
-                        if(index_cosine < (i+1) * n_cosines / deviceIds.size())
-                            id = i;
+                return cosineDeviceIndices[index_cosine];
+        }
+
+        // the calculation time of a path is proportional to the number of crossed layers
+        double getPathCost(int index_cosine) const{
+            return double(this->maxlayers[index_cosine] + 1);
+        }
+
+        double getPathCost(const std::vector<int>& cosines) const{
+            double cost = 0.0;
+            for(const auto& icos : cosines)
+                cost += getPathCost(icos);
+            return cost;
+        }
+
+        // distribute the paths among the GPUs such that each GPU finishes at the same time.
+        // paths are assigned by decreasing cost to the GPU with the smallest estimated time after adding the path.
+        // if there are less paths than GPUs, only the first n_cosines GPUs are used
+        void partitionCosines(){
+            const int n_used = std::min(int(deviceIds.size()), this->n_cosines);
+
+            std::vector<int> order(this->n_cosines);
+            std::iota(order.begin(), order.end(), 0);
+            std::stable_sort(order.begin(), order.end(), [&](int l, int r){ return getPathCost(l) > getPathCost(r); });
+
+            std::vector<double> load(n_used, 0.0);
+            cosineDeviceIndices.resize(this->n_cosines);
+
+            for(const auto& icos : order){
+                int best = 0;
+                double bestTime = std::numeric_limits<double>::max();
+
+                for(int d = 0; d < n_used; d++){
+                    const double time = (load[d] + getPathCost(icos)) / deviceWeights[d];
+                    if(time < bestTime){
+                        bestTime = time;
+                        best = d;
+                    }
+                }
+
+                cosineDeviceIndices[icos] = best;
+                load[best] += getPathCost(icos);
+            }
+
+            // each used GPU must process at least one path. Take the cheapest path of the GPU with the most paths
+            for(int d = 0; d < n_used; d++){
+                if(std::count(cosineDeviceIndices.begin(), cosineDeviceIndices.end(), d) > 0)
+                    continue;
+
+                std::vector<int> counts(n_used, 0);
+                for(const auto& device : cosineDeviceIndices)
+                    counts[device]++;
+
+                const int donor = std::distance(counts.begin(), std::max_element(counts.begin(), counts.end()));
+
+                for(auto it = order.rbegin(); it != order.rend(); ++it){
+                    if(cosineDeviceIndices[*it] == donor){
+                        cosineDeviceIndices[*it] = d;
+                        break;
+                    }
+                }
+            }
+
+            cosineIndices.assign(n_used, std::vector<int>{});
+            localCosineIndices.resize(this->n_cosines);
+
+            for(int icos = 0; icos < this->n_cosines; icos++){
+
+                int deviceIndex = getCosineDeviceIndex(icos);
+
+                cosineIndices[deviceIndex].push_back(icos);
+                // the icos-th path is processed by GPU deviceIndex.
+                // In the subproblem processed by GPU deviceIndex, the icos-th path is the localCosineIndices[icos]-th path
+                localCosineIndices[icos] = cosineIndices[deviceIndex].size() - 1;
+            }
+        }
+
+        // recompute the distribution of the paths. GPUs which get a different number of paths are resized. If the number of cosine bins
+        // changed, GPUs which get paths for the first time get a new CudaPropagatorSingle, and the propagators of GPUs without paths are released
+        void rebalanceCosines(){
+            const std::vector<std::vector<int>> oldCosineIndices = cosineIndices;
+
+            partitionCosines();
+
+            if(cosineIndices == oldCosineIndices)
+                return;
+
+            for(size_t i = 0; i < cosineIndices.size(); i++){
+                if(i >= propagatorVector.size()){
+                    propagatorVector.push_back(makeDevicePropagator(i));
+                    continue;
                 }
-        #else
-                // cyclic distribution.
-                const int id = index_cosine % deviceIds.size();
-        #endif
-                return id;
+
+                propagatorVector[i]->resize(cosineIndices[i].size(), this->n_energies);
+                propagatorVector[i]->setCosineList(getDeviceCosines(i));
+                if(this->n_heightSamples > 0)
+                    setDeviceProductionHeightDistribution(*propagatorVector[i], i);
+                else
+                    propagatorVector[i]->clearProductionHeightDistribution();
+            }
+
+            propagatorVector.erase(propagatorVector.begin() + cosineIndices.size(), propagatorVector.end());
+        }
+
+        // make list of cosines for GPU i
+        std::vector<FLOAT_T> getDeviceCosines(int i) const{
+            std::vector<FLOAT_T> myCos(cosineIndices[i].size());
+            std::transform(cosineIndices[i].begin(),
+                            cosineIndices[i].end(),
+                            myCos.begin(),
+                            [&](int icos){ return this->cosineList[icos]; }
+            );
+            return myCos;
+        }
+
+        // pass the production heights and weights of the cosines of GPU i to propagator
+        void setDeviceProductionHeightDistribution(CudaPropagatorSingle<FLOAT_T>& propagator, int i) const{
+            const int n_samples = this->n_heightSamples;
+
+            std::vector<FLOAT_T> heights(cosineIndices[i].size() * n_samples);
+            std::vector<FLOAT_T> weights(cosineIndices[i].size() * n_samples);
+
+            for(size_t icos = 0; icos < cosineIndices[i].size(); icos++){
+                const std::size_t offset = std::size_t(cosineIndices[i][icos]) * std::size_t(n_samples);
+
+                std::copy_n(this->productionHeightSamples.begin() + offset, n_samples, heights.begin() + icos * n_samples);
+                std::copy_n(this->productionHeightWeights.begin() + offset, n_samples, weights.begin() + icos * n_samples);
+            }
+
+            propagator.setProductionHeightDistribution(heights, weights, n_samples);
+        }
+
+        // create the propagator of GPU i for its current list of cosines and copy the current setup and the settings of the first GPU to it
+        std::unique_ptr<CudaPropagatorSingle<FLOAT_T>> makeDevicePropagator(int i) const{
+            std::unique_ptr<CudaPropagatorSingle<FLOAT_T>> propagator(
+                new CudaPropagatorSingle<FLOAT_T>(deviceIds[i], cosineIndices[i].size(), this->n_energies, memoryPool)
+            );
+
+            const CudaPropagatorSingle<FLOAT_T>& first = *propagatorVector.front();
+
+            // the timings and counters start at zero. The hook is shared by all GPUs
+            propagator->instrumentation = first.instrumentation;
+            propagator->instrumentation.reset();
+            propagator->instrumentation.setDeviceId(deviceIds[i]);
+
+            propagator->setEnergyList(this->energyList);
+            propagator->setCosineList(getDeviceCosines(i));
+
+            if(!this->densityModel->empty())
+                propagator->setDensityModel(this->densityModel);
+
+            if(this->n_densityVariants > 0)
+                propagator->setDensityVariants(this->densityVariantRhos, this->n_densityVariants);
+
+            if(this->isSetProductionHeight)
+                propagator->setProductionHeight(this->ProductionHeightinCentimeter / 100000.0);
+
+            if(this->n_heightSamples > 0)
+                setDeviceProductionHeightDistribution(*propagator, i);
+
+            propagator->Mix_U = this->Mix_U;
+            propagator->dm = this->dm;
+            propagator->mixingAngles = this->mixingAngles;
+            propagator->massDifferences = this->massDifferences;
+
+            propagator->setResultLayout(this->resultLayout);
+
+            std::vector<ProbType> channels;
+            for(int t = 0; t < 9; t++){
+                if(this->isRequestedChannel(ProbType(t)))
+                    channels.push_back(ProbType(t));
+            }
+            propagator->setRequestedChannels(channels);
+
+            propagator->setEventChunkSize(first.getEventChunkSize());
+            propagator->setMixedPrecision(first.isMixedPrecision());
+            propagator->setBlockSize(first.blockSize);
+            propagator->setGraphMode(first.isGraphMode());
+
+            return propagator;
         }
 
     private:
 
+        std::shared_ptr<CudaMemoryPool> memoryPool = std::make_shared<CudaMemoryPool>(); // shared by the propagators of all GPUs
         std::vector<int> deviceIds;
+        std::vector<double> deviceWeights; // relative throughput of each GPU
         std::vector<std::vector<int>> cosineIndices;
         std::vector<int> localCosineIndices;
+        std::vector<int> cosineDeviceIndices; // for each path, the index in deviceIds of the GPU which processes it
 
         std::vector<int> cosineBatches;
 
@@ -0,0 +1,201 @@
+/*
+This file is part of CUDAProb3++.
+
+CUDAProb3++ is free software: you can redistribute it and/or modify
+it under the terms of the GNU Lesser General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+CUDAProb3++ is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public License
+along with CUDAProb3++.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef CUDAPROB3_DENSITYMODEL_HPP
+#define CUDAPROB3_DENSITYMODEL_HPP
+
+#include "constants.hpp"
+#include "physics.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+#include <fstream>
+#include <iterator>
+#include <memory>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+namespace cudaprob3{
+
+    /// \class DensityModel
+    /// \brief Layers of a spherically symmetric earth model, parsed and validated once
+    /// \details A DensityModel is immutable. Propagators hold it by std::shared_ptr<const DensityModel>, so the same model can be
+    /// shared by any number of propagators and devices, and switching between prepared models only swaps a pointer.
+    /// The layers are stored from the surface to the center. For each layer, coslimit holds the cosine below which a path
+    /// crosses the layer. coslimit is non-increasing, so the number of crossed layers of a path is found by binary search
+    /// @param FLOAT_T The floating point type to use for calculations, i.e float, double
+    template<class FLOAT_T>
+    class DensityModel{
+    public:
+        /// \brief Empty model without layers
+        DensityModel() = default;
+
+        /// \brief Constructor
+        /// \details radii_ and rhos_ must be same size. both radii_ and rhos_ must be sorted, in the same order.
+        /// The density (g/cm^3) at a distance (km) from the center of the sphere between radii_[i], exclusive,
+        /// and radii_[j], inclusive, i < j  is assumed to be rhos_[j]
+        /// @param radii_ List of radii
+        /// @param rhos_ List of densities
+        DensityModel(const std::vector<FLOAT_T>& radii_, const std::vector<FLOAT_T>& rhos_){
+
+            if(rhos_.size() != radii_.size()){
+                throw std::runtime_error("setDensity : rhos.size() != radii.size()");
+            }
+
+            if(rhos_.size() == 0 || radii_.size() == 0){
+                throw std::runtime_error("setDensity : vectors must not be empty");
+            }
+
+            bool needFlip = false;
+
+            if(radii_.size() >= 2){
+                int sign = (radii_[1] - radii_[0] > 0 ? 1 : -1);
+
+                for(size_t i = 1; i < radii_.size(); i++){
+                    if((radii_[i] - radii_[i-1]) * sign < 0)
+                        throw std::runtime_error("radii order messed up");
+                }
+
+                if(sign == 1)
+                    needFlip = true;
+            }
+
+            radii = radii_;
+            rhos = rhos_;
+
+            if(needFlip){
+                std::reverse(radii.begin(), radii.end());
+                std::reverse(rhos.begin(), rhos.end());
+            }
+
+            // the outermost radius is the surface. all inner radii must lie inside the sphere, otherwise their coslimit is undefined
+            for(size_t i = 0; i < radii.size(); i++){
+                if(!(radii[i] >= 0) || !(rhos[i] >= 0))
+                    throw std::runtime_error("setDensity : radii and rhos must not be negative");
+                if(i > 0 && radii[i] > Constants<FLOAT_T>::REarth())
+                    throw std::runtime_error("setDensity : inner radii must not exceed the radius of the earth");
+            }
+
+            // collect the unique densities of the layers. densities[0] is reserved for vacuum.
+            // all layers with the same density share the same precomputed matter solutions
+            densities.assign(1, FLOAT_T(0.0));
+            densityIndices.resize(rhos.size());
+
+            for(size_t i = 0; i < rhos.size(); i++){
+                auto it = std::find(densities.begin(), densities.end(), rhos[i]);
+                densityIndices[i] = std::distance(densities.begin(), it);
+                if(it == densities.end())
+                    densities.push_back(rhos[i]);
+            }
+
+            coslimit.reserve(radii.size());
+
+            // first element of _Radii is largest radius
+            for(size_t i=0; i < radii.size() ; i++ )
+            {
+                // Using a cosine threshold
+                FLOAT_T x = -1* sqrt( 1 - (radii[i] * radii[i] / ( Constants<FLOAT_T>::REarth()*Constants<FLOAT_T>::REarth())) );
+                if ( i  == 0 ) x = 0;
+                coslimit.push_back(x);
+            }
+        }
+
+        /// \brief Parse a density file
+        /// \details File must contain two columns where the first column contains the radius (km)
+        /// and the second column contains the density (g/cm³). Parsing stops at the first entry which is not a number.
+        /// The first row must have the radius 0. The last row must have to radius of the sphere
+        ///
+        /// @param filename File with density information
+        static DensityModel fromFile(const std::string& filename){
+            std::ifstream file(filename, std::ios::binary);
+            if(!file)
+                throw std::runtime_error("could not open density file " + filename);
+
+            std::ostringstream stream;
+            stream << file.rdbuf();
+            const std::string text = stream.str();
+
+            std::vector<FLOAT_T> radii;
+            std::vector<FLOAT_T> rhos;
+
+            const char* pos = text.c_str();
+            while(true){
+                char* end;
+                const double r = std::strtod(pos, &end);
+                if(end == pos)
+                    break;
+                pos = end;
+
+                const double d = std::strtod(pos, &end);
+                if(end == pos)
+                    break;
+                pos = end;
+
+                radii.push_back(FLOAT_T(r));
+                rhos.push_back(FLOAT_T(d));
+            }
+
+            return DensityModel(radii, rhos);
+        }
+
+        /// \brief Number of crossed layers of the path with cosine_zenith, excluding the atmospheric layer
+        int getMaxLayer(FLOAT_T cosine_zenith) const{
+            return physics::getMaxLayer(coslimit.data(), int(coslimit.size()), cosine_zenith);
+        }
+
+        bool operator==(const DensityModel& other) const{
+            return radii == other.radii && rhos == other.rhos;
+        }
+
+        bool operator!=(const DensityModel& other) const{
+            return !(*this == other);
+        }
+
+        bool empty() const{ return radii.empty(); }
+        int getLayerCount() const{ return int(radii.size()); }
+
+        /// \brief Radii (km) from the surface to the center
+        const std::vector<FLOAT_T>& getRadii() const{ return radii; }
+        /// \brief Densities (g/cm^3) of the layers from the surface to the center
+        const std::vector<FLOAT_T>& getRhos() const{ return rhos; }
+        /// \brief Unique densities of the layers. getDensities()[0] is vacuum
+        const std::vector<FLOAT_T>& getDensities() const{ return densities; }
+        /// \brief For each layer, the index of its density in getDensities()
+        const std::vector<int>& getDensityIndices() const{ return densityIndices; }
+        /// \brief For each layer, the cosine below which a path crosses the layer. Non-increasing
+        const std::vector<FLOAT_T>& getCoslimit() const{ return coslimit; }
+
+    private:
+        std::vector<FLOAT_T> radii;
+        std::vector<FLOAT_T> rhos;
+        std::vector<FLOAT_T> densities;
+        std::vector<int> densityIndices;
+        std::vector<FLOAT_T> coslimit;
+    };
+
+    /// \brief Parse a density file into a model which can be shared by propagators
+    template<class FLOAT_T>
+    std::shared_ptr<const DensityModel<FLOAT_T>> makeDensityModelFromFile(const std::string& filename){
+        return std::make_shared<const DensityModel<FLOAT_T>>(DensityModel<FLOAT_T>::fromFile(filename));
+    }
+
+} // namespace cudaprob3
+
+#endif
@@ -0,0 +1,368 @@
+/*
+This file is part of CUDAProb3++.
+
+CUDAProb3++ is free software: you can redistribute it and/or modify
+it under the terms of the GNU Lesser General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+CUDAProb3++ is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public License
+along with CUDAProb3++.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef CUDAPROB3_EVENTRATES_HPP
+#define CUDAPROB3_EVENTRATES_HPP
+
+#include "hpc_helpers.cuh"
+#include "propagator.hpp"
+#include "threadpool.hpp"
+#include "types.hpp"
+
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <memory>
+#include <stdexcept>
+#include <utility>
+#include <vector>
+
+/*
+ * Reduction of the probabilities of a calculated grid to expected event counts per reconstructed bin.
+ *
+ * The expected count of reconstructed bin r is
+ *
+ *   N[r] = sum over the elements (type, flavour j, cell c, r, w) of the response of w * sum_i flux[type][i][c] * P(i->j)[type][c]
+ *
+ * The weight w of an element combines cross section, exposure, efficiency and the migration of the true cell c to the
+ * reconstructed bin r. Only flavours i with a flux contribute.
+ *
+ * The response is stored as compressed rows, one row per reconstructed bin, so each bin is a contiguous range of elements.
+ * The functions of namespace eventrates are shared by EventRateReducer on the host and CudaEventRateReducer on the GPU.
+ */
+
+namespace cudaprob3{
+
+    /// \brief Neutrino flavour of a flux or a detected interaction
+    enum class Flavour : int { e = 0, mu = 1, tau = 2 };
+
+    /// \class FluxTable
+    /// \brief Flux of each neutrino type and flavour in each cell of a grid
+    /// \details Flavours without a flux do not contribute to the event rates, and their probabilities need not be requested
+    /// @param FLOAT_T The floating point type to use for calculations, i.e float, double
+    template<class FLOAT_T>
+    class FluxTable{
+    public:
+        FluxTable(int n_cosines_, int n_energies_) : n_cosines(n_cosines_), n_energies(n_energies_){
+            if(n_cosines < 1 || n_energies < 1)
+                throw std::runtime_error("FluxTable. The grid must not be empty");
+
+            values.resize(6 * getCellCount(), FLOAT_T(0));
+            isSet.fill(false);
+        }
+
+        /// \brief Set the flux of a neutrino type and flavour
+        /// @param type Neutrino or Antineutrino
+        /// @param flavour Flavour of the flux
+        /// @param flux Flux of each cell, [cosine][energy]
+        void setFlux(NeutrinoType type, Flavour flavour, const std::vector<FLOAT_T>& flux){
+            if(flux.size() != getCellCount())
+                throw std::runtime_error("FluxTable::setFlux. flux must have one entry per cell");
+
+            const int k = int(type) * 3 + int(flavour);
+            std::copy(flux.begin(), flux.end(), values.begin() + std::uint64_t(k) * getCellCount());
+            isSet[k] = true;
+        }
+
+        /// \brief Check if the flux of a neutrino type and flavour was set
+        bool hasFlux(NeutrinoType type, Flavour flavour) const{
+            return isSet[int(type) * 3 + int(flavour)];
+        }
+
+        /// \brief Flux of each type, flavour and cell, [type][flavour][cosine][energy]
+        const std::vector<FLOAT_T>& getValues() const{ return values; }
+
+        int getCosineCount() const{ return n_cosines; }
+        int getEnergyCount() const{ return n_energies; }
+        std::uint64_t getCellCount() const{ return std::uint64_t(n_cosines) * n_energies; }
+
+    private:
+        int n_cosines;
+        int n_energies;
+        std::vector<FLOAT_T> values;
+        std::array<bool, 6> isSet;
+    };
+
+    /// \class ResponseMatrix
+    /// \brief Sparse map of the true cells of a grid to reconstructed bins
+    /// @param FLOAT_T The floating point type to use for calculations, i.e float, double
+    template<class FLOAT_T>
+    class ResponseMatrix{
+    public:
+        struct Element{
+            NeutrinoType type;
+            Flavour flavour; // detected flavour
+            int index_cosine;
+            int index_energy;
+            int recoBin;
+            FLOAT_T weight;
+        };
+
+        ResponseMatrix(int n_cosines_, int n_energies_, int n_recoBins_)
+            : n_cosines(n_cosines_), n_energies(n_energies_), n_recoBins(n_recoBins_){
+            if(n_cosines < 1 || n_energies < 1 || n_recoBins < 1)
+                throw std::runtime_error("ResponseMatrix. The grid and the reconstructed bins must not be empty");
+        }
+
+        /// \brief Add the contribution of a true cell to a reconstructed bin
+        /// \details Elements with the same indices are summed
+        /// @param type Neutrino or Antineutrino
+        /// @param flavour Detected flavour
+        /// @param index_cosine Cosine bin of the true cell
+        /// @param index_energy Energy bin of the true cell
+        /// @param recoBin Reconstructed bin
+        /// @param weight Number of events in recoBin per unit of flux times probability in the true cell
+        void add(NeutrinoType type, Flavour flavour, int index_cosine, int index_energy, int recoBin, FLOAT_T weight){
+            if(index_cosine < 0 || index_cosine >= n_cosines || index_energy < 0 || index_energy >= n_energies)
+                throw std::runtime_error("ResponseMatrix::add. Invalid cell");
+            if(recoBin < 0 || recoBin >= n_recoBins)
+                throw std::runtime_error("ResponseMatrix::add. Invalid reconstructed bin");
+
+            elements.push_back(Element{type, flavour, index_cosine, index_energy, recoBin, weight});
+        }
+
+        const std::vector<Element>& getElements() const{ return elements; }
+
+        int getCosineCount() const{ return n_cosines; }
+        int getEnergyCount() const{ return n_energies; }
+        int getRecoBinCount() const{ return n_recoBins; }
+
+    private:
+        int n_cosines;
+        int n_energies;
+        int n_recoBins;
+        std::vector<Element> elements;
+    };
+
+namespace eventrates{
+
+    // element of a row of the compressed response
+    template<class FLOAT_T>
+    struct RowElement{
+        std::uint32_t cell; // index_cosine * n_energies + index_energy
+        int channel; // type * 3 + detected flavour
+        FLOAT_T weight;
+    };
+
+    // offset of probability P(i->j) of each channel = type * 3 + j in the results of a hypothesis, or -1 if flavour i has no flux
+    struct ChannelOffsets{
+        std::int64_t offset[18]; // [channel][i]
+    };
+
+    // sort the elements of the response into rows of reconstructed bins. Elements of a row keep their order
+    template<class FLOAT_T>
+    void makeRows(const ResponseMatrix<FLOAT_T>& response, std::vector<int>& rowBegin, std::vector<RowElement<FLOAT_T>>& rows,
+                    std::array<bool, 6>& usedChannels){
+
+        const auto& elements = response.getElements();
+        const int n_bins = response.getRecoBinCount();
+
+        rowBegin.assign(n_bins + 1, 0);
+        for(const auto& element : elements)
+            rowBegin[element.recoBin + 1]++;
+        for(int r = 0; r < n_bins; r++)
+            rowBegin[r + 1] += rowBegin[r];
+
+        std::vector<int> position(rowBegin.begin(), rowBegin.end() - 1);
+        rows.resize(elements.size());
+        usedChannels.fill(false);
+
+        for(const auto& element : elements){
+            const int channel = int(element.type) * 3 + int(element.flavour);
+
+            RowElement<FLOAT_T> row;
+            row.cell = std::uint32_t(std::uint64_t(element.index_cosine) * response.getEnergyCount() + element.index_energy);
+            row.channel = channel;
+            row.weight = element.weight;
+
+            rows[position[element.recoBin]++] = row;
+            usedChannels[channel] = true;
+        }
+    }
+
+    // check that the flux and the response of a n_cosines x n_energies grid belong to the grid of the propagator, and that the
+    // propagator calculated each probability which is needed by the used channels
+    template<class FLOAT_T>
+    void checkInputs(const Propagator<FLOAT_T>& propagator, const FluxTable<FLOAT_T>& flux, int n_cosines, int n_energies,
+                        const std::array<bool, 6>& usedChannels){
+
+        if(int(propagator.getCosineList().size()) != n_cosines || int(propagator.getEnergyList().size()) != n_energies
+                || flux.getCosineCount() != n_cosines || flux.getEnergyCount() != n_energies)
+            throw std::runtime_error("EventRateReducer. The flux and the response must have the grid of the propagator");
+
+        for(int channel = 0; channel < 6; channel++){
+            if(!usedChannels[channel])
+                continue;
+
+            const NeutrinoType type = NeutrinoType(channel / 3);
+            if(!propagator.isCalculatedType(type))
+                throw std::runtime_error("EventRateReducer. NeutrinoType of the response was not calculated");
+
+            for(int i = 0; i < 3; i++){
+                if(flux.hasFlux(type, Flavour(i)) && !propagator.isRequestedChannel(ProbType(i * 3 + channel % 3)))
+                    throw std::runtime_error("EventRateReducer. ProbType of the response was not requested");
+            }
+        }
+    }
+
+    // expected events of one element. results points to the results of the hypothesis, flux to the flux table
+    template<class FLOAT_T>
+    HOSTDEVICEQUALIFIER
+    FLOAT_T getElementRate(const RowElement<FLOAT_T>& element, const FLOAT_T* const results, std::uint64_t cellStride,
+                            const FLOAT_T* const flux, std::uint64_t n_cells, const ChannelOffsets& offsets){
+
+        const int type = element.channel / 3;
+        FLOAT_T rate = FLOAT_T(0);
+
+        for(int i = 0; i < 3; i++){
+            const std::int64_t offset = offsets.offset[element.channel * 3 + i];
+            if(offset < 0)
+                continue;
+
+            rate += flux[std::uint64_t(type * 3 + i) * n_cells + element.cell] * results[std::uint64_t(offset) + element.cell * cellStride];
+        }
+
+        return element.weight * rate;
+    }
+
+} // namespace eventrates
+
+    /// \class EventRateReducer
+    /// \brief Reduces the probabilities of a calculated grid on the host to expected event counts per reconstructed bin
+    /// \details The reconstructed bins are run in tasks by a TaskScheduler, e.g. the one of a CpuPropagator, or by the calling thread without a scheduler
+    /// @param FLOAT_T The floating point type to use for calculations, i.e float, double
+    template<class FLOAT_T>
+    class EventRateReducer{
+    public:
+        /// \brief Constructor
+        /// @param flux_ Flux of the grid
+        /// @param response_ Response of the grid
+        /// @param scheduler_ Scheduler which runs the reduction, see setScheduler
+        EventRateReducer(const FluxTable<FLOAT_T>& flux_, const ResponseMatrix<FLOAT_T>& response_,
+                            std::shared_ptr<TaskScheduler> scheduler_ = nullptr) : flux(flux_), scheduler(std::move(scheduler_)){
+            setResponse(response_);
+        }
+
+        /// \brief Set the scheduler which runs the reconstructed bins of reduce
+        /// @param scheduler_ The scheduler, or nullptr to reduce all bins on the calling thread
+        void setScheduler(std::shared_ptr<TaskScheduler> scheduler_){
+            scheduler = std::move(scheduler_);
+        }
+
+        /// \brief Get the scheduler which runs the reduction, or nullptr
+        std::shared_ptr<TaskScheduler> getScheduler() const{
+            return scheduler;
+        }
+
+        void setFlux(const FluxTable<FLOAT_T>& flux_){
+            flux = flux_;
+        }
+
+        void setResponse(const ResponseMatrix<FLOAT_T>& response){
+            n_recoBins = response.getRecoBinCount();
+            n_cosines = response.getCosineCount();
+            n_energies = response.getEnergyCount();
+            eventrates::makeRows(response, rowBegin, rows, usedChannels);
+        }
+
+        /// \brief Compute the expected events of each reconstructed bin for a hypothesis of the last calculation of propagator
+        /// @param propagator Propagator with a finished calculation
+        /// @param index_batch Hypothesis of a batch calculation, or 0 for a grid calculation
+        /// @return Expected events of each reconstructed bin
+        std::vector<FLOAT_T> reduce(Propagator<FLOAT_T>& propagator, int index_batch = 0){
+            eventrates::checkInputs(propagator, flux, n_cosines, n_energies, usedChannels);
+
+            const std::uint64_t n_cells = flux.getCellCount();
+
+            // copy the needed probabilities into a table with one slot per channel and initial flavour
+            eventrates::ChannelOffsets offsets;
+            int n_slots = 0;
+            for(int channel = 0; channel < 6; channel++){
+                for(int i = 0; i < 3; i++){
+                    const bool needed = usedChannels[channel] && flux.hasFlux(NeutrinoType(channel / 3), Flavour(i));
+                    offsets.offset[channel * 3 + i] = needed ? std::int64_t(n_slots++) * std::int64_t(n_cells) : -1;
+                }
+            }
+
+            table.resize(std::uint64_t(n_slots) * n_cells);
+
+            for(int channel = 0; channel < 6; channel++){
+                for(int i = 0; i < 3; i++){
+                    const std::int64_t offset = offsets.offset[channel * 3 + i];
+                    if(offset < 0)
+                        continue;
+
+                    const NeutrinoType type = NeutrinoType(channel / 3);
+                    const ProbType t = ProbType(i * 3 + channel % 3);
+
+                    for(int index_cosine = 0; index_cosine < n_cosines; index_cosine++){
+                        for(int index_energy = 0; index_energy < n_energies; index_energy++){
+                            table[offset + std::uint64_t(index_cosine) * n_energies + index_energy] = index_batch == 0
+                                ? propagator.getProbability(index_cosine, index_energy, t, type)
+                                : propagator.getBatchProbability(index_batch, index_cosine, index_energy, t, type);
+                        }
+                    }
+                }
+            }
+
+            std::vector<FLOAT_T> counts(n_recoBins);
+            const FLOAT_T* const fluxValues = flux.getValues().data();
+
+            // each task reduces binsPerTask consecutive bins, whose rows may differ in length
+            constexpr int binsPerTask = 16;
+
+            auto reduceBins = [&](std::int64_t index_task, int){
+                const int first = int(index_task) * binsPerTask;
+                const int last = std::min(first + binsPerTask, n_recoBins);
+
+                for(int r = first; r < last; r++){
+                    FLOAT_T sum = FLOAT_T(0);
+                    for(int k = rowBegin[r]; k < rowBegin[r + 1]; k++)
+                        sum += eventrates::getElementRate(rows[k], table.data(), 1, fluxValues, n_cells, offsets);
+                    counts[r] = sum;
+                }
+            };
+
+            const std::int64_t n_tasks = SDIV(n_recoBins, binsPerTask);
+
+            if(scheduler){
+                scheduler->parallelFor(n_tasks, reduceBins);
+            }else{
+                for(std::int64_t index_task = 0; index_task < n_tasks; index_task++)
+                    reduceBins(index_task, 0);
+            }
+
+            return counts;
+        }
+
+        int getRecoBinCount() const{ return n_recoBins; }
+
+    private:
+        FluxTable<FLOAT_T> flux;
+        std::vector<int> rowBegin;
+        std::vector<eventrates::RowElement<FLOAT_T>> rows;
+        std::array<bool, 6> usedChannels;
+        std::vector<FLOAT_T> table; // [slot][cosine][energy]
+        int n_recoBins = 0;
+        int n_cosines = 0;
+        int n_energies = 0;
+        std::shared_ptr<TaskScheduler> scheduler; // runs the reconstructed bins of reduce, or nullptr for the calling thread
+    };
+
+} // namespace cudaprob3
+
+#endif
@@ -0,0 +1,351 @@
+/*
+This file is part of CUDAProb3++.
+
+CUDAProb3++ is free software: you can redistribute it and/or modify
+it under the terms of the GNU Lesser General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+CUDAProb3++ is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public License
+along with CUDAProb3++.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+ * Throughput benchmark of the propagators. Sweeps grid sizes, float and double, density models,
+ * thread counts of CpuPropagator and device sets of CudaPropagator, and prints the results as JSON to stdout.
+ *
+ * Options (all optional):
+ *   --sizes 100,200,400        grid sizes n, each grid has n cosines and n energies
+ *   --models 4,12,59           density models models/PREM_<x>layer.dat
+ *   --threads 1,2,4            thread counts of CpuPropagator
+ *   --devices 0:0,1            device sets of CudaPropagator, separated by ':'
+ *   --repetitions 10           number of warm calculations per configuration
+ *   --no-cpu / --no-gpu        skip a backend
+ */
+
+#include <cpupropagator.hpp> // include openmp propagator
+#include <cudapropagator.cuh> // include cuda propagator
+
+#include <omp.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <iostream>
+#include <memory>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+using namespace cudaprob3; // namespace of the propagators
+
+struct BenchmarkConfig{
+    std::vector<int> sizes{100, 200, 400};
+    std::vector<int> models{4, 12, 59};
+    std::vector<int> threads = omp_get_max_threads() > 1 ? std::vector<int>{1, omp_get_max_threads()} : std::vector<int>{1};
+    std::vector<std::vector<int>> devices{{0}};
+    int repetitions = 10;
+    bool runCpu = true;
+    bool runGpu = true;
+};
+
+// result of one configuration. Negative times are not available and are written as null
+struct BenchmarkResult{
+    std::string backend;
+    std::string precision;
+    int layers;
+    int n_cosines;
+    int n_energies;
+    int threads = 0;
+    std::vector<int> devices;
+    int repetitions;
+    double coldMs;
+    double warmMs;
+    double kernelMs = -1.0;
+    double transferMs = -1.0;
+};
+
+template<class T>
+std::vector<T> linspace(T min, T max, int n){
+    std::vector<T> list(n);
+    for(int i = 0; i < n; i++)
+        list[i] = n == 1 ? min : min + (max - min) * T(i) / T(n - 1);
+    return list;
+}
+
+template<class T>
+std::vector<T> logspace(T min, T max, int n){
+    std::vector<T> list = linspace(std::log(min), std::log(max), n);
+    for(auto& x : list)
+        x = std::exp(x);
+    return list;
+}
+
+std::vector<int> parseIntList(const std::string& s){
+    std::vector<int> list;
+    std::stringstream ss(s);
+    std::string item;
+    while(std::getline(ss, item, ','))
+        list.push_back(std::stoi(item));
+    return list;
+}
+
+BenchmarkConfig parseArguments(int argc, char** argv){
+    BenchmarkConfig config;
+
+    for(int i = 1; i < argc; i++){
+        const std::string arg = argv[i];
+        const bool hasValue = i + 1 < argc;
+
+        if(arg == "--sizes" && hasValue){
+            config.sizes = parseIntList(argv[++i]);
+        }else if(arg == "--models" && hasValue){
+            config.models = parseIntList(argv[++i]);
+        }else if(arg == "--threads" && hasValue){
+            config.threads = parseIntList(argv[++i]);
+        }else if(arg == "--devices" && hasValue){
+            config.devices.clear();
+            std::stringstream ss(argv[++i]);
+            std::string set;
+            while(std::getline(ss, set, ':'))
+                config.devices.push_back(parseIntList(set));
+        }else if(arg == "--repetitions" && hasValue){
+            config.repetitions = std::max(1, std::stoi(argv[++i]));
+        }else if(arg == "--no-cpu"){
+            config.runCpu = false;
+        }else if(arg == "--no-gpu"){
+            config.runGpu = false;
+        }else{
+            throw std::runtime_error("unknown argument " + arg);
+        }
+    }
+
+    return config;
+}
+
+std::string getModelFile(int layers){
+    return "models/PREM_" + std::to_string(layers) + "layer.dat";
+}
+
+// set up the propagator with the oscillation parameters of example/main.cpp
+template<class FLOAT_T>
+void setUp(Propagator<FLOAT_T>& propagator, int n, int layers){
+    propagator.setEnergyList(logspace(FLOAT_T(1.0), FLOAT_T(100.0), n));
+    propagator.setCosineList(linspace(FLOAT_T(-1.0), FLOAT_T(1.0), n));
+    propagator.setMNSMatrix(0.5695951908800630, 0.1608752771983211, 0.7853981633974483, 0.0);
+    propagator.setNeutrinoMasses(7.9e-5, 2.5e-3);
+    propagator.setDensityFromFile(getModelFile(layers));
+    propagator.setProductionHeight(22.0);
+}
+
+// change the cp phase, such that repeated calculations are not skipped
+template<class FLOAT_T>
+void changeParameters(Propagator<FLOAT_T>& propagator, int repetition){
+    propagator.setMNSMatrix(0.5695951908800630, 0.1608752771983211, 0.7853981633974483, 1e-3 * (repetition + 1));
+}
+
+double milliseconds(std::chrono::steady_clock::time_point begin, std::chrono::steady_clock::time_point end){
+    return std::chrono::duration<double, std::milli>(end - begin).count();
+}
+
+template<class FLOAT_T>
+BenchmarkResult runCpu(int n, int layers, int threads, int repetitions){
+    BenchmarkResult result;
+    result.backend = "cpu";
+    result.precision = sizeof(FLOAT_T) == 4 ? "float" : "double";
+    result.layers = layers;
+    result.n_cosines = n;
+    result.n_energies = n;
+    result.threads = threads;
+    result.repetitions = repetitions;
+
+    CpuPropagator<FLOAT_T> propagator(n, n, threads);
+    setUp(propagator, n, layers);
+
+    // the first calculation includes the allocation of the result and work arrays
+    auto begin = std::chrono::steady_clock::now();
+    propagator.calculateProbabilities(Neutrino);
+    auto end = std::chrono::steady_clock::now();
+    result.coldMs = milliseconds(begin, end);
+
+    double total = 0.0;
+    for(int r = 0; r < repetitions; r++){
+        changeParameters(propagator, r);
+
+        begin = std::chrono::steady_clock::now();
+        propagator.calculateProbabilities(Neutrino);
+        end = std::chrono::steady_clock::now();
+        total += milliseconds(begin, end);
+    }
+    result.warmMs = total / repetitions;
+
+    return result;
+}
+
+#ifdef __NVCC__
+
+template<class FLOAT_T>
+BenchmarkResult runGpu(int n, int layers, const std::vector<int>& devices, int repetitions){
+    BenchmarkResult result;
+    result.backend = "gpu";
+    result.precision = sizeof(FLOAT_T) == 4 ? "float" : "double";
+    result.layers = layers;
+    result.n_cosines = n;
+    result.n_energies = n;
+    result.devices = devices;
+    result.repetitions = repetitions;
+
+    if(devices.size() == 1){
+        // with a single GPU, the kernel and the transfer are timed separately with CUDA events
+        auto begin = std::chrono::steady_clock::now();
+        CudaPropagatorSingle<FLOAT_T> propagator(devices[0], n, n);
+        setUp(propagator, n, layers);
+        propagator.calculateProbabilities(Neutrino);
+        propagator.getProbability(0, 0, ProbType::e_e);
+        auto end = std::chrono::steady_clock::now();
+        result.coldMs = milliseconds(begin, end);
+
+        cudaSetDevice(devices[0]); CUERR;
+        cudaEvent_t events[3];
+        for(auto& event : events){
+            cudaEventCreate(&event); CUERR;
+        }
+
+        double total = 0.0;
+        double kernel = 0.0;
+        double transfer = 0.0;
+
+        for(int r = 0; r < repetitions; r++){
+            changeParameters(propagator, r);
+
+            begin = std::chrono::steady_clock::now();
+            cudaEventRecord(events[0], propagator.getStream()); CUERR;
+            propagator.calculateProbabilitiesAsync(Neutrino);
+            cudaEventRecord(events[1], propagator.getStream()); CUERR;
+            propagator.fetchResultsAsync();
+            cudaEventRecord(events[2], propagator.getStream()); CUERR;
+            propagator.waitForCompletion();
+            end = std::chrono::steady_clock::now();
+
+            float kernelMs;
+            float transferMs;
+            cudaEventElapsedTime(&kernelMs, events[0], events[1]); CUERR;
+            cudaEventElapsedTime(&transferMs, events[1], events[2]); CUERR;
+
+            total += milliseconds(begin, end);
+            kernel += kernelMs;
+            transfer += transferMs;
+        }
+
+        result.warmMs = total / repetitions;
+        result.kernelMs = kernel / repetitions;
+        result.transferMs = transfer / repetitions;
+
+        for(auto& event : events)
+            cudaEventDestroy(event);
+    }else{
+        auto begin = std::chrono::steady_clock::now();
+        CudaPropagator<FLOAT_T> propagator(devices, n, n);
+        setUp(propagator, n, layers);
+        propagator.calculateProbabilities(Neutrino);
+        propagator.fetchResultsAsync();
+        propagator.waitForCompletion();
+        auto end = std::chrono::steady_clock::now();
+        result.coldMs = milliseconds(begin, end);
+
+        double total = 0.0;
+        for(int r = 0; r < repetitions; r++){
+            changeParameters(propagator, r);
+
+            begin = std::chrono::steady_clock::now();
+            propagator.calculateProbabilitiesAsync(Neutrino);
+            propagator.fetchResultsAsync();
+            propagator.waitForCompletion();
+            end = std::chrono::steady_clock::now();
+            total += milliseconds(begin, end);
+        }
+        result.warmMs = total / repetitions;
+    }
+
+    return result;
+}
+
+#endif
+
+void writeNumber(std::ostream& os, double value){
+    if(value < 0.0)
+        os << "null";
+    else
+        os << value;
+}
+
+void writeJson(std::ostream& os, const std::vector<BenchmarkResult>& results){
+    os << "{\n  \"benchmark\": \"cudaprob3\",\n  \"results\": [";
+
+    for(size_t i = 0; i < results.size(); i++){
+        const BenchmarkResult& r = results[i];
+        const double cells = double(r.n_cosines) * double(r.n_energies);
+
+        os << (i == 0 ? "\n" : ",\n");
+        os << "    {\"backend\": \"" << r.backend << "\""
+           << ", \"precision\": \"" << r.precision << "\""
+           << ", \"layers\": " << r.layers
+           << ", \"n_cosines\": " << r.n_cosines
+           << ", \"n_energies\": " << r.n_energies;
+
+        if(r.backend == "cpu"){
+            os << ", \"threads\": " << r.threads;
+        }else{
+            os << ", \"devices\": [";
+            for(size_t d = 0; d < r.devices.size(); d++)
+                os << (d == 0 ? "" : ", ") << r.devices[d];
+            os << "]";
+        }
+
+        os << ", \"repetitions\": " << r.repetitions
+           << ", \"cold_ms\": "; writeNumber(os, r.coldMs);
+        os << ", \"warm_ms\": "; writeNumber(os, r.warmMs);
+        os << ", \"kernel_ms\": "; writeNumber(os, r.kernelMs);
+        os << ", \"transfer_ms\": "; writeNumber(os, r.transferMs);
+        os << ", \"cells_per_second\": "; writeNumber(os, cells / (r.warmMs * 1e-3));
+        os << "}";
+    }
+
+    os << "\n  ]\n}\n";
+}
+
+template<class FLOAT_T>
+void runAll(const BenchmarkConfig& config, std::vector<BenchmarkResult>& results){
+    for(const auto& layers : config.models){
+        for(const auto& n : config.sizes){
+            if(config.runCpu){
+                for(const auto& threads : config.threads)
+                    results.push_back(runCpu<FLOAT_T>(n, layers, threads, config.repetitions));
+            }
+#ifdef __NVCC__
+            if(config.runGpu){
+                for(const auto& devices : config.devices)
+                    results.push_back(runGpu<FLOAT_T>(n, layers, devices, config.repetitions));
+            }
+#endif
+        }
+    }
+}
+
+int main(int argc, char** argv){
+
+    const BenchmarkConfig config = parseArguments(argc, argv);
+
+    std::vector<BenchmarkResult> results;
+
+    runAll<float>(config, results);
+    runAll<double>(config, results);
+
+    writeJson(std::cout, results);
+}
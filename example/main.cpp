@@ -25,6 +25,7 @@ along with CUDAProb3++.  If not, see <http://www.gnu.org/licenses/>.
 #include <iomanip>
 #include <iostream>
 #include <memory>
+#include <string>
 #include <vector>
 
 using namespace cudaprob3; // namespace of the propagators
@@ -81,12 +82,22 @@ int main(int argc, char** argv){
     int n_energies = 200;
     //int threads = 4;
 
-    if(argc > 1)
-	n_cosines = std::atoi(argv[1]);
-    if(argc > 2)
-        n_energies = std::atoi(argv[2]);
-    //if(argc > 3)
-	//   threads = std::atoi(argv[3]);
+    // the probabilities are additionally written to text files if the option --text is given
+    bool textOutput = false;
+    std::vector<std::string> args;
+    for(int i = 1; i < argc; i++){
+        if(std::string(argv[i]) == "--text")
+            textOutput = true;
+        else
+            args.push_back(argv[i]);
+    }
+
+    if(args.size() > 0)
+	n_cosines = std::atoi(args[0].c_str());
+    if(args.size() > 1)
+        n_energies = std::atoi(args[1].c_str());
+    //if(args.size() > 2)
+	//   threads = std::atoi(args[2].c_str());
 
     std::vector<FLOAT_T> cosineList = linspace((FLOAT_T)-1.0, (FLOAT_T)0.0, n_cosines);
     std::vector<FLOAT_T> energyList = logspace((FLOAT_T)1.e0, (FLOAT_T)1.e2, n_energies);
@@ -138,75 +149,77 @@ int main(int argc, char** argv){
     propagator->getProbability(0,0, ProbType::e_e);
     TIMERSTOPCPU(calc_and_transfer);
 
-#if 1
-    // write output to files
-
-	std::ofstream outfile00("out_e_e.txt");
-	std::ofstream outfile01("out_e_m.txt");
-	std::ofstream outfile02("out_e_t.txt");
-	std::ofstream outfile10("out_m_e.txt");
-	std::ofstream outfile11("out_m_m.txt");
-	std::ofstream outfile12("out_m_t.txt");
-	std::ofstream outfile20("out_t_e.txt");
-	std::ofstream outfile21("out_t_m.txt");
-	std::ofstream outfile22("out_t_t.txt");
-
-    outfile00 << n_cosines << " " << n_energies <<'\n';
-    outfile01 << n_cosines << " " << n_energies <<'\n';
-    outfile02 << n_cosines << " " << n_energies <<'\n';
-    outfile10 << n_cosines << " " << n_energies <<'\n';
-    outfile11 << n_cosines << " " << n_energies <<'\n';
-    outfile12 << n_cosines << " " << n_energies <<'\n';
-    outfile20 << n_cosines << " " << n_energies <<'\n';
-    outfile21 << n_cosines << " " << n_energies <<'\n';
-    outfile22 << n_cosines << " " << n_energies <<'\n';
-
-    for(int i = 0; i < n_cosines; i++) {
-        for(int j = 0; j < n_energies; j++) {
-
-            // ProbType::x_y is probability of transition x -> y
-            outfile00 << std::setprecision(20) << propagator->getProbability(i, j, ProbType::e_e) << " ";
-            outfile01 << std::setprecision(20) << propagator->getProbability(i, j, ProbType::e_m) << " ";
-            outfile02 << std::setprecision(20) << propagator->getProbability(i, j, ProbType::e_t) << " ";
-            outfile10 << std::setprecision(20) << propagator->getProbability(i, j, ProbType::m_e) << " ";
-            outfile11 << std::setprecision(20) << propagator->getProbability(i, j, ProbType::m_m) << " ";
-            outfile12 << std::setprecision(20) << propagator->getProbability(i, j, ProbType::m_t) << " ";
-            outfile20 << std::setprecision(20) << propagator->getProbability(i, j, ProbType::t_e) << " ";
-            outfile21 << std::setprecision(20) << propagator->getProbability(i, j, ProbType::t_m) << " ";
-            outfile22 << std::setprecision(20) << propagator->getProbability(i, j, ProbType::t_t) << " ";
-		}
-
-		outfile00 << '\n';
-		outfile01 << '\n';
-		outfile02 << '\n';
-		outfile10 << '\n';
-		outfile11 << '\n';
-		outfile12 << '\n';
-		outfile20 << '\n';
-		outfile21 << '\n';
-		outfile22 << '\n';
-	}
-    outfile00 << '\n';
-    outfile01 << '\n';
-    outfile02 << '\n';
-    outfile10 << '\n';
-    outfile11 << '\n';
-    outfile12 << '\n';
-    outfile20 << '\n';
-    outfile21 << '\n';
-    outfile22 << '\n';
-
-	outfile00.flush();
-	outfile01.flush();
-	outfile02.flush();
-	outfile10.flush();
-	outfile11.flush();
-	outfile12.flush();
-	outfile20.flush();
-	outfile21.flush();
-	outfile22.flush();
-
-#endif
+    // write the probabilities and all inputs to a binary table, which can be read with load or ProbabilityTable
+    propagator->save("probabilities.cp3");
+
+    if(textOutput){
+        // write output to text files. This takes much longer than the calculation for large grids
+
+        std::ofstream outfile00("out_e_e.txt");
+        std::ofstream outfile01("out_e_m.txt");
+        std::ofstream outfile02("out_e_t.txt");
+        std::ofstream outfile10("out_m_e.txt");
+        std::ofstream outfile11("out_m_m.txt");
+        std::ofstream outfile12("out_m_t.txt");
+        std::ofstream outfile20("out_t_e.txt");
+        std::ofstream outfile21("out_t_m.txt");
+        std::ofstream outfile22("out_t_t.txt");
+
+        outfile00 << n_cosines << " " << n_energies <<'\n';
+        outfile01 << n_cosines << " " << n_energies <<'\n';
+        outfile02 << n_cosines << " " << n_energies <<'\n';
+        outfile10 << n_cosines << " " << n_energies <<'\n';
+        outfile11 << n_cosines << " " << n_energies <<'\n';
+        outfile12 << n_cosines << " " << n_energies <<'\n';
+        outfile20 << n_cosines << " " << n_energies <<'\n';
+        outfile21 << n_cosines << " " << n_energies <<'\n';
+        outfile22 << n_cosines << " " << n_energies <<'\n';
+
+        for(int i = 0; i < n_cosines; i++) {
+            for(int j = 0; j < n_energies; j++) {
+
+                // ProbType::x_y is probability of transition x -> y
+                outfile00 << std::setprecision(20) << propagator->getProbability(i, j, ProbType::e_e) << " ";
+                outfile01 << std::setprecision(20) << propagator->getProbability(i, j, ProbType::e_m) << " ";
+                outfile02 << std::setprecision(20) << propagator->getProbability(i, j, ProbType::e_t) << " ";
+                outfile10 << std::setprecision(20) << propagator->getProbability(i, j, ProbType::m_e) << " ";
+                outfile11 << std::setprecision(20) << propagator->getProbability(i, j, ProbType::m_m) << " ";
+                outfile12 << std::setprecision(20) << propagator->getProbability(i, j, ProbType::m_t) << " ";
+                outfile20 << std::setprecision(20) << propagator->getProbability(i, j, ProbType::t_e) << " ";
+                outfile21 << std::setprecision(20) << propagator->getProbability(i, j, ProbType::t_m) << " ";
+                outfile22 << std::setprecision(20) << propagator->getProbability(i, j, ProbType::t_t) << " ";
+            }
+
+            outfile00 << '\n';
+            outfile01 << '\n';
+            outfile02 << '\n';
+            outfile10 << '\n';
+            outfile11 << '\n';
+            outfile12 << '\n';
+            outfile20 << '\n';
+            outfile21 << '\n';
+            outfile22 << '\n';
+        }
+        outfile00 << '\n';
+        outfile01 << '\n';
+        outfile02 << '\n';
+        outfile10 << '\n';
+        outfile11 << '\n';
+        outfile12 << '\n';
+        outfile20 << '\n';
+        outfile21 << '\n';
+        outfile22 << '\n';
+
+        outfile00.flush();
+        outfile01.flush();
+        outfile02.flush();
+        outfile10.flush();
+        outfile11.flush();
+        outfile12.flush();
+        outfile20.flush();
+        outfile21.flush();
+        outfile22.flush();
+    }
 
     TIMERSTOPCPU(total_runtime_with_output)
 
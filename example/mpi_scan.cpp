@@ -0,0 +1,108 @@
+/*
+This file is part of CUDAProb3++.
+
+CUDAProb3++ is free software: you can redistribute it and/or modify
+it under the terms of the GNU Lesser General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+CUDAProb3++ is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public License
+along with CUDAProb3++.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+ * Scan of the cp phase distributed over MPI ranks. The hypotheses of the batch are distributed among the ranks.
+ * Each rank sums the muon neutrino disappearance probability of its hypotheses over the cosine bins into a histogram
+ * over energy and hypothesis, and the histograms are summed on rank 0.
+ *
+ * mpirun -n 4 ./mpiscan
+ */
+
+#include <mpipropagator.hpp> // include mpi propagator
+
+#ifdef __NVCC__
+#include <cudapropagator.cuh> // include cuda propagator
+#endif
+
+#include <cmath>
+#include <iostream>
+#include <memory>
+#include <vector>
+
+using namespace cudaprob3; // namespace of the propagators
+
+int main(int argc, char** argv){
+
+    MPI_Init(&argc, &argv);
+
+    {
+        const int n_cosines = 200;
+        const int n_energies = 200;
+        const int n_hypotheses = 64;
+
+        using FLOAT_T = double;
+
+        MpiPropagator<FLOAT_T>::LocalPropagatorFactory factory;
+#ifdef __NVCC__
+        // each rank uses one GPU of its node
+        factory = [](int nc, int ne){
+            int rank;
+            int nDevices;
+            MPI_Comm_rank(MPI_COMM_WORLD, &rank);
+            cudaGetDeviceCount(&nDevices);
+            return std::unique_ptr<Propagator<FLOAT_T>>(new CudaPropagator<FLOAT_T>(std::vector<int>{rank % nDevices}, nc, ne));
+        };
+#endif
+
+        MpiPropagator<FLOAT_T> propagator(MPI_COMM_WORLD, n_cosines, n_energies, MpiDecomposition::Batch, factory);
+
+        std::vector<FLOAT_T> cosineList(n_cosines);
+        std::vector<FLOAT_T> energyList(n_energies);
+        for(int i = 0; i < n_cosines; i++)
+            cosineList[i] = -1.0 + 2.0 * i / (n_cosines - 1);
+        for(int i = 0; i < n_energies; i++)
+            energyList[i] = std::exp(std::log(1.0) + (std::log(100.0) - std::log(1.0)) * i / (n_energies - 1));
+
+        propagator.setEnergyList(energyList);
+        propagator.setCosineList(cosineList);
+        propagator.setDensityFromFile("models/PREM_12layer.dat");
+        propagator.setProductionHeight(22.0);
+        propagator.setRequestedChannels({m_m});
+
+        std::vector<OscParams<FLOAT_T>> batch(n_hypotheses);
+        for(int i = 0; i < n_hypotheses; i++)
+            batch[i] = OscParams<FLOAT_T>{0.5695951908800630, 0.1608752771983211, 0.7853981633974483, 2.0 * M_PI * i / n_hypotheses, 7.9e-5, 2.5e-3};
+
+        // the histograms are filled from the local results, so they are not gathered
+        propagator.setGatherResults(false);
+        propagator.calculateProbabilitiesBatch(Neutrino, batch);
+
+        std::vector<FLOAT_T> histogram(std::size_t(n_hypotheses) * n_energies, 0.0);
+        Propagator<FLOAT_T>& local = propagator.getLocalPropagator();
+        const std::vector<int> hypotheses = propagator.getLocalBatchIndices();
+
+        for(std::size_t b = 0; b < hypotheses.size(); b++)
+            for(int c = 0; c < n_cosines; c++)
+                for(int e = 0; e < n_energies; e++)
+                    histogram[std::size_t(hypotheses[b]) * n_energies + e] += local.getBatchProbability(b, c, e, m_m);
+
+        propagator.reduceSum(histogram, 0);
+
+        if(propagator.getRank() == 0){
+            std::cout << "# dCP, sum over cosines and energies of P(mu -> mu), " << propagator.getRankCount() << " ranks" << std::endl;
+            for(int i = 0; i < n_hypotheses; i++){
+                FLOAT_T sum = 0.0;
+                for(int e = 0; e < n_energies; e++)
+                    sum += histogram[std::size_t(i) * n_energies + e];
+                std::cout << batch[i].dCP << " " << sum << std::endl;
+            }
+        }
+    }
+
+    MPI_Finalize();
+}
@@ -0,0 +1,180 @@
+/*
+This file is part of CUDAProb3++.
+
+CUDAProb3++ is free software: you can redistribute it and/or modify
+it under the terms of the GNU Lesser General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+CUDAProb3++ is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public License
+along with CUDAProb3++.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+ * Validation of the GPU precision modes. Calculates a grid with CudaPropagatorSingle in float, mixed, and double precision
+ * and prints the maximum and the root mean square deviation of each ProbType from CpuPropagator<double>.
+ *
+ * Options (all optional):
+ *   --size 400                 grid size n, the grid has n cosines and n energies
+ *   --model 12                 density model models/PREM_<x>layer.dat
+ *   --emin 0.1 --emax 100      energy range in GeV. The phase error of float grows at low energies
+ *   --device 0                 GPU to use
+ */
+
+#include <cpupropagator.hpp> // include openmp propagator
+#include <cudapropagator.cuh> // include cuda propagator
+
+#include <algorithm>
+#include <cmath>
+#include <iomanip>
+#include <iostream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+using namespace cudaprob3; // namespace of the propagators
+
+struct ValidationConfig{
+    int size = 400;
+    int model = 12;
+    double emin = 0.1;
+    double emax = 100.0;
+    int device = 0;
+};
+
+// deviation of one ProbType from the reference
+struct Deviation{
+    double max = 0.0;
+    double rms = 0.0;
+};
+
+template<class T>
+std::vector<T> linspace(T min, T max, int n){
+    std::vector<T> list(n);
+    for(int i = 0; i < n; i++)
+        list[i] = n == 1 ? min : min + (max - min) * T(i) / T(n - 1);
+    return list;
+}
+
+template<class T>
+std::vector<T> logspace(T min, T max, int n){
+    std::vector<T> list = linspace(std::log(min), std::log(max), n);
+    for(auto& x : list)
+        x = std::exp(x);
+    return list;
+}
+
+ValidationConfig parseArguments(int argc, char** argv){
+    ValidationConfig config;
+
+    for(int i = 1; i < argc; i++){
+        const std::string arg = argv[i];
+        const bool hasValue = i + 1 < argc;
+
+        if(arg == "--size" && hasValue){
+            config.size = std::max(2, std::stoi(argv[++i]));
+        }else if(arg == "--model" && hasValue){
+            config.model = std::stoi(argv[++i]);
+        }else if(arg == "--emin" && hasValue){
+            config.emin = std::stod(argv[++i]);
+        }else if(arg == "--emax" && hasValue){
+            config.emax = std::stod(argv[++i]);
+        }else if(arg == "--device" && hasValue){
+            config.device = std::stoi(argv[++i]);
+        }else{
+            throw std::runtime_error("unknown argument " + arg);
+        }
+    }
+
+    return config;
+}
+
+// set up the propagator with the oscillation parameters of example/main.cpp
+template<class FLOAT_T>
+void setUp(Propagator<FLOAT_T>& propagator, const ValidationConfig& config){
+    propagator.setEnergyList(logspace(FLOAT_T(config.emin), FLOAT_T(config.emax), config.size));
+    propagator.setCosineList(linspace(FLOAT_T(-1.0), FLOAT_T(1.0), config.size));
+    propagator.setMNSMatrix(0.5695951908800630, 0.1608752771983211, 0.7853981633974483, 0.0);
+    propagator.setNeutrinoMasses(7.9e-5, 2.5e-3);
+    propagator.setDensityFromFile("models/PREM_" + std::to_string(config.model) + "layer.dat");
+    propagator.setProductionHeight(22.0);
+}
+
+template<class FLOAT_T>
+std::vector<Deviation> getDeviations(Propagator<FLOAT_T>& propagator, Propagator<double>& reference, int n){
+    std::vector<Deviation> deviations(9);
+
+    for(int t = 0; t < 9; t++){
+        double sum = 0.0;
+
+        for(int c = 0; c < n; c++){
+            for(int e = 0; e < n; e++){
+                const double d = std::abs(double(propagator.getProbability(c, e, ProbType(t))) - reference.getProbability(c, e, ProbType(t)));
+                deviations[t].max = std::max(deviations[t].max, d);
+                sum += d * d;
+            }
+        }
+
+        deviations[t].rms = std::sqrt(sum / (double(n) * double(n)));
+    }
+
+    return deviations;
+}
+
+void printDeviations(const std::string& mode, NeutrinoType type, const std::vector<Deviation>& deviations){
+    static const char* const names[9] = {"e_e", "e_m", "e_t", "m_e", "m_m", "m_t", "t_e", "t_m", "t_t"};
+
+    for(int t = 0; t < 9; t++){
+        std::cout << std::left << std::setw(8) << mode
+                  << std::setw(14) << (type == Neutrino ? "neutrino" : "antineutrino")
+                  << std::setw(6) << names[t]
+                  << std::right << std::scientific << std::setprecision(3)
+                  << std::setw(12) << deviations[t].max
+                  << std::setw(12) << deviations[t].rms << "\n";
+    }
+}
+
+int main(int argc, char** argv){
+
+    const ValidationConfig config = parseArguments(argc, argv);
+    const int n = config.size;
+
+#ifdef __NVCC__
+    CpuPropagator<double> reference(n, n, omp_get_max_threads());
+    setUp(reference, config);
+
+    CudaPropagatorSingle<float> singlePropagator(config.device, n, n);
+    setUp(singlePropagator, config);
+
+    CudaPropagatorSingle<double> mixedPropagator(config.device, n, n);
+    setUp(mixedPropagator, config);
+    mixedPropagator.setMixedPrecision(true);
+
+    CudaPropagatorSingle<double> doublePropagator(config.device, n, n);
+    setUp(doublePropagator, config);
+
+    std::cout << "# deviation from CpuPropagator<double>, " << n << " x " << n << " grid, PREM_" << config.model << "layer, "
+              << config.emin << " - " << config.emax << " GeV\n";
+    std::cout << std::left << std::setw(8) << "# mode" << std::setw(14) << "type" << std::setw(6) << "prob"
+              << std::right << std::setw(12) << "max" << std::setw(12) << "rms" << "\n";
+
+    for(NeutrinoType type : {Neutrino, Antineutrino}){
+        reference.calculateProbabilities(type);
+        singlePropagator.calculateProbabilities(type);
+        mixedPropagator.calculateProbabilities(type);
+        doublePropagator.calculateProbabilities(type);
+
+        printDeviations("float", type, getDeviations(singlePropagator, reference, n));
+        printDeviations("mixed", type, getDeviations(mixedPropagator, reference, n));
+        printDeviations("double", type, getDeviations(doublePropagator, reference, n));
+    }
+#else
+    (void)n;
+    std::cout << "validate_precision requires the CUDA compiler\n";
+#endif
+}
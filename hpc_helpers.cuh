@@ -108,6 +108,17 @@ along with CUDAProb3++.  If not, see <http://www.gnu.org/licenses/>.
     #define UNROLLQUALIFIER
 #endif
 
+// runtime dispatch of host functions on the instruction set of the cpu. Each function is compiled for
+// AVX-512, AVX2 and the default target, and the best version is selected when the program is loaded
+#if !defined(__CUDACC__) && defined(__x86_64__) && defined(__has_attribute)
+    #if __has_attribute(target_clones)
+        #define CPUDISPATCHQUALIFIER __attribute__((target_clones("avx512f","avx2","default")))
+    #endif
+#endif
+#ifndef CPUDISPATCHQUALIFIER
+    #define CPUDISPATCHQUALIFIER
+#endif
+
 // safe division
 #define SDIV(x,y)(((x)+(y)-1)/(y))
 
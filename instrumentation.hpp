@@ -0,0 +1,334 @@
+/*
+This file is part of CUDAProb3++.
+
+CUDAProb3++ is free software: you can redistribute it and/or modify
+it under the terms of the GNU Lesser General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+CUDAProb3++ is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public License
+along with CUDAProb3++.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef CUDAPROB3_INSTRUMENTATION_HPP
+#define CUDAPROB3_INSTRUMENTATION_HPP
+
+/*
+ * Timers and counters of the propagators. Nothing is recorded unless CUDAPROB3_INSTRUMENTATION is defined before the first
+ * include of the library. The query interface is always available and returns zeros otherwise.
+ *
+ * If instrumentation is enabled and the CUDA compiler finds the header-only NVTX3 library, each phase is additionally
+ * marked by an NVTX range. Define CUDAPROB3_NO_NVTX to disable the ranges.
+ */
+
+#include "hpc_helpers.cuh"
+
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <vector>
+
+#if defined(CUDAPROB3_INSTRUMENTATION) && defined(__CUDACC__) && !defined(CUDAPROB3_NO_NVTX) && defined(__has_include)
+    #if __has_include(<nvtx3/nvToolsExt.h>)
+        #include <nvtx3/nvToolsExt.h>
+        #define CUDAPROB3_NVTX
+    #endif
+#endif
+
+namespace cudaprob3{
+
+    /// \brief Phase of a calculation which is timed by the instrumentation
+    enum class Phase : int {
+        Setup = 0, ///< preparation on the host, e.g. the neutrino parameters of each hypothesis
+        HostToDevice = 1, ///< transfers to the GPU
+        Kernel = 2, ///< calculation of the probabilities
+        DeviceToHost = 3 ///< transfers of results from the GPU
+    };
+
+    constexpr int n_phases = 4;
+
+    /// \brief get the name of a phase, e.g. for metrics exporters
+    inline const char* getPhaseName(Phase phase){
+        static const char* const names[n_phases] = {"setup", "host_to_device", "kernel", "device_to_host"};
+        return names[int(phase)];
+    }
+
+    /// \brief Recorded durations of one phase
+    struct PhaseTiming{
+        std::uint64_t count = 0; ///< number of timed occurrences
+        double totalSeconds = 0.0; ///< sum of all durations
+        double lastSeconds = 0.0; ///< duration of the most recent occurrence
+    };
+
+    /// \brief Timings and counters of a propagator
+    struct Statistics{
+        int deviceId = -1; ///< GPU of the propagator, or -1 for CpuPropagator and the sum over GPUs
+        std::array<PhaseTiming, n_phases> phases; ///< timings, indexed by Phase
+        std::uint64_t calculations = 0; ///< number of performed calculations
+        std::uint64_t skippedCalculations = 0; ///< number of calculations which reused the previous results
+        std::uint64_t cells = 0; ///< number of calculated (cosine, energy, type, hypothesis) cells or (event, type) pairs
+        std::uint64_t bytesHostToDevice = 0; ///< number of bytes transferred to the GPU
+        std::uint64_t bytesDeviceToHost = 0; ///< number of bytes transferred from the GPU
+
+        /// \brief get the timing of a phase
+        const PhaseTiming& operator[](Phase phase) const{
+            return phases[int(phase)];
+        }
+
+        /// \brief add the timings and counters of other, e.g. of another GPU. lastSeconds is the maximum of both
+        Statistics& operator+=(const Statistics& other){
+            for(int i = 0; i < n_phases; i++){
+                phases[i].count += other.phases[i].count;
+                phases[i].totalSeconds += other.phases[i].totalSeconds;
+                phases[i].lastSeconds = std::max(phases[i].lastSeconds, other.phases[i].lastSeconds);
+            }
+            calculations += other.calculations;
+            skippedCalculations += other.skippedCalculations;
+            cells += other.cells;
+            bytesHostToDevice += other.bytesHostToDevice;
+            bytesDeviceToHost += other.bytesDeviceToHost;
+
+            return *this;
+        }
+    };
+
+    /// \brief Function which is called with each timed phase, its duration in seconds and the GPU (-1 for the host)
+    /// \details GPU phases are reported once their completion is observed, i.e. possibly later than they were enqueued
+    using InstrumentationHook = std::function<void(Phase phase, double seconds, int deviceId)>;
+
+    /// \brief Records the timings and counters of a propagator. All functions are empty unless CUDAPROB3_INSTRUMENTATION is defined
+    class Instrumentation{
+    public:
+        static constexpr bool isEnabled(){
+#ifdef CUDAPROB3_INSTRUMENTATION
+            return true;
+#else
+            return false;
+#endif
+        }
+
+        void recordPhase(Phase phase, double seconds){
+#ifdef CUDAPROB3_INSTRUMENTATION
+            PhaseTiming& timing = statistics.phases[int(phase)];
+            timing.count++;
+            timing.totalSeconds += seconds;
+            timing.lastSeconds = seconds;
+
+            if(hook)
+                hook(phase, seconds, statistics.deviceId);
+#else
+            (void)phase; (void)seconds;
+#endif
+        }
+
+        void recordCalculation(std::uint64_t cells){
+#ifdef CUDAPROB3_INSTRUMENTATION
+            statistics.calculations++;
+            statistics.cells += cells;
+#else
+            (void)cells;
+#endif
+        }
+
+        void recordSkippedCalculation(){
+#ifdef CUDAPROB3_INSTRUMENTATION
+            statistics.skippedCalculations++;
+#endif
+        }
+
+        void recordTransfer(Phase direction, std::uint64_t bytes){
+#ifdef CUDAPROB3_INSTRUMENTATION
+            if(direction == Phase::HostToDevice)
+                statistics.bytesHostToDevice += bytes;
+            else
+                statistics.bytesDeviceToHost += bytes;
+#else
+            (void)direction; (void)bytes;
+#endif
+        }
+
+        const Statistics& getStatistics() const{
+            return statistics;
+        }
+
+        // clear the timings and counters. The device id and the hook are kept
+        void reset(){
+            const int deviceId = statistics.deviceId;
+            statistics = Statistics{};
+            statistics.deviceId = deviceId;
+        }
+
+        void setHook(const InstrumentationHook& hook_){
+            hook = hook_;
+        }
+
+        void setDeviceId(int deviceId){
+            statistics.deviceId = deviceId;
+        }
+
+    private:
+        Statistics statistics;
+        InstrumentationHook hook;
+    };
+
+    // mark the begin and the end of a phase in the NVTX timeline
+    inline void pushPhaseRange(Phase phase){
+#ifdef CUDAPROB3_NVTX
+        nvtxRangePushA(getPhaseName(phase));
+#else
+        (void)phase;
+#endif
+    }
+
+    inline void popPhaseRange(){
+#ifdef CUDAPROB3_NVTX
+        nvtxRangePop();
+#endif
+    }
+
+    // times a phase on the host from construction to destruction
+    class ScopedPhase{
+    public:
+#ifdef CUDAPROB3_INSTRUMENTATION
+        ScopedPhase(Instrumentation& instrumentation_, Phase phase_)
+                : instrumentation(instrumentation_), phase(phase_), begin(std::chrono::steady_clock::now()){
+            pushPhaseRange(phase);
+        }
+
+        ~ScopedPhase(){
+            popPhaseRange();
+            instrumentation.recordPhase(phase, std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count());
+        }
+#else
+        ScopedPhase(Instrumentation&, Phase){}
+#endif
+
+        ScopedPhase(const ScopedPhase&) = delete;
+        ScopedPhase& operator=(const ScopedPhase&) = delete;
+
+#ifdef CUDAPROB3_INSTRUMENTATION
+    private:
+        Instrumentation& instrumentation;
+        Phase phase;
+        std::chrono::steady_clock::time_point begin;
+#endif
+    };
+
+#ifdef __CUDACC__
+
+    // times phases of the work which is enqueued in CUDA streams with pairs of events. The durations are evaluated once the
+    // work is completed, so the host is not blocked. All functions are empty unless CUDAPROB3_INSTRUMENTATION is defined.
+    // The events belong to the current device of the calls
+    class StreamPhaseTimer{
+    public:
+        StreamPhaseTimer() = default;
+        StreamPhaseTimer(const StreamPhaseTimer&) = delete;
+        StreamPhaseTimer& operator=(const StreamPhaseTimer&) = delete;
+
+        ~StreamPhaseTimer(){
+            for(const auto& measurement : pending){
+                cudaEventDestroy(measurement.start);
+                cudaEventDestroy(measurement.stop);
+            }
+            for(const auto& event : unusedEvents)
+                cudaEventDestroy(event);
+        }
+
+        // record the begin of a phase in stream
+        void begin(cudaStream_t stream, Phase phase){
+#ifdef CUDAPROB3_INSTRUMENTATION
+            pushPhaseRange(phase);
+
+            Measurement measurement;
+            measurement.phase = phase;
+            measurement.start = getEvent();
+            measurement.stop = getEvent();
+
+            cudaEventRecord(measurement.start, stream); CUERR;
+            pending.push_back(measurement);
+#else
+            (void)stream; (void)phase;
+#endif
+        }
+
+        // record the end of the phase of the last call to begin in stream
+        void end(cudaStream_t stream){
+#ifdef CUDAPROB3_INSTRUMENTATION
+            cudaEventRecord(pending.back().stop, stream); CUERR;
+
+            popPhaseRange();
+#else
+            (void)stream;
+#endif
+        }
+
+        // pass the durations of completed phases to instrumentation. If wait is true, wait for all phases
+        void collect(Instrumentation& instrumentation, bool wait){
+#ifdef CUDAPROB3_INSTRUMENTATION
+            size_t completed = 0;
+
+            for(; completed < pending.size(); completed++){
+                const Measurement& measurement = pending[completed];
+
+                if(wait){
+                    cudaEventSynchronize(measurement.stop); CUERR;
+                }else{
+                    const cudaError_t status = cudaEventQuery(measurement.stop);
+                    if(status == cudaErrorNotReady)
+                        break;
+                    if(status != cudaSuccess){
+                        CUERR;
+                    }
+                }
+
+                float milliseconds = 0.0f;
+                cudaEventElapsedTime(&milliseconds, measurement.start, measurement.stop); CUERR;
+
+                instrumentation.recordPhase(measurement.phase, 1e-3 * milliseconds);
+
+                unusedEvents.push_back(measurement.start);
+                unusedEvents.push_back(measurement.stop);
+            }
+
+            pending.erase(pending.begin(), pending.begin() + completed);
+#else
+            (void)instrumentation; (void)wait;
+#endif
+        }
+
+    private:
+        struct Measurement{
+            Phase phase;
+            cudaEvent_t start;
+            cudaEvent_t stop;
+        };
+
+        cudaEvent_t getEvent(){
+            cudaEvent_t event;
+
+            if(unusedEvents.empty()){
+                cudaEventCreate(&event); CUERR;
+            }else{
+                event = unusedEvents.back();
+                unusedEvents.pop_back();
+            }
+
+            return event;
+        }
+
+        std::vector<Measurement> pending; // phases in the order of their begin
+        std::vector<cudaEvent_t> unusedEvents;
+    };
+
+#endif // #ifdef __CUDACC__
+
+} // namespace cudaprob3
+
+#endif
@@ -20,6 +20,8 @@ along with CUDAProb3++.  If not, see <http://www.gnu.org/licenses/>.
 
 #include "hpc_helpers.cuh"
 
+#include <math.h>
+
 namespace cudaprob3{
 
     namespace math{
@@ -30,6 +32,226 @@ namespace cudaprob3{
             T im;
         };
 
+        /*
+        *   Forward-mode dual number. val is the value, d[i] is its derivative with respect to the i-th of N parameters.
+        *   The operators and the elementary functions below apply the chain rule, such that the templated physics
+        *   functions compute the derivatives of their results when they are instantiated with Dual instead of float or double.
+        *   Comparisons only consider the value
+        */
+        template<typename T, int N>
+        struct Dual{
+            T val;
+            T d[N];
+
+            Dual() = default;
+
+            HOSTDEVICEQUALIFIER
+            constexpr Dual(T v) : val(v), d{} {}
+
+            HOSTDEVICEQUALIFIER
+            Dual operator-() const{
+                Dual r;
+                r.val = -val;
+                UNROLLQUALIFIER
+                for(int i = 0; i < N; i++) r.d[i] = -d[i];
+                return r;
+            }
+
+            HOSTDEVICEQUALIFIER
+            friend Dual operator+(const Dual& a, const Dual& b){
+                Dual r;
+                r.val = a.val + b.val;
+                UNROLLQUALIFIER
+                for(int i = 0; i < N; i++) r.d[i] = a.d[i] + b.d[i];
+                return r;
+            }
+
+            HOSTDEVICEQUALIFIER
+            friend Dual operator+(const Dual& a, T b){
+                Dual r = a;
+                r.val += b;
+                return r;
+            }
+
+            HOSTDEVICEQUALIFIER
+            friend Dual operator+(T a, const Dual& b){
+                return b + a;
+            }
+
+            HOSTDEVICEQUALIFIER
+            friend Dual operator-(const Dual& a, const Dual& b){
+                Dual r;
+                r.val = a.val - b.val;
+                UNROLLQUALIFIER
+                for(int i = 0; i < N; i++) r.d[i] = a.d[i] - b.d[i];
+                return r;
+            }
+
+            HOSTDEVICEQUALIFIER
+            friend Dual operator-(const Dual& a, T b){
+                Dual r = a;
+                r.val -= b;
+                return r;
+            }
+
+            HOSTDEVICEQUALIFIER
+            friend Dual operator-(T a, const Dual& b){
+                Dual r;
+                r.val = a - b.val;
+                UNROLLQUALIFIER
+                for(int i = 0; i < N; i++) r.d[i] = -b.d[i];
+                return r;
+            }
+
+            HOSTDEVICEQUALIFIER
+            friend Dual operator*(const Dual& a, const Dual& b){
+                Dual r;
+                r.val = a.val * b.val;
+                UNROLLQUALIFIER
+                for(int i = 0; i < N; i++) r.d[i] = a.d[i] * b.val + a.val * b.d[i];
+                return r;
+            }
+
+            HOSTDEVICEQUALIFIER
+            friend Dual operator*(const Dual& a, T b){
+                Dual r;
+                r.val = a.val * b;
+                UNROLLQUALIFIER
+                for(int i = 0; i < N; i++) r.d[i] = a.d[i] * b;
+                return r;
+            }
+
+            HOSTDEVICEQUALIFIER
+            friend Dual operator*(T a, const Dual& b){
+                return b * a;
+            }
+
+            HOSTDEVICEQUALIFIER
+            friend Dual operator/(const Dual& a, const Dual& b){
+                Dual r;
+                r.val = a.val / b.val;
+                UNROLLQUALIFIER
+                for(int i = 0; i < N; i++) r.d[i] = (a.d[i] - r.val * b.d[i]) / b.val;
+                return r;
+            }
+
+            HOSTDEVICEQUALIFIER
+            friend Dual operator/(const Dual& a, T b){
+                Dual r;
+                r.val = a.val / b;
+                UNROLLQUALIFIER
+                for(int i = 0; i < N; i++) r.d[i] = a.d[i] / b;
+                return r;
+            }
+
+            HOSTDEVICEQUALIFIER
+            friend Dual operator/(T a, const Dual& b){
+                Dual r;
+                r.val = a / b.val;
+                UNROLLQUALIFIER
+                for(int i = 0; i < N; i++) r.d[i] = -r.val * b.d[i] / b.val;
+                return r;
+            }
+
+            HOSTDEVICEQUALIFIER
+            Dual& operator+=(const Dual& b){ return *this = *this + b; }
+
+            HOSTDEVICEQUALIFIER
+            Dual& operator-=(const Dual& b){ return *this = *this - b; }
+
+            HOSTDEVICEQUALIFIER
+            Dual& operator*=(const Dual& b){ return *this = *this * b; }
+
+            HOSTDEVICEQUALIFIER
+            Dual& operator/=(const Dual& b){ return *this = *this / b; }
+
+            HOSTDEVICEQUALIFIER
+            friend bool operator==(const Dual& a, const Dual& b){ return a.val == b.val; }
+
+            HOSTDEVICEQUALIFIER
+            friend bool operator!=(const Dual& a, const Dual& b){ return a.val != b.val; }
+
+            HOSTDEVICEQUALIFIER
+            friend bool operator<(const Dual& a, const Dual& b){ return a.val < b.val; }
+
+            HOSTDEVICEQUALIFIER
+            friend bool operator>(const Dual& a, const Dual& b){ return a.val > b.val; }
+
+            HOSTDEVICEQUALIFIER
+            friend bool operator<=(const Dual& a, const Dual& b){ return a.val <= b.val; }
+
+            HOSTDEVICEQUALIFIER
+            friend bool operator>=(const Dual& a, const Dual& b){ return a.val >= b.val; }
+        };
+
+        /*
+        *   Dual number whose value is given by the function f(x.val) and whose derivatives are scaled by df(x.val)
+        */
+        template<typename T, int N>
+        HOSTDEVICEQUALIFIER
+        Dual<T, N> applyChainRule(const Dual<T, N>& x, T f, T df){
+            Dual<T, N> r;
+            r.val = f;
+            UNROLLQUALIFIER
+            for(int i = 0; i < N; i++) r.d[i] = df * x.d[i];
+            return r;
+        }
+
+        // the overloads for Dual must not hide the scalar functions of the global namespace in this namespace
+        using ::sin;
+        using ::cos;
+        using ::sqrt;
+        using ::fabs;
+        using ::acos;
+
+        template<typename T, int N>
+        HOSTDEVICEQUALIFIER
+        Dual<T, N> sin(const Dual<T, N>& x){
+            return applyChainRule(x, T(::sin(x.val)), T(::cos(x.val)));
+        }
+
+        template<typename T, int N>
+        HOSTDEVICEQUALIFIER
+        Dual<T, N> cos(const Dual<T, N>& x){
+            return applyChainRule(x, T(::cos(x.val)), T(-::sin(x.val)));
+        }
+
+        template<typename T, int N>
+        HOSTDEVICEQUALIFIER
+        void sincos(const Dual<T, N>& x, Dual<T, N>* s, Dual<T, N>* c){
+            T sv, cv;
+#ifdef __CUDA_ARCH__
+            ::sincos(x.val, &sv, &cv);
+#else
+            sv = ::sin(x.val);
+            cv = ::cos(x.val);
+#endif
+            *s = applyChainRule(x, sv, cv);
+            *c = applyChainRule(x, cv, -sv);
+        }
+
+        // the derivative of sqrt at 0 is set to 0, since the callers clamp negative arguments to 0
+        template<typename T, int N>
+        HOSTDEVICEQUALIFIER
+        Dual<T, N> sqrt(const Dual<T, N>& x){
+            const T r = ::sqrt(x.val);
+            return applyChainRule(x, r, r > T(0) ? T(0.5) / r : T(0));
+        }
+
+        template<typename T, int N>
+        HOSTDEVICEQUALIFIER
+        Dual<T, N> fabs(const Dual<T, N>& x){
+            return applyChainRule(x, T(::fabs(x.val)), x.val < T(0) ? T(-1) : T(1));
+        }
+
+        // the derivative of acos at -1 and 1 is set to 0, since the callers clamp arguments outside of [-1, 1]
+        template<typename T, int N>
+        HOSTDEVICEQUALIFIER
+        Dual<T, N> acos(const Dual<T, N>& x){
+            const T derivative = ::fabs(x.val) < T(1) ? T(-1) / T(::sqrt(T(1) - x.val * x.val)) : T(0);
+            return applyChainRule(x, T(::acos(x.val)), derivative);
+        }
+
         template<typename T>
         HOSTDEVICEQUALIFIER
         constexpr T ct_sqr(T x){
@@ -0,0 +1,622 @@
+/*
+This file is part of CUDAProb3++.
+
+CUDAProb3++ is free software: you can redistribute it and/or modify
+it under the terms of the GNU Lesser General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+CUDAProb3++ is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public License
+along with CUDAProb3++.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef CUDAPROB3_MPIPROPAGATOR_HPP
+#define CUDAPROB3_MPIPROPAGATOR_HPP
+
+#include "propagator.hpp"
+#include "cpupropagator.hpp"
+
+#include <mpi.h>
+
+#include <algorithm>
+#include <cstdint>
+#include <functional>
+#include <limits>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+
+namespace cudaprob3{
+
+    /// \brief Work which is distributed among the ranks of an MpiPropagator
+    enum class MpiDecomposition {
+        Cosines, ///< each rank calculates every n_ranks-th cosine bin of each calculation
+        Batch ///< each rank calculates a contiguous range of the hypotheses of each batch calculation
+    };
+
+    /// \class MpiPropagator
+    /// \brief Neutrino propagation distributed over the ranks of an MPI communicator. Derived from Propagator
+    /// \details Each rank owns a local propagator, e.g. a CpuPropagator or a CudaPropagator with the GPUs of its node, which calculates
+    /// the share of the rank. All functions of Propagator are collective, i.e. they must be called by all ranks in the same order with the same arguments.
+    /// By default, the results are gathered on all ranks after each calculation, so getProbability can be called for each cell on each rank.
+    /// With setGatherResults(false), each rank keeps only its own results, which can be accumulated per rank, e.g. into a histogram,
+    /// and combined with reduceSum.
+    /// Calculations of a single hypothesis with MpiDecomposition::Batch are performed by every rank
+    /// @param FLOAT_T The floating point type to use for calculations, i.e float, double
+    template<class FLOAT_T>
+    class MpiPropagator : public Propagator<FLOAT_T>{
+    public:
+        /// \brief Function which creates the local propagator of a rank for the given number of cosine and energy bins
+        using LocalPropagatorFactory = std::function<std::unique_ptr<Propagator<FLOAT_T>>(int n_cosines, int n_energies)>;
+
+        /// \brief Constructor
+        ///
+        /// @param comm Communicator of the participating ranks. It is duplicated
+        /// @param n_cosines Number cosine bins
+        /// @param n_energies Number of energy bins
+        /// @param decomposition Work which is distributed among the ranks
+        /// @param factory Creates the local propagator of this rank. If empty, a CpuPropagator with a single thread is used
+        MpiPropagator(MPI_Comm comm, int n_cosines, int n_energies, MpiDecomposition decomposition = MpiDecomposition::Cosines,
+                        const LocalPropagatorFactory& factory = LocalPropagatorFactory())
+                : Propagator<FLOAT_T>(n_cosines, n_energies), decomposition(decomposition){
+
+            MPI_Comm_dup(comm, &communicator);
+            MPI_Comm_rank(communicator, &rank);
+            MPI_Comm_size(communicator, &n_ranks);
+
+            if(decomposition == MpiDecomposition::Cosines && n_cosines < n_ranks)
+                throw std::runtime_error("MpiPropagator::MpiPropagator. Less cosine bins than ranks");
+
+            const int n_localCosines = decomposition == MpiDecomposition::Cosines ? getRankCosineCount(rank) : n_cosines;
+
+            if(factory)
+                localPropagator = factory(n_localCosines, n_energies);
+            else
+                localPropagator.reset(new CpuPropagator<FLOAT_T>(n_localCosines, n_energies, 1));
+
+            if(!localPropagator)
+                throw std::runtime_error("MpiPropagator::MpiPropagator. factory returned nullptr");
+
+            this->resultLayout = localPropagator->getResultLayout();
+        }
+
+        /// \brief Constructor with a CpuPropagator as local propagator of each rank
+        ///
+        /// @param comm Communicator of the participating ranks. It is duplicated
+        /// @param n_cosines Number cosine bins
+        /// @param n_energies Number of energy bins
+        /// @param threads Number of threads of the CpuPropagator of each rank
+        /// @param decomposition Work which is distributed among the ranks
+        MpiPropagator(MPI_Comm comm, int n_cosines, int n_energies, int threads, MpiDecomposition decomposition = MpiDecomposition::Cosines)
+                : MpiPropagator(comm, n_cosines, n_energies, decomposition, [threads](int nc, int ne){
+                    return std::unique_ptr<Propagator<FLOAT_T>>(new CpuPropagator<FLOAT_T>(nc, ne, threads));
+                }){
+        }
+
+        /// \brief Destructor
+        ~MpiPropagator(){
+            if(communicator != MPI_COMM_NULL)
+                MPI_Comm_free(&communicator);
+        }
+
+        MpiPropagator(const MpiPropagator& other) = delete;
+        MpiPropagator& operator=(const MpiPropagator& other) = delete;
+        MpiPropagator(MpiPropagator&& other) = delete;
+        MpiPropagator& operator=(MpiPropagator&& other) = delete;
+
+    public:
+
+        void setDensityModel(std::shared_ptr<const DensityModel<FLOAT_T>> model) override{
+            Propagator<FLOAT_T>::setDensityModel(model);
+
+            localPropagator->setDensityModel(model);
+        }
+
+        void setDensityVariants(const std::vector<FLOAT_T>& rhos, int n_variants) override{
+            Propagator<FLOAT_T>::setDensityVariants(rhos, n_variants);
+
+            localPropagator->setDensityVariants(rhos, n_variants);
+        }
+
+        void clearDensityVariants() override{
+            Propagator<FLOAT_T>::clearDensityVariants();
+
+            localPropagator->clearDensityVariants();
+        }
+
+        void setNeutrinoMasses(FLOAT_T dm12sq, FLOAT_T dm23sq) override{
+            Propagator<FLOAT_T>::setNeutrinoMasses(dm12sq, dm23sq);
+
+            localPropagator->setNeutrinoMasses(dm12sq, dm23sq);
+        }
+
+        void setMNSMatrix(FLOAT_T theta12, FLOAT_T theta13, FLOAT_T theta23, FLOAT_T dCP) override{
+            Propagator<FLOAT_T>::setMNSMatrix(theta12, theta13, theta23, dCP);
+
+            localPropagator->setMNSMatrix(theta12, theta13, theta23, dCP);
+        }
+
+        void setEnergyList(const std::vector<FLOAT_T>& list) override{
+            Propagator<FLOAT_T>::setEnergyList(list);
+
+            localPropagator->setEnergyList(list);
+        }
+
+        void setCosineList(const std::vector<FLOAT_T>& list) override{
+            Propagator<FLOAT_T>::setCosineList(list);
+
+            if(decomposition == MpiDecomposition::Cosines){
+                std::vector<FLOAT_T> localCosines;
+                for(int index_cosine = rank; index_cosine < this->n_cosines; index_cosine += n_ranks)
+                    localCosines.push_back(list[index_cosine]);
+
+                localPropagator->setCosineList(localCosines);
+            }else{
+                localPropagator->setCosineList(list);
+            }
+        }
+
+        void resize(int n_cosines, int n_energies) override{
+            if(decomposition == MpiDecomposition::Cosines && n_cosines < n_ranks)
+                throw std::runtime_error("MpiPropagator::resize. Less cosine bins than ranks");
+
+            Propagator<FLOAT_T>::resize(n_cosines, n_energies);
+
+            const int n_localCosines = decomposition == MpiDecomposition::Cosines ? getRankCosineCount(rank) : n_cosines;
+
+            localPropagator->resize(n_localCosines, n_energies);
+        }
+
+        void setProductionHeight(FLOAT_T heightKM) override{
+            Propagator<FLOAT_T>::setProductionHeight(heightKM);
+
+            localPropagator->setProductionHeight(heightKM);
+        }
+
+        void setProductionHeightDistribution(const std::vector<FLOAT_T>& heightsKM, const std::vector<FLOAT_T>& weights, int n_samples) override{
+            Propagator<FLOAT_T>::setProductionHeightDistribution(heightsKM, weights, n_samples);
+
+            if(decomposition == MpiDecomposition::Cosines){
+                // the samples of the cosines of this rank
+                std::vector<FLOAT_T> localHeights;
+                std::vector<FLOAT_T> localWeights;
+                for(int index_cosine = rank; index_cosine < this->n_cosines; index_cosine += n_ranks){
+                    const std::size_t offset = std::size_t(index_cosine) * std::size_t(n_samples);
+                    localHeights.insert(localHeights.end(), heightsKM.begin() + offset, heightsKM.begin() + offset + n_samples);
+                    localWeights.insert(localWeights.end(), weights.begin() + offset, weights.begin() + offset + n_samples);
+                }
+
+                localPropagator->setProductionHeightDistribution(localHeights, localWeights, n_samples);
+            }else{
+                localPropagator->setProductionHeightDistribution(heightsKM, weights, n_samples);
+            }
+        }
+
+        void clearProductionHeightDistribution() override{
+            Propagator<FLOAT_T>::clearProductionHeightDistribution();
+
+            localPropagator->clearProductionHeightDistribution();
+        }
+
+        void setResultLayout(ResultLayout layout) override{
+            Propagator<FLOAT_T>::setResultLayout(layout);
+
+            localPropagator->setResultLayout(layout);
+        }
+
+        void setRequestedChannels(const std::vector<ProbType>& channels) override{
+            Propagator<FLOAT_T>::setRequestedChannels(channels);
+
+            localPropagator->setRequestedChannels(channels);
+        }
+
+        /// \brief Use a result cache in the local propagator of each rank, see Propagator::setResultCacheDirectory
+        /// \details Each rank caches the results of its share of the grid. The directory should be on a file system which is shared by all ranks
+        /// @param directory Cache directory, or an empty string to disable the cache
+        void setResultCacheDirectory(const std::string& directory) override{
+            Propagator<FLOAT_T>::setResultCacheDirectory(directory);
+
+            localPropagator->setResultCacheDirectory(directory);
+        }
+
+        /// \brief Write the gathered probabilities of the last grid calculation to a binary table file, see Propagator::save
+        /// \details Must be called by all ranks. Rank 0 writes the file, and all ranks return after it is written.
+        /// The results of the calculation must have been gathered or be calculated by every rank
+        /// @param filename Output file
+        void save(const std::string& filename) override{
+            if(this->cachedCalculation == Propagator<FLOAT_T>::GridCalculation && !gatheredResults
+                    && decomposition == MpiDecomposition::Cosines && n_ranks > 1)
+                throw std::runtime_error("MpiPropagator::save. The results were not gathered");
+
+            // the failure of rank 0 is passed to all ranks
+            int failed = 0;
+            std::string message;
+            if(rank == 0){
+                try{
+                    Propagator<FLOAT_T>::save(filename);
+                }catch(const std::runtime_error& error){
+                    failed = 1;
+                    message = error.what();
+                }
+            }
+
+            MPI_Bcast(&failed, 1, MPI_INT, 0, communicator);
+            if(failed)
+                throw std::runtime_error(rank == 0 ? message : "MpiPropagator::save. Rank 0 could not write " + filename);
+        }
+
+        /// \brief get the timings and counters of the local propagator of this rank
+        Statistics getStatistics() override{
+            return localPropagator->getStatistics();
+        }
+
+        void resetStatistics() override{
+            localPropagator->resetStatistics();
+        }
+
+        void setInstrumentationHook(const InstrumentationHook& hook) override{
+            localPropagator->setInstrumentationHook(hook);
+        }
+
+        /// \brief Gather the results of each calculation on all ranks
+        /// \details If gather is false, getProbability and getBatchProbability throw for cells or hypotheses of other ranks
+        /// @param gather Gather subsequent results
+        void setGatherResults(bool gather){
+            gatherResults = gather;
+        }
+
+        /// \brief Check whether the results are gathered on all ranks
+        bool isGatherResults() const{
+            return gatherResults;
+        }
+
+        /// \brief get the rank of this process in the communicator of the propagator
+        int getRank() const{
+            return rank;
+        }
+
+        /// \brief get the number of ranks of the communicator of the propagator
+        int getRankCount() const{
+            return n_ranks;
+        }
+
+        /// \brief get the propagator which calculates the share of this rank, e.g. to access its results directly
+        /// \details The cosine bins of the local propagator are getLocalCosineIndices(), its hypotheses are getLocalBatchIndices()
+        Propagator<FLOAT_T>& getLocalPropagator(){
+            return *localPropagator;
+        }
+
+        /// \brief get the cosine bins of the grid which are calculated by this rank, in the order of the local propagator
+        std::vector<int> getLocalCosineIndices() const{
+            std::vector<int> indices;
+            for(int index_cosine = 0; index_cosine < this->n_cosines; index_cosine++){
+                if(decomposition == MpiDecomposition::Batch || getCosineRank(index_cosine) == rank)
+                    indices.push_back(index_cosine);
+            }
+            return indices;
+        }
+
+        /// \brief get the hypotheses of the last batch calculation which are calculated by this rank, in the order of the local propagator
+        std::vector<int> getLocalBatchIndices() const{
+            std::vector<int> indices;
+            for(int index_batch = getBatchBegin(rank); index_batch < getBatchEnd(rank); index_batch++)
+                indices.push_back(index_batch);
+            return indices;
+        }
+
+        /// \brief Sum values element-wise over all ranks, e.g. rank-local histograms
+        /// @param values Values of this rank, replaced by the sum on the receiving ranks. Must have the same size on all ranks
+        /// @param root Rank which receives the sum, or -1 for all ranks
+        void reduceSum(std::vector<FLOAT_T>& values, int root = -1){
+            if(root < 0){
+                MPI_Allreduce(MPI_IN_PLACE, values.data(), int(values.size()), getMpiType(), MPI_SUM, communicator);
+            }else if(root == rank){
+                MPI_Reduce(MPI_IN_PLACE, values.data(), int(values.size()), getMpiType(), MPI_SUM, root, communicator);
+            }else{
+                MPI_Reduce(values.data(), nullptr, int(values.size()), getMpiType(), MPI_SUM, root, communicator);
+            }
+        }
+
+    public:
+        void calculateProbabilities(NeutrinoType type) override{
+            localPropagator->calculateProbabilities(type);
+
+            this->setCachedCalculation(type, 1);
+            finishCalculation(type, 1, 1, false);
+        }
+
+        void calculateProbabilitiesBatch(NeutrinoType type, const std::vector<OscParams<FLOAT_T>>& batch) override{
+            calculateBatch(type, 1, batch);
+        }
+
+        void calculateProbabilitiesBothTypes() override{
+            localPropagator->calculateProbabilitiesBothTypes();
+
+            this->setCachedCalculation(Neutrino, 2);
+            finishCalculation(Neutrino, 2, 1, false);
+        }
+
+        void calculateProbabilitiesBatchBothTypes(const std::vector<OscParams<FLOAT_T>>& batch) override{
+            calculateBatch(Neutrino, 2, batch);
+        }
+
+        FLOAT_T getProbability(int index_cosine, int index_energy, ProbType t) override{
+            if(this->hasLoadedTable())
+                return this->getLoadedProbability(index_cosine, index_energy, t, this->n_calculatedTypes == 2 ? Neutrino : this->calculatedType);
+
+            return getBatchProbability(0, index_cosine, index_energy, t, this->n_calculatedTypes == 2 ? Neutrino : this->calculatedType);
+        }
+
+        FLOAT_T getBatchProbability(int index_batch, int index_cosine, int index_energy, ProbType t) override{
+            return getBatchProbability(index_batch, index_cosine, index_energy, t, this->n_calculatedTypes == 2 ? Neutrino : this->calculatedType);
+        }
+
+        FLOAT_T getProbability(int index_cosine, int index_energy, ProbType t, NeutrinoType type) override{
+            if(this->hasLoadedTable())
+                return this->getLoadedProbability(index_cosine, index_energy, t, type);
+
+            return getBatchProbability(0, index_cosine, index_energy, t, type);
+        }
+
+        FLOAT_T getBatchProbability(int index_batch, int index_cosine, int index_energy, ProbType t, NeutrinoType type) override{
+            if(index_batch < 0 || index_batch >= batchSize)
+                throw std::runtime_error("MpiPropagator::getBatchProbability. Invalid index_batch");
+            if(index_cosine < 0 || index_cosine >= this->n_cosines || index_energy < 0 || index_energy >= this->n_energies)
+                throw std::runtime_error("MpiPropagator::getProbability. Invalid cell");
+            if(!this->isRequestedChannel(t))
+                throw std::runtime_error("MpiPropagator::getProbability. ProbType was not requested");
+
+            const int index_type = this->getTypeIndex(type);
+            if(index_type < 0)
+                throw std::runtime_error("MpiPropagator::getProbability. NeutrinoType was not calculated");
+
+            if(gatheredResults){
+                return resultList[std::uint64_t(index_type) * std::uint64_t(batchSize) * this->getResultsPerHypothesis()
+                                    + this->getResultIndex(index_batch, index_cosine, index_energy, t)];
+            }
+
+            // the results of this rank are read from the local propagator
+            const int localBatch = index_batch - getBatchBegin(rank);
+            const int localCosine = decomposition == MpiDecomposition::Cosines ? index_cosine / n_ranks : index_cosine;
+
+            if(localBatch < 0 || localBatch >= getBatchEnd(rank) - getBatchBegin(rank)
+                    || (decomposition == MpiDecomposition::Cosines && getCosineRank(index_cosine) != rank))
+                throw std::runtime_error("MpiPropagator::getProbability. The result was calculated by another rank and was not gathered");
+
+            return getLocalProbability(localBatch, localCosine, index_energy, t, type);
+        }
+
+    protected:
+        // the events are split into contiguous ranges of equal size. The results are always gathered on all ranks
+        void calculateEvents(NeutrinoType type, int n_types, std::uint64_t n_events, const FLOAT_T* cosines, const FLOAT_T* energies,
+                                const FLOAT_T* productionHeights, FLOAT_T* result) override{
+
+            const std::vector<int> begin = splitRange(n_events);
+            const std::uint64_t n_localEvents = begin[rank + 1] - begin[rank];
+            const int n_channels = this->n_channels;
+
+            std::vector<FLOAT_T> localResult(std::uint64_t(n_types) * n_localEvents * std::uint64_t(n_channels));
+
+            if(n_localEvents > 0){
+                const FLOAT_T* const localHeights = productionHeights == nullptr ? nullptr : productionHeights + begin[rank];
+
+                if(n_types == 2)
+                    localPropagator->calculateEventProbabilitiesBothTypes(n_localEvents, cosines + begin[rank], energies + begin[rank], localHeights, localResult.data());
+                else
+                    localPropagator->calculateEventProbabilities(type, n_localEvents, cosines + begin[rank], energies + begin[rank], localHeights, localResult.data());
+            }
+
+            // the results of each type are gathered separately, since the results of all events of a type are contiguous
+            std::vector<int> counts(n_ranks);
+            std::vector<int> displacements(n_ranks);
+            for(int r = 0; r < n_ranks; r++){
+                counts[r] = (begin[r + 1] - begin[r]) * n_channels;
+                displacements[r] = begin[r] * n_channels;
+            }
+
+            for(int index_type = 0; index_type < n_types; index_type++){
+                MPI_Allgatherv(localResult.data() + std::uint64_t(index_type) * n_localEvents * std::uint64_t(n_channels), counts[rank], getMpiType(),
+                                result + std::uint64_t(index_type) * n_events * std::uint64_t(n_channels), counts.data(), displacements.data(), getMpiType(),
+                                communicator);
+            }
+        }
+
+        // the gradient of the single hypothesis is not distributed among the ranks with the Batch decomposition. The derivatives
+        // are gathered like the hypotheses of a batch
+        void calculateGradients(NeutrinoType type, int n_types) override{
+            if(n_types == 2)
+                localPropagator->calculateProbabilityGradientsBothTypes();
+            else
+                localPropagator->calculateProbabilityGradients(type);
+
+            this->setCachedCalculation(type, n_types, this->GradientCalculation);
+            finishCalculation(type, n_types, physics::ResultBlocks<physics::Gradient<FLOAT_T>>::value, false);
+        }
+
+    private:
+        static MPI_Datatype getMpiType(){
+            return sizeof(FLOAT_T) == sizeof(float) ? MPI_FLOAT : MPI_DOUBLE;
+        }
+
+        // the cosine bins are assigned round-robin, which balances the number of crossed layers for sorted cosine lists
+        int getCosineRank(int index_cosine) const{
+            return index_cosine % n_ranks;
+        }
+
+        int getRankCosineCount(int r) const{
+            return this->n_cosines / n_ranks + (r < this->n_cosines % n_ranks ? 1 : 0);
+        }
+
+        // range [getBatchBegin(r), getBatchEnd(r)) of the hypotheses of the last calculation which were calculated by rank r.
+        // If the hypotheses were not distributed, each rank calculated all hypotheses
+        int getBatchBegin(int r) const{
+            return localBatches ? batchBegin[r] : 0;
+        }
+
+        int getBatchEnd(int r) const{
+            return localBatches ? batchBegin[r + 1] : batchSize;
+        }
+
+        // split n elements into n_ranks contiguous ranges of equal size. Range r is [begin[r], begin[r+1])
+        std::vector<int> splitRange(std::uint64_t n) const{
+            if(n > std::uint64_t(std::numeric_limits<int>::max()))
+                throw std::runtime_error("MpiPropagator. Too many elements to distribute");
+
+            std::vector<int> begin(n_ranks + 1, 0);
+            for(int r = 0; r < n_ranks; r++)
+                begin[r + 1] = begin[r] + int(n / n_ranks) + (std::uint64_t(r) < n % n_ranks ? 1 : 0);
+            return begin;
+        }
+
+        void calculateBatch(NeutrinoType type, int n_types, const std::vector<OscParams<FLOAT_T>>& batch){
+            if(batch.size() == 0)
+                throw std::runtime_error("MpiPropagator::calculateProbabilitiesBatch. batch must not be empty");
+
+            if(decomposition == MpiDecomposition::Batch){
+                const std::vector<int> begin = splitRange(batch.size());
+                const std::vector<OscParams<FLOAT_T>> localBatch(batch.begin() + begin[rank], batch.begin() + begin[rank + 1]);
+
+                // ranks without hypotheses take part in the gathering only
+                if(localBatch.size() > 0){
+                    if(n_types == 2)
+                        localPropagator->calculateProbabilitiesBatchBothTypes(localBatch);
+                    else
+                        localPropagator->calculateProbabilitiesBatch(type, localBatch);
+                }
+            }else{
+                if(n_types == 2)
+                    localPropagator->calculateProbabilitiesBatchBothTypes(batch);
+                else
+                    localPropagator->calculateProbabilitiesBatch(type, batch);
+            }
+
+            this->setCachedBatchCalculation(type, n_types, batch);
+            finishCalculation(type, n_types, batch.size(), decomposition == MpiDecomposition::Batch);
+        }
+
+        // probability of the last calculation of the local propagator. The results of grid calculations without density variants are
+        // read with getProbability, which also serves results of the result cache of the local propagator
+        FLOAT_T getLocalProbability(int localBatch, int localCosine, int index_energy, ProbType t, NeutrinoType type){
+            if(this->cachedCalculation == Propagator<FLOAT_T>::GridCalculation && this->n_calculatedVariants == 1)
+                return localPropagator->getProbability(localCosine, index_energy, t, type);
+
+            return localPropagator->getBatchProbability(localBatch, localCosine, index_energy, t, type);
+        }
+
+        // record the distribution of the last calculation of n_batch parameter sets and gather its results if requested.
+        // The hypotheses of a parameter set are its density variants, which are always calculated by the same rank
+        void finishCalculation(NeutrinoType type, int n_types, int n_batch, bool distributedBatch){
+            const int n_variants = this->getDensityVariantCount();
+
+            this->calculatedType = type;
+            this->n_calculatedTypes = n_types;
+            this->n_calculatedVariants = n_variants;
+            batchSize = n_batch * n_variants;
+            localBatches = distributedBatch;
+
+            if(distributedBatch){
+                batchBegin = splitRange(n_batch);
+                for(auto& begin : batchBegin)
+                    begin *= n_variants;
+            }
+
+            // results which are calculated by every rank need not be gathered
+            gatheredResults = gatherResults && (distributedBatch || decomposition == MpiDecomposition::Cosines) && n_ranks > 1;
+
+            if(gatheredResults)
+                gather();
+        }
+
+        // collect the results of all ranks in resultList, in the layout of this propagator
+        void gather(){
+            const int n_types = this->n_calculatedTypes;
+            const int n_channels = this->n_channels;
+            const std::vector<int> localCosines = getLocalCosineIndices();
+            const int n_energies = this->n_energies;
+
+            // number of probabilities of each rank per type
+            auto getCount = [&](int r){
+                const std::uint64_t cosines = decomposition == MpiDecomposition::Cosines ? getRankCosineCount(r) : this->n_cosines;
+                return std::uint64_t(getBatchEnd(r) - getBatchBegin(r)) * cosines * std::uint64_t(n_energies) * std::uint64_t(n_channels);
+            };
+
+            std::vector<int> counts(n_ranks);
+            std::vector<int> displacements(n_ranks);
+            std::uint64_t total = 0;
+            for(int r = 0; r < n_ranks; r++){
+                const std::uint64_t count = std::uint64_t(n_types) * getCount(r);
+                if(total + count > std::uint64_t(std::numeric_limits<int>::max()))
+                    throw std::runtime_error("MpiPropagator::gather. Too many results to gather, use setGatherResults(false)");
+
+                counts[r] = int(count);
+                displacements[r] = int(total);
+                total += count;
+            }
+
+            // pack the local results as [type][local hypothesis][local cosine][energy][requested ProbType]
+            std::vector<FLOAT_T> packed(counts[rank]);
+            std::vector<ProbType> channels;
+            for(int t = 0; t < 9; t++){
+                if(this->isRequestedChannel(ProbType(t)))
+                    channels.push_back(ProbType(t));
+            }
+
+            const int n_localBatch = getBatchEnd(rank) - getBatchBegin(rank);
+            std::uint64_t k = 0;
+            for(int index_type = 0; index_type < n_types; index_type++){
+                const NeutrinoType type = n_types == 2 ? NeutrinoType(index_type) : this->calculatedType;
+
+                for(int b = 0; b < n_localBatch; b++)
+                    for(size_t c = 0; c < localCosines.size(); c++)
+                        for(int e = 0; e < n_energies; e++)
+                            for(const auto& t : channels)
+                                packed[k++] = getLocalProbability(b, c, e, t, type);
+            }
+
+            std::vector<FLOAT_T> received(total);
+            MPI_Allgatherv(packed.data(), counts[rank], getMpiType(), received.data(), counts.data(), displacements.data(), getMpiType(), communicator);
+
+            // unpack into the layout of this propagator
+            const std::uint64_t typeStride = std::uint64_t(batchSize) * this->getResultsPerHypothesis();
+            resultList.resize(std::uint64_t(n_types) * typeStride);
+
+            for(int r = 0; r < n_ranks; r++){
+                const FLOAT_T* data = received.data() + displacements[r];
+                const int n_rankCosines = decomposition == MpiDecomposition::Cosines ? getRankCosineCount(r) : this->n_cosines;
+
+                for(int index_type = 0; index_type < n_types; index_type++)
+                    for(int b = getBatchBegin(r); b < getBatchEnd(r); b++)
+                        for(int c = 0; c < n_rankCosines; c++){
+                            const int index_cosine = decomposition == MpiDecomposition::Cosines ? c * n_ranks + r : c;
+
+                            for(int e = 0; e < n_energies; e++)
+                                for(const auto& t : channels)
+                                    resultList[std::uint64_t(index_type) * typeStride + this->getResultIndex(b, index_cosine, e, t)] = *data++;
+                        }
+            }
+        }
+
+        MPI_Comm communicator = MPI_COMM_NULL;
+        int rank = 0;
+        int n_ranks = 1;
+        MpiDecomposition decomposition;
+        std::unique_ptr<Propagator<FLOAT_T>> localPropagator;
+
+        bool gatherResults = true;
+        bool gatheredResults = false; // resultList holds the results of the last calculation
+        bool localBatches = false; // the hypotheses of the last calculation were distributed among the ranks
+        int batchSize = 1; // number of hypotheses of the last calculation
+        std::vector<int> batchBegin; // first hypothesis of each rank of the last calculation
+        std::vector<FLOAT_T> resultList;
+    };
+
+}
+
+#endif
@@ -20,12 +20,18 @@ along with CUDAProb3++.  If not, see <http://www.gnu.org/licenses/>.
 
 #include "constants.hpp"
 #include "math.hpp"
+#include "types.hpp"
 
 #include <string.h>
 #include <stdio.h>
-//#include <math.h>
+#include <math.h>
 //#include <algorithm>
 #include <assert.h>
+#include <stddef.h>
+#include <algorithm>
+#include <stdexcept>
+#include <string>
+#include <cstdint>
 #include <omp.h>
 
 
@@ -36,44 +42,41 @@ along with CUDAProb3++.  If not, see <http://www.gnu.org/licenses/>.
  *
  * template<typename FLOAT_T>
  * __host__ __device__
- * void calculate(NeutrinoType type, const FLOAT_T* const cosinelist, int n_cosines, const FLOAT_T* const energylist, int n_energies,
- *                       const FLOAT_T* const radii, const FLOAT_T* const rhos, const int* const maxlayers, FLOAT_T ProductionHeightinCentimeter, FLOAT_T* const result)
+ * void calculate(NeutrinoType type, const OscillationContext<FLOAT_T>& context, FLOAT_T* const result)
  *
  * It can either be called directly on the CPU, or on the GPU via kernel
  *
  * template<typename FLOAT_T>
  * __global__
- * void calculateKernel(NeutrinoType type, const FLOAT_T* const cosinelist, int n_cosines, const FLOAT_T* const energylist, int n_energies,
- *                       const FLOAT_T* const radii, const FLOAT_T* const rhos, const int* const maxlayers, FLOAT_T ProductionHeightinCentimeter, FLOAT_T* const result)
+ * void calculateKernel(NeutrinoType type, const OscillationContext<FLOAT_T> context, FLOAT_T* const result)
  *
  *
  * Both host and device code is combined in function void calculate(..), such that only one function has to be maintained for host and device.
  *
  *
- * Before using function void calculate(..) (or the kernel), neutrino mixing matrix and neutrino mass differences have to be set.
- * Use
+ * The OscillationContext<FLOAT_T> holds all inputs of the calculation, i.e. the grid, the density model, the production height,
+ * and a table of n_parameters ParameterSet<FLOAT_T>, one per oscillation hypothesis. The results of hypothesis k are stored
+ * at offset k * n_cosines * n_energies * n_channels, where n_channels is the number of requested ProbTypes. Within a hypothesis,
+ * the result of cell (cosine, energy) and ProbType t is stored at (cosine * n_energies + energy) * resultCellStride
+ * + channelSlots[t] * resultChannelStride, which selects either AoS or SoA layout. ProbTypes with channelSlots[t] < 0 are not stored.
+ * If n_types == 2, the type argument is ignored and both Neutrino and Antineutrino are calculated in the same pass, sharing
+ * the parameter sets and the path geometry. The Antineutrino results are stored at offset resultTypeStride.
+ * With n_densityVariants > 1, each parameter set p is calculated for each variant v of the layer densities, which only differ in
+ * layerDensityIndices. The matter solutions of p are shared by all variants, and the results are stored as hypothesis k = p * n_densityVariants + v.
+ * calculateGradients additionally computes the derivatives of the probabilities with respect to the oscillation parameters in the same pass,
+ * by instantiating the physics functions with forward-mode dual numbers, see math::Dual.
+ * For the kernel, all pointers of the context must point to device memory.
  *
- * template<typename FLOAT_T>
- * void setMixMatrix(math::ComplexNumber<FLOAT_T>* U);
- *
- * and
- *
- * template<typename FLOAT_T>
- * void setMassDifferences(FLOAT_T* dm);
+ * Paths which do not cross the earth (maxlayers 0) are evaluated in closed form from the vacuum eigen-decomposition of the
+ * ParameterSet. The other paths multiply the transition matrices of their layers. If pathOrder is set, the paths with the most
+ * layers are processed first.
  *
- * before GPU calculation.
+ * There is no global state. Each propagator owns its context, such that propagators can be used concurrently from multiple threads.
  *
- * Use
+ * A ParameterSet<FLOAT_T> is filled on the host from the neutrino mixing matrix and neutrino mass differences with
  *
  * template<typename FLOAT_T>
- * void setMixMatrix_host(math::ComplexNumber<FLOAT_T>* U);
- *
- * and
- *
- * template<typename FLOAT_T>
- * void setMassDifferences_host(FLOAT_T* dm);
- *
- * before CPU calculation.
+ * void setParameterSet(ParameterSet<FLOAT_T>& parameters, const math::ComplexNumber<FLOAT_T>* U, const FLOAT_T* dm);
  *
  *
  *
@@ -86,77 +89,172 @@ along with CUDAProb3++.  If not, see <http://www.gnu.org/licenses/>.
 
 
 
-// in device code, we need to access the device global constants instead of host global constants
-#ifdef __CUDA_ARCH__
+// the mixing matrix, mass differences and precomputed factors are read from the parameter set "parameters" of the current hypothesis
+#define U(i,j) parameters.mix_data[( i * 3 + j)]
+#define DM(i,j) parameters.mass_data[( i * 3 + j)]
+#define AXFAC(a,b,c,d,e) parameters.A_X_factor[a * 3 * 3 * 3 * 4 + b * 3 * 3 * 4 + c * 3 * 4 + d * 4 + e]
+#define ORDER(i) parameters.mass_order[i]
 
-    #define U(i,j) ((math::ComplexNumber<FLOAT_T>*)mix_data_device)[( i * 3 + j)]
-    #define DM(i,j) ((FLOAT_T*)mass_data_device)[( i * 3 + j)]
-    #define AXFAC(a,b,c,d,e) ((FLOAT_T*)A_X_factor_device)[a * 3 * 3 * 3 * 4 + b * 3 * 3 * 4 + c * 3 * 4 + d * 4 + e]
-    #define ORDER(i) mass_order_device[i]
 
-#else
+namespace cudaprob3{
 
-    #define U(i,j) ((math::ComplexNumber<FLOAT_T>*)mix_data)[( i * 3 + j)]
-    #define DM(i,j) ((FLOAT_T*)mass_data)[( i * 3 + j)]
-    #define AXFAC(a,b,c,d,e) ((FLOAT_T*)A_X_factor)[a * 3 * 3 * 3 * 4 + b * 3 * 3 * 4 + c * 3 * 4 + d * 4 + e]
-    #define ORDER(i) mass_order[i]
-#endif
+        namespace physics{
 
+            /*
+            * Parameters of one oscillation hypothesis
+            */
+            template<typename FLOAT_T>
+            struct ParameterSet{
+                math::ComplexNumber<FLOAT_T> mix_data[9];
+                FLOAT_T mass_data[9];
+                FLOAT_T A_X_factor[81 * 4]; //precomputed factors which only depend on the mixing matrix for faster calculation
+                int mass_order[3];
+                // vacuum eigen-decomposition. The vacuum amplitude of a path with length L (km) and energy E (GeV) is
+                // A[n][m] = sum_k exp(i * vacuum_phase[k] * L / E) * vacuum_product[n][m][k]
+                FLOAT_T vacuum_phase[3];
+                math::ComplexNumber<FLOAT_T> vacuum_product[3][3][3];
+            };
 
-namespace cudaprob3{
+            /*
+            * Precomputed matter eigen-solution for one (hypothesis, energy, density).
+            * It does not depend on the path length, so it is shared by all cosines and layers of the same density.
+            *
+            * phase[k] : -LoEfac * d_dmMatVac[k][0] / E, i.e. the phase of a layer with length L (km) is phase[k] * L
+            * product[n][m][k] : product of Eq. (11), already combined with the mixing matrix via the precomputed A_X_factor,
+            *                    such that A[n][m] = sum_k exp(i * phase[k] * L) * product[n][m][k]
+            */
+            template<typename FLOAT_T>
+            struct MatterSolution{
+                using ComputeType = FLOAT_T; // precision of the matrix products of calculatePaths
+                using ProbabilityType = FLOAT_T; // type of the probabilities of calculatePaths before they are stored
+                FLOAT_T phase[3];
+                math::ComplexNumber<FLOAT_T> product[3][3][3];
+            };
 
-        namespace physics{
+            /*
+            * Matter eigen-solution of the mixed precision mode. It is computed in double precision.
+            * The phases are kept in double precision, such that the phase of long paths at low energies is accurate,
+            * while the products and the layer matrix products of calculatePaths are single precision
+            */
+            struct MixedMatterSolution{
+                using ComputeType = float;
+                using ProbabilityType = double;
+                double phase[3];
+                math::ComplexNumber<float> product[3][3][3];
+            };
 
             /*
-            * Constant global data
+            * Number of oscillation parameters of a gradient calculation, see OscParameter.
+            * A Gradient<FLOAT_T> holds a value and its derivative d[p] with respect to each OscParameter p
             */
+            constexpr int n_gradientParameters = 6;
 
-            #ifdef __NVCC__
-                __constant__ double mix_data_device [9 * sizeof(math::ComplexNumber<double>)] ;
-                __constant__ double mass_data_device[9];
-                __constant__ double A_X_factor_device[81 * 4]; //precomputed factors which only depend on the mixing matrix for faster calculation
-                __constant__ int mass_order_device[3];
-            #endif
+            template<typename FLOAT_T>
+            using Gradient = math::Dual<FLOAT_T, n_gradientParameters>;
+
+            /*
+            * Number of result blocks of each hypothesis whose probabilities are of type PROB_T. The results of a hypothesis are
+            * followed by their derivatives with respect to each parameter of the dual number, in blocks of the size of a hypothesis
+            */
+            template<typename PROB_T>
+            struct ResultBlocks{
+                static constexpr int value = 1;
+            };
 
-            double mix_data [9 * sizeof(math::ComplexNumber<double>)] ;
-            double mass_data[9];
-            double A_X_factor[81 * 4]; //precomputed factors for faster calculation
-            int mass_order[3];
+            template<typename T, int N>
+            struct ResultBlocks<math::Dual<T, N>>{
+                static constexpr int value = N + 1;
+            };
 
+            // upper limit of memory used for matter solutions. Larger batches are processed in chunks of hypotheses
+            constexpr std::uint64_t maxMatterSolutionBytes = std::uint64_t(256) * 1024 * 1024;
 
             /*
-             * Set global 3x3 pmns mixing matrix
-             */
+            * Number of hypotheses which can be processed at once without exceeding maxMatterSolutionBytes
+            */
             template<typename FLOAT_T>
-            void setMixMatrix(math::ComplexNumber<FLOAT_T>* U){
-                memcpy((FLOAT_T*)mix_data, U, sizeof(math::ComplexNumber<FLOAT_T>) * 9);
+            int getMatterSolutionChunkSize(int n_energies, int n_densities, int n_parameters, int n_types = 1){
+                const std::uint64_t bytesPerHypothesis = sizeof(MatterSolution<FLOAT_T>) * std::uint64_t(n_energies) * std::uint64_t(n_densities)
+                                                            * std::uint64_t(n_types);
+                const std::uint64_t chunk = maxMatterSolutionBytes / bytesPerHypothesis;
+
+                if(chunk < 1) return 1;
+                if(chunk > std::uint64_t(n_parameters)) return n_parameters;
+                return int(chunk);
+            }
 
-                //precomputed factors for faster calculation
-                for (int n=0; n<3; n++) {
-                    for (int m=0; m<3; m++) {
-                        for (int i=0; i<3; i++) {
-                            for (int j=0; j<3; j++) {
-                                AXFAC(n,m,i,j,0) = U[n * 3 + i].re * U[m * 3 + j].re + U[n * 3 + i].im * U[m * 3 + j].im;
-                                AXFAC(n,m,i,j,1) = U[n * 3 + i].re * U[m * 3 + j].im - U[n * 3 + i].im * U[m * 3 + j].re;
-                                AXFAC(n,m,i,j,2) = U[n * 3 + i].im * U[m * 3 + j].im + U[n * 3 + i].re * U[m * 3 + j].re;
-                                AXFAC(n,m,i,j,3) = U[n * 3 + i].im * U[m * 3 + j].re - U[n * 3 + i].re * U[m * 3 + j].im;
-                            }
-                        }
-                    }
-                }
-                #ifdef __NVCC__
-                    //copy to constant memory on GPU
-                    cudaMemcpyToSymbol(mix_data_device, U, sizeof(math::ComplexNumber<FLOAT_T>) * 9, 0, H2D); CUERR;
-                    cudaMemcpyToSymbol(A_X_factor_device, A_X_factor, sizeof(FLOAT_T) * 81 * 4, 0, H2D); CUERR;
-                #endif
+            /*
+            * Input of function calculate(..)
+            */
+            template<typename FLOAT_T>
+            struct OscillationContext{
+                const FLOAT_T* cosinelist;
+                int n_cosines;
+                const FLOAT_T* energylist;
+                int n_energies;
+                const FLOAT_T* densities; // unique densities of the density model. densities[0] is vacuum
+                int n_densities;
+                const int* maxlayers;
+                const int* pathOrder; // cosine of each processed path, ordered by descending maxlayers, or nullptr to process the cosines in index order
+                const FLOAT_T* layerDistances; // for each cosine, the traversed distance (km) of layers 0 to maxlayers[cosine]
+                const int* layerDensityIndices; // for each density variant and cosine, the index in densities of layers 0 to maxlayers[cosine]
+                int layerStride; // number of table entries per cosine in layerDistances and layerDensityIndices
+                int n_densityVariants; // number of density variants. Each parameter set is calculated for each variant
+                unsigned long long layerVariantStride; // distance between the layerDensityIndices of consecutive density variants
+                const FLOAT_T* heightDistances; // for each cosine, the traversed distance (km) of layer 0 for each sampled production height
+                const FLOAT_T* heightWeights; // for each cosine, the normalized weight of each sampled production height
+                int n_heightSamples; // number of production heights per cosine whose probabilities are averaged, or 0 to use layerDistances
+                const ParameterSet<FLOAT_T>* parameterList;
+                int n_parameters;
+                int n_types; // 1: calculate the type passed to calculate(..). 2: calculate Neutrino and Antineutrino
+                MatterSolution<FLOAT_T>* matterSolutions; // n_types * n_parameters * n_energies * n_densities precomputed solutions
+                const ParameterSet<Gradient<FLOAT_T>>* gradientParameterList; // parameter sets with derivatives of calculateGradients(..)
+                MatterSolution<Gradient<FLOAT_T>>* gradientSolutions; // precomputed solutions with derivatives of calculateGradients(..)
+                unsigned long long resultCellStride; // distance between results of consecutive cells in result
+                unsigned long long resultChannelStride; // distance between results of consecutive requested ProbTypes in result
+                int n_channels; // number of requested ProbTypes
+                int channelSlots[9]; // for each ProbType, its position among the requested ProbTypes, or -1 if it is not requested
+                unsigned long long resultTypeStride; // distance between Neutrino and Antineutrino results in result if n_types == 2
+            };
+
+            /*
+            * Input of function calculateEvents(..). Each event has its own cosine, energy, and production height.
+            * The requested ProbTypes of event e of the index_type-th type are stored at
+            * result[(index_type * n_events + e) * n_channels + channelSlots[ProbType]]
+            */
+            template<typename FLOAT_T>
+            struct EventContext{
+                const FLOAT_T* cosines;
+                const FLOAT_T* energies;
+                const FLOAT_T* productionHeights; // production height (km) of each event, or nullptr to use productionHeight for all events
+                FLOAT_T productionHeight; // production height (km)
+                unsigned long long n_events;
+                const FLOAT_T* radii; // radii (km) of the density model from outside to inside
+                const FLOAT_T* coslimit; // each layer is crossed by paths with a cosine smaller than its coslimit
+                const int* densityIndices; // for each layer of the density model, the index in densities
+                int n_layers;
+                const FLOAT_T* densities; // unique densities of the density model. densities[0] is vacuum
+                const ParameterSet<FLOAT_T>* parameters;
+                int n_types; // 1: calculate the type passed to calculateEvents(..). 2: calculate Neutrino and Antineutrino
+                int n_channels; // number of requested ProbTypes
+                int channelSlots[9]; // for each ProbType, its position among the requested ProbTypes, or -1 if it is not requested
+            };
+
+            /*
+             * Neutrino type of the index_type-th calculated type
+             */
+            HOSTDEVICEQUALIFIER
+            inline NeutrinoType getNeutrinoTypeOfIndex(NeutrinoType type, int n_types, int index_type){
+                if(n_types == 1) return type;
+                return index_type == 0 ? Neutrino : Antineutrino;
             }
 
             /*
-             * Set global 3x3 pmns mixing matrix on host only
+             * Set 3x3 pmns mixing matrix and precomputed factors of parameter set
              */
             template<typename FLOAT_T>
-            void setMixMatrix_host(math::ComplexNumber<FLOAT_T>* U){
-                memcpy((FLOAT_T*)mix_data, U, sizeof(math::ComplexNumber<FLOAT_T>) * 9);
+            void setMixMatrix(ParameterSet<FLOAT_T>& parameters, const math::ComplexNumber<FLOAT_T>* U){
+                memcpy(parameters.mix_data, U, sizeof(math::ComplexNumber<FLOAT_T>) * 9);
 
                 //precomputed factors for faster calculation
                 for (int n=0; n<3; n++) {
@@ -174,29 +272,18 @@ namespace cudaprob3{
             }
 
             /*
-             * Set global 3x3 neutrino mass difference matrix
+             * Set 3x3 neutrino mass difference matrix of parameter set
              */
-            /// \brief set mass differences to constant memory
             template<typename FLOAT_T>
-            void setMassDifferences(FLOAT_T* dm){
-                memcpy((FLOAT_T*)mass_data, dm, sizeof(FLOAT_T) * 9);
-                #ifdef __NVCC__
-                cudaMemcpyToSymbol(mass_data_device, dm, sizeof(FLOAT_T) * 9 , 0, cudaMemcpyHostToDevice); CUERR;
-                #endif
+            void setMassDifferences(ParameterSet<FLOAT_T>& parameters, const FLOAT_T* dm){
+                memcpy(parameters.mass_data, dm, sizeof(FLOAT_T) * 9);
             }
 
             /*
-             * Set global 3x3 neutrino mass difference matrix on host only
+             * Precompute the ordering of vacuum masses of parameter set
              */
             template<typename FLOAT_T>
-            void setMassDifferences_host(FLOAT_T* dm){
-                memcpy((FLOAT_T*)mass_data, dm, sizeof(FLOAT_T) * 9);
-            }
-
-
-            //
-            template<typename FLOAT_T>
-            void prepare_getMfast(NeutrinoType type) {
+            void prepare_getMfast(ParameterSet<FLOAT_T>& parameters) {
                 FLOAT_T alphaV, betaV, gammaV, argV, tmpV;
                 FLOAT_T theta0V, theta1V, theta2V;
                 FLOAT_T mMatV[3];
@@ -230,8 +317,6 @@ namespace cudaprob3{
                 mMatV[0] += tmpV; mMatV[1] += tmpV; mMatV[2] += tmpV;
 
                 /* Sort according to which reproduce the vaccum eigenstates */
-                int order[3];
-
                 for (int i=0; i<3; i++) {
                     tmpV = fabs(DM(i,0)-mMatV[0]);
                     int k = 0;
@@ -243,13 +328,42 @@ namespace cudaprob3{
                             tmpV = tmp;
                         }
                     }
-                    order[i] = k;
+                    ORDER(i) = k;
+                }
+            }
+
+            /*
+             * Precompute the vacuum eigen-decomposition of parameter set, which is used for paths without earth layers.
+             * The vacuum mass eigenstates are the columns of the mixing matrix. The phases are relative to the first mass
+             */
+            template<typename FLOAT_T>
+            void prepare_vacuum(ParameterSet<FLOAT_T>& parameters){
+                /* (1/2)*(1/(h_bar*c)) in units of GeV/(eV^2-km) */
+                const FLOAT_T LoEfac = 2.534;
+
+                for (int k=0; k<3; k++) {
+                    parameters.vacuum_phase[k] = LoEfac * DM(0,k);
+                }
+
+                for (int n=0; n<3; n++) {
+                    for (int m=0; m<3; m++) {
+                        for (int k=0; k<3; k++) {
+                            parameters.vacuum_product[n][m][k].re = U(n,k).re * U(m,k).re + U(n,k).im * U(m,k).im;
+                            parameters.vacuum_product[n][m][k].im = U(n,k).im * U(m,k).re - U(n,k).re * U(m,k).im;
+                        }
+                    }
                 }
-                memcpy(mass_order, order, sizeof(int) * 3);
+            }
 
-                #ifdef __NVCC__
-                cudaMemcpyToSymbol(mass_order_device, order, sizeof(int) * 3, 0, cudaMemcpyHostToDevice); CUERR;
-                #endif
+            /*
+             * Fill parameter set from 3x3 pmns mixing matrix and 3x3 neutrino mass difference matrix
+             */
+            template<typename FLOAT_T>
+            void setParameterSet(ParameterSet<FLOAT_T>& parameters, const math::ComplexNumber<FLOAT_T>* U, const FLOAT_T* dm){
+                setMixMatrix(parameters, U);
+                setMassDifferences(parameters, dm);
+                prepare_getMfast(parameters);
+                prepare_vacuum(parameters);
             }
 
            /*
@@ -267,7 +381,7 @@ namespace cudaprob3{
             */
             template<typename FLOAT_T>
             HOSTDEVICEQUALIFIER
-            void getMfast(const FLOAT_T Enu, const FLOAT_T rho,
+            void getMfast(const ParameterSet<FLOAT_T>& parameters, const FLOAT_T Enu, const FLOAT_T rho,
                 const NeutrinoType type,
                 FLOAT_T d_dmMatMat[][3], FLOAT_T d_dmMatVac[][3]) {
 
@@ -345,7 +459,7 @@ namespace cudaprob3{
             */
             template<typename FLOAT_T>
             HOSTDEVICEQUALIFIER
-            void get_product(const FLOAT_T L, const FLOAT_T E, const FLOAT_T rho, const FLOAT_T d_dmMatVac[][3], const FLOAT_T d_dmMatMat[][3],
+            void get_product(const ParameterSet<FLOAT_T>& parameters, const FLOAT_T L, const FLOAT_T E, const FLOAT_T rho, const FLOAT_T d_dmMatVac[][3], const FLOAT_T d_dmMatMat[][3],
                 const NeutrinoType type, math::ComplexNumber<FLOAT_T> product[][3][3]){
 
                 math::ComplexNumber<FLOAT_T> twoEHmM[3][3][3];
@@ -433,7 +547,7 @@ namespace cudaprob3{
 
             template<typename FLOAT_T>
             HOSTDEVICEQUALIFIER
-            void getA(const FLOAT_T L, const FLOAT_T E, const FLOAT_T rho, const FLOAT_T d_dmMatVac[][3], const FLOAT_T d_dmMatMat[][3],
+            void getA(const ParameterSet<FLOAT_T>& parameters, const FLOAT_T L, const FLOAT_T E, const FLOAT_T rho, const FLOAT_T d_dmMatVac[][3], const FLOAT_T d_dmMatMat[][3],
                 const NeutrinoType type, math::ComplexNumber<FLOAT_T> A[3][3], const FLOAT_T phase_offset){
 
                 math::ComplexNumber<FLOAT_T> X[3][3];
@@ -442,7 +556,7 @@ namespace cudaprob3{
                 const FLOAT_T LoEfac = 2.534;
 
                 if (phase_offset == 0.0) {
-                    get_product(L, E, rho, d_dmMatVac, d_dmMatMat, type, product);
+                    get_product(parameters, L, E, rho, d_dmMatVac, d_dmMatMat, type, product);
                 }
 
 
@@ -516,18 +630,260 @@ namespace cudaprob3{
                 }
             }
 
+            /*
+             * Precompute the matter eigen-solution for neutrino with energy E in matter of constant density rho
+             */
+            template<typename FLOAT_T>
+            HOSTDEVICEQUALIFIER
+            void getMatterSolution(const ParameterSet<FLOAT_T>& parameters, const NeutrinoType type, const FLOAT_T E, const FLOAT_T rho,
+                                    MatterSolution<FLOAT_T>& solution){
+
+                FLOAT_T d_dmMatVac[3][3], d_dmMatMat[3][3];
+                math::ComplexNumber<FLOAT_T> product[3][3][3];
+                /* (1/2)*(1/(h_bar*c)) in units of GeV/(eV^2-km) */
+                const FLOAT_T LoEfac = 2.534;
+
+                getMfast(parameters, E, rho, type, d_dmMatMat, d_dmMatVac);
+                get_product(parameters, FLOAT_T(0.0), E, rho, d_dmMatVac, d_dmMatMat, type, product);
+
+                UNROLLQUALIFIER
+                for (int k=0; k<3; k++) {
+                    solution.phase[k] = -LoEfac * d_dmMatVac[k][0] / E;
+                }
+
+                /* Eq. (10) applied to each term of the sum in Eq. (11) */
+                UNROLLQUALIFIER
+                for (int n=0; n<3; n++) {
+                    UNROLLQUALIFIER
+                    for (int m=0; m<3; m++) {
+                        UNROLLQUALIFIER
+                        for (int k=0; k<3; k++) {
+                            FLOAT_T re = 0;
+                            FLOAT_T im = 0;
+
+                            UNROLLQUALIFIER
+                            for (int i=0; i<3; i++) {
+                                UNROLLQUALIFIER
+                                for (int j=0; j<3; j++) {
+                                    // use precomputed factors
+                                    re += AXFAC(n,m,i,j,0) * product[i][j][k].re +
+                                          AXFAC(n,m,i,j,1) * product[i][j][k].im;
+                                    im += AXFAC(n,m,i,j,2) * product[i][j][k].im +
+                                          AXFAC(n,m,i,j,3) * product[i][j][k].re;
+                                }
+                            }
+
+                            solution.product[n][m][k].re = re;
+                            solution.product[n][m][k].im = im;
+                        }
+                    }
+                }
+            }
+
+            /*
+             * Precompute the matter eigen-solution of the mixed precision mode in double precision and round the products to single precision
+             */
+            HOSTDEVICEQUALIFIER
+            inline void getMatterSolution(const ParameterSet<double>& parameters, const NeutrinoType type, const double E, const double rho,
+                                    MixedMatterSolution& solution){
+
+                MatterSolution<double> exact;
+                getMatterSolution(parameters, type, E, rho, exact);
+
+                UNROLLQUALIFIER
+                for (int k=0; k<3; k++) {
+                    solution.phase[k] = exact.phase[k];
+                }
+
+                UNROLLQUALIFIER
+                for (int n=0; n<3; n++) {
+                    UNROLLQUALIFIER
+                    for (int m=0; m<3; m++) {
+                        UNROLLQUALIFIER
+                        for (int k=0; k<3; k++) {
+                            solution.product[n][m][k].re = float(exact.product[n][m][k].re);
+                            solution.product[n][m][k].im = float(exact.product[n][m][k].im);
+                        }
+                    }
+                }
+            }
+
+            /*
+             * Precompute the matter eigen-solution and its derivatives with respect to the parameters of the dual numbers of parameter set.
+             * The energy and the density do not carry derivatives
+             */
+            template<typename T, int N>
+            HOSTDEVICEQUALIFIER
+            void getMatterSolution(const ParameterSet<math::Dual<T, N>>& parameters, const NeutrinoType type, const T E, const T rho,
+                                    MatterSolution<math::Dual<T, N>>& solution){
+
+                getMatterSolution<math::Dual<T, N>>(parameters, type, E, rho, solution);
+            }
+
+            /*
+             * Get 3x3 transition amplitude A for a layer of length L kilometers from the precomputed matter eigen-solution.
+             * The length is real, also if the solution holds dual numbers
+             */
+            template<typename FLOAT_T, typename LENGTH_T>
+            HOSTDEVICEQUALIFIER
+            void getA(const MatterSolution<FLOAT_T>& solution, const LENGTH_T L, math::ComplexNumber<FLOAT_T> A[3][3]){
+
+                UNROLLQUALIFIER
+                for (int n=0; n<3; n++) {
+                    UNROLLQUALIFIER
+                    for (int m=0; m<3; m++) {
+                        A[n][m].re = 0;
+                        A[n][m].im = 0;
+                    }
+                }
+
+                UNROLLQUALIFIER
+                for (int k=0; k<3; k++) {
+                    const FLOAT_T arg = solution.phase[k] * L;
+
+#ifdef __CUDACC__
+                    FLOAT_T c,s;
+                    sincos(arg, &s, &c);
+#else
+                    const FLOAT_T s = sin(arg);
+                    const FLOAT_T c = cos(arg);
+#endif
+                    UNROLLQUALIFIER
+                    for (int n=0; n<3; n++) {
+                        UNROLLQUALIFIER
+                        for (int m=0; m<3; m++) {
+                            A[n][m].re += c*solution.product[n][m][k].re - s*solution.product[n][m][k].im;
+                            A[n][m].im += c*solution.product[n][m][k].im + s*solution.product[n][m][k].re;
+                        }
+                    }
+                }
+            }
+
+            /*
+             * Get 3x3 transition amplitude A in single precision from a matter solution of the mixed precision mode.
+             * The phase is computed and reduced to [-pi, pi] in double precision. Only the reduced phase is rounded to single precision
+             */
+            HOSTDEVICEQUALIFIER
+            inline void getA(const MixedMatterSolution& solution, const double L, math::ComplexNumber<float> A[3][3]){
+
+                UNROLLQUALIFIER
+                for (int n=0; n<3; n++) {
+                    UNROLLQUALIFIER
+                    for (int m=0; m<3; m++) {
+                        A[n][m].re = 0;
+                        A[n][m].im = 0;
+                    }
+                }
+
+                const double twopi = 6.283185307179586;
+
+                UNROLLQUALIFIER
+                for (int k=0; k<3; k++) {
+                    const double phase = solution.phase[k] * L;
+                    const float arg = float(phase - twopi * rint(phase / twopi));
+
+#ifdef __CUDACC__
+                    float c,s;
+                    sincosf(arg, &s, &c);
+#else
+                    const float s = sinf(arg);
+                    const float c = cosf(arg);
+#endif
+                    UNROLLQUALIFIER
+                    for (int n=0; n<3; n++) {
+                        UNROLLQUALIFIER
+                        for (int m=0; m<3; m++) {
+                            A[n][m].re += c*solution.product[n][m][k].re - s*solution.product[n][m][k].im;
+                            A[n][m].im += c*solution.product[n][m][k].im + s*solution.product[n][m][k].re;
+                        }
+                    }
+                }
+            }
+
+            /*
+             * Parameter set of hypothesis index_parameter for matter solutions of type SOLUTION_T. The solutions with derivatives
+             * of a gradient calculation use the parameter sets with derivatives
+             */
+            template<typename FLOAT_T, typename SOLUTION_T>
+            HOSTDEVICEQUALIFIER
+            const ParameterSet<FLOAT_T>& getParameterSet(const OscillationContext<FLOAT_T>& context, int index_parameter, const SOLUTION_T*){
+                return context.parameterList[index_parameter];
+            }
+
+            template<typename FLOAT_T>
+            HOSTDEVICEQUALIFIER
+            const ParameterSet<Gradient<FLOAT_T>>& getParameterSet(const OscillationContext<FLOAT_T>& context, int index_parameter,
+                                                                    const MatterSolution<Gradient<FLOAT_T>>*){
+                return context.gradientParameterList[index_parameter];
+            }
+
+            /*
+             * Precompute the matter eigen-solution with the given index of calculateMatterSolutions(..) into solutions[index]
+             */
+            template<typename FLOAT_T, int N_TYPES = 0, typename SOLUTION_T>
+            HOSTDEVICEQUALIFIER
+            void calculateMatterSolution(NeutrinoType type, const OscillationContext<FLOAT_T>& context, unsigned long long index, SOLUTION_T* const solutions){
+
+                const int n_types = N_TYPES > 0 ? N_TYPES : context.n_types;
+
+                const int index_density = index % context.n_densities;
+                const int index_energy = (index / context.n_densities) % context.n_energies;
+                const int index_hypothesis = index / ((unsigned long long)(context.n_densities) * (unsigned long long)(context.n_energies));
+                const int index_type = index_hypothesis / context.n_parameters;
+                const int index_parameter = index_hypothesis % context.n_parameters;
+
+                getMatterSolution(getParameterSet(context, index_parameter, solutions),
+                                    getNeutrinoTypeOfIndex(type, n_types, index_type),
+                                    context.energylist[index_energy],
+                                    context.densities[index_density] * Constants<FLOAT_T>::density_convert(),
+                                    solutions[index]);
+            }
+
+            /*
+             * Precompute the matter eigen-solutions of each (hypothesis, energy, density) of the context into solutions,
+             * which is either MatterSolution<FLOAT_T>, MatterSolution<Gradient<FLOAT_T>> or, for FLOAT_T = double, MixedMatterSolution.
+             * If N_TYPES > 0, it replaces context.n_types at compile time, such that the branches on the neutrino type can be resolved.
+             * On the host, the solutions are computed by the calling thread. CpuPropagator distributes calculateMatterSolution(..) over its TaskScheduler
+             */
+            template<typename FLOAT_T, int N_TYPES = 0, typename SOLUTION_T>
+            HOSTDEVICEQUALIFIER
+            void calculateMatterSolutions(NeutrinoType type, const OscillationContext<FLOAT_T>& context, SOLUTION_T* const solutions){
+
+                const int n_types = N_TYPES > 0 ? N_TYPES : context.n_types;
+                const unsigned long long n_solutions = (unsigned long long)(n_types) * (unsigned long long)(context.n_parameters)
+                                                        * (unsigned long long)(context.n_energies) * (unsigned long long)(context.n_densities);
+
+            #ifdef __CUDA_ARCH__
+                for(unsigned long long index = blockIdx.x * blockDim.x + threadIdx.x; index < n_solutions; index += blockDim.x * gridDim.x){
+            #else
+                for(unsigned long long index = 0; index < n_solutions; index++){
+            #endif
+                    calculateMatterSolution<FLOAT_T, N_TYPES>(type, context, index, solutions);
+                }
+            }
+
+            /*
+             * Precompute the matter eigen-solutions of each (hypothesis, energy, density) of the context.
+             * The result is stored in context.matterSolutions
+             */
+            template<typename FLOAT_T, int N_TYPES = 0>
+            HOSTDEVICEQUALIFIER
+            void calculateMatterSolutions(NeutrinoType type, const OscillationContext<FLOAT_T>& context){
+                calculateMatterSolutions<FLOAT_T, N_TYPES>(type, context, context.matterSolutions);
+            }
+
             /*
              * Get 3x3 transition amplitude Aout for neutrino with energy E travelling Len kilometers through matter of constant density rho
              */
             template<typename FLOAT_T>
             HOSTDEVICEQUALIFIER
-            void get_transition_matrix(const NeutrinoType type, const FLOAT_T Enu, const FLOAT_T rho, const FLOAT_T Len,
+            void get_transition_matrix(const ParameterSet<FLOAT_T>& parameters, const NeutrinoType type, const FLOAT_T Enu, const FLOAT_T rho, const FLOAT_T Len,
                                         math::ComplexNumber<FLOAT_T> Aout[][3], const FLOAT_T phase_offset){
 
                 FLOAT_T d_dmMatVac[3][3], d_dmMatMat[3][3];
 
-                getMfast(Enu, rho, type, d_dmMatMat, d_dmMatVac);
-                getA(Len, Enu, rho, d_dmMatVac, d_dmMatMat, type, Aout,phase_offset);
+                getMfast(parameters, Enu, rho, type, d_dmMatMat, d_dmMatVac);
+                getA(parameters, Len, Enu, rho, d_dmMatVac, d_dmMatMat, type, Aout,phase_offset);
             }
 
             /*
@@ -547,6 +903,22 @@ namespace cudaprob3{
                 return rhos[i];
             }
 
+            /*
+                Find index of density in layer. Index 0 is vacuum
+            */
+            HOSTDEVICEQUALIFIER
+            inline int getDensityIndexOfLayer(const int* const densityIndices, int layer, int max_layer){
+                if(layer == 0) return 0;
+                int i;
+                if(layer <= max_layer){
+                    i = layer-1;
+                }else{
+                    i = 2 * max_layer - layer - 1;
+                }
+
+                return densityIndices[i];
+            }
+
             /*
                 Find distance in layer
             */
@@ -579,145 +951,796 @@ namespace cudaprob3{
                 }
             }
 
+            /*
+                Find number of layers crossed by path with cosine_zenith. The atmospheric layer is excluded.
+                coslimit is non-increasing (see DensityModel), so the crossed layers are a prefix of coslimit, found by binary search
+            */
+            template<typename FLOAT_T>
+            HOSTDEVICEQUALIFIER
+            int getMaxLayer(const FLOAT_T* const coslimit, int n_layers, FLOAT_T cosine_zenith){
+                int first = 0;
+                int last = n_layers;
+                while(first < last){
+                    const int mid = (first + last) / 2;
+                    if(cosine_zenith < coslimit[mid])
+                        first = mid + 1;
+                    else
+                        last = mid;
+                }
+                return first;
+            }
 
+            /*
+                Find total length (cm) of path with cosine_zenith from the production height (cm) to the detector
+            */
             template<typename FLOAT_T>
             HOSTDEVICEQUALIFIER
-            void calculate(NeutrinoType type,
-                            const FLOAT_T* const cosinelist,
-                            int n_cosines,
-                            const FLOAT_T* const energylist,
-                            int n_energies,
-                            const FLOAT_T* const radii,
-                            const FLOAT_T* const rhos,
-                            const int* const maxlayers,
-                            FLOAT_T ProductionHeightinCentimeter,
-                            FLOAT_T* const result){
-
-            //prepare more constant data. For the kernel, this is done by the wrapper function callCalculateKernelAsync
-            #ifndef __CUDA_ARCH__
-                prepare_getMfast<FLOAT_T>(type);
-            #endif
+            FLOAT_T getPathLength(FLOAT_T cosine_zenith, FLOAT_T productionHeightinCentimeter){
+                return sqrt((Constants<FLOAT_T>::REarthcm() + productionHeightinCentimeter )*(Constants<FLOAT_T>::REarthcm() + productionHeightinCentimeter)
+                            - (Constants<FLOAT_T>::REarthcm()*Constants<FLOAT_T>::REarthcm())*( 1 - cosine_zenith*cosine_zenith)) - Constants<FLOAT_T>::REarthcm()*cosine_zenith;
+            }
 
-            #ifdef __CUDA_ARCH__
-                // on the device, we use the global thread Id to index the data
-                const int max_energies_per_path = SDIV(n_energies, blockDim.x) * blockDim.x;
-                for(unsigned index = blockIdx.x * blockDim.x + threadIdx.x; index < n_cosines * max_energies_per_path; index += blockDim.x * gridDim.x){
-                    const unsigned index_energy = index % max_energies_per_path;
-                    const unsigned index_cosine = index / max_energies_per_path;
-            #else
-                // on the host, we use OpenMP to parallelize looping over cosines
-                #pragma omp parallel for schedule(dynamic)
-                for(int index_cosine = 0; index_cosine < n_cosines; index_cosine += 1){
-            #endif
+            /*
+                Multiply transition matrix of the i-th layer of a path into finalTransitionMatrix.
+                The layers below the atmosphere are crossed twice, so their product is also collected in TransitionMatrixCoreToMantle
+                which completes the path in finishPathTransition
+            */
+            template<typename FLOAT_T>
+            HOSTDEVICEQUALIFIER
+            void accumulateLayerTransition(int i, int MaxLayer,
+                                            math::ComplexNumber<FLOAT_T> TransitionMatrix[][3],
+                                            math::ComplexNumber<FLOAT_T> finalTransitionMatrix[][3],
+                                            math::ComplexNumber<FLOAT_T> TransitionMatrixCoreToMantle[][3],
+                                            math::ComplexNumber<FLOAT_T> TransitionTemp[][3]){
+
+                if (i == 0){    // atmosphere
+                    copy_complex_matrix( TransitionMatrix , finalTransitionMatrix );
+                }else if(i < MaxLayer){ // not the innermost layer, can reuse current TransitionMatrix
+                    clear_complex_matrix( TransitionTemp );
+                    multiply_complex_matrix( TransitionMatrix, finalTransitionMatrix, TransitionTemp );
+                    copy_complex_matrix( TransitionTemp, finalTransitionMatrix );
+
+                    clear_complex_matrix( TransitionTemp );
+                    multiply_complex_matrix( TransitionMatrixCoreToMantle, TransitionMatrix, TransitionTemp );
+                    copy_complex_matrix( TransitionTemp, TransitionMatrixCoreToMantle );
+                }else{ // innermost layer
+                    clear_complex_matrix( TransitionTemp );
+                    multiply_complex_matrix( TransitionMatrix, finalTransitionMatrix, TransitionTemp );
+                    copy_complex_matrix( TransitionTemp, finalTransitionMatrix );
+                }
+            }
 
-                    const FLOAT_T cosine_zenith = cosinelist[index_cosine];
+            /*
+                Calculate final transition matrix of a path from the matrices of accumulateLayerTransition
+            */
+            template<typename FLOAT_T>
+            HOSTDEVICEQUALIFIER
+            void finishPathTransition(math::ComplexNumber<FLOAT_T> finalTransitionMatrix[][3],
+                                        math::ComplexNumber<FLOAT_T> TransitionMatrixCoreToMantle[][3],
+                                        math::ComplexNumber<FLOAT_T> TransitionTemp[][3]){
 
-                    const FLOAT_T PathLength = sqrt((Constants<FLOAT_T>::REarthcm() + ProductionHeightinCentimeter )*(Constants<FLOAT_T>::REarthcm() + ProductionHeightinCentimeter)
-                                                - (Constants<FLOAT_T>::REarthcm()*Constants<FLOAT_T>::REarthcm())*( 1 - cosine_zenith*cosine_zenith)) - Constants<FLOAT_T>::REarthcm()*cosine_zenith;
+                clear_complex_matrix( TransitionTemp );
+                multiply_complex_matrix( TransitionMatrixCoreToMantle, finalTransitionMatrix, TransitionTemp );
+                copy_complex_matrix( TransitionTemp, finalTransitionMatrix );
+            }
 
-                    const FLOAT_T TotalEarthLength =  -2.0*cosine_zenith*Constants<FLOAT_T>::REarthcm(); // in [cm]
-                    const int MaxLayer = maxlayers[index_cosine];
 
-                    math::ComplexNumber<FLOAT_T> TransitionMatrix[3][3];
-                    math::ComplexNumber<FLOAT_T> TransitionMatrixCoreToMantle[3][3];
-                    math::ComplexNumber<FLOAT_T> finalTransitionMatrix[3][3];
-                    math::ComplexNumber<FLOAT_T> TransitionTemp[3][3];
+            /*
+             * Calculate the probabilities of a path which crosses earth layers from the precomputed matter solutions of its energy.
+             * If the probabilities are averaged over production heights, the product of the earth layers is computed once
+             * and only the vacuum layer is applied per height
+             */
+            template<typename FLOAT_T, int MAX_LAYERS, typename SOLUTION_T>
+            HOSTDEVICEQUALIFIER
+            void calculateEarthPathProbabilities(const OscillationContext<FLOAT_T>& context,
+                            const SOLUTION_T* const matterSolutions,
+                            const FLOAT_T* const layerDistances,
+                            const int* const layerDensityIndices,
+                            const int MaxLayer,
+                            const int index_cosine,
+                            typename SOLUTION_T::ProbabilityType probabilities[3][3]){
+
+                using COMPUTE_T = typename SOLUTION_T::ComputeType;
+
+                math::ComplexNumber<COMPUTE_T> TransitionMatrix[3][3];
+                math::ComplexNumber<COMPUTE_T> TransitionMatrixCoreToMantle[3][3];
+                math::ComplexNumber<COMPUTE_T> finalTransitionMatrix[3][3];
+                math::ComplexNumber<COMPUTE_T> TransitionTemp[3][3];
+
+                // set TransitionMatrixCoreToMantle to unit matrix
+                UNROLLQUALIFIER
+                for(int i = 0; i < 3; i++){
+                    UNROLLQUALIFIER
+                    for(int j = 0; j < 3; j++){
+                            TransitionMatrixCoreToMantle[i][j].re = (i == j ? 1.0 : 0.0);
+                            TransitionMatrixCoreToMantle[i][j].im = 0.0;
+                    }
+                }
 
-                #ifndef __CUDA_ARCH__
-                    for(int index_energy = 0; index_energy < n_energies; index_energy += 1){
-                #else
-                    if(index_energy < n_energies){
-                #endif
+                // if the probabilities are averaged over production heights, the vacuum layer is applied per height below.
+                // the product of the other layers does not depend on the height and starts from the unit matrix
+                const int firstLayer = context.n_heightSamples > 0 ? 1 : 0;
+                if(firstLayer > 0){
+                    UNROLLQUALIFIER
+                    for(int i = 0; i < 3; i++){
+                        UNROLLQUALIFIER
+                        for(int j = 0; j < 3; j++){
+                                finalTransitionMatrix[i][j].re = (i == j ? 1.0 : 0.0);
+                                finalTransitionMatrix[i][j].im = 0.0;
+                        }
+                    }
+                }
 
-                        const FLOAT_T energy = energylist[index_energy];
+                // loop from vacuum layer to innermost crossed layer
+                if(MAX_LAYERS > 0){
+                    UNROLLQUALIFIER
+                    for (int i = 0; i <= MAX_LAYERS ; i++ ){
+                        if(i > MaxLayer)
+                            break;
+                        if(i < firstLayer)
+                            continue;
+
+                        getA( matterSolutions[layerDensityIndices[i]],
+                                layerDistances[i],          // in km
+                                TransitionMatrix			   // Output transition matrix
+                                );
+
+                        accumulateLayerTransition(i, MaxLayer, TransitionMatrix, finalTransitionMatrix, TransitionMatrixCoreToMantle, TransitionTemp);
+                    }
+                }else{
+                    for (int i = firstLayer; i <= MaxLayer ; i++ ){
+                        getA( matterSolutions[layerDensityIndices[i]],
+                                layerDistances[i],          // in km
+                                TransitionMatrix			   // Output transition matrix
+                                );
+
+                        accumulateLayerTransition(i, MaxLayer, TransitionMatrix, finalTransitionMatrix, TransitionMatrixCoreToMantle, TransitionTemp);
+                    }
+                }
+
+                // calculate final transition matrix
+                finishPathTransition(finalTransitionMatrix, TransitionMatrixCoreToMantle, TransitionTemp);
 
-                        // set TransitionMatrixCoreToMantle to unit matrix
+                if(firstLayer > 0){
+                    // weighted average over the production heights. the transition matrix of height k is the product of
+                    // the earth matrix and the vacuum matrix of the atmospheric distance of height k
+                    const unsigned long long heightOffset = (unsigned long long)(index_cosine) * (unsigned long long)(context.n_heightSamples);
+
+                    UNROLLQUALIFIER
+                    for (int inflv = 0 ; inflv < 3 ; inflv++ ){
                         UNROLLQUALIFIER
-                        for(int i = 0; i < 3; i++){
-                            UNROLLQUALIFIER
-                            for(int j = 0; j < 3; j++){
-                                    TransitionMatrixCoreToMantle[i][j].re = (i == j ? 1.0 : 0.0);
-                                    TransitionMatrixCoreToMantle[i][j].im = 0.0;
-                            }
+                        for (int outflv = 0 ; outflv < 3 ; outflv++ ){
+                            probabilities[inflv][outflv] = 0.0;
                         }
+                    }
 
-                        // loop from vacuum layer to innermost crossed layer
-                        for (int i = 0; i <= MaxLayer ; i++ ){
-                            const FLOAT_T distance = getTraversedDistanceOfLayer(radii, i, MaxLayer, PathLength, TotalEarthLength, cosine_zenith);
-                            const FLOAT_T density = getDensityOfLayer(rhos, i, MaxLayer);
-
-                            get_transition_matrix( type,
-                                                    energy	,		   // in GeV
-                                                    density  * Constants<FLOAT_T>::density_convert(),
-                                                    distance / Constants<FLOAT_T>::km2cm(),
-                                                    TransitionMatrix,			   // Output transition matrix
-                                                    FLOAT_T(0.0)  					   // phase offset
-                                                    );
-
-                            if (i == 0){    // atmosphere
-                                copy_complex_matrix( TransitionMatrix , finalTransitionMatrix );
-                            }else if(i < MaxLayer){ // not the innermost layer, can reuse current TransitionMatrix
-                                clear_complex_matrix( TransitionTemp );
-                                multiply_complex_matrix( TransitionMatrix, finalTransitionMatrix, TransitionTemp );
-                                copy_complex_matrix( TransitionTemp, finalTransitionMatrix );
-
-                                clear_complex_matrix( TransitionTemp );
-                                multiply_complex_matrix( TransitionMatrixCoreToMantle, TransitionMatrix, TransitionTemp );
-                                copy_complex_matrix( TransitionTemp, TransitionMatrixCoreToMantle );
-                            }else{ // innermost layer
-                                clear_complex_matrix( TransitionTemp );
-                                multiply_complex_matrix( TransitionMatrix, finalTransitionMatrix, TransitionTemp );
-                                copy_complex_matrix( TransitionTemp, finalTransitionMatrix );
-                            }
-                        }
+                    for(int k = 0; k < context.n_heightSamples; k++){
+                        getA( matterSolutions[layerDensityIndices[0]],
+                                context.heightDistances[heightOffset + k],     // in km
+                                TransitionMatrix
+                                );
 
-                        // calculate final transition matrix
                         clear_complex_matrix( TransitionTemp );
-                        multiply_complex_matrix( TransitionMatrixCoreToMantle, finalTransitionMatrix, TransitionTemp );
-                        copy_complex_matrix( TransitionTemp, finalTransitionMatrix );
+                        multiply_complex_matrix( finalTransitionMatrix, TransitionMatrix, TransitionTemp );
+
+                        const FLOAT_T weight = context.heightWeights[heightOffset + k];
 
-                        // for oscillation probabilities where the initial wave function
-                        // evaluates to 0+0i for two flavors and evaluates to 1+0i for the remaining third flavor,
-                        // we don't need to perform full matrix vector multiplication
                         UNROLLQUALIFIER
                         for (int inflv = 0 ; inflv < 3 ; inflv++ ){
                             UNROLLQUALIFIER
                             for (int outflv = 0 ; outflv < 3 ; outflv++ ){
-                                const FLOAT_T re = finalTransitionMatrix[outflv][inflv].re;
-                                const FLOAT_T im = finalTransitionMatrix[outflv][inflv].im;
-
-                            #ifdef __CUDA_ARCH__
-                                const unsigned long long resultIndex = (unsigned long long)(n_energies) * (unsigned long long)(index_cosine) + (unsigned long long)(index_energy);
-                                result[resultIndex + (unsigned long long)(n_energies) * (unsigned long long)(n_cosines) * (unsigned long long)((inflv * 3 + outflv))] = re * re + im * im;
-                            #else
-                                const unsigned long long resultIndex = (unsigned long long)(index_cosine) * (unsigned long long)(n_energies) * (unsigned long long)(9)
-                                                    + (unsigned long long)(index_energy) * (unsigned long long)(9);
-                                result[resultIndex + (unsigned long long)((inflv * 3 + outflv))] = re * re + im * im;
-                            #endif
-
+                                const COMPUTE_T re = TransitionTemp[outflv][inflv].re;
+                                const COMPUTE_T im = TransitionTemp[outflv][inflv].im;
+                                probabilities[inflv][outflv] += weight * (re * re + im * im);
                             }
                         }
                     }
+                }else{
+                    UNROLLQUALIFIER
+                    for (int inflv = 0 ; inflv < 3 ; inflv++ ){
+                        UNROLLQUALIFIER
+                        for (int outflv = 0 ; outflv < 3 ; outflv++ ){
+                            const COMPUTE_T re = finalTransitionMatrix[outflv][inflv].re;
+                            const COMPUTE_T im = finalTransitionMatrix[outflv][inflv].im;
+                            probabilities[inflv][outflv] = re * re + im * im;
+                        }
+                    }
+                }
+            }
+
+            /*
+             * Add weight times the probability of each requested ProbType of a vacuum path with length L (km) and energy E (GeV) to probabilities.
+             * The amplitudes are evaluated in closed form from the vacuum eigen-decomposition of the parameter set, see prepare_vacuum
+             */
+            template<typename FLOAT_T, typename VALUE_T>
+            HOSTDEVICEQUALIFIER
+            void accumulateVacuumProbabilities(const ParameterSet<VALUE_T>& parameters, const FLOAT_T E, const FLOAT_T L, const FLOAT_T weight,
+                            const int* const channelSlots, VALUE_T probabilities[3][3]){
+
+                VALUE_T c[3], s[3];
+
+                UNROLLQUALIFIER
+                for (int k=0; k<3; k++) {
+                    const VALUE_T arg = parameters.vacuum_phase[k] * L / E;
+#ifdef __CUDACC__
+                    sincos(arg, &s[k], &c[k]);
+#else
+                    s[k] = sin(arg);
+                    c[k] = cos(arg);
+#endif
+                }
+
+                UNROLLQUALIFIER
+                for (int inflv = 0 ; inflv < 3 ; inflv++ ){
+                    UNROLLQUALIFIER
+                    for (int outflv = 0 ; outflv < 3 ; outflv++ ){
+                        if(channelSlots[inflv * 3 + outflv] < 0)
+                            continue;
+
+                        VALUE_T re = 0;
+                        VALUE_T im = 0;
+
+                        UNROLLQUALIFIER
+                        for (int k=0; k<3; k++) {
+                            const math::ComplexNumber<VALUE_T> product = parameters.vacuum_product[outflv][inflv][k];
+                            re += c[k] * product.re - s[k] * product.im;
+                            im += c[k] * product.im + s[k] * product.re;
+                        }
+
+                        probabilities[inflv][outflv] += weight * (re * re + im * im);
+                    }
+                }
+            }
+
+            /*
+             * Calculate the probabilities of a path which only crosses the atmosphere, i.e. maxlayers is 0.
+             * L is the length (km) of the path for the production height of the context
+             */
+            template<typename FLOAT_T, typename VALUE_T>
+            HOSTDEVICEQUALIFIER
+            void calculateVacuumPathProbabilities(const OscillationContext<FLOAT_T>& context,
+                            const ParameterSet<VALUE_T>& parameters,
+                            const FLOAT_T E,
+                            const FLOAT_T L,
+                            const int index_cosine,
+                            VALUE_T probabilities[3][3]){
+
+                UNROLLQUALIFIER
+                for (int inflv = 0 ; inflv < 3 ; inflv++ ){
+                    UNROLLQUALIFIER
+                    for (int outflv = 0 ; outflv < 3 ; outflv++ ){
+                        probabilities[inflv][outflv] = 0.0;
+                    }
+                }
+
+                if(context.n_heightSamples > 0){
+                    const unsigned long long heightOffset = (unsigned long long)(index_cosine) * (unsigned long long)(context.n_heightSamples);
+
+                    for(int k = 0; k < context.n_heightSamples; k++){
+                        accumulateVacuumProbabilities(parameters, E, context.heightDistances[heightOffset + k], context.heightWeights[heightOffset + k],
+                                                        context.channelSlots, probabilities);
+                    }
+                }else{
+                    accumulateVacuumProbabilities(parameters, E, L, FLOAT_T(1.0), context.channelSlots, probabilities);
+                }
+            }
+
+            /*
+             * Store a probability at result
+             */
+            template<typename FLOAT_T>
+            HOSTDEVICEQUALIFIER
+            void storeProbability(FLOAT_T* const result, const unsigned long long, const FLOAT_T probability){
+                *result = probability;
+            }
+
+            /*
+             * Store the value of a probability with derivatives at result, and its derivative with respect to the i-th parameter
+             * at result + (i + 1) * derivativeStride
+             */
+            template<typename FLOAT_T, int N>
+            HOSTDEVICEQUALIFIER
+            void storeProbability(FLOAT_T* const result, const unsigned long long derivativeStride, const math::Dual<FLOAT_T, N>& probability){
+                result[0] = probability.val;
+
+                UNROLLQUALIFIER
+                for(int i = 0; i < N; i++){
+                    result[(unsigned long long)(i + 1) * derivativeStride] = probability.d[i];
+                }
+            }
+
+            /*
+             * Calculate the probabilities of cell (index_cosine, index_energy) of hypothesis index_hypothesis of calculatePaths(..).
+             * layerDistances and layerDensityIndices are the path geometry of index_cosine in the density variant of the hypothesis
+             */
+            template<typename FLOAT_T, int MAX_LAYERS, typename SOLUTION_T>
+            HOSTDEVICEQUALIFIER
+            void calculatePathCell(const OscillationContext<FLOAT_T>& context,
+                            const SOLUTION_T* const solutionList,
+                            FLOAT_T* const resultList,
+                            int index_hypothesis,
+                            int index_cosine,
+                            int index_energy,
+                            const FLOAT_T* const layerDistances,
+                            const int* const layerDensityIndices){
+
+                const int n_energies = context.n_energies;
+                const int n_parameters = context.n_parameters;
+                const int n_variants = context.n_densityVariants;
+
+                using PROB_T = typename SOLUTION_T::ProbabilityType;
+                const unsigned long long resultsPerHypothesis = (unsigned long long)(context.n_cosines) * (unsigned long long)(n_energies)
+                                                                * (unsigned long long)(context.n_channels);
+
+                const int index_type = index_hypothesis / (n_parameters * n_variants);
+                const int index_parameter = (index_hypothesis / n_variants) % n_parameters;
+                const int index_variant = index_hypothesis % n_variants;
+                const int index_solutions = index_type * n_parameters + index_parameter; // matter solutions of all variants
+
+                FLOAT_T* const result = resultList + (unsigned long long)(index_type) * context.resultTypeStride
+                                                    + (unsigned long long)(index_parameter * n_variants + index_variant)
+                                                        * (unsigned long long)(ResultBlocks<PROB_T>::value) * resultsPerHypothesis;
+
+                const int MaxLayer = context.maxlayers[index_cosine];
+
+                // for oscillation probabilities where the initial wave function
+                // evaluates to 0+0i for two flavors and evaluates to 1+0i for the remaining third flavor,
+                // we don't need to perform full matrix vector multiplication
+                PROB_T probabilities[3][3];
+
+                if(MaxLayer == 0){
+                    // down-going path through the atmosphere only. The vacuum solution does not need matrix products
+                    calculateVacuumPathProbabilities(context, getParameterSet(context, index_parameter, solutionList), context.energylist[index_energy],
+                                                        layerDistances[0], index_cosine, probabilities);
+                }else{
+                    // precomputed matter solutions of this type, hypothesis and energy
+                    const SOLUTION_T* const matterSolutions = solutionList
+                                + ((unsigned long long)(index_solutions) * (unsigned long long)(n_energies) + (unsigned long long)(index_energy))
+                                    * (unsigned long long)(context.n_densities);
+
+                    calculateEarthPathProbabilities<FLOAT_T, MAX_LAYERS>(context, matterSolutions, layerDistances, layerDensityIndices,
+                                                                            MaxLayer, index_cosine, probabilities);
+                }
+
+                UNROLLQUALIFIER
+                for (int inflv = 0 ; inflv < 3 ; inflv++ ){
+                    UNROLLQUALIFIER
+                    for (int outflv = 0 ; outflv < 3 ; outflv++ ){
+                        // only requested ProbTypes are stored
+                        const int slot = context.channelSlots[inflv * 3 + outflv];
+                        if(slot < 0)
+                            continue;
+
+                        const unsigned long long resultIndex = ((unsigned long long)(index_cosine) * (unsigned long long)(n_energies) + (unsigned long long)(index_energy))
+                                            * context.resultCellStride;
+                        storeProbability(result + resultIndex + (unsigned long long)(slot) * context.resultChannelStride, resultsPerHypothesis,
+                                            probabilities[inflv][outflv]);
+
+                    }
+                }
+            }
+
+            /*
+             * Calculate the probabilities of each energy of path index_path of hypothesis index_hypothesis of calculatePaths(..).
+             * With pathOrder, the path is not the cosine index, see calculatePaths(..)
+             */
+            template<typename FLOAT_T, int MAX_LAYERS = 0, typename SOLUTION_T = MatterSolution<FLOAT_T>>
+            HOSTDEVICEQUALIFIER
+            void calculatePath(const OscillationContext<FLOAT_T>& context,
+                            const SOLUTION_T* const solutionList,
+                            FLOAT_T* const resultList,
+                            int index_hypothesis,
+                            int index_path){
+
+                const int index_cosine = context.pathOrder != nullptr ? context.pathOrder[index_path] : index_path;
+                const int index_variant = index_hypothesis % context.n_densityVariants;
+
+                // precomputed path geometry of this cosine
+                const FLOAT_T* const layerDistances = context.layerDistances + (unsigned long long)(index_cosine) * (unsigned long long)(context.layerStride);
+                const int* const layerDensityIndices = context.layerDensityIndices + (unsigned long long)(index_variant) * context.layerVariantStride
+                                                    + (unsigned long long)(index_cosine) * (unsigned long long)(context.layerStride);
+
+                for(int index_energy = 0; index_energy < context.n_energies; index_energy += 1){
+                    calculatePathCell<FLOAT_T, MAX_LAYERS>(context, solutionList, resultList, index_hypothesis, index_cosine, index_energy,
+                                                            layerDistances, layerDensityIndices);
+                }
+            }
+
+            /*
+             * Calculate the probabilities of each cell of the context from the precomputed matter solutions in solutionList.
+             * The matrices of the paths have the precision SOLUTION_T::ComputeType. If the solutions hold dual numbers, see calculateGradients,
+             * the results of each hypothesis are followed by their derivatives, see ResultBlocks.
+             * If MAX_LAYERS > 0, it is the number of radii of the density model, which bounds the innermost crossed layer of each path.
+             * Then, the loop over the layers has a constant trip count and is unrolled.
+             * On the host, the paths are calculated by the calling thread. CpuPropagator distributes the (hypothesis, path) pairs of
+             * calculatePath(..) over its TaskScheduler
+             */
+            template<typename FLOAT_T, int MAX_LAYERS = 0, typename SOLUTION_T = MatterSolution<FLOAT_T>>
+            HOSTDEVICEQUALIFIER
+            void calculatePaths(const OscillationContext<FLOAT_T>& context,
+                            const SOLUTION_T* const solutionList,
+                            FLOAT_T* const resultList){
+
+                const int n_cosines = context.n_cosines;
+                const int n_hypotheses = context.n_types * context.n_parameters * context.n_densityVariants;
+
+            #ifdef __CUDA_ARCH__
+                // on the device, we use the global thread Id to index the data. The hypothesis and type are selected by the z-dimension of the grid
+                const int n_energies = context.n_energies;
+                const int max_energies_per_path = SDIV(n_energies, blockDim.x) * blockDim.x;
+                for(unsigned index_hypothesis = blockIdx.z; index_hypothesis < n_hypotheses; index_hypothesis += gridDim.z){
+                for(unsigned index = blockIdx.x * blockDim.x + threadIdx.x; index < n_cosines * max_energies_per_path; index += blockDim.x * gridDim.x){
+                    const unsigned index_energy = index % max_energies_per_path;
+                    const unsigned index_path = index / max_energies_per_path;
+
+                    // paths with many layers are processed first, such that the cheap vacuum paths balance the load at the end
+                    const int index_cosine = context.pathOrder != nullptr ? context.pathOrder[index_path] : index_path;
+                    const int index_variant = index_hypothesis % context.n_densityVariants;
+
+                    // all threads of a block belong to the same cosine, since max_energies_per_path is a multiple of blockDim.x.
+                    // The block stages the geometry of the path in shared memory, see getPathsKernelSharedMemory
+                    const FLOAT_T* const layerDistances = context.layerDistances + (unsigned long long)(index_cosine) * (unsigned long long)(context.layerStride);
+                    const int* const layerDensityIndices = context.layerDensityIndices + (unsigned long long)(index_variant) * context.layerVariantStride
+                                                        + (unsigned long long)(index_cosine) * (unsigned long long)(context.layerStride);
+
+                    extern __shared__ __align__(16) unsigned char sharedGeometry[];
+                    FLOAT_T* const sharedDistances = reinterpret_cast<FLOAT_T*>(sharedGeometry);
+                    int* const sharedDensityIndices = reinterpret_cast<int*>(sharedDistances + context.layerStride);
+
+                    __syncthreads(); // the geometry of the previous path is no longer read
+                    for(int i = threadIdx.x; i < context.layerStride; i += blockDim.x){
+                        sharedDistances[i] = layerDistances[i];
+                        sharedDensityIndices[i] = layerDensityIndices[i];
+                    }
+                    __syncthreads();
+
+                    if(index_energy < n_energies){
+                        calculatePathCell<FLOAT_T, MAX_LAYERS>(context, solutionList, resultList, index_hypothesis, index_cosine, index_energy,
+                                                                sharedDistances, sharedDensityIndices);
+                    }
+                }
+                }
+            #else
+                for(int index_task = 0; index_task < n_hypotheses * n_cosines; index_task += 1){
+                    calculatePath<FLOAT_T, MAX_LAYERS>(context, solutionList, resultList, index_task / n_cosines, index_task % n_cosines);
+                }
+            #endif
+            }
+
+            /*
+             * Calculate the probabilities of each cell of the context.
+             * If MAX_LAYERS > 0, it is the number of radii of the density model, see calculatePaths
+             */
+            template<typename FLOAT_T, int MAX_LAYERS = 0>
+            HOSTDEVICEQUALIFIER
+            void calculate(NeutrinoType type,
+                            const OscillationContext<FLOAT_T>& context,
+                            FLOAT_T* const resultList){
+
+            //prepare matter solutions which are shared by all cosines. For the kernel, this is done by the wrapper function callCalculateKernelAsync
+            #ifndef __CUDA_ARCH__
+                calculateMatterSolutions(type, context);
+            #else
+                (void)type;
+            #endif
+
+                calculatePaths<FLOAT_T, MAX_LAYERS>(context, context.matterSolutions, resultList);
+            }
+
+            /*
+             * Calculate the probabilities of each cell of the context and their derivatives with respect to the oscillation parameters
+             * in a single pass. The parameter sets context.gradientParameterList hold dual numbers, which are seeded with respect to
+             * each OscParameter, and the matter solutions are stored in context.gradientSolutions. The results of hypothesis k are stored
+             * as ResultBlocks<Gradient<FLOAT_T>>::value = n_gradientParameters + 1 consecutive hypotheses: first the probabilities, followed
+             * by the derivatives with respect to each OscParameter
+             */
+            template<typename FLOAT_T, int MAX_LAYERS = 0>
+            HOSTDEVICEQUALIFIER
+            void calculateGradients(NeutrinoType type,
+                            const OscillationContext<FLOAT_T>& context,
+                            FLOAT_T* const resultList){
+
+            #ifndef __CUDA_ARCH__
+                calculateMatterSolutions(type, context, context.gradientSolutions);
+            #else
+                (void)type;
+            #endif
+
+                calculatePaths<FLOAT_T, MAX_LAYERS>(context, context.gradientSolutions, resultList);
+            }
+
+            /*
+             * Calculate the probabilities of each cell of the context in the mixed precision mode. The matter solutions are computed
+             * in double precision and stored as MixedMatterSolution in the memory of context.matterSolutions, which is large enough.
+             * The layer matrices and the probabilities are single precision
+             */
+            template<int MAX_LAYERS = 0>
+            HOSTDEVICEQUALIFIER
+            void calculateMixed(NeutrinoType type,
+                            const OscillationContext<double>& context,
+                            double* const resultList){
+
+                MixedMatterSolution* const solutions = reinterpret_cast<MixedMatterSolution*>(context.matterSolutions);
+
+            #ifndef __CUDA_ARCH__
+                calculateMatterSolutions(type, context, solutions);
+            #else
+                (void)type;
+            #endif
+
+                calculatePaths<double, MAX_LAYERS>(context, solutions, resultList);
+            }
+
+            /*
+             * Calculate the probabilities of event task index of calculateEvents(..), i.e. event index % n_events of type index / n_events
+             */
+            template<typename FLOAT_T, int N_TYPES = 0>
+            HOSTDEVICEQUALIFIER
+            void calculateEvent(NeutrinoType type,
+                            const EventContext<FLOAT_T>& context,
+                            unsigned long long index,
+                            FLOAT_T* const resultList){
+
+                const int n_types = N_TYPES > 0 ? N_TYPES : context.n_types;
+
+                const int index_type = index / context.n_events;
+                const unsigned long long index_event = index % context.n_events;
+                const NeutrinoType eventType = getNeutrinoTypeOfIndex(type, n_types, index_type);
+
+                const FLOAT_T cosine_zenith = context.cosines[index_event];
+                const FLOAT_T energy = context.energies[index_event];
+                const FLOAT_T productionHeight = context.productionHeights == nullptr ? context.productionHeight : context.productionHeights[index_event];
+
+                const FLOAT_T PathLength = getPathLength(cosine_zenith, productionHeight * Constants<FLOAT_T>::km2cm());
+                const FLOAT_T TotalEarthLength = -2.0*cosine_zenith*Constants<FLOAT_T>::REarthcm(); // in [cm]
+                const int MaxLayer = getMaxLayer(context.coslimit, context.n_layers, cosine_zenith);
+
+                math::ComplexNumber<FLOAT_T> TransitionMatrix[3][3];
+                math::ComplexNumber<FLOAT_T> TransitionMatrixCoreToMantle[3][3];
+                math::ComplexNumber<FLOAT_T> finalTransitionMatrix[3][3];
+                math::ComplexNumber<FLOAT_T> TransitionTemp[3][3];
+
+                // set TransitionMatrixCoreToMantle to unit matrix
+                UNROLLQUALIFIER
+                for(int i = 0; i < 3; i++){
+                    UNROLLQUALIFIER
+                    for(int j = 0; j < 3; j++){
+                            TransitionMatrixCoreToMantle[i][j].re = (i == j ? 1.0 : 0.0);
+                            TransitionMatrixCoreToMantle[i][j].im = 0.0;
+                    }
+                }
+
+                // loop from vacuum layer to innermost crossed layer
+                for (int i = 0; i <= MaxLayer ; i++ ){
+                    const FLOAT_T distance = getTraversedDistanceOfLayer(context.radii, i, MaxLayer, PathLength, TotalEarthLength, cosine_zenith);
+                    const int densityIndex = getDensityIndexOfLayer(context.densityIndices, i, MaxLayer);
+
+                    MatterSolution<FLOAT_T> solution;
+                    getMatterSolution(*context.parameters, eventType, energy,
+                                        context.densities[densityIndex] * Constants<FLOAT_T>::density_convert(),
+                                        solution);
+
+                    getA( solution,
+                            distance / Constants<FLOAT_T>::km2cm(),          // in km
+                            TransitionMatrix			   // Output transition matrix
+                            );
+
+                    accumulateLayerTransition(i, MaxLayer, TransitionMatrix, finalTransitionMatrix, TransitionMatrixCoreToMantle, TransitionTemp);
+                }
+
+                finishPathTransition(finalTransitionMatrix, TransitionMatrixCoreToMantle, TransitionTemp);
+
+                FLOAT_T* const result = resultList + (unsigned long long)(index) * (unsigned long long)(context.n_channels);
+
+                UNROLLQUALIFIER
+                for (int inflv = 0 ; inflv < 3 ; inflv++ ){
+                    UNROLLQUALIFIER
+                    for (int outflv = 0 ; outflv < 3 ; outflv++ ){
+                        const int slot = context.channelSlots[inflv * 3 + outflv];
+                        if(slot < 0)
+                            continue;
+
+                        const FLOAT_T re = finalTransitionMatrix[outflv][inflv].re;
+                        const FLOAT_T im = finalTransitionMatrix[outflv][inflv].im;
+
+                        result[slot] = re * re + im * im;
+                    }
+                }
+            }
+
+            /*
+             * Calculate the probabilities of each event of the context. The path geometry and the matter solutions
+             * are computed per event, since events do not share their energy.
+             * If N_TYPES > 0, it replaces context.n_types at compile time.
+             * On the host, the events are calculated by the calling thread. CpuPropagator distributes ranges of calculateEvent(..) over its TaskScheduler
+             */
+            template<typename FLOAT_T, int N_TYPES = 0>
+            HOSTDEVICEQUALIFIER
+            void calculateEvents(NeutrinoType type,
+                            const EventContext<FLOAT_T>& context,
+                            FLOAT_T* const resultList){
+
+                const int n_types = N_TYPES > 0 ? N_TYPES : context.n_types;
+                const unsigned long long n_tasks = (unsigned long long)(n_types) * context.n_events;
+
+            #ifdef __CUDA_ARCH__
+                for(unsigned long long index = blockIdx.x * blockDim.x + threadIdx.x; index < n_tasks; index += blockDim.x * gridDim.x){
+            #else
+                for(unsigned long long index = 0; index < n_tasks; index++){
+            #endif
+                    calculateEvent<FLOAT_T, N_TYPES>(type, context, index, resultList);
                 }
             }
 
 
             #ifdef __NVCC__
+            /*
+             * The kernels are specialized at compile time. MAX_LAYERS > 0 is the number of radii of the density model, see calculate.
+             * TYPE >= 0 is the NeutrinoType of a calculation of a single type. TYPE < 0 selects the type at runtime.
+             * BLOCK_SIZE is the number of threads per block of the path kernels, i.e. the number of energies of the same path per block.
+             * Each block size may use up to 128 registers per thread, as 64 threads with 8 blocks per multiprocessor
+             */
+
+            // supported block sizes of the path kernels
+            constexpr int pathsKernelBlockSizes[] = {64, 128, 256};
+            constexpr int n_pathsKernelBlockSizes = 3;
+            constexpr int defaultPathsKernelBlockSize = 64;
+
+            template<typename FLOAT_T, int MAX_LAYERS, int BLOCK_SIZE>
+            KERNEL
+            __launch_bounds__( BLOCK_SIZE, 512 / BLOCK_SIZE )
+            void calculateKernel(NeutrinoType type,
+                                const OscillationContext<FLOAT_T> context,
+                                FLOAT_T* const result){
+
+                calculate<FLOAT_T, MAX_LAYERS>(type, context, result);
+            }
+
+            template<int MAX_LAYERS, int BLOCK_SIZE>
+            KERNEL
+            __launch_bounds__( BLOCK_SIZE, 512 / BLOCK_SIZE )
+            void calculateMixedKernel(const OscillationContext<double> context,
+                                double* const result){
+
+                calculatePaths<double, MAX_LAYERS>(context, reinterpret_cast<const MixedMatterSolution*>(context.matterSolutions), result);
+            }
+
+            template<typename FLOAT_T, int TYPE>
+            KERNEL
+            void calculateMatterSolutionsKernel(NeutrinoType type,
+                                const OscillationContext<FLOAT_T> context){
+
+                calculateMatterSolutions<FLOAT_T, (TYPE < 0 ? 0 : 1)>(TYPE < 0 ? type : NeutrinoType(TYPE), context);
+            }
+
+            template<int TYPE>
+            KERNEL
+            void calculateMixedMatterSolutionsKernel(NeutrinoType type,
+                                const OscillationContext<double> context){
+
+                calculateMatterSolutions<double, (TYPE < 0 ? 0 : 1)>(TYPE < 0 ? type : NeutrinoType(TYPE), context,
+                                                                        reinterpret_cast<MixedMatterSolution*>(context.matterSolutions));
+            }
+
+            template<typename FLOAT_T>
+            KERNEL
+            void calculateGradientMatterSolutionsKernel(NeutrinoType type,
+                                const OscillationContext<FLOAT_T> context){
+
+                calculateMatterSolutions<FLOAT_T>(type, context, context.gradientSolutions);
+            }
+
             template<typename FLOAT_T>
             KERNEL
+            void calculateGradientKernel(const OscillationContext<FLOAT_T> context,
+                                FLOAT_T* const result){
+
+                calculatePaths<FLOAT_T, 0>(context, context.gradientSolutions, result);
+            }
+
+            template<typename FLOAT_T, int TYPE>
+            KERNEL
             __launch_bounds__( 64, 8 )
-            void calculateKernel(NeutrinoType type,
-                                const FLOAT_T* const cosinelist,
-                                int n_cosines,
-                                const FLOAT_T* const energylist,
-                                int n_energies,
-                                const FLOAT_T* const radii,
-                                const FLOAT_T* const rhos,
-                                const int* const maxlayers,
-                                FLOAT_T ProductionHeightinCentimeter,
+            void calculateEventsKernel(NeutrinoType type,
+                                const EventContext<FLOAT_T> context,
                                 FLOAT_T* const result){
 
-                calculate(type, cosinelist, n_cosines, energylist, n_energies, radii, rhos, maxlayers, ProductionHeightinCentimeter, result);
+                calculateEvents<FLOAT_T, (TYPE < 0 ? 0 : 1)>(TYPE < 0 ? type : NeutrinoType(TYPE), context, result);
+            }
+
+            template<typename FLOAT_T>
+            void callCalculateEventsKernelAsync(cudaStream_t stream,
+                                        NeutrinoType type,
+                                        const EventContext<FLOAT_T>& context,
+                                        FLOAT_T* const result){
+
+                const unsigned long long n_tasks = (unsigned long long)(context.n_types) * context.n_events;
+                const unsigned blocks = std::min(SDIV(n_tasks, 64ull), 65535ull);
+
+                // the matter solutions of each layer are computed in the kernel. Their branches on the type are resolved at compile time.
+                // The layer loop is not specialized, the unrolled matter solutions would make the kernel too large
+                if(context.n_types == 2)
+                    calculateEventsKernel<FLOAT_T, -1><<<blocks, 64, 0, stream>>>(type, context, result);
+                else if(type == Neutrino)
+                    calculateEventsKernel<FLOAT_T, Neutrino><<<blocks, 64, 0, stream>>>(type, context, result);
+                else
+                    calculateEventsKernel<FLOAT_T, Antineutrino><<<blocks, 64, 0, stream>>>(type, context, result);
+                CUERR;
+            }
+
+            // precompute the matter solutions of the context. They are shared by all cosines
+            template<typename FLOAT_T>
+            void callCalculateMatterSolutionsKernelAsync(cudaStream_t stream,
+                                        NeutrinoType type,
+                                        const OscillationContext<FLOAT_T>& context){
+
+                const unsigned long long n_solutions = (unsigned long long)(context.n_types) * (unsigned long long)(context.n_parameters)
+                                                        * (unsigned long long)(context.n_energies) * (unsigned long long)(context.n_densities);
+                const unsigned solutionBlocks = std::min(SDIV(n_solutions, 128ull), 65535ull);
+
+                if(context.n_types == 2)
+                    calculateMatterSolutionsKernel<FLOAT_T, -1><<<solutionBlocks, 128, 0, stream>>>(type, context);
+                else if(type == Neutrino)
+                    calculateMatterSolutionsKernel<FLOAT_T, Neutrino><<<solutionBlocks, 128, 0, stream>>>(type, context);
+                else
+                    calculateMatterSolutionsKernel<FLOAT_T, Antineutrino><<<solutionBlocks, 128, 0, stream>>>(type, context);
+                CUERR;
+            }
+
+            // dynamic shared memory of the path kernels, which stage the geometry table of one path
+            template<typename FLOAT_T>
+            size_t getPathsKernelSharedMemory(const OscillationContext<FLOAT_T>& context){
+                return size_t(context.layerStride) * (sizeof(FLOAT_T) + sizeof(int));
+            }
+
+            template<typename FLOAT_T, int MAX_LAYERS>
+            void launchCalculateKernel(dim3 grid, dim3 block, cudaStream_t stream, NeutrinoType type,
+                                        const OscillationContext<FLOAT_T>& context, FLOAT_T* const result){
+
+                const size_t sharedMemory = getPathsKernelSharedMemory(context);
+
+                switch(block.x){
+                    case 64: calculateKernel<FLOAT_T, MAX_LAYERS, 64><<<grid, block, sharedMemory, stream>>>(type, context, result); break;
+                    case 128: calculateKernel<FLOAT_T, MAX_LAYERS, 128><<<grid, block, sharedMemory, stream>>>(type, context, result); break;
+                    case 256: calculateKernel<FLOAT_T, MAX_LAYERS, 256><<<grid, block, sharedMemory, stream>>>(type, context, result); break;
+                    default: throw std::runtime_error("physics::launchCalculateKernel. unsupported block size " + std::to_string(block.x));
+                }
+            }
+
+            template<int MAX_LAYERS>
+            void launchCalculateMixedKernel(dim3 grid, dim3 block, cudaStream_t stream,
+                                        const OscillationContext<double>& context, double* const result){
+
+                const size_t sharedMemory = getPathsKernelSharedMemory(context);
+
+                switch(block.x){
+                    case 64: calculateMixedKernel<MAX_LAYERS, 64><<<grid, block, sharedMemory, stream>>>(context, result); break;
+                    case 128: calculateMixedKernel<MAX_LAYERS, 128><<<grid, block, sharedMemory, stream>>>(context, result); break;
+                    case 256: calculateMixedKernel<MAX_LAYERS, 256><<<grid, block, sharedMemory, stream>>>(context, result); break;
+                    default: throw std::runtime_error("physics::launchCalculateMixedKernel. unsupported block size " + std::to_string(block.x));
+                }
+            }
+
+            // calculate the paths of the context from already precomputed matter solutions. block.x must be one of pathsKernelBlockSizes.
+            // The layer loop is unrolled for the density models in example/models (PREM with 4, 10 and 12 layers)
+            template<typename FLOAT_T>
+            void callCalculatePathsKernelAsync(dim3 grid,
+                                        dim3 block,
+                                        cudaStream_t stream,
+                                        NeutrinoType type,
+                                        const OscillationContext<FLOAT_T>& context,
+                                        FLOAT_T* const result){
+
+                // the geometry table has one entry for the atmosphere and one per radius of the density model
+                const int n_radii = context.layerStride - 1;
+
+                switch(n_radii){
+                    case 5: launchCalculateKernel<FLOAT_T, 5>(grid, block, stream, type, context, result); break;
+                    case 11: launchCalculateKernel<FLOAT_T, 11>(grid, block, stream, type, context, result); break;
+                    case 13: launchCalculateKernel<FLOAT_T, 13>(grid, block, stream, type, context, result); break;
+                    default: launchCalculateKernel<FLOAT_T, 0>(grid, block, stream, type, context, result); break;
+                }
+                CUERR;
             }
 
             template<typename FLOAT_T>
@@ -725,20 +1748,70 @@ namespace cudaprob3{
                                         dim3 block,
                                         cudaStream_t stream,
                                         NeutrinoType type,
-                                        const FLOAT_T* const cosinelist,
-                                        int n_cosines,
-                                        const FLOAT_T* const energylist,
-                                        int n_energies,
-                                        const FLOAT_T* const radii,
-                                        const FLOAT_T* const rhos,
-                                        const int* const maxlayers,
-                                        FLOAT_T ProductionHeightinCentimeter,
+                                        const OscillationContext<FLOAT_T>& context,
+                                        FLOAT_T* const result){
+
+                callCalculateMatterSolutionsKernelAsync(stream, type, context);
+                callCalculatePathsKernelAsync(grid, block, stream, type, context, result);
+            }
+
+            // calculate the context in the mixed precision mode, see calculateMixed. The same dispatch as callCalculateKernelAsync
+            inline void callCalculateMixedKernelAsync(dim3 grid,
+                                        dim3 block,
+                                        cudaStream_t stream,
+                                        NeutrinoType type,
+                                        const OscillationContext<double>& context,
+                                        double* const result){
+
+                const unsigned long long n_solutions = (unsigned long long)(context.n_types) * (unsigned long long)(context.n_parameters)
+                                                        * (unsigned long long)(context.n_energies) * (unsigned long long)(context.n_densities);
+                const unsigned solutionBlocks = std::min(SDIV(n_solutions, 128ull), 65535ull);
+
+                if(context.n_types == 2)
+                    calculateMixedMatterSolutionsKernel<-1><<<solutionBlocks, 128, 0, stream>>>(type, context);
+                else if(type == Neutrino)
+                    calculateMixedMatterSolutionsKernel<Neutrino><<<solutionBlocks, 128, 0, stream>>>(type, context);
+                else
+                    calculateMixedMatterSolutionsKernel<Antineutrino><<<solutionBlocks, 128, 0, stream>>>(type, context);
+                CUERR;
+
+                const int n_radii = context.layerStride - 1;
+
+                switch(n_radii){
+                    case 5: launchCalculateMixedKernel<5>(grid, block, stream, context, result); break;
+                    case 11: launchCalculateMixedKernel<11>(grid, block, stream, context, result); break;
+                    case 13: launchCalculateMixedKernel<13>(grid, block, stream, context, result); break;
+                    default: launchCalculateMixedKernel<0>(grid, block, stream, context, result); break;
+                }
+                CUERR;
+            }
+
+            // calculate the probabilities of the context and their derivatives, see calculateGradients. The kernels are not specialized
+            // for the type and the number of layers, the unrolled dual number arithmetic would make them too large
+            template<typename FLOAT_T>
+            void callCalculateGradientKernelAsync(dim3 grid,
+                                        dim3 block,
+                                        cudaStream_t stream,
+                                        NeutrinoType type,
+                                        const OscillationContext<FLOAT_T>& context,
                                         FLOAT_T* const result){
 
-                prepare_getMfast<FLOAT_T>(type);
+                const unsigned long long n_solutions = (unsigned long long)(context.n_types) * (unsigned long long)(context.n_parameters)
+                                                        * (unsigned long long)(context.n_energies) * (unsigned long long)(context.n_densities);
+                const unsigned solutionBlocks = std::min(SDIV(n_solutions, 128ull), 65535ull);
 
-                calculateKernel<FLOAT_T><<<grid, block, 0, stream>>>(type, cosinelist, n_cosines, energylist, n_energies, radii, rhos, maxlayers, ProductionHeightinCentimeter, result);
+                calculateGradientMatterSolutionsKernel<FLOAT_T><<<solutionBlocks, 128, 0, stream>>>(type, context);
                 CUERR;
+
+                const size_t sharedMemory = getPathsKernelSharedMemory(context);
+
+                calculateGradientKernel<FLOAT_T><<<grid, block, sharedMemory, stream>>>(context, result);
+                CUERR;
+            }
+
+            // the mixed precision mode needs double precision inputs
+            inline void callCalculateMixedKernelAsync(dim3, dim3, cudaStream_t, NeutrinoType, const OscillationContext<float>&, float* const){
+                throw std::runtime_error("physics::callCalculateMixedKernelAsync. mixed precision requires FLOAT_T = double");
             }
             #endif
 
@@ -746,6 +1819,12 @@ namespace cudaprob3{
 
 } // namespace cudaprob3
 
+// the helper macros are only used in this file
+#undef U
+#undef DM
+#undef AXFAC
+#undef ORDER
+
 
 
 
@@ -0,0 +1,625 @@
+/*
+This file is part of CUDAProb3++.
+
+CUDAProb3++ is free software: you can redistribute it and/or modify
+it under the terms of the GNU Lesser General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+CUDAProb3++ is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public License
+along with CUDAProb3++.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef CUDAPROB3_PHYSICS_SIMD_HPP
+#define CUDAPROB3_PHYSICS_SIMD_HPP
+
+#include "hpc_helpers.cuh"
+#include "physics.hpp"
+#include "threadpool.hpp"
+#include "types.hpp"
+
+#include <math.h>
+#include <algorithm>
+#include <cstdint>
+#include <omp.h>
+#include <vector>
+
+/*
+ * This file contains a vectorized host version of physics::calculate(..).
+ *
+ * For a given cosine, all energies cross the same layers. The vectorized version processes SimdWidth<FLOAT_T>::value energies at once.
+ * Complex 3x3 matrices are stored as structure of arrays with one lane per energy, such that the loops over lanes
+ * in getA, sincos and the matrix multiplications can be vectorized by the compiler.
+ *
+ * The precomputed matter eigen-solutions are stored in the same form as MatterSolutionBlock<FLOAT_T>,
+ * one block per (type, hypothesis, block of energies, density).
+ *
+ * The work is split into tasks of a hypothesis and a range of blocks of energies of one path, whose cost is balanced by the number
+ * of crossed layers, and run by a TaskScheduler. The function of a task is compiled for multiple instruction sets (see CPUDISPATCHQUALIFIER)
+ * and the best version is selected at runtime.
+ */
+
+namespace cudaprob3{
+
+    namespace math{
+
+        /*
+         * Constants of the argument reduction of sincos_lanes
+         */
+        template<typename FLOAT_T>
+        struct SinCosConstants;
+
+        template<>
+        struct SinCosConstants<double>{
+            // pi/2 = pio2_1 + pio2_2 + pio2_3. k * pio2_1 and k * pio2_2 are exact for |k| < 2^20
+            static constexpr double twoOverPi = 6.36619772367581382433e-01;
+            static constexpr double pio2_1 = 1.57079632673412561417e+00;
+            static constexpr double pio2_2 = 6.07710050630396597660e-11;
+            static constexpr double pio2_3 = 2.02226624871116645580e-21;
+            static constexpr double shifter = 6755399441055744.0; // 1.5 * 2^52. Rounds to nearest integer
+            static constexpr double limit = 1.0e8; // larger arguments are handled by the standard library
+        };
+
+        template<>
+        struct SinCosConstants<float>{
+            static constexpr float twoOverPi = 6.36619772e-01f;
+            static constexpr float pio2_1 = 1.5703125f;
+            static constexpr float pio2_2 = 4.83751296997070312e-04f;
+            static constexpr float pio2_3 = 7.54978995489188216e-08f;
+            static constexpr float shifter = 12582912.0f; // 1.5 * 2^23. Rounds to nearest integer
+            static constexpr float limit = 1.0e5f; // larger arguments are handled by the standard library
+        };
+
+        /*
+         * Branch free sine and cosine of W arguments which can be vectorized.
+         * Cody-Waite argument reduction to [-pi/4, pi/4] followed by the minimax polynomials of fdlibm
+         */
+        template<typename FLOAT_T, int W>
+        inline void sincos_lanes(const FLOAT_T x[W], FLOAT_T s[W], FLOAT_T c[W]){
+            typedef SinCosConstants<FLOAT_T> K;
+
+            #pragma omp simd
+            for(int w = 0; w < W; w++){
+                const FLOAT_T kr = (x[w] * K::twoOverPi + K::shifter) - K::shifter;
+                const FLOAT_T kc = kr > FLOAT_T(K::limit) ? FLOAT_T(K::limit) : (kr < -FLOAT_T(K::limit) ? -FLOAT_T(K::limit) : kr);
+                const int q = int(kc);
+                const FLOAT_T r = ((x[w] - kr * K::pio2_1) - kr * K::pio2_2) - kr * K::pio2_3;
+                const FLOAT_T z = r * r;
+
+                const FLOAT_T sr = r + r * z * (FLOAT_T(-1.66666666666666324348e-01) + z * (FLOAT_T(8.33333333332248946124e-03)
+                                    + z * (FLOAT_T(-1.98412698298579493134e-04) + z * (FLOAT_T(2.75573137070700676789e-06)
+                                    + z * (FLOAT_T(-2.50507602534068634195e-08) + z * FLOAT_T(1.58969099521155010221e-10))))));
+                const FLOAT_T cr = FLOAT_T(1.0) - FLOAT_T(0.5) * z + z * z * (FLOAT_T(4.16666666666666019037e-02) + z * (FLOAT_T(-1.38888888888741095749e-03)
+                                    + z * (FLOAT_T(2.48015872894767294178e-05) + z * (FLOAT_T(-2.75573143513906633035e-07)
+                                    + z * (FLOAT_T(2.08757232129817482790e-09) + z * FLOAT_T(-1.13596475577881948265e-11))))));
+
+                // select quadrant
+                const FLOAT_T sq = (q & 1) ? cr : sr;
+                const FLOAT_T cq = (q & 1) ? sr : cr;
+                s[w] = (q & 2) ? -sq : sq;
+                c[w] = ((q + 1) & 2) ? -cq : cq;
+            }
+
+            // arguments which are too large for the reduction, and NaN
+            for(int w = 0; w < W; w++){
+                if(!(fabs(x[w]) <= K::limit)){
+                    s[w] = sin(x[w]);
+                    c[w] = cos(x[w]);
+                }
+            }
+        }
+
+        /*
+         *   multiply complex 3x3 matrices of W lanes
+         *        C = A X B
+         */
+        template<typename FLOAT_T, int W>
+        inline void multiply_complex_matrix_lanes(const FLOAT_T Are[3][3][W], const FLOAT_T Aim[3][3][W],
+                                                const FLOAT_T Bre[3][3][W], const FLOAT_T Bim[3][3][W],
+                                                FLOAT_T Cre[3][3][W], FLOAT_T Cim[3][3][W]){
+            for(int i = 0; i < 3; i++){
+                for(int j = 0; j < 3; j++){
+                    #pragma omp simd
+                    for(int w = 0; w < W; w++){
+                        FLOAT_T re = 0;
+                        FLOAT_T im = 0;
+                        for(int k = 0; k < 3; k++){
+                            re += Are[i][k][w] * Bre[k][j][w] - Aim[i][k][w] * Bim[k][j][w];
+                            im += Aim[i][k][w] * Bre[k][j][w] + Are[i][k][w] * Bim[k][j][w];
+                        }
+                        Cre[i][j][w] = re;
+                        Cim[i][j][w] = im;
+                    }
+                }
+            }
+        }
+
+        /*
+         *   copy complex 3x3 matrices of W lanes
+         *        A --> B
+         */
+        template<typename FLOAT_T, int W>
+        inline void copy_complex_matrix_lanes(const FLOAT_T Are[3][3][W], const FLOAT_T Aim[3][3][W], FLOAT_T Bre[3][3][W], FLOAT_T Bim[3][3][W]){
+            std::copy(&Are[0][0][0], &Are[0][0][0] + 9 * W, &Bre[0][0][0]);
+            std::copy(&Aim[0][0][0], &Aim[0][0][0] + 9 * W, &Bim[0][0][0]);
+        }
+
+    }
+
+    namespace physics{
+
+        /*
+         * Number of energies which are processed at once by the vectorized calculation. One 512 bit register per real component
+         */
+        template<typename FLOAT_T>
+        struct SimdWidth{
+            static constexpr int value = 64 / sizeof(FLOAT_T);
+        };
+
+        /*
+         * Precomputed matter eigen-solutions of SimdWidth<FLOAT_T>::value energies, see MatterSolution<FLOAT_T>
+         */
+        template<typename FLOAT_T>
+        struct MatterSolutionBlock{
+            static constexpr int W = SimdWidth<FLOAT_T>::value;
+
+            FLOAT_T phase[3][W];
+            FLOAT_T productRe[3][3][3][W]; // [k][n][m][lane]
+            FLOAT_T productIm[3][3][3][W];
+        };
+
+        /*
+         * Number of blocks of energies of the vectorized calculation
+         */
+        template<typename FLOAT_T>
+        int getEnergyBlockCount(int n_energies){
+            return SDIV(n_energies, SimdWidth<FLOAT_T>::value);
+        }
+
+        /*
+         * Precompute the matter eigen-solutions of each (type, hypothesis, block of energies, density) of the context.
+         * Lanes beyond the last energy repeat the last energy
+         */
+        template<typename FLOAT_T>
+        void calculateMatterSolutionBlocks(NeutrinoType type, const OscillationContext<FLOAT_T>& context, MatterSolutionBlock<FLOAT_T>* const blocks,
+                                            TaskScheduler& scheduler){
+            constexpr int W = SimdWidth<FLOAT_T>::value;
+
+            const int n_blocks = getEnergyBlockCount<FLOAT_T>(context.n_energies);
+            const long long n_solutionBlocks = (long long)(context.n_types) * (long long)(context.n_parameters)
+                                                * (long long)(n_blocks) * (long long)(context.n_densities);
+
+            scheduler.parallelFor(n_solutionBlocks, [&](std::int64_t index, int){
+                const int index_density = index % context.n_densities;
+                const int index_block = (index / context.n_densities) % n_blocks;
+                const int index_hypothesis = index / ((long long)(context.n_densities) * (long long)(n_blocks));
+                const int index_type = index_hypothesis / context.n_parameters;
+                const int index_parameter = index_hypothesis % context.n_parameters;
+
+                MatterSolutionBlock<FLOAT_T>& block = blocks[index];
+
+                for(int w = 0; w < W; w++){
+                    const int index_energy = std::min(index_block * W + w, context.n_energies - 1);
+
+                    MatterSolution<FLOAT_T> solution;
+                    getMatterSolution(context.parameterList[index_parameter],
+                                        getNeutrinoTypeOfIndex(type, context.n_types, index_type),
+                                        context.energylist[index_energy],
+                                        context.densities[index_density] * Constants<FLOAT_T>::density_convert(),
+                                        solution);
+
+                    for(int k = 0; k < 3; k++){
+                        block.phase[k][w] = solution.phase[k];
+                        for(int n = 0; n < 3; n++){
+                            for(int m = 0; m < 3; m++){
+                                block.productRe[k][n][m][w] = solution.product[n][m][k].re;
+                                block.productIm[k][n][m][w] = solution.product[n][m][k].im;
+                            }
+                        }
+                    }
+                }
+            });
+        }
+
+        /*
+         * Get 3x3 transition amplitudes A of W energies for a layer of length L kilometers from the precomputed matter eigen-solutions
+         */
+        template<typename FLOAT_T>
+        inline void getA_lanes(const MatterSolutionBlock<FLOAT_T>& block, const FLOAT_T L,
+                                FLOAT_T Are[3][3][SimdWidth<FLOAT_T>::value], FLOAT_T Aim[3][3][SimdWidth<FLOAT_T>::value]){
+            constexpr int W = SimdWidth<FLOAT_T>::value;
+
+            FLOAT_T arg[3][W];
+            FLOAT_T s[3][W];
+            FLOAT_T c[3][W];
+
+            for(int k = 0; k < 3; k++){
+                #pragma omp simd
+                for(int w = 0; w < W; w++){
+                    arg[k][w] = block.phase[k][w] * L;
+                }
+                math::sincos_lanes<FLOAT_T, W>(arg[k], s[k], c[k]);
+            }
+
+            for(int n = 0; n < 3; n++){
+                for(int m = 0; m < 3; m++){
+                    #pragma omp simd
+                    for(int w = 0; w < W; w++){
+                        FLOAT_T re = 0;
+                        FLOAT_T im = 0;
+                        for(int k = 0; k < 3; k++){
+                            re += c[k][w] * block.productRe[k][n][m][w] - s[k][w] * block.productIm[k][n][m][w];
+                            im += c[k][w] * block.productIm[k][n][m][w] + s[k][w] * block.productRe[k][n][m][w];
+                        }
+                        Are[n][m][w] = re;
+                        Aim[n][m][w] = im;
+                    }
+                }
+            }
+        }
+
+        /*
+         * Add weight times the vacuum probability of each requested ProbType of W energies for a path of length L kilometers to probabilities,
+         * see accumulateVacuumProbabilities
+         */
+        template<typename FLOAT_T>
+        inline void accumulateVacuumProbabilities_lanes(const ParameterSet<FLOAT_T>& parameters, const FLOAT_T inverseEnergies[SimdWidth<FLOAT_T>::value],
+                                const FLOAT_T L, const FLOAT_T weight, const int* const channelSlots,
+                                FLOAT_T probabilities[3][3][SimdWidth<FLOAT_T>::value]){
+            constexpr int W = SimdWidth<FLOAT_T>::value;
+
+            FLOAT_T arg[3][W];
+            FLOAT_T s[3][W];
+            FLOAT_T c[3][W];
+
+            for(int k = 0; k < 3; k++){
+                #pragma omp simd
+                for(int w = 0; w < W; w++){
+                    arg[k][w] = parameters.vacuum_phase[k] * L * inverseEnergies[w];
+                }
+                math::sincos_lanes<FLOAT_T, W>(arg[k], s[k], c[k]);
+            }
+
+            for (int inflv = 0 ; inflv < 3 ; inflv++ ){
+                for (int outflv = 0 ; outflv < 3 ; outflv++ ){
+                    if(channelSlots[inflv * 3 + outflv] < 0)
+                        continue;
+
+                    const math::ComplexNumber<FLOAT_T>* const product = parameters.vacuum_product[outflv][inflv];
+
+                    #pragma omp simd
+                    for(int w = 0; w < W; w++){
+                        FLOAT_T re = 0;
+                        FLOAT_T im = 0;
+                        for(int k = 0; k < 3; k++){
+                            re += c[k][w] * product[k].re - s[k][w] * product[k].im;
+                            im += c[k][w] * product[k].im + s[k][w] * product[k].re;
+                        }
+                        probabilities[inflv][outflv][w] += weight * (re * re + im * im);
+                    }
+                }
+            }
+        }
+
+        /*
+         * Part of the paths of one hypothesis: the blocks of energies [firstBlock, endBlock) of the path index_path of context.pathOrder
+         */
+        struct PathTask{
+            int index_path;
+            int firstBlock;
+            int endBlock;
+        };
+
+        /*
+         * Relative cost of one block of energies of a path with MaxLayer crossed layers. Each layer costs one getA and the matrix products.
+         * Averaging over production heights adds one product per height sample
+         */
+        inline long long getPathBlockCost(int MaxLayer, int n_heightSamples){
+            return (long long)(MaxLayer + 1) + (long long)(n_heightSamples);
+        }
+
+        /*
+         * Split the paths of each hypothesis into tasks of about equal cost, such that n_threads threads get several tasks each,
+         * even if there are few cosines. Paths with many layers are split into more blocks of energies. The tasks keep the order
+         * of context.pathOrder, i.e. expensive paths first
+         */
+        template<typename FLOAT_T>
+        void getPathTasks(const OscillationContext<FLOAT_T>& context, int n_hypotheses, int n_threads, std::vector<PathTask>& tasks){
+            // more tasks than threads, such that the load can be balanced by stealing
+            constexpr long long tasksPerThread = 8;
+
+            const int n_blocks = getEnergyBlockCount<FLOAT_T>(context.n_energies);
+
+            long long totalCost = 0;
+            for(int index_cosine = 0; index_cosine < context.n_cosines; index_cosine++)
+                totalCost += (long long)(n_blocks) * getPathBlockCost(context.maxlayers[index_cosine], context.n_heightSamples);
+
+            const long long taskCost = std::max(1LL, totalCost * (long long)(n_hypotheses) / (tasksPerThread * (long long)(n_threads)));
+
+            tasks.clear();
+
+            for(int index_path = 0; index_path < context.n_cosines; index_path++){
+                const int index_cosine = context.pathOrder != nullptr ? context.pathOrder[index_path] : index_path;
+                const long long pathCost = (long long)(n_blocks) * getPathBlockCost(context.maxlayers[index_cosine], context.n_heightSamples);
+                const int n_parts = int(std::min<long long>(n_blocks, std::max(1LL, SDIV(pathCost, taskCost))));
+
+                for(int part = 0; part < n_parts; part++){
+                    PathTask task;
+                    task.index_path = index_path;
+                    task.firstBlock = int((long long)(n_blocks) * part / n_parts);
+                    task.endBlock = int((long long)(n_blocks) * (part + 1) / n_parts);
+                    tasks.push_back(task);
+                }
+            }
+        }
+
+        /*
+         * Results of hypothesis index_hypothesis, i.e. type, parameter set and density variant, in resultList
+         */
+        template<typename FLOAT_T>
+        FLOAT_T* getHypothesisResults(const OscillationContext<FLOAT_T>& context, FLOAT_T* const resultList, int index_hypothesis){
+            const int n_parameters = context.n_parameters;
+            const int n_variants = context.n_densityVariants;
+            const int index_type = index_hypothesis / (n_parameters * n_variants);
+            const int index_parameter = (index_hypothesis / n_variants) % n_parameters;
+            const int index_variant = index_hypothesis % n_variants;
+
+            return resultList + (unsigned long long)(index_type) * context.resultTypeStride
+                                + (unsigned long long)(index_parameter * n_variants + index_variant) * (unsigned long long)(context.n_cosines)
+                                    * (unsigned long long)(context.n_energies) * (unsigned long long)(context.n_channels);
+        }
+
+        /*
+         * Write zeros to the results of task of hypothesis index_hypothesis, i.e. the same cells which are written by calculatePathBlocks
+         */
+        template<typename FLOAT_T>
+        void clearPathBlocks(const OscillationContext<FLOAT_T>& context, FLOAT_T* const resultList, int index_hypothesis, const PathTask& task){
+            constexpr int W = SimdWidth<FLOAT_T>::value;
+
+            const int index_cosine = context.pathOrder != nullptr ? context.pathOrder[task.index_path] : task.index_path;
+            const int firstEnergy = task.firstBlock * W;
+            const int endEnergy = std::min(task.endBlock * W, context.n_energies);
+            FLOAT_T* const result = getHypothesisResults(context, resultList, index_hypothesis);
+
+            for(int slot = 0; slot < context.n_channels; slot++){
+                for(int index_energy = firstEnergy; index_energy < endEnergy; index_energy++){
+                    const unsigned long long resultIndex = ((unsigned long long)(index_cosine) * (unsigned long long)(context.n_energies) + (unsigned long long)(index_energy))
+                                        * context.resultCellStride;
+                    result[resultIndex + (unsigned long long)(slot) * context.resultChannelStride] = FLOAT_T(0.0);
+                }
+            }
+        }
+
+        /*
+         * Vectorized host version of calculate(..) for the blocks of energies of task of hypothesis index_hypothesis.
+         * Uses the precomputed matter solution blocks instead of context.matterSolutions
+         */
+        template<typename FLOAT_T>
+        CPUDISPATCHQUALIFIER
+        void calculatePathBlocks(const OscillationContext<FLOAT_T>& context,
+                                const MatterSolutionBlock<FLOAT_T>* const blocks,
+                                FLOAT_T* const resultList,
+                                int index_hypothesis,
+                                const PathTask& task){
+
+            constexpr int W = SimdWidth<FLOAT_T>::value;
+
+            const int n_energies = context.n_energies;
+            const int n_densities = context.n_densities;
+            const int n_parameters = context.n_parameters;
+            const int n_variants = context.n_densityVariants;
+            const int n_blocks = getEnergyBlockCount<FLOAT_T>(n_energies);
+
+            const int index_path = task.index_path;
+            const int index_cosine = context.pathOrder != nullptr ? context.pathOrder[index_path] : index_path;
+            const int index_type = index_hypothesis / (n_parameters * n_variants);
+            const int index_parameter = (index_hypothesis / n_variants) % n_parameters;
+            const int index_variant = index_hypothesis % n_variants;
+            const int index_solutions = index_type * n_parameters + index_parameter; // matter solutions of all variants
+
+            FLOAT_T* const result = getHypothesisResults(context, resultList, index_hypothesis);
+
+            // precomputed path geometry of this cosine
+            const FLOAT_T* const layerDistances = context.layerDistances + (unsigned long long)(index_cosine) * (unsigned long long)(context.layerStride);
+            const int* const layerDensityIndices = context.layerDensityIndices + (unsigned long long)(index_variant) * context.layerVariantStride
+                                                    + (unsigned long long)(index_cosine) * (unsigned long long)(context.layerStride);
+            const int MaxLayer = context.maxlayers[index_cosine];
+
+            FLOAT_T TransitionMatrixRe[3][3][W], TransitionMatrixIm[3][3][W];
+            FLOAT_T TransitionMatrixCoreToMantleRe[3][3][W], TransitionMatrixCoreToMantleIm[3][3][W];
+            FLOAT_T finalTransitionMatrixRe[3][3][W], finalTransitionMatrixIm[3][3][W];
+            FLOAT_T TransitionTempRe[3][3][W], TransitionTempIm[3][3][W];
+
+            for(int index_block = task.firstBlock; index_block < task.endBlock; index_block++){
+
+                // precomputed matter solutions of this type, hypothesis and block of energies
+                const MatterSolutionBlock<FLOAT_T>* const solutionBlocks = blocks
+                            + ((unsigned long long)(index_solutions) * (unsigned long long)(n_blocks) + (unsigned long long)(index_block))
+                                * (unsigned long long)(n_densities);
+
+                FLOAT_T probabilities[3][3][W];
+
+                // energies of this block. The last block may be incomplete
+                const int n_lanes = std::min(W, n_energies - index_block * W);
+
+                if(MaxLayer == 0){
+                    // down-going path through the atmosphere only. The vacuum solution does not need matrix products
+                    const ParameterSet<FLOAT_T>& parameters = context.parameterList[index_parameter];
+
+                    FLOAT_T inverseEnergies[W];
+                    for(int w = 0; w < W; w++)
+                        inverseEnergies[w] = FLOAT_T(1.0) / context.energylist[index_block * W + std::min(w, n_lanes - 1)];
+
+                    for (int inflv = 0 ; inflv < 3 ; inflv++ )
+                        for (int outflv = 0 ; outflv < 3 ; outflv++ )
+                            for(int w = 0; w < W; w++)
+                                probabilities[inflv][outflv][w] = 0.0;
+
+                    if(context.n_heightSamples > 0){
+                        const unsigned long long heightOffset = (unsigned long long)(index_cosine) * (unsigned long long)(context.n_heightSamples);
+
+                        for(int k = 0; k < context.n_heightSamples; k++){
+                            accumulateVacuumProbabilities_lanes(parameters, inverseEnergies, context.heightDistances[heightOffset + k],
+                                                                context.heightWeights[heightOffset + k], context.channelSlots, probabilities);
+                        }
+                    }else{
+                        accumulateVacuumProbabilities_lanes(parameters, inverseEnergies, layerDistances[0], FLOAT_T(1.0), context.channelSlots, probabilities);
+                    }
+                }else{
+                    // set TransitionMatrixCoreToMantle to unit matrix
+                    for(int i = 0; i < 3; i++){
+                        for(int j = 0; j < 3; j++){
+                            for(int w = 0; w < W; w++){
+                                TransitionMatrixCoreToMantleRe[i][j][w] = (i == j ? 1.0 : 0.0);
+                                TransitionMatrixCoreToMantleIm[i][j][w] = 0.0;
+                            }
+                        }
+                    }
+
+                    // if the probabilities are averaged over production heights, the vacuum layer is applied per height below.
+                    // the product of the other layers does not depend on the height and starts from the unit matrix
+                    const int firstLayer = context.n_heightSamples > 0 ? 1 : 0;
+                    if(firstLayer > 0){
+                        for(int i = 0; i < 3; i++){
+                            for(int j = 0; j < 3; j++){
+                                for(int w = 0; w < W; w++){
+                                    finalTransitionMatrixRe[i][j][w] = (i == j ? 1.0 : 0.0);
+                                    finalTransitionMatrixIm[i][j][w] = 0.0;
+                                }
+                            }
+                        }
+                    }
+
+                    // loop from vacuum layer to innermost crossed layer
+                    for (int i = firstLayer; i <= MaxLayer ; i++ ){
+                        getA_lanes(solutionBlocks[layerDensityIndices[i]], layerDistances[i], TransitionMatrixRe, TransitionMatrixIm);
+
+                        if (i == 0){    // atmosphere
+                            math::copy_complex_matrix_lanes<FLOAT_T, W>(TransitionMatrixRe, TransitionMatrixIm, finalTransitionMatrixRe, finalTransitionMatrixIm);
+                        }else if(i < MaxLayer){ // not the innermost layer, can reuse current TransitionMatrix
+                            math::multiply_complex_matrix_lanes<FLOAT_T, W>(TransitionMatrixRe, TransitionMatrixIm, finalTransitionMatrixRe, finalTransitionMatrixIm,
+                                                                            TransitionTempRe, TransitionTempIm);
+                            math::copy_complex_matrix_lanes<FLOAT_T, W>(TransitionTempRe, TransitionTempIm, finalTransitionMatrixRe, finalTransitionMatrixIm);
+
+                            math::multiply_complex_matrix_lanes<FLOAT_T, W>(TransitionMatrixCoreToMantleRe, TransitionMatrixCoreToMantleIm, TransitionMatrixRe, TransitionMatrixIm,
+                                                                            TransitionTempRe, TransitionTempIm);
+                            math::copy_complex_matrix_lanes<FLOAT_T, W>(TransitionTempRe, TransitionTempIm, TransitionMatrixCoreToMantleRe, TransitionMatrixCoreToMantleIm);
+                        }else{ // innermost layer
+                            math::multiply_complex_matrix_lanes<FLOAT_T, W>(TransitionMatrixRe, TransitionMatrixIm, finalTransitionMatrixRe, finalTransitionMatrixIm,
+                                                                            TransitionTempRe, TransitionTempIm);
+                            math::copy_complex_matrix_lanes<FLOAT_T, W>(TransitionTempRe, TransitionTempIm, finalTransitionMatrixRe, finalTransitionMatrixIm);
+                        }
+                    }
+
+                    // calculate final transition matrix
+                    math::multiply_complex_matrix_lanes<FLOAT_T, W>(TransitionMatrixCoreToMantleRe, TransitionMatrixCoreToMantleIm, finalTransitionMatrixRe, finalTransitionMatrixIm,
+                                                                    TransitionTempRe, TransitionTempIm);
+
+                    if(firstLayer > 0){
+                        // weighted average over the production heights. the earth matrix is kept in finalTransitionMatrix
+                        math::copy_complex_matrix_lanes<FLOAT_T, W>(TransitionTempRe, TransitionTempIm, finalTransitionMatrixRe, finalTransitionMatrixIm);
+
+                        const unsigned long long heightOffset = (unsigned long long)(index_cosine) * (unsigned long long)(context.n_heightSamples);
+
+                        for (int inflv = 0 ; inflv < 3 ; inflv++ )
+                            for (int outflv = 0 ; outflv < 3 ; outflv++ )
+                                for(int w = 0; w < W; w++)
+                                    probabilities[inflv][outflv][w] = 0.0;
+
+                        for(int k = 0; k < context.n_heightSamples; k++){
+                            getA_lanes(solutionBlocks[layerDensityIndices[0]], context.heightDistances[heightOffset + k], TransitionMatrixRe, TransitionMatrixIm);
+
+                            math::multiply_complex_matrix_lanes<FLOAT_T, W>(finalTransitionMatrixRe, finalTransitionMatrixIm, TransitionMatrixRe, TransitionMatrixIm,
+                                                                            TransitionTempRe, TransitionTempIm);
+
+                            const FLOAT_T weight = context.heightWeights[heightOffset + k];
+
+                            for (int inflv = 0 ; inflv < 3 ; inflv++ ){
+                                for (int outflv = 0 ; outflv < 3 ; outflv++ ){
+                                    #pragma omp simd
+                                    for(int w = 0; w < W; w++){
+                                        const FLOAT_T re = TransitionTempRe[outflv][inflv][w];
+                                        const FLOAT_T im = TransitionTempIm[outflv][inflv][w];
+                                        probabilities[inflv][outflv][w] += weight * (re * re + im * im);
+                                    }
+                                }
+                            }
+                        }
+                    }else{
+                        for (int inflv = 0 ; inflv < 3 ; inflv++ ){
+                            for (int outflv = 0 ; outflv < 3 ; outflv++ ){
+                                #pragma omp simd
+                                for(int w = 0; w < W; w++){
+                                    const FLOAT_T re = TransitionTempRe[outflv][inflv][w];
+                                    const FLOAT_T im = TransitionTempIm[outflv][inflv][w];
+                                    probabilities[inflv][outflv][w] = re * re + im * im;
+                                }
+                            }
+                        }
+                    }
+                }
+
+                // store the requested probabilities of the valid lanes
+                for (int inflv = 0 ; inflv < 3 ; inflv++ ){
+                    for (int outflv = 0 ; outflv < 3 ; outflv++ ){
+                        const int slot = context.channelSlots[inflv * 3 + outflv];
+                        if(slot < 0)
+                            continue;
+
+                        for(int w = 0; w < n_lanes; w++){
+                            const int index_energy = index_block * W + w;
+
+                            const unsigned long long resultIndex = ((unsigned long long)(index_cosine) * (unsigned long long)(n_energies) + (unsigned long long)(index_energy))
+                                                * context.resultCellStride;
+                            result[resultIndex + (unsigned long long)(slot) * context.resultChannelStride] = probabilities[inflv][outflv][w];
+                        }
+                    }
+                }
+            }
+        }
+
+        /*
+         * Vectorized host version of calculate(..). Produces the same results, using the precomputed matter solution blocks
+         * instead of context.matterSolutions. blocks must hold n_types * n_parameters * getEnergyBlockCount(n_energies) * n_densities blocks.
+         * The tasks of each hypothesis, see getPathTasks, are run by scheduler. If placeResults is set, the results are a new buffer
+         * whose pages are first written by the threads which calculate them, see TaskScheduler::parallelForStatic
+         */
+        template<typename FLOAT_T>
+        void calculateVectorized(NeutrinoType type,
+                                const OscillationContext<FLOAT_T>& context,
+                                MatterSolutionBlock<FLOAT_T>* const blocks,
+                                FLOAT_T* const resultList,
+                                TaskScheduler& scheduler,
+                                bool placeResults){
+
+            const int n_hypotheses = context.n_types * context.n_parameters * context.n_densityVariants;
+
+            std::vector<PathTask> tasks;
+            getPathTasks(context, n_hypotheses, scheduler.getThreadCount(), tasks);
+
+            const std::int64_t n_pathTasks = tasks.size();
+            const std::int64_t n_tasks = std::int64_t(n_hypotheses) * n_pathTasks;
+
+            if(placeResults){
+                scheduler.parallelForStatic(n_tasks, [&](std::int64_t index_task, int){
+                    clearPathBlocks(context, resultList, int(index_task / n_pathTasks), tasks[index_task % n_pathTasks]);
+                });
+            }
+
+            calculateMatterSolutionBlocks(type, context, blocks, scheduler);
+
+            scheduler.parallelFor(n_tasks, [&](std::int64_t index_task, int){
+                calculatePathBlocks(context, blocks, resultList, int(index_task / n_pathTasks), tasks[index_task % n_pathTasks]);
+            });
+        }
+
+    } // namespace physics
+
+} // namespace cudaprob3
+
+#endif
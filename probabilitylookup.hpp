@@ -0,0 +1,437 @@
+/*
+This file is part of CUDAProb3++.
+
+CUDAProb3++ is free software: you can redistribute it and/or modify
+it under the terms of the GNU Lesser General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+CUDAProb3++ is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public License
+along with CUDAProb3++.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef CUDAPROB3_PROBABILITYLOOKUP_HPP
+#define CUDAPROB3_PROBABILITYLOOKUP_HPP
+
+#include "constants.hpp"
+#include "hpc_helpers.cuh"
+#include "propagator.hpp"
+#include "threadpool.hpp"
+#include "types.hpp"
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <cstdint>
+#include <memory>
+#include <stdexcept>
+#include <utility>
+#include <vector>
+
+/*
+ * Interpolation of the probabilities of a calculated grid at arbitrary (cosine, energy) points, e.g. to weight events.
+ *
+ * The grid is interpolated in cosine and log(energy). The axes need not be uniform: each axis has a table of buckets of
+ * equal width which gives the first node of each bucket, so locating a point takes a few comparisons independent of the
+ * number of nodes. Points outside of the grid are clamped to its edges.
+ *
+ * The functions of namespace lookup are shared by ProbabilityLookup on the host and CudaProbabilityLookup on the GPU.
+ * They read the grid through a fetch functor which returns the probability of node (index_cosine, index_energy).
+ */
+
+namespace cudaprob3{
+
+    /// \brief Interpolation method of ProbabilityLookup and CudaProbabilityLookup
+    enum class Interpolation {
+        Bilinear, ///< linear in cosine and log(energy)
+        Bicubic ///< cubic Hermite in cosine and log(energy), with slopes from the neighbouring nodes. The result is clamped to [0, 1]
+    };
+
+    /// \brief Energy nodes (GeV) whose density follows the oscillation phase of the longest path through the earth
+    /// \details The density of the nodes in log(energy) is proportional to 1 + phi(E) / pi, where
+    /// phi(E) = 1.267 dm2sq L / E is the oscillation phase for the earth diameter L. Fast oscillations at low energies get more
+    /// nodes than a logarithmic grid of the same size, while high energies keep a minimum density. The phase depends smoothly on
+    /// the cosine, so uniform cosine nodes are appropriate for the other axis
+    /// @param emin Lowest energy (GeV)
+    /// @param emax Highest energy (GeV)
+    /// @param n Number of nodes, at least 2
+    /// @param dm2sq Largest mass difference (eV)^2
+    template<class FLOAT_T>
+    std::vector<FLOAT_T> getOscillationAwareEnergyList(FLOAT_T emin, FLOAT_T emax, int n, FLOAT_T dm2sq = 2.5e-3){
+        if(!(emin > 0) || !(emax > emin) || n < 2)
+            throw std::runtime_error("getOscillationAwareEnergyList. Requires 0 < emin < emax and n >= 2");
+
+        const double diameter = 2.0 * Constants<double>::REarth();
+        const double umin = std::log(double(emin));
+        const double umax = std::log(double(emax));
+        auto density = [&](double u){
+            return 1.0 + 1.267 * std::abs(double(dm2sq)) * diameter / std::exp(u) / M_PI;
+        };
+
+        // cumulative node density on a fine uniform grid of log(energy), which is inverted at equally spaced quantiles
+        const int n_fine = 64 * n;
+        std::vector<double> cumulative(n_fine + 1, 0.0);
+        const double du = (umax - umin) / n_fine;
+        for(int i = 0; i < n_fine; i++)
+            cumulative[i + 1] = cumulative[i] + 0.5 * du * (density(umin + i * du) + density(umin + (i + 1) * du));
+
+        std::vector<FLOAT_T> list(n);
+        int i = 0;
+        for(int k = 0; k < n; k++){
+            const double target = cumulative[n_fine] * k / (n - 1);
+            while(i < n_fine - 1 && cumulative[i + 1] < target)
+                i++;
+            const double fraction = (target - cumulative[i]) / (cumulative[i + 1] - cumulative[i]);
+            list[k] = FLOAT_T(std::exp(umin + (i + std::min(1.0, std::max(0.0, fraction))) * du));
+        }
+        list[0] = emin;
+        list[n - 1] = emax;
+
+        return list;
+    }
+
+namespace lookup{
+
+    // nodes of an interpolation axis with its bucket table
+    template<class FLOAT_T>
+    struct LookupAxis{
+        const FLOAT_T* nodes; // strictly increasing
+        const int* buckets; // for each bucket, the last node which is not larger than the begin of the bucket
+        int n_nodes;
+        int n_buckets;
+        FLOAT_T first; // nodes[0]
+        FLOAT_T last; // nodes[n_nodes - 1]
+        FLOAT_T inverseBucketWidth;
+    };
+
+    // fill the bucket table of nodes. The table has 4 buckets per node
+    template<class FLOAT_T>
+    std::vector<int> makeBuckets(const std::vector<FLOAT_T>& nodes){
+        const int n_buckets = 4 * int(nodes.size());
+        const FLOAT_T width = (nodes.back() - nodes.front()) / n_buckets;
+
+        std::vector<int> buckets(n_buckets);
+        int i = 0;
+        for(int b = 0; b < n_buckets; b++){
+            const FLOAT_T begin = nodes.front() + b * width;
+            while(i < int(nodes.size()) - 2 && nodes[i + 1] <= begin)
+                i++;
+            buckets[b] = i;
+        }
+        return buckets;
+    }
+
+    template<class FLOAT_T>
+    LookupAxis<FLOAT_T> makeAxis(const FLOAT_T* nodes, const int* buckets, int n_nodes, FLOAT_T first, FLOAT_T last){
+        LookupAxis<FLOAT_T> axis;
+        axis.nodes = nodes;
+        axis.buckets = buckets;
+        axis.n_nodes = n_nodes;
+        axis.n_buckets = 4 * n_nodes;
+        axis.first = first;
+        axis.last = last;
+        axis.inverseBucketWidth = axis.n_buckets / (last - first);
+        return axis;
+    }
+
+    // index i of the interval [nodes[i], nodes[i+1]] which contains x, and the position t in [0, 1] within the interval.
+    // x is clamped to the axis. NaN is treated as the first node
+    template<class FLOAT_T>
+    HOSTDEVICEQUALIFIER
+    int locate(const LookupAxis<FLOAT_T>& axis, FLOAT_T x, FLOAT_T& t){
+        if(!(x > axis.first)) x = axis.first;
+        if(x > axis.last) x = axis.last;
+
+        int bucket = int((x - axis.first) * axis.inverseBucketWidth);
+        if(bucket > axis.n_buckets - 1) bucket = axis.n_buckets - 1;
+
+        int i = axis.buckets[bucket];
+        while(i < axis.n_nodes - 2 && axis.nodes[i + 1] <= x)
+            i++;
+
+        t = (x - axis.nodes[i]) / (axis.nodes[i + 1] - axis.nodes[i]);
+        return i;
+    }
+
+    template<class FLOAT_T, class Fetch>
+    HOSTDEVICEQUALIFIER
+    FLOAT_T interpolateBilinear(const Fetch& fetch, int index_cosine, FLOAT_T tc, int index_energy, FLOAT_T te){
+        const FLOAT_T p00 = fetch(index_cosine, index_energy);
+        const FLOAT_T p01 = fetch(index_cosine, index_energy + 1);
+        const FLOAT_T p10 = fetch(index_cosine + 1, index_energy);
+        const FLOAT_T p11 = fetch(index_cosine + 1, index_energy + 1);
+
+        const FLOAT_T p0 = p00 + te * (p01 - p00);
+        const FLOAT_T p1 = p10 + te * (p11 - p10);
+        return p0 + tc * (p1 - p0);
+    }
+
+    // cubic Hermite interpolation in [x1, x2] of the values y0..y3 at nodes with spacings h0 = x1 - x0, h1 = x2 - x1, h2 = x3 - x2.
+    // The slope at an inner node is the weighted average of the adjacent secants, which is exact for quadratics.
+    // At the edges of the axis (hasLeft or hasRight false) the secant of the interval is used
+    template<class FLOAT_T>
+    HOSTDEVICEQUALIFIER
+    FLOAT_T cubicHermite(FLOAT_T y0, FLOAT_T y1, FLOAT_T y2, FLOAT_T y3, FLOAT_T h0, FLOAT_T h1, FLOAT_T h2,
+                            bool hasLeft, bool hasRight, FLOAT_T t){
+        const FLOAT_T s1 = (y2 - y1) / h1;
+        const FLOAT_T m1 = hasLeft ? ((y1 - y0) / h0 * h1 + s1 * h0) / (h0 + h1) : s1;
+        const FLOAT_T m2 = hasRight ? (s1 * h2 + (y3 - y2) / h2 * h1) / (h1 + h2) : s1;
+
+        const FLOAT_T t2 = t * t;
+        const FLOAT_T t3 = t2 * t;
+
+        return (FLOAT_T(2) * t3 - FLOAT_T(3) * t2 + FLOAT_T(1)) * y1
+                + (t3 - FLOAT_T(2) * t2 + t) * h1 * m1
+                + (FLOAT_T(3) * t2 - FLOAT_T(2) * t3) * y2
+                + (t3 - t2) * h1 * m2;
+    }
+
+    template<class FLOAT_T, class Fetch>
+    HOSTDEVICEQUALIFIER
+    FLOAT_T interpolateBicubic(const Fetch& fetch, const LookupAxis<FLOAT_T>& cosineAxis, int index_cosine, FLOAT_T tc,
+                                const LookupAxis<FLOAT_T>& energyAxis, int index_energy, FLOAT_T te){
+
+        const FLOAT_T* ce = energyAxis.nodes;
+        const bool eLeft = index_energy > 0;
+        const bool eRight = index_energy + 2 < energyAxis.n_nodes;
+        const int e0 = eLeft ? index_energy - 1 : index_energy;
+        const int e3 = eRight ? index_energy + 2 : index_energy + 1;
+        const FLOAT_T he0 = eLeft ? ce[index_energy] - ce[e0] : FLOAT_T(1);
+        const FLOAT_T he1 = ce[index_energy + 1] - ce[index_energy];
+        const FLOAT_T he2 = eRight ? ce[e3] - ce[index_energy + 1] : FLOAT_T(1);
+
+        const FLOAT_T* cc = cosineAxis.nodes;
+        const bool cLeft = index_cosine > 0;
+        const bool cRight = index_cosine + 2 < cosineAxis.n_nodes;
+        const int c0 = cLeft ? index_cosine - 1 : index_cosine;
+        const int c3 = cRight ? index_cosine + 2 : index_cosine + 1;
+        const FLOAT_T hc0 = cLeft ? cc[index_cosine] - cc[c0] : FLOAT_T(1);
+        const FLOAT_T hc1 = cc[index_cosine + 1] - cc[index_cosine];
+        const FLOAT_T hc2 = cRight ? cc[c3] - cc[index_cosine + 1] : FLOAT_T(1);
+
+        const int rows[4] = {c0, index_cosine, index_cosine + 1, c3};
+        FLOAT_T values[4];
+
+        for(int k = 0; k < 4; k++){
+            values[k] = cubicHermite(fetch(rows[k], e0), fetch(rows[k], index_energy), fetch(rows[k], index_energy + 1), fetch(rows[k], e3),
+                                        he0, he1, he2, eLeft, eRight, te);
+        }
+
+        const FLOAT_T p = cubicHermite(values[0], values[1], values[2], values[3], hc0, hc1, hc2, cLeft, cRight, tc);
+
+        return p < FLOAT_T(0) ? FLOAT_T(0) : (p > FLOAT_T(1) ? FLOAT_T(1) : p);
+    }
+
+    // check the grid of a propagator and return its nodes in cosine and log(energy)
+    template<class FLOAT_T>
+    void getLookupNodes(const Propagator<FLOAT_T>& propagator, std::vector<FLOAT_T>& cosineNodes, std::vector<FLOAT_T>& energyNodes){
+        cosineNodes = propagator.getCosineList();
+        energyNodes = propagator.getEnergyList();
+
+        if(cosineNodes.size() < 2 || energyNodes.size() < 2)
+            throw std::runtime_error("ProbabilityLookup. The grid must have at least 2 cosine and 2 energy bins");
+
+        for(std::size_t i = 0; i < energyNodes.size(); i++){
+            if(!(energyNodes[i] > 0))
+                throw std::runtime_error("ProbabilityLookup. The energies must be positive");
+            energyNodes[i] = std::log(energyNodes[i]);
+        }
+
+        auto isIncreasing = [](const std::vector<FLOAT_T>& nodes){
+            for(std::size_t i = 1; i < nodes.size(); i++)
+                if(!(nodes[i] > nodes[i - 1]))
+                    return false;
+            return true;
+        };
+
+        if(!isIncreasing(cosineNodes) || !isIncreasing(energyNodes))
+            throw std::runtime_error("ProbabilityLookup. The cosine list and the energy list must be strictly increasing");
+    }
+
+} // namespace lookup
+
+    /// \class ProbabilityLookup
+    /// \brief Interpolates the probabilities of a calculated grid on the host
+    /// \details The probabilities of all requested ProbTypes and calculated neutrino types are copied from the propagator, which can be
+    /// used for other calculations afterwards. Call update after a new calculation to refresh the lookup.
+    /// Events are processed in blocks: the nodes of all events of a block are located first, then the block is interpolated in a
+    /// vectorizable loop. Blocks are run by a TaskScheduler, e.g. the one of a CpuPropagator, or by the calling thread without a scheduler
+    /// @param FLOAT_T The floating point type to use for calculations, i.e float, double
+    template<class FLOAT_T>
+    class ProbabilityLookup{
+    public:
+        /// \brief Constructor
+        /// @param propagator Propagator with a finished calculation. The cosine list and the energy list must be strictly increasing
+        /// @param index_batch Hypothesis of a batch calculation, or 0 for a grid calculation
+        /// @param scheduler_ Scheduler which runs the blocks of events, see setScheduler
+        explicit ProbabilityLookup(Propagator<FLOAT_T>& propagator, int index_batch = 0, std::shared_ptr<TaskScheduler> scheduler_ = nullptr)
+                : scheduler(std::move(scheduler_)){
+            update(propagator, index_batch);
+        }
+
+        /// \brief Set the scheduler which runs the blocks of events of evaluate
+        /// @param scheduler_ The scheduler, or nullptr to evaluate all events on the calling thread
+        void setScheduler(std::shared_ptr<TaskScheduler> scheduler_){
+            scheduler = std::move(scheduler_);
+        }
+
+        /// \brief Get the scheduler which runs the blocks of events, or nullptr
+        std::shared_ptr<TaskScheduler> getScheduler() const{
+            return scheduler;
+        }
+
+        /// \brief Copy the probabilities of the last calculation of propagator. The grid may differ from the previous one
+        /// @param propagator Propagator with a finished calculation
+        /// @param index_batch Hypothesis of a batch calculation, or 0 for a grid calculation
+        void update(Propagator<FLOAT_T>& propagator, int index_batch = 0){
+            lookup::getLookupNodes(propagator, cosineNodes, energyNodes);
+            cosineBuckets = lookup::makeBuckets(cosineNodes);
+            energyBuckets = lookup::makeBuckets(energyNodes);
+
+            n_cosines = cosineNodes.size();
+            n_energies = energyNodes.size();
+            const std::uint64_t n_cells = std::uint64_t(n_cosines) * n_energies;
+
+            n_slots = 0;
+            for(int index_type = 0; index_type < 2; index_type++){
+                const NeutrinoType type = NeutrinoType(index_type);
+
+                for(int t = 0; t < 9; t++){
+                    const bool available = propagator.isCalculatedType(type) && propagator.isRequestedChannel(ProbType(t));
+                    slots[index_type * 9 + t] = available ? n_slots++ : -1;
+                }
+            }
+
+            if(n_slots == 0)
+                throw std::runtime_error("ProbabilityLookup::update. The propagator has no results");
+
+            table.resize(n_slots * n_cells);
+
+            for(int index_type = 0; index_type < 2; index_type++){
+                for(int t = 0; t < 9; t++){
+                    const int slot = slots[index_type * 9 + t];
+                    if(slot < 0)
+                        continue;
+
+                    FLOAT_T* const out = table.data() + slot * n_cells;
+                    for(int index_cosine = 0; index_cosine < n_cosines; index_cosine++){
+                        for(int index_energy = 0; index_energy < n_energies; index_energy++){
+                            out[std::uint64_t(index_cosine) * n_energies + index_energy] = index_batch == 0
+                                ? propagator.getProbability(index_cosine, index_energy, ProbType(t), NeutrinoType(index_type))
+                                : propagator.getBatchProbability(index_batch, index_cosine, index_energy, ProbType(t), NeutrinoType(index_type));
+                        }
+                    }
+                }
+            }
+        }
+
+        /// \brief Check if the lookup contains the probability t of type
+        bool contains(ProbType t, NeutrinoType type) const{
+            return slots[int(type) * 9 + int(t)] >= 0;
+        }
+
+        /// \brief Interpolate the probability t of type for a list of events
+        /// @param t ProbType
+        /// @param type Neutrino or Antineutrino
+        /// @param n_events Number of events
+        /// @param cosines Cosine of each event
+        /// @param energies Energy (GeV) of each event
+        /// @param result Output with space for n_events probabilities
+        /// @param interpolation Bilinear or Bicubic
+        void evaluate(ProbType t, NeutrinoType type, std::uint64_t n_events, const FLOAT_T* cosines, const FLOAT_T* energies,
+                        FLOAT_T* result, Interpolation interpolation = Interpolation::Bilinear) const{
+
+            const FLOAT_T* const grid = getGrid(t, type);
+            const lookup::LookupAxis<FLOAT_T> cosineAxis = getCosineAxis();
+            const lookup::LookupAxis<FLOAT_T> energyAxis = getEnergyAxis();
+            const int n_e = n_energies;
+
+            auto fetch = [grid, n_e](int index_cosine, int index_energy){
+                return grid[std::uint64_t(index_cosine) * n_e + index_energy];
+            };
+
+            const std::int64_t n_blocks = std::int64_t(SDIV(n_events, std::uint64_t(eventBlockSize)));
+
+            auto evaluateBlock = [&](std::int64_t block, int){
+                const std::uint64_t first = std::uint64_t(block) * eventBlockSize;
+                const int n = int(std::min(std::uint64_t(eventBlockSize), n_events - first));
+
+                int cosineIndices[eventBlockSize];
+                int energyIndices[eventBlockSize];
+                FLOAT_T tc[eventBlockSize];
+                FLOAT_T te[eventBlockSize];
+
+                for(int k = 0; k < n; k++){
+                    cosineIndices[k] = lookup::locate(cosineAxis, cosines[first + k], tc[k]);
+                    energyIndices[k] = lookup::locate(energyAxis, FLOAT_T(std::log(energies[first + k])), te[k]);
+                }
+
+                if(interpolation == Interpolation::Bilinear){
+                    #pragma omp simd
+                    for(int k = 0; k < n; k++)
+                        result[first + k] = lookup::interpolateBilinear(fetch, cosineIndices[k], tc[k], energyIndices[k], te[k]);
+                }else{
+                    for(int k = 0; k < n; k++)
+                        result[first + k] = lookup::interpolateBicubic(fetch, cosineAxis, cosineIndices[k], tc[k],
+                                                                        energyAxis, energyIndices[k], te[k]);
+                }
+            };
+
+            if(scheduler){
+                scheduler->parallelFor(n_blocks, evaluateBlock);
+            }else{
+                for(std::int64_t block = 0; block < n_blocks; block++)
+                    evaluateBlock(block, 0);
+            }
+        }
+
+        /// \brief Interpolate the probability t of type at a single point
+        FLOAT_T getProbability(FLOAT_T cosine, FLOAT_T energy, ProbType t, NeutrinoType type,
+                                Interpolation interpolation = Interpolation::Bilinear) const{
+            FLOAT_T result;
+            evaluate(t, type, 1, &cosine, &energy, &result, interpolation);
+            return result;
+        }
+
+        int getCosineCount() const{ return n_cosines; }
+        int getEnergyCount() const{ return n_energies; }
+
+    private:
+        static constexpr int eventBlockSize = 256;
+
+        const FLOAT_T* getGrid(ProbType t, NeutrinoType type) const{
+            const int slot = slots[int(type) * 9 + int(t)];
+            if(slot < 0)
+                throw std::runtime_error("ProbabilityLookup::evaluate. ProbType or NeutrinoType was not calculated");
+
+            return table.data() + std::uint64_t(slot) * n_cosines * n_energies;
+        }
+
+        lookup::LookupAxis<FLOAT_T> getCosineAxis() const{
+            return lookup::makeAxis(cosineNodes.data(), cosineBuckets.data(), n_cosines, cosineNodes.front(), cosineNodes.back());
+        }
+
+        lookup::LookupAxis<FLOAT_T> getEnergyAxis() const{
+            return lookup::makeAxis(energyNodes.data(), energyBuckets.data(), n_energies, energyNodes.front(), energyNodes.back());
+        }
+
+        std::vector<FLOAT_T> cosineNodes;
+        std::vector<FLOAT_T> energyNodes; // log(energy)
+        std::vector<int> cosineBuckets;
+        std::vector<int> energyBuckets;
+        std::vector<FLOAT_T> table; // [slot][cosine][energy]
+        std::array<int, 18> slots; // for each type and ProbType, the slot in table, or -1
+        int n_slots = 0;
+        int n_cosines = 0;
+        int n_energies = 0;
+        std::shared_ptr<TaskScheduler> scheduler; // runs the blocks of events of evaluate, or nullptr for the calling thread
+    };
+
+} // namespace cudaprob3
+
+#endif
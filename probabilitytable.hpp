@@ -0,0 +1,413 @@
+/*
+This file is part of CUDAProb3++.
+
+CUDAProb3++ is free software: you can redistribute it and/or modify
+it under the terms of the GNU Lesser General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+CUDAProb3++ is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public License
+along with CUDAProb3++.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef CUDAPROB3_PROBABILITYTABLE_HPP
+#define CUDAPROB3_PROBABILITYTABLE_HPP
+
+#include "types.hpp"
+
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <functional>
+#include <stdexcept>
+#include <string>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/*
+ * Binary file format of calculated probability tables, version 1. All values are stored in the native byte order.
+ *
+ * The file starts with a ProbabilityTableHeader, followed by the sections energies, cosines, radii, rhos, production heights
+ * and production height weights as arrays of FLOAT_T, and the probabilities as array of FLOAT_T in the order
+ * [type][channel][cosine][energy], where channel enumerates the requested ProbTypes in ascending order.
+ * Each section starts at a multiple of 64 bytes, its offset is stored in the header. Empty sections have size 0.
+ *
+ * Files are written to a temporary file which is renamed afterwards, so readers never see partially written tables.
+ * ProbabilityTable maps a file into memory and reads the probabilities without copies.
+ */
+
+namespace cudaprob3{
+
+    constexpr std::uint32_t probabilityTableVersion = 1;
+
+    /// \brief Header of a binary probability table
+    struct ProbabilityTableHeader{
+        char magic[8]; ///< "CP3TABLE"
+        std::uint32_t version; ///< file format version, see probabilityTableVersion
+        std::uint32_t floatBytes; ///< size of the floating point type of all sections
+        std::uint32_t mixedPrecision; ///< 1 if the probabilities were calculated in the mixed precision mode of the GPU propagators
+        std::int32_t n_cosines; ///< number of cosine bins
+        std::int32_t n_energies; ///< number of energy bins
+        std::int32_t n_layers; ///< number of layers of the density model
+        std::int32_t n_heightSamples; ///< production heights per cosine bin, or 0 if a single production height was used
+        std::int32_t n_types; ///< number of neutrino types. 2 means Neutrino followed by Antineutrino
+        std::int32_t type; ///< NeutrinoType of the probabilities if n_types == 1
+        std::int32_t n_channels; ///< number of stored ProbTypes
+        std::int32_t channels[9]; ///< stored ProbTypes in ascending order. Unused entries are -1
+        double productionHeight; ///< production height in km if n_heightSamples == 0
+        double mixingAngles[4]; ///< theta12, theta13, theta23, dCP in radians
+        double massDifferences[2]; ///< dm12sq, dm23sq in (eV)^2
+        std::uint64_t inputHash; ///< hash of all inputs of the calculation, see Propagator::setResultCacheDirectory
+        std::uint64_t energiesOffset; ///< byte offset of the energy list (GeV)
+        std::uint64_t cosinesOffset; ///< byte offset of the cosine list
+        std::uint64_t radiiOffset; ///< byte offset of the layer radii (km)
+        std::uint64_t rhosOffset; ///< byte offset of the layer densities (g/cm^3)
+        std::uint64_t heightsOffset; ///< byte offset of the production heights (km), n_heightSamples per cosine
+        std::uint64_t weightsOffset; ///< byte offset of the normalized production height weights, n_heightSamples per cosine
+        std::uint64_t probabilitiesOffset; ///< byte offset of the probabilities
+        std::uint64_t fileSize; ///< size of the file in bytes
+    };
+
+    static_assert(std::is_standard_layout<ProbabilityTableHeader>::value, "ProbabilityTableHeader must be standard layout");
+
+    /// \brief 64 bit FNV-1a hash, used to identify the inputs of a calculation
+    class InputHash{
+    public:
+        void add(const void* data, std::size_t bytes){
+            const unsigned char* bytePtr = static_cast<const unsigned char*>(data);
+            for(std::size_t i = 0; i < bytes; i++){
+                hash ^= bytePtr[i];
+                hash *= 1099511628211ull;
+            }
+        }
+
+        template<class T>
+        void add(const T& value){
+            static_assert(std::is_trivially_copyable<T>::value, "InputHash::add. T must be trivially copyable");
+            add(&value, sizeof(T));
+        }
+
+        template<class T>
+        void add(const std::vector<T>& values){
+            add(std::uint64_t(values.size()));
+            add(values.data(), values.size() * sizeof(T));
+        }
+
+        std::uint64_t get() const{
+            return hash;
+        }
+
+    private:
+        std::uint64_t hash = 14695981039346656037ull;
+    };
+
+    /// \class ProbabilityTable
+    /// \brief Read-only probability table of a binary table file, which is mapped into memory
+    /// @param FLOAT_T The floating point type of the table, i.e float, double
+    template<class FLOAT_T>
+    class ProbabilityTable{
+    public:
+        /// \brief Map a table file into memory and check its header
+        /// @param filename Table file written by Propagator::save
+        explicit ProbabilityTable(const std::string& filename){
+            const int fd = open(filename.c_str(), O_RDONLY);
+            if(fd < 0)
+                throw std::runtime_error("ProbabilityTable::ProbabilityTable. Cannot open " + filename);
+
+            struct stat status;
+            if(fstat(fd, &status) != 0 || std::uint64_t(status.st_size) < sizeof(ProbabilityTableHeader)){
+                close(fd);
+                throw std::runtime_error("ProbabilityTable::ProbabilityTable. " + filename + " is not a probability table");
+            }
+
+            mappedBytes = std::size_t(status.st_size);
+            mapping = mmap(nullptr, mappedBytes, PROT_READ, MAP_SHARED, fd, 0);
+            close(fd);
+
+            if(mapping == MAP_FAILED){
+                mapping = nullptr;
+                throw std::runtime_error("ProbabilityTable::ProbabilityTable. Cannot map " + filename);
+            }
+
+            try{
+                checkHeader(filename);
+            }catch(...){
+                unmap();
+                throw;
+            }
+        }
+
+        ~ProbabilityTable(){
+            unmap();
+        }
+
+        ProbabilityTable(const ProbabilityTable&) = delete;
+        ProbabilityTable& operator=(const ProbabilityTable&) = delete;
+
+        ProbabilityTable(ProbabilityTable&& other) noexcept{
+            *this = std::move(other);
+        }
+
+        ProbabilityTable& operator=(ProbabilityTable&& other) noexcept{
+            if(this != &other){
+                unmap();
+                mapping = other.mapping;
+                mappedBytes = other.mappedBytes;
+                other.mapping = nullptr;
+                other.mappedBytes = 0;
+            }
+            return *this;
+        }
+
+        /// \brief get the header of the table
+        const ProbabilityTableHeader& getHeader() const{
+            return *static_cast<const ProbabilityTableHeader*>(mapping);
+        }
+
+        int getCosineCount() const{ return getHeader().n_cosines; }
+        int getEnergyCount() const{ return getHeader().n_energies; }
+        int getHeightSampleCount() const{ return getHeader().n_heightSamples; }
+
+        /// \brief get the number of neutrino types of the table
+        int getTypeCount() const{ return getHeader().n_types; }
+
+        /// \brief check if the table contains the probabilities of type
+        bool hasType(NeutrinoType type) const{
+            return getTypeIndex(type) >= 0;
+        }
+
+        /// \brief check if the table contains the probability t
+        bool isStoredChannel(ProbType t) const{
+            return getChannelIndex(t) >= 0;
+        }
+
+        /// \brief get the stored ProbTypes in ascending order
+        std::vector<ProbType> getChannels() const{
+            std::vector<ProbType> channels;
+            for(int i = 0; i < getHeader().n_channels; i++)
+                channels.push_back(ProbType(getHeader().channels[i]));
+            return channels;
+        }
+
+        std::vector<FLOAT_T> getEnergyList() const{ return getSection(getHeader().energiesOffset, getEnergyCount()); }
+        std::vector<FLOAT_T> getCosineList() const{ return getSection(getHeader().cosinesOffset, getCosineCount()); }
+        std::vector<FLOAT_T> getRadii() const{ return getSection(getHeader().radiiOffset, getHeader().n_layers); }
+        std::vector<FLOAT_T> getRhos() const{ return getSection(getHeader().rhosOffset, getHeader().n_layers); }
+
+        /// \brief get the production heights (km), getHeightSampleCount() per cosine bin
+        std::vector<FLOAT_T> getProductionHeightSamples() const{
+            return getSection(getHeader().heightsOffset, std::uint64_t(getCosineCount()) * getHeightSampleCount());
+        }
+
+        /// \brief get the normalized weights of the production heights, getHeightSampleCount() per cosine bin
+        std::vector<FLOAT_T> getProductionHeightWeights() const{
+            return getSection(getHeader().weightsOffset, std::uint64_t(getCosineCount()) * getHeightSampleCount());
+        }
+
+        /// \brief get a view of the probabilities t of type, which points into the mapped file
+        /// @param t Stored ProbType
+        /// @param type Stored NeutrinoType
+        ProbabilityView<FLOAT_T> getProbabilityView(ProbType t, NeutrinoType type) const{
+            const int index_type = getTypeIndex(type);
+            const int index_channel = getChannelIndex(t);
+
+            if(index_type < 0)
+                throw std::runtime_error("ProbabilityTable::getProbabilityView. The table does not contain this neutrino type");
+            if(index_channel < 0)
+                throw std::runtime_error("ProbabilityTable::getProbabilityView. The table does not contain this ProbType");
+
+            const std::uint64_t offset = (std::uint64_t(index_type) * getHeader().n_channels + index_channel) * getCellCount();
+
+            ProbabilityView<FLOAT_T> view;
+            view.data = getProbabilities() + offset;
+            view.stride = 1;
+            view.n_cosines = getCosineCount();
+            view.n_energies = getEnergyCount();
+
+            return view;
+        }
+
+        /// \brief get a view of all probabilities of the table, which points into the mapped file
+        /// \details The probabilities are stored in SoA layout. The table contains a single hypothesis
+        ResultSpan<FLOAT_T> getResultSpan() const{
+            const std::uint64_t channelResults = std::uint64_t(getHeader().n_channels) * getCellCount();
+
+            ResultSpan<FLOAT_T> span;
+            span.data = getProbabilities();
+            span.size = std::uint64_t(getTypeCount()) * channelResults;
+            span.cellStride = 1;
+            span.channelStride = getCellCount();
+            span.batchStride = channelResults;
+            span.typeStride = channelResults;
+            span.n_types = getTypeCount();
+            span.layout = SoA;
+
+            return span;
+        }
+
+        /// \brief get the probability t of type in cosine bin index_cosine and energy bin index_energy
+        FLOAT_T getProbability(int index_cosine, int index_energy, ProbType t, NeutrinoType type) const{
+            if(index_cosine < 0 || index_cosine >= getCosineCount() || index_energy < 0 || index_energy >= getEnergyCount())
+                throw std::runtime_error("ProbabilityTable::getProbability. Invalid cell");
+
+            const ProbabilityView<FLOAT_T> view = getProbabilityView(t, type);
+            return view.data[std::uint64_t(index_cosine) * getEnergyCount() + index_energy];
+        }
+
+        /// \brief Write a table file
+        /// \details The file is written to a temporary file in the same directory which is renamed to filename afterwards.
+        /// The version, magic, floatBytes, offsets and fileSize of header are set by this function
+        /// @param filename Output file
+        /// @param header Header with the grid sizes, the neutrino types, the stored channels and the oscillation parameters
+        /// @param energies, cosines, radii, rhos, heights, weights Contents of the sections
+        /// @param fillChannel Function which writes the n_cosines * n_energies probabilities of a type index and a channel index
+        ///        in the order [cosine][energy] to its third argument
+        static void write(const std::string& filename, ProbabilityTableHeader header,
+                            const std::vector<FLOAT_T>& energies, const std::vector<FLOAT_T>& cosines,
+                            const std::vector<FLOAT_T>& radii, const std::vector<FLOAT_T>& rhos,
+                            const std::vector<FLOAT_T>& heights, const std::vector<FLOAT_T>& weights,
+                            const std::function<void(int, int, FLOAT_T*)>& fillChannel){
+
+            std::memcpy(header.magic, magicString(), sizeof(header.magic));
+            header.version = probabilityTableVersion;
+            header.floatBytes = sizeof(FLOAT_T);
+
+            const std::uint64_t n_cells = std::uint64_t(header.n_cosines) * header.n_energies;
+
+            std::uint64_t offset = alignOffset(sizeof(ProbabilityTableHeader));
+            auto placeSection = [&](std::uint64_t& sectionOffset, std::uint64_t elements){
+                sectionOffset = offset;
+                offset = alignOffset(offset + elements * sizeof(FLOAT_T));
+            };
+
+            placeSection(header.energiesOffset, energies.size());
+            placeSection(header.cosinesOffset, cosines.size());
+            placeSection(header.radiiOffset, radii.size());
+            placeSection(header.rhosOffset, rhos.size());
+            placeSection(header.heightsOffset, heights.size());
+            placeSection(header.weightsOffset, weights.size());
+            header.probabilitiesOffset = offset;
+            header.fileSize = offset + std::uint64_t(header.n_types) * header.n_channels * n_cells * sizeof(FLOAT_T);
+
+            // unique among the processes which share the directory
+            char host[256] = {0};
+            gethostname(host, sizeof(host) - 1);
+            const std::string tmpname = filename + ".tmp." + host + "." + std::to_string(getpid());
+            std::FILE* file = std::fopen(tmpname.c_str(), "wb");
+            if(file == nullptr)
+                throw std::runtime_error("ProbabilityTable::write. Cannot create " + tmpname);
+
+            bool ok = true;
+            auto writeAt = [&](std::uint64_t position, const void* data, std::uint64_t bytes){
+                ok = ok && std::fseek(file, long(position), SEEK_SET) == 0;
+                ok = ok && (bytes == 0 || std::fwrite(data, 1, bytes, file) == bytes);
+            };
+
+            writeAt(0, &header, sizeof(header));
+            writeAt(header.energiesOffset, energies.data(), energies.size() * sizeof(FLOAT_T));
+            writeAt(header.cosinesOffset, cosines.data(), cosines.size() * sizeof(FLOAT_T));
+            writeAt(header.radiiOffset, radii.data(), radii.size() * sizeof(FLOAT_T));
+            writeAt(header.rhosOffset, rhos.data(), rhos.size() * sizeof(FLOAT_T));
+            writeAt(header.heightsOffset, heights.data(), heights.size() * sizeof(FLOAT_T));
+            writeAt(header.weightsOffset, weights.data(), weights.size() * sizeof(FLOAT_T));
+
+            std::vector<FLOAT_T> buffer(n_cells);
+            std::uint64_t position = header.probabilitiesOffset;
+            for(int index_type = 0; index_type < header.n_types && ok; index_type++){
+                for(int index_channel = 0; index_channel < header.n_channels && ok; index_channel++){
+                    fillChannel(index_type, index_channel, buffer.data());
+                    writeAt(position, buffer.data(), n_cells * sizeof(FLOAT_T));
+                    position += n_cells * sizeof(FLOAT_T);
+                }
+            }
+
+            ok = std::fclose(file) == 0 && ok;
+
+            if(!ok || std::rename(tmpname.c_str(), filename.c_str()) != 0){
+                std::remove(tmpname.c_str());
+                throw std::runtime_error("ProbabilityTable::write. Cannot write " + filename);
+            }
+        }
+
+    private:
+        static const char* magicString(){
+            return "CP3TABLE";
+        }
+
+        static std::uint64_t alignOffset(std::uint64_t offset){
+            return (offset + 63) / 64 * 64;
+        }
+
+        void checkHeader(const std::string& filename) const{
+            const ProbabilityTableHeader& header = getHeader();
+
+            if(std::memcmp(header.magic, magicString(), sizeof(header.magic)) != 0)
+                throw std::runtime_error("ProbabilityTable::ProbabilityTable. " + filename + " is not a probability table");
+            if(header.version != probabilityTableVersion)
+                throw std::runtime_error("ProbabilityTable::ProbabilityTable. " + filename + " has an unsupported version");
+            if(header.floatBytes != sizeof(FLOAT_T))
+                throw std::runtime_error("ProbabilityTable::ProbabilityTable. " + filename + " was written with a different floating point type");
+            if(header.fileSize != mappedBytes || header.n_cosines <= 0 || header.n_energies <= 0 || header.n_layers < 0
+                    || header.n_heightSamples < 0 || header.n_types < 1 || header.n_types > 2
+                    || header.n_channels < 1 || header.n_channels > 9)
+                throw std::runtime_error("ProbabilityTable::ProbabilityTable. " + filename + " is corrupted");
+
+            const std::uint64_t n_cells = std::uint64_t(header.n_cosines) * header.n_energies;
+            if(header.probabilitiesOffset + std::uint64_t(header.n_types) * header.n_channels * n_cells * sizeof(FLOAT_T) != header.fileSize)
+                throw std::runtime_error("ProbabilityTable::ProbabilityTable. " + filename + " is corrupted");
+        }
+
+        int getTypeIndex(NeutrinoType type) const{
+            if(getHeader().n_types == 2)
+                return type == Neutrino ? 0 : 1;
+            return int(type) == getHeader().type ? 0 : -1;
+        }
+
+        int getChannelIndex(ProbType t) const{
+            for(int i = 0; i < getHeader().n_channels; i++)
+                if(getHeader().channels[i] == int(t))
+                    return i;
+            return -1;
+        }
+
+        std::uint64_t getCellCount() const{
+            return std::uint64_t(getCosineCount()) * getEnergyCount();
+        }
+
+        const FLOAT_T* getProbabilities() const{
+            return reinterpret_cast<const FLOAT_T*>(static_cast<const char*>(mapping) + getHeader().probabilitiesOffset);
+        }
+
+        std::vector<FLOAT_T> getSection(std::uint64_t offset, std::uint64_t elements) const{
+            if(offset + elements * sizeof(FLOAT_T) > mappedBytes)
+                throw std::runtime_error("ProbabilityTable::getSection. The table is corrupted");
+
+            const FLOAT_T* begin = reinterpret_cast<const FLOAT_T*>(static_cast<const char*>(mapping) + offset);
+            return std::vector<FLOAT_T>(begin, begin + elements);
+        }
+
+        void unmap(){
+            if(mapping != nullptr)
+                munmap(mapping, mappedBytes);
+            mapping = nullptr;
+            mappedBytes = 0;
+        }
+
+        void* mapping = nullptr;
+        std::size_t mappedBytes = 0;
+    };
+
+} // namespace cudaprob3
+
+#endif
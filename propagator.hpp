@@ -21,11 +21,18 @@ along with CUDAProb3++.  If not, see <http://www.gnu.org/licenses/>.
 #include "constants.hpp"
 #include "types.hpp"
 #include "math.hpp"
+#include "physics.hpp"
+#include "instrumentation.hpp"
+#include "probabilitytable.hpp"
+#include "densitymodel.hpp"
 
 
 #include <algorithm>
 #include <array>
+#include <cstdio>
 #include <fstream>
+#include <memory>
+#include <numeric>
 #include <string>
 #include <stdexcept>
 #include <vector>
@@ -51,6 +58,12 @@ namespace cudaprob3{
             energyList.resize(n_energies);
             cosineList.resize(n_cosines);
             maxlayers.resize(n_cosines);
+            pathOrder.resize(n_cosines);
+            std::iota(pathOrder.begin(), pathOrder.end(), 0);
+
+            // all ProbTypes are calculated by default
+            for(int i = 0; i < 9; i++)
+                channelSlots[i] = i;
         }
 
         /// \brief Copy constructor
@@ -71,17 +84,46 @@ namespace cudaprob3{
             energyList = other.energyList;
             cosineList = other.cosineList;
             maxlayers = other.maxlayers;
-            radii = other.radii;
-            rhos = other.rhos;
-            coslimit = other.coslimit;
+            pathOrder = other.pathOrder;
+            layerDistances = other.layerDistances;
+            layerDensityIndices = other.layerDensityIndices;
+            layerStride = other.layerStride;
+            productionHeightSamples = other.productionHeightSamples;
+            productionHeightWeights = other.productionHeightWeights;
+            heightDistances = other.heightDistances;
+            n_heightSamples = other.n_heightSamples;
+            resultLayout = other.resultLayout;
+            channelSlots = other.channelSlots;
+            n_channels = other.n_channels;
+            calculatedType = other.calculatedType;
+            n_calculatedTypes = other.n_calculatedTypes;
+            n_calculatedVariants = other.n_calculatedVariants;
+            densityModel = other.densityModel;
+            densityVariantRhos = other.densityVariantRhos;
+            n_densityVariants = other.n_densityVariants;
+            variantDensities = other.variantDensities;
+            variantDensityIndices = other.variantDensityIndices;
             Mix_U = other.Mix_U;
             dm = other.dm;
+            mixingAngles = other.mixingAngles;
+            massDifferences = other.massDifferences;
 
             ProductionHeightinCentimeter = other.ProductionHeightinCentimeter;
             isSetCosine = other.isSetCosine;
             isSetProductionHeight = other.isSetProductionHeight;
             isInit = other.isInit;
 
+            changedInputs = other.changedInputs;
+            cachedCalculation = other.cachedCalculation;
+            cachedType = other.cachedType;
+            cachedTypes = other.cachedTypes;
+            cachedBatch = other.cachedBatch;
+            loadedTable = other.loadedTable;
+            resultCacheDirectory = other.resultCacheDirectory;
+            unusableCacheFile = other.unusableCacheFile;
+
+            instrumentation = other.instrumentation;
+
             return *this;
         }
 
@@ -91,17 +133,46 @@ namespace cudaprob3{
             energyList = std::move(other.energyList);
             cosineList = std::move(other.cosineList);
             maxlayers = std::move(other.maxlayers);
-            radii = std::move(other.radii);
-            rhos = std::move(other.rhos);
-            coslimit = std::move(other.coslimit);
+            pathOrder = std::move(other.pathOrder);
+            layerDistances = std::move(other.layerDistances);
+            layerDensityIndices = std::move(other.layerDensityIndices);
+            layerStride = other.layerStride;
+            productionHeightSamples = std::move(other.productionHeightSamples);
+            productionHeightWeights = std::move(other.productionHeightWeights);
+            heightDistances = std::move(other.heightDistances);
+            n_heightSamples = other.n_heightSamples;
+            resultLayout = other.resultLayout;
+            channelSlots = other.channelSlots;
+            n_channels = other.n_channels;
+            calculatedType = other.calculatedType;
+            n_calculatedTypes = other.n_calculatedTypes;
+            n_calculatedVariants = other.n_calculatedVariants;
+            densityModel = std::move(other.densityModel);
+            densityVariantRhos = std::move(other.densityVariantRhos);
+            n_densityVariants = other.n_densityVariants;
+            variantDensities = std::move(other.variantDensities);
+            variantDensityIndices = std::move(other.variantDensityIndices);
             Mix_U = std::move(other.Mix_U);
             dm = std::move(other.dm);
+            mixingAngles = other.mixingAngles;
+            massDifferences = other.massDifferences;
 
             ProductionHeightinCentimeter = other.ProductionHeightinCentimeter;
             isSetCosine = other.isSetCosine;
             isSetProductionHeight = other.isSetProductionHeight;
             isInit = other.isInit;
 
+            changedInputs = other.changedInputs;
+            cachedCalculation = other.cachedCalculation;
+            cachedType = other.cachedType;
+            cachedTypes = other.cachedTypes;
+            cachedBatch = std::move(other.cachedBatch);
+            loadedTable = std::move(other.loadedTable);
+            resultCacheDirectory = std::move(other.resultCacheDirectory);
+            unusableCacheFile = std::move(other.unusableCacheFile);
+
+            instrumentation = std::move(other.instrumentation);
+
             other.isInit = false;
 
             return *this;
@@ -115,72 +186,100 @@ namespace cudaprob3{
         /// @param radii_ List of radii
         /// @param rhos_ List of densities
         virtual void setDensity(const std::vector<FLOAT_T>& radii_, const std::vector<FLOAT_T>& rhos_){
+            setDensityModel(std::make_shared<const DensityModel<FLOAT_T>>(radii_, rhos_));
+        }
 
-            if(rhos_.size() != radii_.size()){
-                throw std::runtime_error("setDensity : rhos.size() != radii.size()");
-            }
+        /// \brief Set density information from file
+        /// \details File must contain two columns where the first column contains the radius (km)
+        /// and the second column contains the density (g/cm³).
+        /// The first row must have the radius 0. The last row must have to radius of the sphere
+        ///
+        /// @param filename File with density information
+        virtual void setDensityFromFile(const std::string& filename){
+            setDensityModel(makeDensityModelFromFile<FLOAT_T>(filename));
+        }
 
-            if(rhos_.size() == 0 || radii_.size() == 0){
-                throw std::runtime_error("setDensity : vectors must not be empty");
-            }
+        /// \brief Set a density model which was parsed and validated before
+        /// \details The model is not copied and may be shared by several propagators. Setting the current model again has no effect,
+        /// so models of a systematic study can be prepared once and switched between calculations
+        /// @param model Density model
+        virtual void setDensityModel(std::shared_ptr<const DensityModel<FLOAT_T>> model){
+            if(!model || model->empty())
+                throw std::runtime_error("Propagator::setDensityModel. The density model must not be empty");
 
-            bool needFlip = false;
+            if(model == densityModel)
+                return;
 
-            if(radii_.size() >= 2){
-                int sign = (radii_[1] - radii_[0] > 0 ? 1 : -1);
+            if(*model != *densityModel)
+                changedInputs |= DensityInput;
 
-                for(size_t i = 1; i < radii_.size(); i++){
-                    if((radii_[i] - radii_[i-1]) * sign < 0)
-                        throw std::runtime_error("radii order messed up");
-                }
+            densityModel = std::move(model);
 
-                if(sign == 1)
-                    needFlip = true;
+            // the density variants refer to the layers of the previous model
+            if(n_densityVariants > 0 && densityVariantRhos.size() != std::size_t(n_densityVariants) * densityModel->getLayerCount()){
+                densityVariantRhos.clear();
+                n_densityVariants = 0;
             }
 
-            radii = radii_;
-            rhos = rhos_;
+            setGridDensities();
+            setMaxlayers();
+        }
 
-            if(needFlip){
-                std::reverse(radii.begin(), radii.end());
-                std::reverse(rhos.begin(), rhos.end());
-            }
+        /// \brief get the density model
+        std::shared_ptr<const DensityModel<FLOAT_T>> getDensityModel() const{
+            return densityModel;
+        }
 
-            coslimit.clear();
+        /// \brief Calculate each grid and batch calculation for several variants of the layer densities in the same pass
+        /// \details Row v of rhos holds the densities (g/cm^3) of variant v for each layer of the density model, in the order of
+        /// getDensityModel()->getRhos(), i.e. from the surface to the center. The radii and the path geometry are shared by all variants.
+        /// The matter solutions are computed once per unique density of all variants, so each further variant only costs the
+        /// matrix products of the paths. The results of parameter set p and variant v are hypothesis p * n_variants + v of
+        /// getBatchProbability; grid calculations store variant v as hypothesis v, and getProbability returns variant 0.
+        /// Event and tiled calculations use the density model. Results with density variants are not saved to the result cache.
+        /// The variants are cleared if a density model with a different number of layers is set
+        /// @param rhos Densities of each variant, n_variants rows of getDensityModel()->getLayerCount() entries
+        /// @param n_variants Number of variants
+        virtual void setDensityVariants(const std::vector<FLOAT_T>& rhos, int n_variants){
+            if(densityModel->empty())
+                throw std::runtime_error("Propagator::setDensityVariants. must set density before density variants");
+            if(n_variants < 1)
+                throw std::runtime_error("Propagator::setDensityVariants. n_variants must be positive");
+            if(rhos.size() != std::size_t(n_variants) * densityModel->getLayerCount())
+                throw std::runtime_error("Propagator::setDensityVariants. rhos must have one entry per layer for each variant");
+            for(const FLOAT_T rho : rhos)
+                if(!(rho >= 0))
+                    throw std::runtime_error("Propagator::setDensityVariants. densities must not be negative");
+
+            if(n_variants == n_densityVariants && rhos == densityVariantRhos)
+                return;
+
+            changedInputs |= DensityInput;
+
+            densityVariantRhos = rhos;
+            n_densityVariants = n_variants;
+
+            setGridDensities();
+            setPathGeometry();
+        }
 
-            // first element of _Radii is largest radius
-            for(size_t i=0; i < radii.size() ; i++ )
-            {
-                // Using a cosine threshold
-                FLOAT_T x = -1* sqrt( 1 - (radii[i] * radii[i] / ( Constants<FLOAT_T>::REarth()*Constants<FLOAT_T>::REarth())) );
-                if ( i  == 0 ) x = 0;
-                coslimit.push_back(x);
-            }
+        /// \brief Calculate with the densities of the density model instead of density variants
+        virtual void clearDensityVariants(){
+            if(n_densityVariants == 0)
+                return;
 
-            setMaxlayers();
-        }
+            changedInputs |= DensityInput;
 
-        /// \brief Set density information from file
-        /// \details File must contain two columns where the first column contains the radius (km)
-        /// and the second column contains the density (g/cm³).
-        /// The first row must have the radius 0. The last row must have to radius of the sphere
-        ///
-        /// @param filename File with density information
-        virtual void setDensityFromFile(const std::string& filename){
-            std::ifstream file(filename);
-            if(!file)
-                throw std::runtime_error("could not open density file " + filename);
-
-            std::vector<FLOAT_T> radii;
-            std::vector<FLOAT_T> rhos;
-            FLOAT_T r;
-            FLOAT_T d;
-            while (file >> r >> d){
-                radii.push_back(r);
-                rhos.push_back(d);
-            }
+            densityVariantRhos.clear();
+            n_densityVariants = 0;
 
-            setDensity(radii, rhos);
+            setGridDensities();
+            setPathGeometry();
+        }
+
+        /// \brief Get the number of density variants of each calculation, 1 if no density variants are set
+        int getDensityVariantCount() const{
+            return std::max(1, n_densityVariants);
         }
 
         /// \brief Set mixing angles and cp phase in radians
@@ -189,62 +288,96 @@ namespace cudaprob3{
         /// @param theta23
         /// @param dCP
         virtual void setMNSMatrix(FLOAT_T theta12, FLOAT_T theta13, FLOAT_T theta23, FLOAT_T dCP){
+            std::array<math::ComplexNumber<FLOAT_T>, 9> U;
+            computeMNSMatrix(theta12, theta13, theta23, dCP, U.data());
 
-            const FLOAT_T s12 = sin(theta12);
-            const FLOAT_T s13 = sin(theta13);
-            const FLOAT_T s23 = sin(theta23);
-            const FLOAT_T c12 = cos(theta12);
-            const FLOAT_T c13 = cos(theta13);
-            const FLOAT_T c23 = cos(theta23);
-
-            const FLOAT_T sd  = sin(dCP);
-            const FLOAT_T cd  = cos(dCP);
+            mixingAngles = {theta12, theta13, theta23, dCP};
 
-            U(0,0).re =  c12*c13;
-            U(0,0).im =  0.0;
-            U(0,1).re =  s12*c13;
-            U(0,1).im =  0.0;
-            U(0,2).re =  s13*cd;
-            U(0,2).im = -s13*sd;
-            U(1,0).re = -s12*c23-c12*s23*s13*cd;
-            U(1,0).im =         -c12*s23*s13*sd;
-            U(1,1).re =  c12*c23-s12*s23*s13*cd;
-            U(1,1).im =         -s12*s23*s13*sd;
-            U(1,2).re =  s23*c13;
-            U(1,2).im =  0.0;
-            U(2,0).re =  s12*s23-c12*c23*s13*cd;
-            U(2,0).im =         -c12*c23*s13*sd;
-            U(2,1).re = -c12*s23-s12*c23*s13*cd;
-            U(2,1).im  =         -s12*c23*s13*sd;
-            U(2,2).re =  c23*c13;
-            U(2,2).im  =  0.0;
+            const bool changed = !std::equal(U.begin(), U.end(), Mix_U.begin(),
+                                    [](const math::ComplexNumber<FLOAT_T>& l, const math::ComplexNumber<FLOAT_T>& r){ return l.re == r.re && l.im == r.im; });
+            if(changed){
+                Mix_U = U;
+                changedInputs |= MixingInput;
+            }
         }
 
         /// \brief Set neutrino mass differences (m_i_j)^2 in (eV)^2. no assumptions about mass hierarchy are made
         /// @param dm12sq
         /// @param dm23sq
         virtual void setNeutrinoMasses(FLOAT_T dm12sq, FLOAT_T dm23sq){
-            FLOAT_T mVac[3];
+            std::array<FLOAT_T, 9> DM;
+            computeMassDifferences(dm12sq, dm23sq, DM.data());
 
-            mVac[0] = 0.0;
-            mVac[1] = dm12sq;
-            mVac[2] = dm12sq + dm23sq;
+            massDifferences = {dm12sq, dm23sq};
 
-            const FLOAT_T delta = 5.0e-9;
-            /* Break any degeneracies */
-            if (dm12sq == 0.0) mVac[0] -= delta;
-            if (dm23sq == 0.0) mVac[2] += delta;
+            if(DM != dm){
+                dm = DM;
+                changedInputs |= MassInput;
+            }
+        }
 
-            DM(0,0) = 0.0;
-            DM(1,1) = 0.0;
-            DM(2,2) = 0.0;
-            DM(0,1) = mVac[0]-mVac[1];
-            DM(1,0) = -DM(0,1);
-            DM(0,2) = mVac[0]-mVac[2];
-            DM(2,0) = -DM(0,2);
-            DM(1,2) = mVac[1]-mVac[2];
-            DM(2,1) = -DM(1,2);
+        /// \brief get the energy bins (GeV)
+        const std::vector<FLOAT_T>& getEnergyList() const{
+            return energyList;
+        }
+
+        /// \brief get the cosine bins
+        const std::vector<FLOAT_T>& getCosineList() const{
+            return cosineList;
+        }
+
+        /// \brief get the number of cosine bins
+        int getNumberOfCosines() const{
+            return n_cosines;
+        }
+
+        /// \brief get the number of energy bins
+        int getNumberOfEnergies() const{
+            return n_energies;
+        }
+
+        /// \brief Change the number of cosine bins and energy bins
+        /// \details A list whose size changes is reset to zeros and must be set again before the next calculation. The density model,
+        /// the production height, the oscillation parameters and the other settings are kept. A production height distribution is
+        /// cleared if the number of cosine bins changes, because its samples refer to the cosine bins. Results of previous calculations
+        /// are invalidated. The buffers of the propagators only grow, so switching between binnings which were used before does not allocate memory
+        /// @param n_cosines_ Number cosine bins
+        /// @param n_energies_ Number of energy bins
+        virtual void resize(int n_cosines_, int n_energies_){
+            if(!isInit)
+                throw std::runtime_error("Propagator::resize. Object has been moved from.");
+            if(n_cosines_ < 1 || n_energies_ < 1)
+                throw std::runtime_error("Propagator::resize. Number of cosine bins and energy bins must be positive");
+
+            if(n_cosines_ == n_cosines && n_energies_ == n_energies)
+                return;
+
+            if(n_energies_ != n_energies){
+                n_energies = n_energies_;
+                energyList.assign(n_energies, FLOAT_T(0.0));
+                changedInputs |= EnergyInput;
+            }
+
+            if(n_cosines_ != n_cosines){
+                n_cosines = n_cosines_;
+                cosineList.assign(n_cosines, FLOAT_T(0.0));
+                maxlayers.resize(n_cosines);
+                pathOrder.resize(n_cosines);
+                changedInputs |= CosineInput;
+
+                if(n_heightSamples > 0){
+                    productionHeightSamples.clear();
+                    productionHeightWeights.clear();
+                    heightDistances.clear();
+                    n_heightSamples = 0;
+                    changedInputs |= ProductionHeightInput;
+                }
+
+                // keep the path geometry consistent with the number of cosine bins
+                setMaxlayers();
+            }
 
+            invalidateCachedCalculation();
         }
 
         /// \brief Set the energy bins. Energies are given in GeV
@@ -253,7 +386,10 @@ namespace cudaprob3{
             if(list.size() != size_t(n_energies))
                 throw std::runtime_error("Propagator::setEnergyList. Propagator was not created for this number of energy nodes");
 
-            energyList = list;
+            if(list != energyList){
+                energyList = list;
+                changedInputs |= EnergyInput;
+            }
         }
 
         /// \brief Set cosine bins. Cosines are given in radians
@@ -262,6 +398,9 @@ namespace cudaprob3{
             if(list.size() != size_t(n_cosines))
                 throw std::runtime_error("Propagator::setCosineList. Propagator was not created for this number of cosine nodes");
 
+            if(list != cosineList || !isSetCosine)
+                changedInputs |= CosineInput;
+
             cosineList = list;
 
             if(isSetProductionHeight){
@@ -280,9 +419,87 @@ namespace cudaprob3{
             if(!isSetCosine)
                 throw std::runtime_error("must set cosine list before production height");
 
-            ProductionHeightinCentimeter = heightKM * 100000.0;
+            const FLOAT_T height = heightKM * 100000.0;
+
+            if(!isSetProductionHeight || height != ProductionHeightinCentimeter)
+                changedInputs |= ProductionHeightInput;
+
+            ProductionHeightinCentimeter = height;
 
             isSetProductionHeight = true;
+
+            setPathGeometry();
+        }
+
+        /// \brief Average the probabilities of each cosine over a distribution of production heights
+        /// \details Sample k of cosine bin c has the height heightsKM[c * n_samples + k] (km) and the weight weights[c * n_samples + k].
+        /// The weights of each cosine bin are normalized, and the calculated probabilities are the weighted average over the samples.
+        /// Only the atmospheric layer depends on the production height, so the path through the earth is calculated once per cell.
+        /// The samples refer to the indices of the cosine bins and are kept if the cosine list changes.
+        /// If no production height was set, the weighted mean of the samples is used, e.g. by calculateEventProbabilities.
+        /// @param heightsKM Production heights (km) of each cosine bin
+        /// @param weights Weights of the production heights
+        /// @param n_samples Number of production heights per cosine bin
+        virtual void setProductionHeightDistribution(const std::vector<FLOAT_T>& heightsKM, const std::vector<FLOAT_T>& weights, int n_samples){
+            if(!isSetCosine)
+                throw std::runtime_error("Propagator::setProductionHeightDistribution. must set cosine list before production height distribution");
+            if(n_samples < 1)
+                throw std::runtime_error("Propagator::setProductionHeightDistribution. n_samples must be positive");
+            if(heightsKM.size() != std::size_t(n_cosines) * std::size_t(n_samples) || weights.size() != heightsKM.size())
+                throw std::runtime_error("Propagator::setProductionHeightDistribution. heightsKM and weights must have n_samples entries per cosine bin");
+
+            std::vector<FLOAT_T> normalizedWeights(weights.size());
+            FLOAT_T weightedHeightSum = 0.0;
+
+            for(int index_cosine = 0; index_cosine < n_cosines; index_cosine++){
+                const std::size_t offset = std::size_t(index_cosine) * std::size_t(n_samples);
+
+                FLOAT_T sum = 0.0;
+                for(int k = 0; k < n_samples; k++){
+                    if(weights[offset + k] < 0 || heightsKM[offset + k] < 0)
+                        throw std::runtime_error("Propagator::setProductionHeightDistribution. heights and weights must not be negative");
+                    sum += weights[offset + k];
+                }
+                if(!(sum > 0))
+                    throw std::runtime_error("Propagator::setProductionHeightDistribution. weights of a cosine bin must not sum to zero");
+
+                for(int k = 0; k < n_samples; k++){
+                    normalizedWeights[offset + k] = weights[offset + k] / sum;
+                    weightedHeightSum += normalizedWeights[offset + k] * heightsKM[offset + k];
+                }
+            }
+
+            if(n_heightSamples != n_samples || productionHeightSamples != heightsKM || productionHeightWeights != normalizedWeights)
+                changedInputs |= ProductionHeightInput;
+
+            productionHeightSamples = heightsKM;
+            productionHeightWeights = std::move(normalizedWeights);
+            n_heightSamples = n_samples;
+
+            if(isSetProductionHeight)
+                setPathGeometry();
+            else
+                setProductionHeight(weightedHeightSum / n_cosines);
+        }
+
+        /// \brief Calculate the probabilities with the production height of setProductionHeight instead of a distribution
+        virtual void clearProductionHeightDistribution(){
+            if(n_heightSamples == 0)
+                return;
+
+            changedInputs |= ProductionHeightInput;
+
+            productionHeightSamples.clear();
+            productionHeightWeights.clear();
+            heightDistances.clear();
+            n_heightSamples = 0;
+
+            setPathGeometry();
+        }
+
+        /// \brief Get the number of production heights per cosine bin set by setProductionHeightDistribution, or 0 if no distribution is used
+        int getProductionHeightSampleCount() const{
+            return n_heightSamples;
         }
 
         /// \brief Calculate the probability of each cell
@@ -295,15 +512,737 @@ namespace cudaprob3{
         /// @param t Specify which probability P(i->j)
         virtual FLOAT_T getProbability(int index_cosine, int index_energy, ProbType t) = 0;
 
+        /// \brief Calculate the probability of each cell for a batch of oscillation parameter sets
+        /// \details The mixing matrix and mass differences set via setMNSMatrix and setNeutrinoMasses are not used.
+        /// After the calculation, getProbability(index_cosine, index_energy, t) returns the result of the first hypothesis
+        /// @param type Neutrino or Antineutrino
+        /// @param batch List of oscillation parameter sets
+        virtual void calculateProbabilitiesBatch(NeutrinoType type, const std::vector<OscParams<FLOAT_T>>& batch) = 0;
+
+        /// \brief get oscillation weight for specific hypothesis, cosine and energy after calculateProbabilitiesBatch
+        /// @param index_batch Hypothesis index in batch (zero based)
+        /// @param index_cosine Cosine bin index (zero based)
+        /// @param index_energy Energy bin index (zero based)
+        /// @param t Specify which probability P(i->j)
+        virtual FLOAT_T getBatchProbability(int index_batch, int index_cosine, int index_energy, ProbType t) = 0;
+
+        /// \brief Calculate the probability of each cell for Neutrino and Antineutrino in a single pass
+        /// \details Both types share the parameter setup, the path geometry and the launch.
+        /// After the calculation, getProbability(index_cosine, index_energy, t) returns the Neutrino result
+        virtual void calculateProbabilitiesBothTypes() = 0;
+
+        /// \brief Calculate the probability of each cell for Neutrino and Antineutrino for a batch of oscillation parameter sets
+        /// @param batch List of oscillation parameter sets
+        virtual void calculateProbabilitiesBatchBothTypes(const std::vector<OscParams<FLOAT_T>>& batch) = 0;
+
+        /// \brief get oscillation weight for specific cosine, energy and neutrino type
+        /// \details Throws if the type was not calculated by the last calculation
+        /// @param index_cosine Cosine bin index (zero based)
+        /// @param index_energy Energy bin index (zero based)
+        /// @param t Specify which probability P(i->j)
+        /// @param type Neutrino or Antineutrino
+        virtual FLOAT_T getProbability(int index_cosine, int index_energy, ProbType t, NeutrinoType type) = 0;
+
+        /// \brief get oscillation weight for specific hypothesis, cosine, energy and neutrino type
+        /// \details Throws if the type was not calculated by the last calculation
+        /// @param index_batch Hypothesis index in batch (zero based)
+        /// @param index_cosine Cosine bin index (zero based)
+        /// @param index_energy Energy bin index (zero based)
+        /// @param t Specify which probability P(i->j)
+        /// @param type Neutrino or Antineutrino
+        virtual FLOAT_T getBatchProbability(int index_batch, int index_cosine, int index_energy, ProbType t, NeutrinoType type) = 0;
+
+        /// \brief Set the memory layout of the probabilities of subsequent calculations
+        /// \details Results of previous calculations are invalidated. Use getProbabilityView or getResultSpan of the
+        /// concrete propagator to access the probabilities directly in the selected layout
+        /// @param layout AoS or SoA
+        virtual void setResultLayout(ResultLayout layout){
+            if(layout != resultLayout)
+                changedInputs |= ResultFormatInput;
+
+            resultLayout = layout;
+        }
+
+        /// \brief get the memory layout of the probabilities
+        ResultLayout getResultLayout() const{
+            return resultLayout;
+        }
+
+        /// \brief Restrict subsequent calculations to the given probabilities
+        /// \details Only the requested ProbTypes are stored, which reduces memory and transfers of the results.
+        /// Results of previous calculations are invalidated. Accessing a probability which was not requested throws
+        /// @param channels List of requested ProbTypes. Must not be empty
+        virtual void setRequestedChannels(const std::vector<ProbType>& channels){
+            if(channels.size() == 0)
+                throw std::runtime_error("Propagator::setRequestedChannels. channels must not be empty");
+
+            std::array<bool, 9> requested;
+            requested.fill(false);
+
+            for(const auto& t : channels){
+                if(int(t) < 0 || int(t) >= 9)
+                    throw std::runtime_error("Propagator::setRequestedChannels. Invalid ProbType");
+                requested[int(t)] = true;
+            }
+
+            const std::array<int, 9> oldSlots = channelSlots;
+
+            // requested ProbTypes are stored in ascending order
+            n_channels = 0;
+            for(int i = 0; i < 9; i++)
+                channelSlots[i] = requested[i] ? n_channels++ : -1;
+
+            if(channelSlots != oldSlots)
+                changedInputs |= ResultFormatInput;
+        }
+
+        /// \brief Check if the probability t is calculated
+        /// @param t ProbType
+        bool isRequestedChannel(ProbType t) const{
+            return channelSlots[int(t)] >= 0;
+        }
+
+        /// \brief Check if the results of the last calculation contain the probabilities of type
+        /// @param type Neutrino or Antineutrino
+        bool isCalculatedType(NeutrinoType type) const{
+            return getTypeIndex(type) >= 0;
+        }
+
+        /// \brief get the number of requested ProbTypes
+        int getNumberOfRequestedChannels() const{
+            return n_channels;
+        }
+
+        /// \brief Calculate the probabilities of a list of events, each with its own cosine, energy and production height
+        /// \details The events do not use the cosine list and the energy list. The mixing matrix and mass differences set via
+        /// setMNSMatrix and setNeutrinoMasses are used. The requested ProbTypes of each event are stored consecutively in ascending order,
+        /// i.e. result[index_event * getNumberOfRequestedChannels() + k] is the k-th requested ProbType of event index_event
+        /// @param type Neutrino or Antineutrino
+        /// @param n_events Number of events
+        /// @param cosines Cosine of each event
+        /// @param energies Energy (GeV) of each event
+        /// @param productionHeights Production height (km) of each event, or nullptr to use the production height set by setProductionHeight
+        /// @param result Output with space for n_events * getNumberOfRequestedChannels() probabilities
+        void calculateEventProbabilities(NeutrinoType type, std::uint64_t n_events, const FLOAT_T* cosines, const FLOAT_T* energies,
+                                            const FLOAT_T* productionHeights, FLOAT_T* result){
+            checkEvents(n_events, cosines, energies, productionHeights, result);
+
+            if(n_events > 0)
+                calculateEvents(type, 1, n_events, cosines, energies, productionHeights, result);
+        }
+
+        /// \brief Calculate the probabilities of a list of events for Neutrino and Antineutrino in a single pass
+        /// \details The results of all events for Neutrino are followed by the results of all events for Antineutrino
+        /// @param n_events Number of events
+        /// @param cosines Cosine of each event
+        /// @param energies Energy (GeV) of each event
+        /// @param productionHeights Production height (km) of each event, or nullptr to use the production height set by setProductionHeight
+        /// @param result Output with space for 2 * n_events * getNumberOfRequestedChannels() probabilities
+        void calculateEventProbabilitiesBothTypes(std::uint64_t n_events, const FLOAT_T* cosines, const FLOAT_T* energies,
+                                            const FLOAT_T* productionHeights, FLOAT_T* result){
+            checkEvents(n_events, cosines, energies, productionHeights, result);
+
+            if(n_events > 0)
+                calculateEvents(Neutrino, 2, n_events, cosines, energies, productionHeights, result);
+        }
+
+        /// \brief Calculate the probability of each cell and its derivatives with respect to the oscillation parameters
+        /// \details The mixing angles and mass differences set via setMNSMatrix and setNeutrinoMasses are used. The derivatives with respect
+        /// to each OscParameter are computed in the same pass as the probabilities, with forward-mode dual numbers. After the calculation,
+        /// getProbability returns the probabilities and getProbabilityDerivative returns the derivatives. The derivatives of OscParameter p
+        /// are stored as hypothesis 1 + p of the results, e.g. getBatchProbability(1 + p, ...).
+        /// Density variants are not supported
+        /// @param type Neutrino or Antineutrino
+        void calculateProbabilityGradients(NeutrinoType type){
+            checkGradients();
+            calculateGradients(type, 1);
+        }
+
+        /// \brief Calculate the probability of each cell and its derivatives for Neutrino and Antineutrino in a single pass
+        /// \details See calculateProbabilityGradients
+        void calculateProbabilityGradientsBothTypes(){
+            checkGradients();
+            calculateGradients(Neutrino, 2);
+        }
+
+        /// \brief get the derivative of the probability of a cell with respect to an oscillation parameter after calculateProbabilityGradients
+        /// @param index_cosine Cosine bin index (zero based)
+        /// @param index_energy Energy bin index (zero based)
+        /// @param t Specify which probability P(i->j)
+        /// @param parameter Oscillation parameter
+        FLOAT_T getProbabilityDerivative(int index_cosine, int index_energy, ProbType t, OscParameter parameter){
+            return getProbabilityDerivative(index_cosine, index_energy, t, n_calculatedTypes == 2 ? Neutrino : calculatedType, parameter);
+        }
+
+        /// \brief get the derivative of the probability of a cell for the given neutrino type with respect to an oscillation parameter
+        /// \details Throws if the type was not calculated by the last calculation
+        /// @param index_cosine Cosine bin index (zero based)
+        /// @param index_energy Energy bin index (zero based)
+        /// @param t Specify which probability P(i->j)
+        /// @param type Neutrino or Antineutrino
+        /// @param parameter Oscillation parameter
+        FLOAT_T getProbabilityDerivative(int index_cosine, int index_energy, ProbType t, NeutrinoType type, OscParameter parameter){
+            if(cachedCalculation != GradientCalculation)
+                throw std::runtime_error("Propagator::getProbabilityDerivative. The last calculation was not a gradient calculation");
+            if(int(parameter) < 0 || int(parameter) >= physics::n_gradientParameters)
+                throw std::runtime_error("Propagator::getProbabilityDerivative. Invalid OscParameter");
+
+            return getBatchProbability(1 + int(parameter), index_cosine, index_energy, t, type);
+        }
+
+        /// \brief Write the probabilities of the last calculation and all of its inputs to a binary table file
+        /// \details The last calculation must be a grid calculation with the current inputs. Only the requested ProbTypes are written.
+        /// The file format is described in probabilitytable.hpp
+        /// @param filename Output file
+        virtual void save(const std::string& filename){
+            if(!isInit)
+                throw std::runtime_error("Propagator::save. Object has been moved from.");
+            if(cachedCalculation != GridCalculation || changedInputs != 0)
+                throw std::runtime_error("Propagator::save. The last calculation must be a grid calculation with the current inputs");
+            if(n_calculatedVariants > 1)
+                throw std::runtime_error("Propagator::save. Calculations with density variants cannot be saved");
+
+            ProbabilityTableHeader header;
+            std::memset(&header, 0, sizeof(header));
+            header.mixedPrecision = usesMixedPrecision() ? 1 : 0;
+            header.n_cosines = n_cosines;
+            header.n_energies = n_energies;
+            header.n_layers = densityModel->getLayerCount();
+            header.n_heightSamples = n_heightSamples;
+            header.n_types = cachedTypes;
+            header.type = int(cachedType);
+            header.n_channels = n_channels;
+            for(int i = 0; i < 9; i++)
+                header.channels[i] = -1;
+            for(int i = 0; i < 9; i++)
+                if(channelSlots[i] >= 0)
+                    header.channels[channelSlots[i]] = i;
+            header.productionHeight = ProductionHeightinCentimeter / 100000.0;
+            for(int i = 0; i < 4; i++)
+                header.mixingAngles[i] = mixingAngles[i];
+            for(int i = 0; i < 2; i++)
+                header.massDifferences[i] = massDifferences[i];
+            header.inputHash = getInputHash(cachedType, cachedTypes);
+
+            const NeutrinoType type = cachedType;
+            const int n_types = cachedTypes;
+
+            ProbabilityTable<FLOAT_T>::write(filename, header, energyList, cosineList, densityModel->getRadii(), densityModel->getRhos(),
+                productionHeightSamples, productionHeightWeights,
+                [&](int index_type, int index_channel, FLOAT_T* buffer){
+                    const NeutrinoType channelType = n_types == 2 ? NeutrinoType(index_type) : type;
+                    const ProbType t = ProbType(header.channels[index_channel]);
+
+                    for(int index_cosine = 0; index_cosine < n_cosines; index_cosine++)
+                        for(int index_energy = 0; index_energy < n_energies; index_energy++)
+                            buffer[std::size_t(index_cosine) * n_energies + index_energy] = getProbability(index_cosine, index_energy, t, channelType);
+                });
+        }
+
+        /// \brief Set all inputs from a table file written by save and provide its probabilities without a calculation
+        /// \details The file is mapped into memory and getProbability reads the probabilities from the mapping until the
+        /// next calculation. The table must have the grid size of the propagator and was written with the floating point type FLOAT_T.
+        /// The views of the host results of the concrete propagator, e.g. getProbabilityView and getResultSpan, also point into the mapping.
+        /// Their layout is SoA regardless of getResultLayout(). Views of device results are not available
+        /// @param filename Table file
+        virtual void load(const std::string& filename){
+            if(!isInit)
+                throw std::runtime_error("Propagator::load. Object has been moved from.");
+
+            auto table = std::make_shared<const ProbabilityTable<FLOAT_T>>(filename);
+            const ProbabilityTableHeader& header = table->getHeader();
+
+            if(header.n_cosines != n_cosines || header.n_energies != n_energies)
+                throw std::runtime_error("Propagator::load. Propagator was not created for the grid size of " + filename);
+
+            setEnergyList(table->getEnergyList());
+            setCosineList(table->getCosineList());
+            setDensity(table->getRadii(), table->getRhos());
+            setMNSMatrix(header.mixingAngles[0], header.mixingAngles[1], header.mixingAngles[2], header.mixingAngles[3]);
+            setNeutrinoMasses(header.massDifferences[0], header.massDifferences[1]);
+            setProductionHeight(header.productionHeight);
+            if(header.n_heightSamples > 0)
+                setProductionHeightDistribution(table->getProductionHeightSamples(), table->getProductionHeightWeights(), header.n_heightSamples);
+            else
+                clearProductionHeightDistribution();
+            setRequestedChannels(table->getChannels());
+
+            useTable(std::move(table), NeutrinoType(header.type), header.n_types);
+        }
+
+        /// \brief Store the results of grid calculations in a directory and reuse them in later calculations with identical inputs
+        /// \details Each grid calculation of calculateProbabilities and calculateProbabilitiesBothTypes first looks for a table file whose
+        /// name is a hash of all inputs, i.e. precision, grid, density model, oscillation parameters, production heights,
+        /// requested ProbTypes and neutrino types. If it exists, its probabilities are used as by load instead of a calculation.
+        /// Otherwise, the calculated probabilities are saved to the directory. Tables are written atomically, so several processes,
+        /// e.g. on the nodes of a cluster with a shared file system, can use the same directory. The directory must exist.
+        /// Batch, event, tiled and asynchronous calculations do not use the cache. Results of the cache are provided like those of load
+        /// @param directory Cache directory, or an empty string to disable the cache
+        virtual void setResultCacheDirectory(const std::string& directory){
+            resultCacheDirectory = directory;
+        }
+
+        /// \brief get the directory of the result cache, or an empty string if the cache is disabled
+        const std::string& getResultCacheDirectory() const{
+            return resultCacheDirectory;
+        }
+
+        /// \brief Check if getProbability returns the probabilities of a table which was loaded by load or from the result cache
+        bool hasLoadedTable() const{
+            return bool(loadedTable);
+        }
+
+        /// \brief get the timings and counters recorded since construction or the last call to resetStatistics
+        /// \details Values are only recorded if the library is compiled with CUDAPROB3_INSTRUMENTATION. Otherwise, all values are zero
+        virtual Statistics getStatistics(){
+            return instrumentation.getStatistics();
+        }
+
+        /// \brief Clear the recorded timings and counters
+        virtual void resetStatistics(){
+            instrumentation.reset();
+        }
+
+        /// \brief Set a function which is called with the duration of each timed phase, e.g. to export metrics
+        /// @param hook Function to call, or an empty function to remove the hook
+        virtual void setInstrumentationHook(const InstrumentationHook& hook){
+            instrumentation.setHook(hook);
+        }
+
     protected:
+        // inputs which are tracked to detect repeated calculations
+        enum Input : unsigned {
+            MixingInput = 1u << 0,
+            MassInput = 1u << 1,
+            DensityInput = 1u << 2,
+            CosineInput = 1u << 3,
+            EnergyInput = 1u << 4,
+            ProductionHeightInput = 1u << 5,
+            ResultFormatInput = 1u << 6, // result layout and requested ProbTypes
+            AllInputs = (1u << 7) - 1
+        };
+
+        enum CachedCalculation {NoCalculation, GridCalculation, BatchCalculation, GradientCalculation};
+
+        // check if the results of the last calculation are still valid for a grid or gradient calculation with the current mixing matrix
+        // and mass differences
+        bool isCachedCalculation(NeutrinoType type, int n_types, CachedCalculation calculation = GridCalculation) const{
+            return isInit
+                    && changedInputs == 0
+                    && cachedCalculation == calculation
+                    && cachedTypes == n_types
+                    && (n_types == 2 || cachedType == type);
+        }
+
+        // check if the results of the last calculation are still valid for the given batch. The batch does not use the mixing matrix and mass differences
+        bool isCachedBatchCalculation(NeutrinoType type, int n_types, const std::vector<OscParams<FLOAT_T>>& batch) const{
+            auto equalParams = [](const OscParams<FLOAT_T>& l, const OscParams<FLOAT_T>& r){
+                return l.theta12 == r.theta12 && l.theta13 == r.theta13 && l.theta23 == r.theta23
+                        && l.dCP == r.dCP && l.dm12sq == r.dm12sq && l.dm23sq == r.dm23sq;
+            };
+
+            return isInit
+                    && (changedInputs & ~(MixingInput | MassInput)) == 0
+                    && cachedCalculation == BatchCalculation
+                    && cachedTypes == n_types
+                    && (n_types == 2 || cachedType == type)
+                    && batch.size() == cachedBatch.size()
+                    && std::equal(batch.begin(), batch.end(), cachedBatch.begin(), equalParams);
+        }
+
+        // remember that the results of a grid or gradient calculation with the current inputs are available
+        void setCachedCalculation(NeutrinoType type, int n_types, CachedCalculation calculation = GridCalculation){
+            changedInputs = 0;
+            cachedCalculation = calculation;
+            cachedType = type;
+            cachedTypes = n_types;
+            cachedBatch.clear();
+            loadedTable.reset();
+        }
+
+        // remember that the results of a batch calculation with the current inputs are available
+        void setCachedBatchCalculation(NeutrinoType type, int n_types, const std::vector<OscParams<FLOAT_T>>& batch){
+            changedInputs = 0;
+            cachedCalculation = BatchCalculation;
+            cachedType = type;
+            cachedTypes = n_types;
+            cachedBatch = batch;
+            loadedTable.reset();
+        }
+
+        // force the next calculation to be performed
+        void invalidateCachedCalculation(){
+            cachedCalculation = NoCalculation;
+            loadedTable.reset();
+        }
+
+        // probability of the loaded table
+        FLOAT_T getLoadedProbability(int index_cosine, int index_energy, ProbType t, NeutrinoType type) const{
+            return loadedTable->getProbability(index_cosine, index_energy, t, type);
+        }
+
+        // view of the probabilities t of type of the loaded table
+        ProbabilityView<FLOAT_T> getLoadedProbabilityView(ProbType t, NeutrinoType type) const{
+            return loadedTable->getProbabilityView(t, type);
+        }
+
+        // view of all probabilities of the loaded table
+        ResultSpan<FLOAT_T> getLoadedResultSpan() const{
+            return loadedTable->getResultSpan();
+        }
+
+        // the probabilities of table replace the results of a calculation with the current inputs
+        void useTable(std::shared_ptr<const ProbabilityTable<FLOAT_T>> table, NeutrinoType type, int n_types){
+            setCachedCalculation(type, n_types);
+            calculatedType = type;
+            n_calculatedTypes = n_types;
+            n_calculatedVariants = 1;
+            loadedTable = std::move(table);
+        }
+
+        // true if the mixed precision mode of the GPU propagators is used. Part of the inputs of the result cache
+        virtual bool usesMixedPrecision() const{
+            return false;
+        }
+
+        // hash of all inputs which determine the results of a grid calculation
+        std::uint64_t getInputHash(NeutrinoType type, int n_types) const{
+            InputHash hash;
+            hash.add(probabilityTableVersion);
+            hash.add(std::uint32_t(sizeof(FLOAT_T)));
+            hash.add(usesMixedPrecision());
+            hash.add(energyList);
+            hash.add(cosineList);
+            hash.add(densityModel->getRadii());
+            hash.add(densityModel->getRhos());
+            hash.add(Mix_U.data(), sizeof(Mix_U));
+            hash.add(dm);
+            if(n_heightSamples > 0){
+                hash.add(productionHeightSamples);
+                hash.add(productionHeightWeights);
+            }else{
+                hash.add(ProductionHeightinCentimeter);
+            }
+            hash.add(channelSlots);
+            hash.add(n_types);
+            if(n_types == 1)
+                hash.add(int(type));
+            return hash.get();
+        }
+
+        // file of the result cache for the current inputs
+        std::string getResultCacheFilename(NeutrinoType type, int n_types) const{
+            char name[32];
+            std::snprintf(name, sizeof(name), "%016llx.cp3", (unsigned long long)getInputHash(type, n_types));
+            return resultCacheDirectory + "/" + name;
+        }
+
+        // use the results of the result cache for a grid calculation with the current inputs.
+        // Returns false if the cache is disabled, the calculation is cached in memory, or the cache has no results
+        bool loadCachedResults(NeutrinoType type, int n_types){
+            if(resultCacheDirectory.empty() || isCachedCalculation(type, n_types) || !isSetProductionHeight || n_densityVariants > 0)
+                return false;
+
+            const std::string filename = getResultCacheFilename(type, n_types);
+            struct stat status;
+            if(stat(filename.c_str(), &status) != 0)
+                return false;
+
+            // any table which cannot be used, e.g. a truncated file or a failure to open or map it, is a cache miss.
+            // The file is not removed, since it may be valid for other processes. storeCachedResults atomically replaces it
+            std::shared_ptr<const ProbabilityTable<FLOAT_T>> table;
+            try{
+                table = std::make_shared<const ProbabilityTable<FLOAT_T>>(filename);
+            }catch(const std::runtime_error&){
+                unusableCacheFile = filename;
+                return false;
+            }
+
+            const ProbabilityTableHeader& header = table->getHeader();
+
+            if(header.inputHash != getInputHash(type, n_types) || header.n_cosines != n_cosines || header.n_energies != n_energies){
+                unusableCacheFile = filename;
+                return false;
+            }
+
+            useTable(std::move(table), type, n_types);
+            instrumentation.recordSkippedCalculation();
+
+            return true;
+        }
+
+        // save the results of the last grid calculation to the result cache unless they are already stored in a usable table
+        void storeCachedResults(){
+            if(resultCacheDirectory.empty() || loadedTable || n_calculatedVariants > 1)
+                return;
+
+            const std::string filename = getResultCacheFilename(cachedType, cachedTypes);
+            struct stat status;
+            if(stat(filename.c_str(), &status) == 0 && filename != unusableCacheFile)
+                return;
+
+            save(filename);
+            unusableCacheFile.clear();
+        }
+
+        // calculate the probabilities of events. If n_types == 2, both Neutrino and Antineutrino are calculated
+        virtual void calculateEvents(NeutrinoType type, int n_types, std::uint64_t n_events, const FLOAT_T* cosines, const FLOAT_T* energies,
+                                        const FLOAT_T* productionHeights, FLOAT_T* result) = 0;
+
+        // calculate the probabilities and their derivatives with the parameter set of setGradientParameterSet. The results of the
+        // probabilities are followed by the results of each derivative as further hypotheses. If n_types == 2, both Neutrino and Antineutrino are calculated
+        virtual void calculateGradients(NeutrinoType type, int n_types) = 0;
+
+        void checkGradients() const{
+            if(!isInit)
+                throw std::runtime_error("Propagator::calculateProbabilityGradients. Object has been moved from.");
+            if(!isSetProductionHeight)
+                throw std::runtime_error("Propagator::calculateProbabilityGradients. production height was not set");
+            if(n_densityVariants > 0)
+                throw std::runtime_error("Propagator::calculateProbabilityGradients. Density variants are not supported");
+        }
+
+        // fill the parameter set of the mixing angles and mass differences of setMNSMatrix and setNeutrinoMasses. The derivative d[p] of
+        // each of them is seeded with respect to OscParameter p, so the physics functions propagate the derivatives to the probabilities
+        void setGradientParameterSet(physics::ParameterSet<physics::Gradient<FLOAT_T>>& parameters) const{
+            using GRADIENT_T = physics::Gradient<FLOAT_T>;
+
+            auto seed = [](FLOAT_T value, OscParameter parameter){
+                GRADIENT_T x(value);
+                x.d[int(parameter)] = FLOAT_T(1.0);
+                return x;
+            };
+
+            std::array<math::ComplexNumber<GRADIENT_T>, 9> U;
+            std::array<GRADIENT_T, 9> DM;
+
+            computeMNSMatrix(seed(mixingAngles[0], Theta12), seed(mixingAngles[1], Theta13), seed(mixingAngles[2], Theta23),
+                                seed(mixingAngles[3], DeltaCP), U.data());
+            computeMassDifferences(seed(massDifferences[0], Dm12sq), seed(massDifferences[1], Dm23sq), DM.data());
+
+            physics::setParameterSet(parameters, U.data(), DM.data());
+        }
+
+        void checkEvents(std::uint64_t n_events, const FLOAT_T* cosines, const FLOAT_T* energies,
+                            const FLOAT_T* productionHeights, FLOAT_T* result) const{
+            if(densityModel->empty())
+                throw std::runtime_error("Propagator::calculateEventProbabilities. density was not set");
+            if(productionHeights == nullptr && !isSetProductionHeight)
+                throw std::runtime_error("Propagator::calculateEventProbabilities. production height was not set");
+            if(n_events > 0 && (cosines == nullptr || energies == nullptr || result == nullptr))
+                throw std::runtime_error("Propagator::calculateEventProbabilities. Invalid event arrays");
+        }
+
+        // copy the density model independent data of the events to the context of the core physics functions
+        void setEventContext(physics::EventContext<FLOAT_T>& context, int n_types) const{
+            context.productionHeight = isSetProductionHeight ? ProductionHeightinCentimeter / Constants<FLOAT_T>::km2cm() : FLOAT_T(0.0);
+            context.n_layers = densityModel->getLayerCount();
+            context.n_types = n_types;
+            context.n_channels = n_channels;
+            for(int i = 0; i < 9; i++)
+                context.channelSlots[i] = channelSlots[i];
+        }
+
+        // compute MNS mixing matrix from mixing angles and cp phase in radians. VALUE_T is FLOAT_T or a dual number of a gradient calculation
+        template<typename VALUE_T>
+        static void computeMNSMatrix(VALUE_T theta12, VALUE_T theta13, VALUE_T theta23, VALUE_T dCP, math::ComplexNumber<VALUE_T>* Mix){
+
+            auto U = [Mix](int i, int j) -> math::ComplexNumber<VALUE_T>& { return Mix[( i * 3 + j)]; };
+
+            const VALUE_T s12 = sin(theta12);
+            const VALUE_T s13 = sin(theta13);
+            const VALUE_T s23 = sin(theta23);
+            const VALUE_T c12 = cos(theta12);
+            const VALUE_T c13 = cos(theta13);
+            const VALUE_T c23 = cos(theta23);
+
+            const VALUE_T sd  = sin(dCP);
+            const VALUE_T cd  = cos(dCP);
+
+            U(0,0).re =  c12*c13;
+            U(0,0).im =  0.0;
+            U(0,1).re =  s12*c13;
+            U(0,1).im =  0.0;
+            U(0,2).re =  s13*cd;
+            U(0,2).im = -s13*sd;
+            U(1,0).re = -s12*c23-c12*s23*s13*cd;
+            U(1,0).im =         -c12*s23*s13*sd;
+            U(1,1).re =  c12*c23-s12*s23*s13*cd;
+            U(1,1).im =         -s12*s23*s13*sd;
+            U(1,2).re =  s23*c13;
+            U(1,2).im =  0.0;
+            U(2,0).re =  s12*s23-c12*c23*s13*cd;
+            U(2,0).im =         -c12*c23*s13*sd;
+            U(2,1).re = -c12*s23-s12*c23*s13*cd;
+            U(2,1).im  =         -s12*c23*s13*sd;
+            U(2,2).re =  c23*c13;
+            U(2,2).im  =  0.0;
+        }
+
+        // compute matrix of neutrino mass differences from (m_i_j)^2 in (eV)^2. VALUE_T is FLOAT_T or a dual number of a gradient calculation
+        template<typename VALUE_T>
+        static void computeMassDifferences(VALUE_T dm12sq, VALUE_T dm23sq, VALUE_T* Dm){
+
+            auto DM = [Dm](int i, int j) -> VALUE_T& { return Dm[( i * 3 + j)]; };
+
+            VALUE_T mVac[3];
+
+            mVac[0] = 0.0;
+            mVac[1] = dm12sq;
+            mVac[2] = dm12sq + dm23sq;
+
+            const VALUE_T delta = 5.0e-9;
+            /* Break any degeneracies */
+            if (dm12sq == 0.0) mVac[0] -= delta;
+            if (dm23sq == 0.0) mVac[2] += delta;
+
+            DM(0,0) = 0.0;
+            DM(1,1) = 0.0;
+            DM(2,2) = 0.0;
+            DM(0,1) = mVac[0]-mVac[1];
+            DM(1,0) = -DM(0,1);
+            DM(0,2) = mVac[0]-mVac[2];
+            DM(2,0) = -DM(0,2);
+            DM(1,2) = mVac[1]-mVac[2];
+            DM(2,1) = -DM(1,2);
+        }
+
+        // collect the unique densities of the density model and all density variants. The densities of the model come first, so the
+        // density indices of the model are also valid for this list. For each variant, determine the index of the density of each layer
+        virtual void setGridDensities(){
+            variantDensities.clear();
+            variantDensityIndices.clear();
+
+            if(n_densityVariants == 0)
+                return;
+
+            variantDensities = densityModel->getDensities();
+            variantDensityIndices.resize(densityVariantRhos.size());
+
+            for(std::size_t i = 0; i < densityVariantRhos.size(); i++){
+                auto it = std::find(variantDensities.begin(), variantDensities.end(), densityVariantRhos[i]);
+                variantDensityIndices[i] = std::distance(variantDensities.begin(), it);
+                if(it == variantDensities.end())
+                    variantDensities.push_back(densityVariantRhos[i]);
+            }
+        }
+
+        // unique densities of grid calculations
+        const std::vector<FLOAT_T>& getGridDensities() const{
+            return n_densityVariants > 0 ? variantDensities : densityModel->getDensities();
+        }
+
         // for each cosine bin, determine the number of layers which will be crossed by the neutrino path
         // the atmospheric layers is excluded
         virtual void setMaxlayers(){
             for(int index_cosine = 0; index_cosine < n_cosines; index_cosine++){
-                FLOAT_T c = cosineList[index_cosine];
-                const int maxLayer = std::count_if(coslimit.begin(), coslimit.end(), [c](FLOAT_T limit){ return c < limit;});
-                maxlayers[index_cosine] = maxLayer;
+                maxlayers[index_cosine] = densityModel->getMaxLayer(cosineList[index_cosine]);
             }
+
+            // process the paths with the most layers first. Paths with the same number of layers keep their order
+            std::iota(pathOrder.begin(), pathOrder.end(), 0);
+            std::stable_sort(pathOrder.begin(), pathOrder.end(), [&](int l, int r){ return maxlayers[l] > maxlayers[r]; });
+
+            setPathGeometry();
+        }
+
+        // for each cosine bin and each crossed layer, determine the traversed distance and the density index of the layer.
+        // the geometry only changes if the cosines, the density model, or the production height change
+        virtual void setPathGeometry(){
+            if(!isSetProductionHeight)
+                return;
+
+            const std::vector<FLOAT_T>& radii = densityModel->getRadii();
+            const int n_layers = radii.size();
+            const int n_variants = getDensityVariantCount();
+
+            layerStride = n_layers + 1;
+
+            const std::uint64_t variantStride = std::uint64_t(n_cosines) * std::uint64_t(layerStride);
+
+            layerDistances.resize(variantStride);
+            layerDensityIndices.resize(std::uint64_t(n_variants) * variantStride);
+
+            for(int index_cosine = 0; index_cosine < n_cosines; index_cosine++){
+                const FLOAT_T cosine_zenith = cosineList[index_cosine];
+
+                const FLOAT_T PathLength = physics::getPathLength(cosine_zenith, ProductionHeightinCentimeter);
+
+                const FLOAT_T TotalEarthLength =  -2.0*cosine_zenith*Constants<FLOAT_T>::REarthcm(); // in [cm]
+                const int MaxLayer = maxlayers[index_cosine];
+
+                const std::uint64_t offset = std::uint64_t(index_cosine) * std::uint64_t(layerStride);
+
+                for(int i = 0; i <= MaxLayer; i++){
+                    const FLOAT_T distance = physics::getTraversedDistanceOfLayer(radii.data(), i, MaxLayer, PathLength, TotalEarthLength, cosine_zenith);
+
+                    layerDistances[offset + i] = distance / Constants<FLOAT_T>::km2cm();
+                }
+
+                // the variants share the distances. Only the densities of the layers differ
+                for(int v = 0; v < n_variants; v++){
+                    const int* const densityIndices = n_densityVariants > 0 ? variantDensityIndices.data() + std::uint64_t(v) * n_layers
+                                                                            : densityModel->getDensityIndices().data();
+
+                    for(int i = 0; i <= MaxLayer; i++)
+                        layerDensityIndices[v * variantStride + offset + i] = physics::getDensityIndexOfLayer(densityIndices, i, MaxLayer);
+                }
+            }
+
+            // distances of the atmospheric layer for the production height distribution
+            heightDistances.resize(std::uint64_t(n_cosines) * std::uint64_t(n_heightSamples));
+
+            for(int index_cosine = 0; index_cosine < n_cosines && n_heightSamples > 0; index_cosine++){
+                const FLOAT_T cosine_zenith = cosineList[index_cosine];
+                const FLOAT_T TotalEarthLength =  -2.0*cosine_zenith*Constants<FLOAT_T>::REarthcm(); // in [cm]
+                const int MaxLayer = maxlayers[index_cosine];
+
+                for(int k = 0; k < n_heightSamples; k++){
+                    const std::uint64_t index = std::uint64_t(index_cosine) * std::uint64_t(n_heightSamples) + k;
+                    const FLOAT_T PathLength = physics::getPathLength(cosine_zenith, productionHeightSamples[index] * Constants<FLOAT_T>::km2cm());
+                    const FLOAT_T distance = physics::getTraversedDistanceOfLayer(radii.data(), 0, MaxLayer, PathLength, TotalEarthLength, cosine_zenith);
+
+                    heightDistances[index] = distance / Constants<FLOAT_T>::km2cm();
+                }
+            }
+        }
+
+        // distance between the probabilities of consecutive cells in the result list
+        std::uint64_t getResultCellStride() const{
+            return resultLayout == AoS ? std::uint64_t(n_channels) : std::uint64_t(1);
+        }
+
+        // distance between the probabilities of consecutive requested ProbTypes in the result list
+        std::uint64_t getResultChannelStride() const{
+            return resultLayout == AoS ? std::uint64_t(1) : std::uint64_t(n_cosines) * std::uint64_t(n_energies);
+        }
+
+        // number of probabilities of a single hypothesis in the result list
+        std::uint64_t getResultsPerHypothesis() const{
+            return std::uint64_t(n_cosines) * std::uint64_t(n_energies) * std::uint64_t(n_channels);
+        }
+
+        // position of a probability in the result list. t must be a requested ProbType
+        std::uint64_t getResultIndex(int index_batch, int index_cosine, int index_energy, ProbType t) const{
+            return std::uint64_t(index_batch) * getResultsPerHypothesis()
+                    + (std::uint64_t(index_cosine) * std::uint64_t(n_energies) + std::uint64_t(index_energy)) * getResultCellStride()
+                    + std::uint64_t(channelSlots[int(t)]) * getResultChannelStride();
+        }
+
+        // position of the results of type among the results of the last calculation, or -1 if type was not calculated
+        int getTypeIndex(NeutrinoType type) const{
+            if(n_calculatedTypes == 2)
+                return type == Neutrino ? 0 : 1;
+            return type == calculatedType ? 0 : -1;
+        }
+
+        // copy the channel selection to the context of the core physics functions
+        void setContextChannels(physics::OscillationContext<FLOAT_T>& context) const{
+            context.resultCellStride = getResultCellStride();
+            context.resultChannelStride = getResultChannelStride();
+            context.n_channels = n_channels;
+            for(int i = 0; i < 9; i++)
+                context.channelSlots[i] = channelSlots[i];
         }
 
         cudaprob3::math::ComplexNumber<FLOAT_T>& U(int i, int j){
@@ -317,14 +1256,34 @@ namespace cudaprob3{
         std::vector<FLOAT_T> energyList;
         std::vector<FLOAT_T> cosineList;
         std::vector<int> maxlayers;
+        std::vector<int> pathOrder; // cosine indices ordered by descending maxlayers
+        std::vector<FLOAT_T> layerDistances; // for each cosine, traversed distance (km) of layers 0 to maxlayers[cosine]
+        std::vector<int> layerDensityIndices; // for each density variant and cosine, index in getGridDensities() of layers 0 to maxlayers[cosine]
+        int layerStride = 1; // number of entries per cosine in layerDistances and layerDensityIndices
+        std::vector<FLOAT_T> productionHeightSamples; // for each cosine, n_heightSamples production heights (km)
+        std::vector<FLOAT_T> productionHeightWeights; // for each cosine, the normalized weights of the production heights
+        std::vector<FLOAT_T> heightDistances; // for each cosine, traversed distance (km) of layer 0 for each production height
+        int n_heightSamples = 0; // number of production heights per cosine, or 0 if ProductionHeightinCentimeter is used
+
+        ResultLayout resultLayout = AoS; // memory layout of the probabilities
+        std::array<int, 9> channelSlots; // for each ProbType, its position among the requested ProbTypes, or -1
+        int n_channels = 9; // number of requested ProbTypes
+
+        NeutrinoType calculatedType = Neutrino; // type of the last calculation if only one type was calculated
+        int n_calculatedTypes = 1; // number of neutrino types of the last calculation
+        int n_calculatedVariants = 1; // number of density variants of the last calculation
         //std::vector<FLOAT_T> pathLengths;
 
-        std::vector<FLOAT_T> radii;
-        std::vector<FLOAT_T> rhos;
-        std::vector<FLOAT_T> coslimit;
+        std::shared_ptr<const DensityModel<FLOAT_T>> densityModel = std::make_shared<const DensityModel<FLOAT_T>>(); // shared, never null
+        std::vector<FLOAT_T> densityVariantRhos; // [variant][layer] densities of setDensityVariants
+        int n_densityVariants = 0; // number of density variants, or 0 to use the densities of the density model
+        std::vector<FLOAT_T> variantDensities; // unique densities of the model and all variants. variantDensities[0] is vacuum
+        std::vector<int> variantDensityIndices; // [variant][layer] index of the density of each layer in variantDensities
 
         std::array<cudaprob3::math::ComplexNumber<FLOAT_T>, 9> Mix_U; // MNS mixing matrix
         std::array<FLOAT_T, 9> dm; // mass differences;
+        std::array<FLOAT_T, 4> mixingAngles{}; // theta12, theta13, theta23, dCP of setMNSMatrix
+        std::array<FLOAT_T, 2> massDifferences{}; // dm12sq, dm23sq of setNeutrinoMasses
 
         FLOAT_T ProductionHeightinCentimeter;
 
@@ -332,6 +1291,17 @@ namespace cudaprob3{
         bool isSetCosine = false;
         bool isInit = true;
 
+        unsigned changedInputs = AllInputs; // inputs which changed since the last calculation
+        CachedCalculation cachedCalculation = NoCalculation; // kind of the last calculation
+        NeutrinoType cachedType = Neutrino; // type of the last calculation
+        int cachedTypes = 1; // number of types of the last calculation
+        std::vector<OscParams<FLOAT_T>> cachedBatch; // batch of the last batch calculation
+        std::shared_ptr<const ProbabilityTable<FLOAT_T>> loadedTable; // table of load or the result cache which provides the probabilities
+        std::string resultCacheDirectory; // directory of the result cache, or empty
+        std::string unusableCacheFile; // file of the result cache which could not be used by loadCachedResults. storeCachedResults replaces it
+
+        Instrumentation instrumentation; // timings and counters, only recorded with CUDAPROB3_INSTRUMENTATION
+
         int n_cosines;
         int n_energies;
     };
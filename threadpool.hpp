@@ -0,0 +1,328 @@
+/*
+This file is part of CUDAProb3++.
+
+CUDAProb3++ is free software: you can redistribute it and/or modify
+it under the terms of the GNU Lesser General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+CUDAProb3++ is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public License
+along with CUDAProb3++.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef CUDAPROB3_THREADPOOL_HPP
+#define CUDAPROB3_THREADPOOL_HPP
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <stdexcept>
+#include <thread>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+namespace cudaprob3{
+
+    /// \class TaskScheduler
+    /// \brief Runs the tasks of the calculations of CpuPropagator
+    /// \details Applications with their own thread pool, e.g. TBB, can implement this interface to run the calculations on their pool.
+    /// The tasks of one parallelFor are independent of each other
+    class TaskScheduler{
+    public:
+        virtual ~TaskScheduler() = default;
+
+        /// \brief Number of threads. The thread indices passed to the tasks are smaller
+        virtual int getThreadCount() const = 0;
+
+        /// \brief Run func(task, thread) for each task of [0, n_tasks) and return after all tasks are finished
+        /// \details Tasks may be moved between threads to balance the load. Exceptions of the tasks are rethrown
+        virtual void parallelFor(std::int64_t n_tasks, const std::function<void(std::int64_t, int)>& func) = 0;
+
+        /// \brief Like parallelFor, but thread t runs exactly the tasks of getStaticRange(n_tasks, getThreadCount(), t)
+        /// \details CpuPropagator writes new result buffers with parallelForStatic, such that each page is allocated on the NUMA node
+        /// of the thread which starts its tasks in parallelFor. The default runs parallelFor
+        virtual void parallelForStatic(std::int64_t n_tasks, const std::function<void(std::int64_t, int)>& func){
+            parallelFor(n_tasks, func);
+        }
+
+        /// \brief First and one past last task of thread t if n_tasks are split evenly into n_threads contiguous ranges
+        static std::pair<std::int64_t, std::int64_t> getStaticRange(std::int64_t n_tasks, int n_threads, int t){
+            return {n_tasks / n_threads * t + std::min<std::int64_t>(t, n_tasks % n_threads),
+                    n_tasks / n_threads * (t + 1) + std::min<std::int64_t>(t + 1, n_tasks % n_threads)};
+        }
+    };
+
+    /// \class ThreadPool
+    /// \brief Work-stealing pool with a fixed number of threads
+    /// \details The calling thread of parallelFor is thread 0 and the pool starts threads - 1 additional threads, which sleep between calls.
+    /// The tasks are split into one contiguous range per thread. Each thread runs its own range from the front.
+    /// If it is finished, it steals single tasks from the back of the ranges of the other threads, such that the owner keeps the tasks
+    /// close to the ones it already ran. Calls from different threads are serialized, and calls from a task of the same pool run sequentially
+    class ThreadPool : public TaskScheduler{
+    public:
+        /// \brief Constructor
+        /// @param threads Number of threads, including the calling thread
+        explicit ThreadPool(int threads) : n_threads(threads){
+            if(threads < 1)
+                throw std::runtime_error("ThreadPool::ThreadPool. threads must be positive");
+
+            ranges.reset(new TaskRange[threads]);
+
+            workers.reserve(threads - 1);
+            for(int t = 1; t < threads; t++)
+                workers.emplace_back(&ThreadPool::workerLoop, this, t);
+        }
+
+        ThreadPool(const ThreadPool&) = delete;
+        ThreadPool& operator=(const ThreadPool&) = delete;
+
+        ~ThreadPool(){
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                stop = true;
+            }
+            startCondition.notify_all();
+
+            for(auto& worker : workers)
+                worker.join();
+        }
+
+        int getThreadCount() const override{
+            return n_threads;
+        }
+
+        void parallelFor(std::int64_t n_tasks, const std::function<void(std::int64_t, int)>& func) override{
+            run(n_tasks, func, true);
+        }
+
+        void parallelForStatic(std::int64_t n_tasks, const std::function<void(std::int64_t, int)>& func) override{
+            run(n_tasks, func, false);
+        }
+
+    private:
+        // remaining tasks [begin, end) of one thread, packed into one word such that owner and thieves update it with compare-and-swap.
+        // The padding keeps the ranges of different threads in different cache lines
+        struct TaskRange{
+            std::atomic<std::uint64_t> bounds{0};
+            char padding[64 - sizeof(std::atomic<std::uint64_t>)];
+        };
+
+        static std::uint64_t pack(std::uint32_t begin, std::uint32_t end){
+            return (std::uint64_t(begin) << 32) | end;
+        }
+
+        // the pool and thread index of the calling thread, if it runs tasks of a pool
+        static const ThreadPool*& activePool(){
+            static thread_local const ThreadPool* pool = nullptr;
+            return pool;
+        }
+
+        static int& activeThread(){
+            static thread_local int thread = 0;
+            return thread;
+        }
+
+        void run(std::int64_t n_tasks, const std::function<void(std::int64_t, int)>& func, bool steal){
+            if(n_tasks <= 0)
+                return;
+
+            if(n_threads == 1 || activePool() == this){
+                const int thread = activePool() == this ? activeThread() : 0;
+                for(std::int64_t task = 0; task < n_tasks; task++)
+                    func(task, thread);
+                return;
+            }
+
+            std::lock_guard<std::mutex> submitLock(submitMutex);
+
+            // the ranges hold 32 bit indices. Larger loops are run in rounds
+            constexpr std::int64_t maxRoundTasks = std::int64_t(0xFFFFFFFF);
+
+            for(std::int64_t first = 0; first < n_tasks; first += maxRoundTasks){
+                const std::int64_t n_roundTasks = std::min(maxRoundTasks, n_tasks - first);
+
+                for(int t = 0; t < n_threads; t++){
+                    const auto range = getStaticRange(n_roundTasks, n_threads, t);
+                    ranges[t].bounds.store(pack(std::uint32_t(range.first), std::uint32_t(range.second)), std::memory_order_relaxed);
+                }
+
+                {
+                    std::lock_guard<std::mutex> lock(mutex);
+                    task = &func;
+                    taskOffset = first;
+                    stealing = steal;
+                    failed.store(false, std::memory_order_relaxed);
+                    exception = nullptr;
+                    n_pending = n_threads - 1;
+                    generation++;
+                }
+                startCondition.notify_all();
+
+                // the calling thread is thread 0
+                const ThreadPool* const callerPool = activePool();
+                const int callerThread = activeThread();
+                activePool() = this;
+                activeThread() = 0;
+
+                runTasks(0);
+
+                activePool() = callerPool;
+                activeThread() = callerThread;
+
+                std::unique_lock<std::mutex> lock(mutex);
+                doneCondition.wait(lock, [&]{ return n_pending == 0; });
+                task = nullptr;
+
+                if(exception)
+                    std::rethrow_exception(exception);
+            }
+        }
+
+        void workerLoop(int thread){
+            activePool() = this;
+            activeThread() = thread;
+
+            std::uint64_t seenGeneration = 0;
+
+            while(true){
+                {
+                    std::unique_lock<std::mutex> lock(mutex);
+                    startCondition.wait(lock, [&]{ return stop || generation != seenGeneration; });
+                    if(stop)
+                        return;
+                    seenGeneration = generation;
+                }
+
+                runTasks(thread);
+
+                {
+                    std::lock_guard<std::mutex> lock(mutex);
+                    n_pending--;
+                    if(n_pending == 0)
+                        doneCondition.notify_one();
+                }
+            }
+        }
+
+        // run the own range of thread, then steal from the others
+        void runTasks(int thread){
+            while(true){
+                const std::int64_t index = popFront(ranges[thread]);
+                if(index < 0)
+                    break;
+                runTask(index, thread);
+            }
+
+            if(!stealing)
+                return;
+
+            for(int k = 1; k < n_threads; k++){
+                TaskRange& victim = ranges[(thread + k) % n_threads];
+                while(true){
+                    const std::int64_t index = popBack(victim);
+                    if(index < 0)
+                        break;
+                    runTask(index, thread);
+                }
+            }
+        }
+
+        void runTask(std::int64_t index, int thread){
+            // after the first exception, the remaining tasks are skipped
+            if(failed.load(std::memory_order_relaxed))
+                return;
+
+            try{
+                (*task)(taskOffset + index, thread);
+            }catch(...){
+                std::lock_guard<std::mutex> lock(mutex);
+                if(!exception)
+                    exception = std::current_exception();
+                failed.store(true, std::memory_order_relaxed);
+            }
+        }
+
+        static std::int64_t popFront(TaskRange& range){
+            std::uint64_t bounds = range.bounds.load(std::memory_order_relaxed);
+            while(true){
+                const std::uint32_t begin = std::uint32_t(bounds >> 32);
+                const std::uint32_t end = std::uint32_t(bounds);
+                if(begin >= end)
+                    return -1;
+                if(range.bounds.compare_exchange_weak(bounds, pack(begin + 1, end), std::memory_order_relaxed))
+                    return begin;
+            }
+        }
+
+        static std::int64_t popBack(TaskRange& range){
+            std::uint64_t bounds = range.bounds.load(std::memory_order_relaxed);
+            while(true){
+                const std::uint32_t begin = std::uint32_t(bounds >> 32);
+                const std::uint32_t end = std::uint32_t(bounds);
+                if(begin >= end)
+                    return -1;
+                if(range.bounds.compare_exchange_weak(bounds, pack(begin, end - 1), std::memory_order_relaxed))
+                    return end - 1;
+            }
+        }
+
+        int n_threads;
+        std::vector<std::thread> workers;
+        std::unique_ptr<TaskRange[]> ranges;
+
+        std::mutex submitMutex; // one loop at a time
+
+        std::mutex mutex; // protects the state of the current loop below
+        std::condition_variable startCondition;
+        std::condition_variable doneCondition;
+        std::uint64_t generation = 0; // incremented for each loop, wakes the threads
+        int n_pending = 0; // threads which did not finish the current loop
+        bool stop = false;
+
+        const std::function<void(std::int64_t, int)>* task = nullptr;
+        std::int64_t taskOffset = 0;
+        bool stealing = true;
+        std::atomic<bool> failed{false};
+        std::exception_ptr exception;
+    };
+
+    /// \brief Allocator which leaves new elements of trivial types uninitialized
+    /// \details Pages of a new buffer are not written when it is resized, such that they are allocated on the NUMA node of the thread which writes them first
+    template<class T>
+    struct DefaultInitAllocator : std::allocator<T>{
+        template<class U>
+        struct rebind{
+            using other = DefaultInitAllocator<U>;
+        };
+
+        DefaultInitAllocator() = default;
+
+        template<class U>
+        DefaultInitAllocator(const DefaultInitAllocator<U>&) noexcept {}
+
+        template<class U>
+        void construct(U* ptr) noexcept(std::is_nothrow_default_constructible<U>::value){
+            ::new(static_cast<void*>(ptr)) U;
+        }
+
+        template<class U, class... Args>
+        void construct(U* ptr, Args&&... args){
+            ::new(static_cast<void*>(ptr)) U(std::forward<Args>(args)...);
+        }
+    };
+
+} // namespace cudaprob3
+
+#endif
@@ -18,6 +18,8 @@ along with CUDAProb3++.  If not, see <http://www.gnu.org/licenses/>.
 #ifndef CUDAPROB3_TYPES_HPP
 #define CUDAPROB3_TYPES_HPP
 
+#include <cstdint>
+
 namespace cudaprob3{
 
     enum ProbType : int{
@@ -27,6 +29,85 @@ namespace cudaprob3{
     };
 
     enum NeutrinoType {Neutrino, Antineutrino};
+
+    /// \brief Oscillation parameter of the derivatives of a gradient calculation, see Propagator::calculateProbabilityGradients
+    enum OscParameter : int {
+        Theta12 = 0, ///< mixing angle theta12 in radians
+        Theta13 = 1, ///< mixing angle theta13 in radians
+        Theta23 = 2, ///< mixing angle theta23 in radians
+        DeltaCP = 3, ///< cp phase in radians
+        Dm12sq = 4, ///< mass difference (m_1_2)^2 in (eV)^2 of setNeutrinoMasses
+        Dm23sq = 5 ///< mass difference (m_2_3)^2 in (eV)^2 of setNeutrinoMasses
+    };
+
+    /// \brief Memory layout of the calculated probabilities
+    enum ResultLayout {
+        AoS, ///< [cosine][energy][ProbType]. Default of CpuPropagator
+        SoA  ///< [ProbType][cosine][energy]. Default of the GPU propagators
+    };
+
+    /// \brief Read-only view of one probability channel P(i->j) of a calculation
+    /// \details The probability of cosine bin c and energy bin e is data[(c * n_energies + e) * stride]
+    /// @param FLOAT_T The floating point type to use for calculations, i.e float, double
+    template<class FLOAT_T>
+    struct ProbabilityView{
+        const FLOAT_T* data; ///< probability of the first cell
+        std::uint64_t stride; ///< distance between the probabilities of consecutive cells. 1 for SoA, 9 for AoS
+        int n_cosines; ///< number of cosine bins
+        int n_energies; ///< number of energy bins
+
+        /// \brief get probability of specific cosine and energy. No bounds checking is performed
+        FLOAT_T operator()(int index_cosine, int index_energy) const{
+            return data[(std::uint64_t(index_cosine) * std::uint64_t(n_energies) + std::uint64_t(index_energy)) * stride];
+        }
+    };
+
+    /// \brief Read-only view of all probabilities of a calculation
+    /// \details The probability t of hypothesis b, cosine bin c and energy bin e is
+    /// data[b * batchStride + (c * n_energies + e) * cellStride + t * channelStride], where t is the position of the ProbType
+    /// among the requested ProbTypes. If both neutrino types were calculated, the Antineutrino results start at data + typeStride
+    /// @param FLOAT_T The floating point type to use for calculations, i.e float, double
+    template<class FLOAT_T>
+    struct ResultSpan{
+        const FLOAT_T* data; ///< first probability
+        std::uint64_t size; ///< number of probabilities of all hypotheses
+        std::uint64_t cellStride; ///< distance between consecutive cells
+        std::uint64_t channelStride; ///< distance between consecutive ProbTypes
+        std::uint64_t batchStride; ///< distance between consecutive hypotheses
+        std::uint64_t typeStride; ///< distance between Neutrino and Antineutrino results if both types were calculated
+        int n_types; ///< number of calculated neutrino types
+        ResultLayout layout; ///< layout of the probabilities
+    };
+
+    /// \brief Read-only view of the probabilities of a tile of consecutive cosine bins of a tiled calculation
+    /// \details The probability t of local cosine bin c and energy bin e is
+    /// data[(c * n_energies + e) * cellStride + t * channelStride], where c = 0 is the cosine bin firstCosine of the grid.
+    /// If both neutrino types were calculated, the Antineutrino results start at data + typeStride
+    /// @param FLOAT_T The floating point type to use for calculations, i.e float, double
+    template<class FLOAT_T>
+    struct ResultTile{
+        const FLOAT_T* data; ///< first probability of the tile
+        int firstCosine; ///< cosine bin of the grid which corresponds to the first cosine bin of the tile
+        int n_cosines; ///< number of cosine bins of the tile
+        int n_energies; ///< number of energy bins
+        std::uint64_t cellStride; ///< distance between consecutive cells
+        std::uint64_t channelStride; ///< distance between consecutive ProbTypes
+        std::uint64_t typeStride; ///< distance between Neutrino and Antineutrino results if both types were calculated
+        int n_types; ///< number of calculated neutrino types
+        ResultLayout layout; ///< layout of the probabilities
+    };
+
+    /// \brief Oscillation parameters of a single hypothesis
+    /// @param FLOAT_T The floating point type to use for calculations, i.e float, double
+    template<class FLOAT_T>
+    struct OscParams{
+        FLOAT_T theta12; ///< mixing angle in radians
+        FLOAT_T theta13; ///< mixing angle in radians
+        FLOAT_T theta23; ///< mixing angle in radians
+        FLOAT_T dCP; ///< cp phase in radians
+        FLOAT_T dm12sq; ///< mass difference (m_1_2)^2 in (eV)^2
+        FLOAT_T dm23sq; ///< mass difference (m_2_3)^2 in (eV)^2
+    };
 }
 
 